@@ -0,0 +1,162 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "Arena.h"
+
+Arena::Arena(size_t block_size, size_t max_retained)
+    : block_size_(block_size), max_retained_(max_retained),
+      head_(nullptr), current_(nullptr), ptr_(nullptr), end_(nullptr)
+{
+}
+
+Arena::~Arena()
+{
+    while(head_)
+    {
+        Block* next = head_->next;
+        ::operator delete(head_);
+        head_ = next;
+    }
+}
+
+void Arena::useBlock(Block* block)
+{
+    current_ = block;
+    ptr_ = block->data();
+    end_ = ptr_ + block->size;
+}
+
+void* Arena::allocateSlow(size_t size, size_t align)
+{
+    // 块头部的大小是 max_align_t 对齐的, 因此对齐要求不超过 max_align_t 时块的起始地址总是满足要求
+    size_t need = size + (align > alignof(max_align_t) ? align : 0);
+    // 之前保留下来的空闲块. 不够大的块跳过, 等到下次 reset 之后再使用
+    Block* block = current_ ? current_->next : nullptr;
+    Block* prev = current_;
+    while(block && block->size < need)
+    {
+        prev = block;
+        block = block->next;
+    }
+    if(!block)
+    {
+        size_t block_size = need > block_size_ ? need : block_size_;
+        block = static_cast<Block*>(::operator new(sizeof(Block) + block_size));
+        block->next = nullptr;
+        block->size = block_size;
+        if(prev)
+            prev->next = block;
+        else
+            head_ = block;
+    }
+    // 被跳过的块移动到新的当前块之后, 使得 current_ 之后仍然都是空闲块
+    if(current_ && current_->next != block)
+    {
+        prev->next = block->next;
+        block->next = current_->next;
+        current_->next = block;
+    }
+    useBlock(block);
+    return allocate(size, align);
+}
+
+const char* Arena::copy(const char* data, size_t len)
+{
+    char* ptr = static_cast<char*>(allocate(len, 1));
+    memcpy(ptr, data, len);
+    return ptr;
+}
+
+void Arena::reset()
+{
+    if(!head_)
+        return;
+    // 保留前面的块, 直到总容量超过 max_retained. 第一个块总是保留
+    size_t retained = head_->size;
+    Block* last = head_;
+    while(last->next && retained + last->next->size <= max_retained_)
+    {
+        last = last->next;
+        retained += last->size;
+    }
+    Block* block = last->next;
+    last->next = nullptr;
+    while(block)
+    {
+        Block* next = block->next;
+        ::operator delete(block);
+        block = next;
+    }
+    useBlock(head_);
+}
+
+size_t Arena::capacity() const
+{
+    size_t total = 0;
+    for(Block* block = head_; block; block = block->next)
+        total += block->size;
+    return total;
+}
+
+#ifndef NDEBUG
+
+const bool AllocCounter::ENABLED = true;
+
+static thread_local uint64_t thread_alloc_count = 0;
+
+uint64_t AllocCounter::threadCount()
+{
+    return thread_alloc_count;
+}
+
+static void* countedAlloc(size_t size)
+{
+    ++thread_alloc_count;
+    return malloc(size ? size : 1);
+}
+
+/**
+ * 替换全局的 operator new / delete. Address Sanitizer 自身也提供了所有形式的实现,
+ * 因此每一种形式都需要替换, 以免分配与释放分别使用了不同的实现
+ */
+void* operator new(size_t size)
+{
+    void* ptr = countedAlloc(size);
+    if(!ptr)
+        throw bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept
+{
+    return countedAlloc(size);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept
+{
+    return countedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept                        { free(ptr); }
+void operator delete[](void* ptr) noexcept                      { free(ptr); }
+void operator delete(void* ptr, const nothrow_t&) noexcept      { free(ptr); }
+void operator delete[](void* ptr, const nothrow_t&) noexcept    { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept                { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept              { free(ptr); }
+
+#else
+
+const bool AllocCounter::ENABLED = false;
+
+uint64_t AllocCounter::threadCount()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief 单调递增(bump-pointer)的内存分配器
+ *        内存从预先申请的块中顺序切分, 单个对象不会被单独释放, 而是通过 reset 一次性全部回收.
+ *        块在 reset 之后保留, 因此稳定状态下的分配只是一次指针的移动, 不会调用 malloc
+ * @note  非线程安全, 同一时刻只能由一个线程使用. 分配出的内存在 reset 之前不会被移动或者复用
+ */
+class Arena
+{
+public:
+    // 每个块的默认大小, 以及 reset 之后最多保留的总容量
+    static const size_t DEFAULT_BLOCK_SIZE = 4096;
+    static const size_t DEFAULT_MAX_RETAINED = 64 * 1024;
+
+    /**
+     * @param block_size    每个块的大小, 超出该大小的分配会单独使用一个块
+     * @param max_retained  reset 之后最多保留的总容量, 超出部分的块会被释放
+     * @note  第一次分配时才会申请内存
+     */
+    explicit Arena(size_t block_size = DEFAULT_BLOCK_SIZE, size_t max_retained = DEFAULT_MAX_RETAINED);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    /**
+     * @brief 分配 size 字节的内存, 其起始地址按照 align 对齐
+     * @param align 对齐要求, 必须是 2 的幂
+     */
+    void* allocate(size_t size, size_t align = alignof(max_align_t))
+    {
+        uintptr_t addr = (reinterpret_cast<uintptr_t>(ptr_) + align - 1) & ~(align - 1);
+        if(ptr_ && addr <= reinterpret_cast<uintptr_t>(end_)
+            && size <= static_cast<size_t>(reinterpret_cast<uintptr_t>(end_) - addr))
+        {
+            ptr_ = reinterpret_cast<char*>(addr + size);
+            return reinterpret_cast<void*>(addr);
+        }
+        return allocateSlow(size, align);
+    }
+
+    /**
+     * @brief 将一段数据复制到 arena 中
+     * @return 复制后的数据的起始地址
+     */
+    const char* copy(const char* data, size_t len);
+
+    /**
+     * @brief 回收所有已经分配的内存, 之后的分配从第一个块重新开始
+     *        总容量超过 max_retained 时, 释放多余的块
+     */
+    void reset();
+
+    /**
+     * @brief 当前所有块的总容量(字节)
+     */
+    size_t capacity() const;
+
+private:
+    // 块头部, 其后紧跟着 size 字节的数据
+    struct Block {
+        Block* next;
+        size_t size;
+        char* data()    { return reinterpret_cast<char*>(this + 1); }
+    };
+    static_assert(sizeof(Block) % alignof(max_align_t) == 0, "block data must be aligned to max_align_t");
+
+    size_t block_size_;
+    size_t max_retained_;
+    Block* head_;       // 第一个块
+    Block* current_;    // 正在从中分配的块, 其后的块都是空闲的
+    char* ptr_;         // current_ 中下一个可分配的位置
+    char* end_;         // current_ 的末尾
+
+    // 当前块的剩余空间不足时, 切换到下一个足够大的空闲块, 或者申请一个新的块
+    void* allocateSlow(size_t size, size_t align);
+    // 从块 block 的起始位置开始分配
+    void useBlock(Block* block);
+};
+
+/**
+ * @brief 从 Arena 中分配内存的 STL 分配器. deallocate 不做任何事情, 内存由 Arena::reset 统一回收
+ * @note  容器中的数据在 arena 被 reset 之后失效, 因此容器的生命周期不能超过 reset
+ */
+template<typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    ArenaAllocator(Arena* arena) : arena_(arena) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+    T* allocate(size_t n)           { return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t)     {}
+    Arena* arena() const            { return arena_; }
+
+private:
+    Arena* arena_;
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)    { return a.arena() == b.arena(); }
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)    { return a.arena() != b.arena(); }
+
+// 使用 Arena 的字符串与容器
+typedef basic_string<char, char_traits<char>, ArenaAllocator<char>> ArenaString;
+template<typename T>
+using ArenaVector = vector<T, ArenaAllocator<T>>;
+
+/**
+ * @brief 调试版本(未定义 NDEBUG)中统计每个线程通过 operator new 分配内存的次数, 用于确认热路径上没有堆分配
+ *        发布版本中不替换 operator new, 计数总是为 0
+ */
+class AllocCounter
+{
+public:
+    static const bool ENABLED;
+
+    /**
+     * @brief 当前线程至今为止的分配次数
+     */
+    static uint64_t threadCount();
+};
+
+#endif
@@ -0,0 +1,328 @@
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "CgiProcess.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Utils.h"
+
+/**
+ * @brief 获取子进程的 pidfd, 子进程退出后其变为可读
+ * @return 内核或者头文件不支持时返回 -1
+ */
+static int openPidFd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+CgiProcess::CgiProcess()
+    : state_(CGI_IDLE), pid_(-1), pid_fd_(-1), input_fd_(-1), output_fd_(-1),
+      input_(nullptr), input_offset_(0), start_ms_(0), killed_(false), epoll_(nullptr),
+      input_event_{-1, nullptr}, output_event_{-1, nullptr}, pid_event_{-1, nullptr}
+{
+}
+
+CgiProcess::~CgiProcess()
+{
+    abort();
+}
+
+bool CgiProcess::start(const string& path, const string* input)
+{
+    assert(state_ == CGI_IDLE);
+    // 创建两个管道
+    int cgi_output[2];
+    int cgi_input[2];
+    /**
+     * NOTE: 创建管道时，一定要指定 O_CLOEXEC
+     * 因为当当前线程 thread1 执行 fork 产生子进程 subproc1 后，
+     * subproc1 会同步继承这些其他线程 thread2 用于其他进程 subproc2 通信的管道
+     * 这样当 thread2 关闭了向 subproc2 写入数据的管道 pipe2w 后，
+     * 由于 subproc1 保存了 pipe2w，因此实际上该管道不会被销毁
+     * 所以 subproc2 将无法从 pipe2w 中读取数据，因为管道没有关闭，不存在EOF
+     *
+     * NOTE: 即便创建管道时指定了 O_CLOEXEC
+     * 但实际上，在子进程中执行 dup2 操作时，新复制出的文件描述符将不会继承 O_CLOEXEC，
+     * 这样我们就可以达到：关闭所有的进程间通信管道，只保留当前子进程的输入输出管道，这样的一个目的
+     *
+     * NOTE: 不能直接使用 O_NONBLOCK 创建管道, 否则子进程一侧的管道也会是非阻塞的
+     */
+    if (pipe2(cgi_output, O_CLOEXEC) == -1) {
+        WARN("cgi_output create error. (%s)", strerror(errno));
+        return false;
+    }
+    if (pipe2(cgi_input, O_CLOEXEC) == -1) {
+        WARN("cgi_input create error. (%s)", strerror(errno));
+        // 记得关闭之前的管道
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        return false;
+    }
+    // 父进程一侧的管道设置为非阻塞
+    if(!setFdNoBlock(cgi_input[1]) || !setFdNoBlock(cgi_output[0]))
+    {
+        WARN("set cgi pipe no block fail! (%s)", strerror(errno));
+        close(cgi_input[0]);
+        close(cgi_input[1]);
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        return false;
+    }
+    // 在 fork 之前准备好参数, 子进程中不再分配内存
+    char* const args[] = { const_cast<char*>(path.c_str()), NULL };
+
+    // 尝试执行该CGI程序
+    pid_t pid;
+    /**
+     * @note 需要注意的是 fork 在多进程中要慎重使用
+     * @ref 谨慎使用多线程中的fork https://www.cnblogs.com/liyuan989/p/4279210.html
+     * @ref 程序员的自我修养（三）：fork() 安全 https://liam.page/2017/01/17/fork-safe/
+     */
+    if((pid = fork()) < 0)
+    {
+        WARN("Fork error. (%s)", strerror(errno));
+        close(cgi_input[0]);
+        close(cgi_input[1]);
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        return false;
+    }
+    // 对于子进程来说
+    if(pid == 0)
+    {
+        /**
+         * 将当前进程的进程号设置为所在组的进程组的组号
+         * 这有助于WebServer 杀死子进程
+         *
+         * kill -pid 时会杀死 PGID为 `-pid` 的所有子进程
+         * 因此可以利用 setpgid 来达到区分进程的目的
+         *
+         * 正常来说,如果没有设置 setpgid,则WebServer所有的子进程,以及子进程的子进程
+         * 其PGID都为WebServer的PID,这为杀死 pid为某个特定值的子进程以及该子进程的子进程巨大障碍
+         * 因此在子进程处需要重新设置 pgid
+         */
+        // 正常来说, setpgid 不可能会失败.如果失败了就直接abort
+        // 因为设置失败将会导致该子进程无法受到父进程的超时限制
+        if(setpgid(0, 0) == -1)
+            FATAL("setpgid fail in child process! (%s)", strerror(errno));
+        // 设置当父进程死亡时，子进程同步死亡
+        if(prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+            FATAL("prctl fail in child process! (%s)", strerror(errno));
+        // 首先重新设置标准输入输出流
+        // 注意 dup2 会自动关闭当前打开的 fd0、fd1 和 fd2
+        if(dup2(cgi_input[0], 0) == -1
+            || dup2(cgi_output[1], 1) == -1
+            || dup2(1, 2) == -1)
+            FATAL("dup2 fail! (%s)", strerror(errno));
+        close(cgi_input[0]);
+        close(cgi_input[1]);
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+
+        // 此时已经完成了所有的准备，现在准备执行目标程序
+        execve(args[0], args, environ);
+        // 如果执行到这里，则说明出现了问题
+        FATAL("execve fail in child process! (%s)", strerror(errno));
+    }
+
+    // 对于父进程WebServer来说
+    close(cgi_input[0]);
+    close(cgi_output[1]);
+    state_ = CGI_RUNNING;
+    pid_ = pid;
+    input_fd_ = cgi_input[1];
+    output_fd_ = cgi_output[0];
+    input_ = input;
+    input_offset_ = 0;
+    start_ms_ = Metrics::nowMicros() / 1000;
+    killed_ = false;
+    // 子进程此时可能已经退出了, 但在被回收之前 pidfd_open 仍然可以成功
+    pid_fd_ = openPidFd(pid);
+    if(pid_fd_ < 0 && errno != ENOSYS)
+        WARN("pidfd_open fail! (%s)", strerror(errno));
+    // 没有需要写入的数据时, 直接关闭标准输入
+    if(!input_ || input_->empty())
+        closeFd_(input_fd_, input_event_);
+    return true;
+}
+
+void CgiProcess::watch(Epoll* epoll, void* owner)
+{
+    assert(state_ == CGI_RUNNING && !epoll_);
+    epoll_ = epoll;
+    input_event_ = {input_fd_, owner};
+    output_event_ = {output_fd_, owner};
+    pid_event_ = {pid_fd_, owner};
+    // 边缘触发模式下, EPOLL_CTL_ADD 时已经就绪的 fd 也会立即产生一次事件
+    watchFd_(input_event_, EPOLLOUT | EPOLLET);
+    watchFd_(output_event_, EPOLLIN | EPOLLET);
+    watchFd_(pid_event_, EPOLLIN | EPOLLET);
+}
+
+void CgiProcess::watchFd_(EpollEvent& event, int cond)
+{
+    if(event.fd < 0 || epoll_->add(event.fd, &event, cond))
+        return;
+    // 没有放入 epoll 的 fd 关闭时无需删除, 超时之后由调用者通过 pump 继续处理
+    WARN("Add cgi fd(%d) to epoll fail! (%s)", event.fd, strerror(errno));
+    event.fd = -1;
+}
+
+bool CgiProcess::pump()
+{
+    if(state_ != CGI_RUNNING)
+        return state_ == CGI_EXITED;
+    if(input_fd_ >= 0)
+        writeInput_();
+    // 先尝试回收子进程, 再读取输出. 这样子进程退出之前写入的数据都一定能够被读出
+    int wstats;
+    pid_t ret;
+    while((ret = waitpid(pid_, &wstats, WNOHANG)) < 0 && errno == EINTR)
+        ;
+    if(ret < 0)
+        WARN("waitpid error. (%s)", strerror(errno));
+    // 没有指定 WUNTRACED, 因此只有当子进程终止时 waitpid 才会返回其 pid
+    if(ret != 0)
+        pid_ = -1;
+    if(output_fd_ >= 0)
+        readOutput_();
+    if(pid_ > 0)
+        return false;
+    // 子进程已经退出. 其创建的进程可能仍然持有管道, 因此不再等待 EOF
+    closeFd_(input_fd_, input_event_);
+    closeFd_(output_fd_, output_event_);
+    closeFd_(pid_fd_, pid_event_);
+    epoll_ = nullptr;
+    state_ = CGI_EXITED;
+    return true;
+}
+
+void CgiProcess::writeInput_()
+{
+    while(input_offset_ < input_->size())
+    {
+        ssize_t len = write(input_fd_, input_->data() + input_offset_, input_->size() - input_offset_);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            // 管道已满, 等待下一次可写事件
+            else if(errno == EAGAIN)
+                return;
+            // 子进程没有读取全部的输入就关闭了标准输入, 此时 errno 为 EPIPE
+            WARN("Write %lu bytes to CGI input fail! (%s)", input_->size() - input_offset_, strerror(errno));
+            break;
+        }
+        input_offset_ += static_cast<size_t>(len);
+    }
+    // 关闭写端, 使得子进程读到 EOF
+    closeFd_(input_fd_, input_event_);
+}
+
+void CgiProcess::readOutput_()
+{
+    for(;;)
+    {
+        // 直接读入 output_ 的尾部, 不经过额外的缓冲区
+        size_t size = output_.size();
+        output_.resize(size + READ_SIZE);
+        ssize_t len = read(output_fd_, &output_[size], READ_SIZE);
+        output_.resize(size + (len > 0 ? static_cast<size_t>(len) : 0));
+        if(len > 0)
+            continue;
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            else if(errno == EAGAIN)
+                return;
+            WARN("Read from CGI output fail! (%s)", strerror(errno));
+        }
+        // EOF 或者出错
+        closeFd_(output_fd_, output_event_);
+        return;
+    }
+}
+
+void CgiProcess::kill()
+{
+    if(pid_ <= 0)
+        return;
+    /**
+     * NOTE: -pid 指的是杀死当前子进程以及该子进程自身的子进程,例如shell脚本
+     * NOTE: 再kill一次 pid 是为了防止子进程太久没有轮到执行,仍然处于fork与execl之间的状态
+     *       此时,之前的 kill -pid 将会不起作用.因此为了确保子进程一定被kill,需要再kill一次pid
+     */
+    int res_kill_sub = ::kill(pid_, SIGKILL);
+    int res_kill_pgid = 0;
+    // 只有在子进程的pgid变化后才kill -pid,防止误伤其他线程中的子进程
+    if(getpgid(pid_) == pid_)
+        res_kill_pgid = ::kill(-pid_, SIGKILL);
+    assert(!res_kill_sub && !res_kill_pgid);
+    (void)res_kill_sub;
+    (void)res_kill_pgid;
+    killed_ = true;
+}
+
+void CgiProcess::finish()
+{
+    assert(state_ != CGI_RUNNING);
+    state_ = CGI_IDLE;
+    input_ = nullptr;
+    clearOutput_();
+}
+
+void CgiProcess::abort()
+{
+    if(state_ == CGI_RUNNING)
+    {
+        closeFd_(input_fd_, input_event_);
+        closeFd_(output_fd_, output_event_);
+        closeFd_(pid_fd_, pid_event_);
+        epoll_ = nullptr;
+        kill();
+        while(pid_ > 0 && waitpid(pid_, nullptr, 0) < 0 && errno == EINTR)
+            ;
+        pid_ = -1;
+        state_ = CGI_EXITED;
+    }
+    finish();
+}
+
+uint64_t CgiProcess::getRuntimeMs() const
+{
+    return Metrics::nowMicros() / 1000 - start_ms_;
+}
+
+void CgiProcess::closeFd_(int& fd, EpollEvent& event)
+{
+    if(fd < 0)
+        return;
+    /// NOTE: 其他线程 fork 出的子进程可能在 exec 之前短暂地持有该管道, 因此必须先从 epoll 中删除再关闭
+    if(epoll_ && event.fd == fd && !epoll_->del(fd))
+        WARN("Delete cgi fd(%d) from epoll fail! (%s)", fd, strerror(errno));
+    close(fd);
+    fd = -1;
+    event.fd = -1;
+}
+
+void CgiProcess::clearOutput_()
+{
+    if(output_.capacity() > MAX_IDLE_OUTPUT)
+        string().swap(output_);
+    else
+        output_.clear();
+}
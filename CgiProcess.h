@@ -0,0 +1,117 @@
+#ifndef CGIPROCESS_H
+#define CGIPROCESS_H
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+#include "Epoll.h"
+
+using namespace std;
+
+/**
+ * @brief 一个正在运行的 CGI 子进程, 以及与其通信的管道
+ *        父进程一侧的管道都是非阻塞的, 写入 stdin、读取 stdout 与回收子进程都由 pump 完成, 不会阻塞调用者.
+ *        子进程的退出通过 pidfd 通知, 内核不支持 pidfd 时需要由调用者定期调用 pump 来检查
+ *        管道与 pidfd 可以通过 watch 放入 epoll 中, 事件携带的数据为 watch 时传入的 owner,
+ *        关闭 fd 之前会先将其从 epoll 中删除, 并将对应 EpollEvent 的 fd 置为 -1, 以便识别过期的事件
+ * @note  非线程安全, 同一时刻只能由一个线程访问
+ */
+class CgiProcess
+{
+public:
+    CgiProcess();
+    ~CgiProcess();
+
+    CgiProcess(const CgiProcess&) = delete;
+    CgiProcess& operator=(const CgiProcess&) = delete;
+
+    /**
+     * @brief 创建子进程并执行 CGI 程序, input 中的数据将作为其标准输入
+     * @param path  CGI 程序的路径
+     * @param input 写入标准输入的数据, 在 finish 或 abort 之前必须保持有效且不被修改
+     * @return 成功则返回 true, 失败则返回 false
+     */
+    bool start(const string& path, const string* input);
+
+    /**
+     * @brief 将管道与 pidfd 以边缘触发的方式放入 epoll 中, 已经关闭的管道不会放入
+     * @param epoll 用于监听的 epoll 实例
+     * @param owner 事件携带的数据
+     */
+    void watch(Epoll* epoll, void* owner);
+
+    /**
+     * @brief 写入标准输入, 读取标准输出, 并尝试回收子进程, 不会阻塞
+     * @return 子进程已经退出, 且其输出已经全部读出时返回 true
+     * @note  子进程退出后关闭所有的管道, 状态变为 CGI_EXITED
+     */
+    bool pump();
+
+    /**
+     * @brief 杀死子进程以及其创建的所有进程, 之后仍然需要通过 pump 回收
+     */
+    void kill();
+
+    /**
+     * @brief 结束已经退出的 CGI 程序, 丢弃其输出, 状态变为 CGI_IDLE
+     */
+    void finish();
+
+    /**
+     * @brief 立即结束 CGI 程序: 杀死并回收子进程, 关闭所有的管道, 状态变为 CGI_IDLE
+     * @note  子进程收到 SIGKILL 之后很快就会退出, 因此这里使用阻塞的 waitpid
+     */
+    void abort();
+
+    bool isRunning() const          { return state_ == CGI_RUNNING; }
+    bool isExited() const           { return state_ == CGI_EXITED; }
+    // 是否已经因为超时而被杀死
+    bool isKilled() const           { return killed_; }
+    // 是否能够通过 pidfd 得知子进程的退出
+    bool hasPidFd() const           { return pid_fd_ >= 0; }
+    // 子进程启动至今的时间(ms)
+    uint64_t getRuntimeMs() const;
+    // 子进程的标准输出
+    const string& getOutput() const { return output_; }
+
+private:
+    // 每次 read 的最大字节数
+    static const size_t READ_SIZE = 4096;
+    // 结束后最多保留的输出缓冲区容量(字节)
+    static const size_t MAX_IDLE_OUTPUT = 64 * 1024;
+
+    enum STATE_TYPE {
+        CGI_IDLE,       // 没有 CGI 程序
+        CGI_RUNNING,    // 子进程尚未被回收
+        CGI_EXITED      // 子进程已经退出, 输出尚未被取走
+    };
+
+    // 将 event 对应的 fd 放入 epoll 中, 失败时将 event.fd 置为 -1
+    void watchFd_(EpollEvent& event, int cond);
+    // 写入标准输入, 全部写入或者出错后关闭管道
+    void writeInput_();
+    // 读取标准输出直到管道为空, 读到 EOF 或者出错后关闭管道
+    void readOutput_();
+    // 将 fd 从 epoll 中删除并关闭
+    void closeFd_(int& fd, EpollEvent& event);
+    // 清空输出, 容量超出 MAX_IDLE_OUTPUT 时将其释放
+    void clearOutput_();
+
+    STATE_TYPE state_;
+    pid_t pid_;                 // 子进程的 pid, 被回收之后为 -1
+    int pid_fd_;                // 子进程的 pidfd, 内核不支持时为 -1
+    int input_fd_;              // 子进程标准输入的写端
+    int output_fd_;             // 子进程标准输出的读端
+    const string* input_;       // 写入标准输入的数据
+    size_t input_offset_;       // 已经写入的字节数
+    string output_;             // 已经读出的标准输出
+    uint64_t start_ms_;         // 子进程的启动时间
+    bool killed_;               // 是否已经被杀死
+    Epoll* epoll_;              // 监听管道的 epoll 实例, 没有 watch 时为 nullptr
+    EpollEvent input_event_;
+    EpollEvent output_event_;
+    EpollEvent pid_event_;
+};
+
+#endif
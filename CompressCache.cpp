@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "CompressCache.h"
+#include "Log.h"
+
+CompressCache::CompressCache(size_t byte_budget)
+    : shard_budget_(byte_budget / SHARD_NUM), job_cond_(job_lock_),
+      stopping_(false), thread_started_(false)
+{
+    if(pthread_create(&thread_, nullptr, compressThread_, this))
+    {
+        ERROR("CompressCache: create compress thread fail!");
+        return;
+    }
+    thread_started_ = true;
+    INFO("CompressCache: %lu bytes per shard", shard_budget_);
+}
+
+CompressCache::~CompressCache()
+{
+    if(!thread_started_)
+        return;
+    {
+        MutexLockGuard guard(job_lock_);
+        stopping_ = true;
+        job_cond_.notifyAll();
+    }
+    pthread_join(thread_, nullptr);
+}
+
+bool CompressCache::isCompressible(const string& mime_type)
+{
+    return !mime_type.compare(0, 5, "text/")
+        || mime_type == "application/javascript"
+        || mime_type == "application/json"
+        || mime_type == "application/xml"
+        || mime_type == "image/svg+xml";
+}
+
+CompressCache::Shard& CompressCache::getShard_(const string& key)
+{
+    return shards_[hash<string>()(key) % SHARD_NUM];
+}
+
+CompressCache::EntryPtr CompressCache::get(const string& key)
+{
+    Shard& shard = getShard_(key);
+    MutexLockGuard guard(shard.lock);
+    auto iter = shard.index.find(key);
+    if(iter == shard.index.end())
+        return nullptr;
+
+    list<Node>::iterator node = iter->second;
+    // 文件已经被修改或者离开了 FileCache, 当作未命中处理
+    if(node->entry->stale_flag->isStale())
+    {
+        INFO("CompressCache: drop stale [%s]", key.c_str());
+        shard.bytes -= node->charge;
+        shard.index.erase(iter);
+        shard.lru.erase(node);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, node);
+    return node->entry;
+}
+
+void CompressCache::submit(const string& key, const FileCache::EntryPtr& file)
+{
+    if(!thread_started_ || file->fd < 0 || file->stale_flag->isStale())
+        return;
+    size_t size = static_cast<size_t>(file->st.st_size);
+    if(!S_ISREG(file->st.st_mode) || size < MIN_SOURCE_SIZE || size > MAX_SOURCE_SIZE)
+        return;
+
+    MutexLockGuard guard(job_lock_);
+    if(jobs_.size() >= MAX_PENDING || !pending_.insert(key).second)
+        return;
+    jobs_.push_back(Job{key, file});
+    job_cond_.notify();
+}
+
+CompressCache::EntryPtr CompressCache::compress_(const FileCache::EntryPtr& file)
+{
+    size_t size = static_cast<size_t>(file->st.st_size);
+    // 使用 pread 读取, 不会影响其他线程对同一个 fd 的使用
+    string source(size, '\0');
+    for(size_t done = 0; done < size; )
+    {
+        ssize_t len = pread(file->fd, &source[done], size - done, static_cast<off_t>(done));
+        if(len < 0 && errno == EINTR)
+            continue;
+        // 文件在此期间被截断, 不缓存不完整的内容
+        if(len <= 0)
+        {
+            WARN("CompressCache: read file [%s] fail!", file->real_path.c_str());
+            return nullptr;
+        }
+        done += static_cast<size_t>(len);
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // windowBits 加上 16 表示输出 gzip 格式
+    if(deflateInit2(&stream, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nullptr;
+    shared_ptr<Entry> entry = make_shared<Entry>();
+    entry->body.resize(deflateBound(&stream, size));
+    stream.next_in = reinterpret_cast<Bytef*>(&source[0]);
+    stream.avail_in = static_cast<uInt>(size);
+    stream.next_out = reinterpret_cast<Bytef*>(&entry->body[0]);
+    stream.avail_out = static_cast<uInt>(entry->body.size());
+    int ret = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if(ret != Z_STREAM_END)
+    {
+        WARN("CompressCache: compress file [%s] fail! (%d)", file->real_path.c_str(), ret);
+        return nullptr;
+    }
+    entry->body.resize(stream.total_out);
+
+    // 压缩后至少要节省 1/8 的空间才值得使用, 否则只记录该结果, 以免重复压缩
+    entry->compressed = entry->body.size() < size - size / 8;
+    if(!entry->compressed)
+        string().swap(entry->body);
+    entry->content_length = to_string(entry->body.size());
+    entry->etag = file->etag.substr(0, file->etag.size() - 1) + "-gzip\"";
+    entry->stale_flag = file->stale_flag;
+    INFO("CompressCache: [%s] %lu -> %lu bytes", file->real_path.c_str(), size,
+         entry->compressed ? entry->body.size() : size);
+    return entry;
+}
+
+void CompressCache::insert_(const string& key, const EntryPtr& entry)
+{
+    size_t charge = key.size() + entry->body.size();
+    if(charge > shard_budget_)
+        return;
+
+    Shard& shard = getShard_(key);
+    MutexLockGuard guard(shard.lock);
+    auto iter = shard.index.find(key);
+    if(iter != shard.index.end())
+    {
+        shard.bytes -= iter->second->charge;
+        shard.lru.erase(iter->second);
+        shard.index.erase(iter);
+    }
+    shard.lru.push_front(Node{key, entry, charge});
+    shard.index[key] = shard.lru.begin();
+    shard.bytes += charge;
+    // 淘汰最久未使用的条目
+    while(shard.bytes > shard_budget_)
+    {
+        Node& victim = shard.lru.back();
+        shard.bytes -= victim.charge;
+        shard.index.erase(victim.key);
+        shard.lru.pop_back();
+    }
+}
+
+void* CompressCache::compressThread_(void* arg)
+{
+    static_cast<CompressCache*>(arg)->run_();
+    return nullptr;
+}
+
+void CompressCache::run_()
+{
+    while(true)
+    {
+        Job job;
+        {
+            MutexLockGuard guard(job_lock_);
+            while(jobs_.empty() && !stopping_)
+                job_cond_.wait();
+            if(stopping_)
+                return;
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+
+        EntryPtr entry = compress_(job.file);
+        // 压缩期间文件已经失效, 则不放入缓存
+        if(entry && !entry->stale_flag->isStale())
+            insert_(job.key, entry);
+
+        MutexLockGuard guard(job_lock_);
+        pending_.erase(job.key);
+    }
+}
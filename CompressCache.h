@@ -0,0 +1,131 @@
+#ifndef COMPRESSCACHE_H
+#define COMPRESSCACHE_H
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "Condition.h"
+#include "FileCache.h"
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief 文本文件的 gzip 压缩结果缓存, 以文件的真实路径为键
+ *        未命中时不会阻塞当前请求: 文件被提交给后台线程压缩, 当前请求发送未压缩的文件,
+ *        之后的请求才会命中压缩后的内容. 每个文件只会被压缩一次
+ * @note  缓存按照字节数限制大小, 分片之间相互独立, 每个分片使用 LRU 淘汰
+ * @note  条目与 FileCache 中对应的条目共享失效标志, 文件被修改或者离开 FileCache 时, 该条目随之失效
+ */
+class CompressCache
+{
+public:
+    // 一个文件压缩后的内容. 创建后不再修改, 因此可以在多个线程之间共享, 并直接作为发送队列中的数据
+    struct Entry {
+        bool compressed;            // false 表示压缩效果不佳, 应当发送原始文件
+        string body;                // gzip 格式的文件内容
+        string content_length;      // 预先格式化的 Content-length
+        string etag;                // 原始文件的 ETag 加上 -gzip 后缀
+        shared_ptr<FileCache::StaleFlag> stale_flag;    // 与 FileCache 条目共享的失效标志
+    };
+    typedef shared_ptr<const Entry> EntryPtr;
+
+    // 只压缩大小位于 [MIN_SOURCE_SIZE, MAX_SOURCE_SIZE] 之间的文件
+    static const size_t MIN_SOURCE_SIZE = 256;
+    static const size_t MAX_SOURCE_SIZE = 8 * 1024 * 1024;
+    // 等待压缩的文件个数上限, 超出时直接丢弃新的请求, 之后的请求会再次提交
+    static const size_t MAX_PENDING = 64;
+
+    /**
+     * @brief 创建压缩缓存, 并启动后台压缩线程
+     * @param byte_budget 所有压缩结果的总字节数上限
+     */
+    explicit CompressCache(size_t byte_budget);
+    ~CompressCache();
+
+    /**
+     * @brief 查询缓存
+     * @param key 文件的真实路径
+     * @return 命中则返回对应的条目, 否则返回 nullptr
+     */
+    EntryPtr get(const string& key);
+
+    /**
+     * @brief 将文件提交给后台线程压缩. 若该文件已经在等待压缩, 则什么也不做
+     * @param key  文件的真实路径
+     * @param file 已经打开的文件, 后台线程将持有其引用直到压缩完成
+     */
+    void submit(const string& key, const FileCache::EntryPtr& file);
+
+    /**
+     * @brief Content-type 为 mime_type 的文件是否值得压缩
+     */
+    static bool isCompressible(const string& mime_type);
+
+private:
+    static const size_t SHARD_NUM = 16;
+    // 压缩级别, 与 gzip 命令的默认值相同
+    static const int COMPRESS_LEVEL = 6;
+
+    // 缓存中的一个条目
+    struct Node {
+        string key;
+        EntryPtr entry;
+        size_t charge;      // 该条目所占用的字节数
+    };
+
+    // 一个分片: LRU 链表, 以及由 key 到链表节点的索引
+    struct Shard {
+        MutexLock lock;
+        list<Node> lru;
+        unordered_map<string, list<Node>::iterator> index;
+        size_t bytes;
+
+        Shard() : bytes(0) {}
+    };
+
+    // 一个等待压缩的文件
+    struct Job {
+        string key;
+        FileCache::EntryPtr file;
+    };
+
+    Shard shards_[SHARD_NUM];
+    size_t shard_budget_;           // 每个分片的字节数上限
+
+    // 后台线程的任务队列. pending_ 中记录了等待中以及正在压缩的文件, 以免重复压缩
+    MutexLock job_lock_;
+    Condition job_cond_;
+    deque<Job> jobs_;
+    unordered_set<string> pending_;
+    bool stopping_;
+    pthread_t thread_;
+    bool thread_started_;
+
+    Shard& getShard_(const string& key);
+
+    /**
+     * @brief 读取并压缩整个文件
+     * @return 读取失败时返回 nullptr
+     */
+    static EntryPtr compress_(const FileCache::EntryPtr& file);
+
+    /**
+     * @brief 将条目放入缓存, 并淘汰超出容量的条目
+     */
+    void insert_(const string& key, const EntryPtr& entry);
+
+    /**
+     * @brief 后台压缩线程所执行的函数
+     */
+    static void* compressThread_(void* arg);
+    void run_();
+};
+
+#endif
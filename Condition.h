@@ -37,6 +37,24 @@ public:
         abstime.tv_sec += (time_t)sec;
         return ETIMEDOUT != pthread_cond_timedwait(&cond_, lock_.getMutex(), &abstime);
     }
+    /**
+     *  @brief  等待当前的条件变量一段时间
+     *  @param  ms 等待的时间(单位:毫秒)
+     *  @return 成功在时间内等待到则返回 true, 超时则返回 false
+     */
+    bool waitForMillis(long ms)
+    {
+        timespec abstime;
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += ms / 1000;
+        abstime.tv_nsec += (ms % 1000) * 1000000;
+        if(abstime.tv_nsec >= 1000000000)
+        {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
+        return ETIMEDOUT != pthread_cond_timedwait(&cond_, lock_.getMutex(), &abstime);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include <new>
+
+#include "ConnectionPool.h"
+#include "HttpHandler.h"
+
+struct ConnectionPool::ThreadCache {
+    HttpHandler* local;         // 只由所有者线程访问的空闲链表
+    char local_pad[64];         // 避免其他线程归还对象时与所有者的访问产生伪共享
+    HttpHandler* remote;        // 其他线程归还的对象, 无锁栈, 所有者一次性取走整个栈
+    char remote_pad[64];
+    bool in_use;                // 是否有线程正在使用该链表
+    ThreadCache* next;          // 所有链表组成的链表, 只会在头部插入
+
+    ThreadCache() : local(nullptr), remote(nullptr), in_use(true), next(nullptr) {}
+};
+
+// 线程退出时归还其空闲链表
+struct ThreadCacheHolder {
+    ConnectionPool::ThreadCache* cache;
+    ~ThreadCacheHolder()    { if(cache) __atomic_store_n(&cache->in_use, false, __ATOMIC_RELEASE); }
+};
+
+static ConnectionPool::ThreadCache* thread_caches = nullptr;
+static thread_local ThreadCacheHolder thread_cache_holder = {nullptr};
+
+static ConnectionPool::ThreadCache* getThreadCache()
+{
+    if(thread_cache_holder.cache)
+        return thread_cache_holder.cache;
+    // 优先复用已经退出的线程所留下的空闲链表
+    ConnectionPool::ThreadCache* cache = __atomic_load_n(&thread_caches, __ATOMIC_ACQUIRE);
+    for(; cache; cache = cache->next)
+    {
+        bool expected = false;
+        if(!__atomic_load_n(&cache->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&cache->in_use, &expected, true, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if(!cache)
+    {
+        cache = new ConnectionPool::ThreadCache();
+        cache->next = __atomic_load_n(&thread_caches, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&thread_caches, &cache->next, cache, true,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    thread_cache_holder.cache = cache;
+    return cache;
+}
+
+HttpHandler* ConnectionPool::acquire(EventLoop* loop, int client_fd)
+{
+    ThreadCache* cache = getThreadCache();
+    // 本地链表为空时, 先取回其他线程归还的对象, 仍然没有则分配一个新的 slab
+    if(!cache->local)
+        cache->local = __atomic_exchange_n(&cache->remote, nullptr, __ATOMIC_ACQUIRE);
+    if(!cache->local)
+    {
+        char* slab = static_cast<char*>(::operator new(sizeof(HttpHandler) * SLAB_OBJECTS));
+        for(size_t i = 0; i < SLAB_OBJECTS; i++)
+        {
+            HttpHandler* handler = new (slab + i * sizeof(HttpHandler)) HttpHandler();
+            handler->pool_owner_ = cache;
+            handler->pool_next_ = cache->local;
+            cache->local = handler;
+        }
+    }
+    HttpHandler* handler = cache->local;
+    cache->local = handler->pool_next_;
+    handler->pool_next_ = nullptr;
+    handler->init(loop, client_fd);
+    return handler;
+}
+
+void ConnectionPool::release(HttpHandler* handler)
+{
+    handler->cleanup();
+    ThreadCache* owner = handler->pool_owner_;
+    if(owner == thread_cache_holder.cache)
+    {
+        handler->pool_next_ = owner->local;
+        owner->local = handler;
+        return;
+    }
+    // 对象不属于当前线程, 将其压入所有者的无锁栈中. 所有者只会取走整个栈, 因此不存在 ABA 问题
+    handler->pool_next_ = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&owner->remote, &handler->pool_next_, handler, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
@@ -0,0 +1,44 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include <cstddef>
+
+class EventLoop;
+class HttpHandler;
+
+/**
+ * @brief 连接对象(HttpHandler)的对象池
+ *        对象按 slab 批量分配, 连接关闭后对象被重置并放回空闲链表, 其接收缓冲区等的容量在上限以内保留,
+ *        因此接受新连接时既不需要 new / delete, 也不需要重新分配缓冲区, 长时间运行也不会产生内存碎片
+ *        每个线程拥有自己的空闲链表, 对象归分配它的线程所有:
+ *          1. 所有者线程释放的对象直接放回本地链表, 不需要任何同步
+ *          2. 其他线程(例如分发模式下的工作线程)释放的对象通过无锁栈归还给所有者,
+ *             所有者在本地链表为空时一次性取回
+ * @note  slab 不会被归还给系统, 池中的对象个数取决于同时存在的连接个数的峰值
+ *        线程退出后其空闲链表保留, 并由之后新建的线程继续使用
+ */
+class ConnectionPool
+{
+public:
+    // 每个线程的空闲链表, 定义于 ConnectionPool.cpp
+    struct ThreadCache;
+
+    /**
+     * @brief 获取一个连接对象, 并将其绑定到新的连接上
+     * @param loop      连接所属的事件循环
+     * @param client_fd 连接的 client_fd
+     */
+    static HttpHandler* acquire(EventLoop* loop, int client_fd);
+
+    /**
+     * @brief 关闭连接并将对象放回池中, 可以在任意线程中调用
+     * @note  与原先的 delete 相同, 调用之后不能再访问该对象
+     */
+    static void release(HttpHandler* handler);
+
+private:
+    // 每次向系统申请的对象个数
+    static const size_t SLAB_OBJECTS = 32;
+};
+
+#endif
@@ -29,6 +29,9 @@ public:
      * @return 有效则返回 true, 无效则返回 false
      */ 
     bool isEpollValid();
+
+    // 获取 epoll 文件描述符, 用于将 epoll 实例本身交给其他的事件机制监听
+    int getFd()     { return epoll_fd_; }
     
     /**
      * @brief 创建一个 epoll 实例
@@ -0,0 +1,715 @@
+#include <cassert>
+#include <algorithm>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ConnectionPool.h"
+#include "EventLoop.h"
+#include "HttpHandler.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Utils.h"
+
+size_t EventLoop::accept_budget = 64;
+
+EventLoop::EventLoop(int listen_fd, ThreadPool* thread_pool, BACKEND_TYPE backend)
+    : epoll_(EPOLL_CLOEXEC), ring_(nullptr), listen_fd_(listen_fd), listen_event_{listen_fd, nullptr},
+      wakeup_fd_(-1), wakeup_event_{-1, nullptr}, thread_pool_(thread_pool)
+{
+    assert(epoll_.isEpollValid());
+    // 每个事件循环都拥有一个独立的空闲 fd
+    idle_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(isDispatchMode())
+    {
+        wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        wakeup_event_.fd = wakeup_fd_;
+        if(wakeup_fd_ < 0 || !epoll_.add(wakeup_fd_, &wakeup_event_, EPOLLIN))
+            FATAL("Setup wakeup eventfd fail! (%s)", strerror(errno));
+    }
+
+    // io_uring 后端只能用于多 reactor 模式. 若初始化失败, 则退化为 epoll
+    if(backend == BACKEND_URING)
+    {
+        assert(!isDispatchMode());
+        if(!setupUring_())
+        {
+            WARN("Setup io_uring backend failed, fall back to epoll.");
+            delete ring_;
+            ring_ = nullptr;
+        }
+    }
+    if(!ring_)
+    {
+        // 将 listen_fd 添加进 epoll 实例. 水平触发使得超出 accept_budget 的连接在下一轮仍然会被通知
+        // listen 套接字被多个事件循环共享时, EPOLLEXCLUSIVE 使得每个新连接只唤醒其中一个, 较旧的内核不支持该标志
+        bool ret = epoll_.add(listen_fd_, &listen_event_, EPOLLIN | EPOLLEXCLUSIVE)
+                   || epoll_.add(listen_fd_, &listen_event_, EPOLLIN);
+        assert(ret);
+        (void)ret;
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    if(ring_)
+        delete ring_;
+    else
+        epoll_.del(listen_fd_);
+    if(idle_fd_ >= 0)
+        close(idle_fd_);
+    if(wakeup_fd_ >= 0)
+    {
+        epoll_.del(wakeup_fd_);
+        close(wakeup_fd_);
+    }
+}
+
+bool EventLoop::setupUring_()
+{
+    ring_ = new IoUring(URING_ENTRIES);
+    if(!ring_->isValid())
+        return false;
+    // fixed file 表中的下标直接使用 fd 的值, 因此表的大小为当前进程可打开的最大文件个数
+    rlimit limit;
+    unsigned nr_files = URING_MAX_FILES;
+    if(!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < nr_files)
+        nr_files = static_cast<unsigned>(limit.rlim_cur);
+    if(!ring_->registerFiles(nr_files))
+    {
+        ERROR("Register io_uring files fail! (%s)", strerror(errno));
+        return false;
+    }
+    // listen fd 失败时不放入 fixed file 表也可以正常工作
+    ring_->updateFile(static_cast<unsigned>(listen_fd_), listen_fd_);
+    if(!ring_->setupBufRing(URING_BUF_ENTRIES, URING_BUF_SIZE, 0))
+    {
+        ERROR("Setup io_uring buffer ring fail! (%s)", strerror(errno));
+        return false;
+    }
+    INFO("Event loop uses io_uring backend (%u fixed files).", nr_files);
+    return true;
+}
+
+void EventLoop::closeConnection(HttpHandler* handler, bool force)
+{
+    // epoll 后端下没有尚未完成的异步操作, 直接释放即可
+    if(!ring_)
+    {
+        ConnectionPool::release(handler);
+        return;
+    }
+
+    shutdownConnection_(handler, force);
+    // 所有的操作都完成后, 才能释放 handler
+    if(handler->uring_.inflight == 0)
+        ConnectionPool::release(handler);
+}
+
+void EventLoop::shutdownConnection_(HttpHandler* handler, bool force)
+{
+    HttpHandler::UringState& state = handler->uring_;
+    // 强制关闭时, 即便已经处于关闭过程中, 也需要取消正在进行的 send
+    if(state.aborted || (state.closing && !force))
+        return;
+    bool closing = state.closing;
+    state.closing = true;
+    state.aborted = force;
+    io_uring_sqe* sqe = nullptr;
+    if(force)
+    {
+        // 强制关闭后不再需要定时器; 否则保留定时器, 以防止对端一直不读取响应
+        handler->timer_.cancel();
+        // 取消当前连接上所有尚未完成的操作, 包括正在进行的 send
+        if(state.inflight && (sqe = ring_->getSqe()))
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = handler->getClientFd();
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            if(state.fixed_file)
+                sqe->cancel_flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+        }
+    }
+    // 只取消 recv, 已提交的响应仍然会发送完毕
+    else if(!closing && state.recv_armed && (sqe = ring_->getSqe()))
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = reinterpret_cast<uint64_t>(handler) | URING_OP_RECV;
+    }
+    if(sqe)
+        sqe->user_data = URING_OP_IGNORE;
+}
+
+void EventLoop::detachConnection(int client_fd)
+{
+    if(!ring_)
+    {
+        bool ret = epoll_.del(client_fd);
+        assert(ret);
+        (void)ret;
+    }
+    // 必须在关闭 fd 之前清空 fixed file 表中的对应项, 否则表中的引用会使连接无法真正关闭
+    else if(static_cast<unsigned>(client_fd) < ring_->getFileTableSize())
+        ring_->updateFile(static_cast<unsigned>(client_fd), -1);
+}
+
+void EventLoop::armAccept_()
+{
+    io_uring_sqe* sqe = ring_->getSqe();
+    if(!sqe)
+        FATAL("Get io_uring sqe fail!");
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd_;
+    if(static_cast<unsigned>(listen_fd_) < ring_->getFileTableSize())
+        sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT;
+}
+
+void EventLoop::armEpoll_()
+{
+    io_uring_sqe* sqe = ring_->getSqe();
+    if(!sqe)
+        FATAL("Get io_uring sqe fail!");
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = epoll_.getFd();
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_OP_EPOLL;
+}
+
+void EventLoop::armRecv_(HttpHandler* handler)
+{
+    HttpHandler::UringState& state = handler->uring_;
+    io_uring_sqe* sqe = ring_->getSqe();
+    if(!sqe)
+    {
+        ERROR("Get io_uring sqe fail!");
+        shutdownConnection_(handler, true);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = handler->getClientFd();
+    sqe->flags = IOSQE_BUFFER_SELECT | (state.fixed_file ? IOSQE_FIXED_FILE : 0);
+    sqe->buf_group = ring_->getBufGroup();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = reinterpret_cast<uint64_t>(handler) | URING_OP_RECV;
+    state.recv_armed = true;
+    ++state.inflight;
+}
+
+void EventLoop::submitSends(HttpHandler* handler)
+{
+    HttpHandler::UringState& state = handler->uring_;
+    // 上一组 send 尚未完成时, 等待其完成后再提交, 以保证响应的顺序
+    if(state.sending || handler->out_queue_.empty())
+        return;
+    // 发送队列中的每段数据对应一个 send, 彼此之间使用 IOSQE_IO_LINK 保证顺序
+    /// NOTE: MSG_WAITALL 使得 send 只会在出错时才返回部分结果, 此时后续的 send 都会被取消
+    size_t count = handler->out_queue_.size();
+    for(size_t i = 0; i < count; i++)
+    {
+        const HttpHandler::OutputChunk& chunk = handler->out_queue_[i];
+        size_t offset = (i == 0) ? handler->out_offset_ : 0;
+        size_t len = chunk.size - offset;
+        // 单个 send 的长度有限, 超出的部分在本组 send 完成后再提交, 因此需要在此处截断链接
+        if(len > URING_MAX_SEND)
+        {
+            len = URING_MAX_SEND;
+            count = i + 1;
+        }
+        io_uring_sqe* sqe = ring_->getSqe();
+        if(!sqe)
+        {
+            // 已经提交的 send 完成后会再次调用该函数
+            if(i == 0)
+                shutdownConnection_(handler, true);
+            return;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = handler->getClientFd();
+        sqe->flags = (state.fixed_file ? IOSQE_FIXED_FILE : 0) | (i + 1 < count ? IOSQE_IO_LINK : 0);
+        sqe->addr = reinterpret_cast<uint64_t>(chunk.ptr() + offset);
+        sqe->len = static_cast<unsigned>(len);
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = reinterpret_cast<uint64_t>(handler) | URING_OP_SEND;
+        ++state.sending;
+        ++state.inflight;
+    }
+}
+
+void EventLoop::handleCqe_(uint64_t user_data, int res, unsigned flags)
+{
+    HttpHandler* handler = reinterpret_cast<HttpHandler*>(user_data & ~URING_OP_MASK);
+    switch(user_data & URING_OP_MASK)
+    {
+    case URING_OP_ACCEPT:
+        handleAcceptCqe_(res, flags);
+        return;
+    case URING_OP_EPOLL:
+        handleEpollCqe_(res, flags);
+        return;
+    case URING_OP_FILES_UPDATE:
+        --handler->uring_.inflight;
+        // 放入 fixed file 表失败, 则链接在其后的 recv 会被取消, 之后直接使用普通的 fd
+        if(res < 0)
+            handler->uring_.fixed_file = false;
+        break;
+    case URING_OP_RECV:
+        handleRecvCqe_(handler, res, flags);
+        break;
+    case URING_OP_SEND:
+        handleSendCqe_(handler, res);
+        break;
+    default:
+        return;
+    }
+    if(handler->uring_.closing && handler->uring_.inflight == 0)
+        ConnectionPool::release(handler);
+}
+
+void EventLoop::handleAcceptCqe_(int res, unsigned flags)
+{
+    if(res >= 0)
+    {
+        int client_fd = res;
+        // 构建一个新的 HttpHandler, 规则与 epoll 后端相同
+        HttpHandler* client_handler = ConnectionPool::acquire(this, client_fd);
+        Metrics::add(Metrics::ACCEPTED_CONNECTIONS);
+        HttpHandler::UringState& state = client_handler->uring_;
+        // 先异步地将 client fd 放入 fixed file 表中, 再链接一个 multishot recv
+        io_uring_sqe* sqe = nullptr;
+        if(static_cast<unsigned>(client_fd) < ring_->getFileTableSize() && (sqe = ring_->getSqe()))
+        {
+            sqe->opcode = IORING_OP_FILES_UPDATE;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->addr = reinterpret_cast<uint64_t>(&state.fd);
+            sqe->len = 1;
+            sqe->off = static_cast<uint64_t>(client_fd);
+            sqe->user_data = reinterpret_cast<uint64_t>(client_handler) | URING_OP_FILES_UPDATE;
+            state.fixed_file = true;
+            ++state.inflight;
+        }
+        armRecv_(client_handler);
+        if(state.closing && state.inflight == 0)
+            ConnectionPool::release(client_handler);
+        else
+            printConnectionStatus(client_fd, "-------->>>>> New Connection");
+    }
+    // 如果由于文件描述符不够用了, 则清空全部的尚未 accept 连接
+    else if(res == -EMFILE)
+    {
+        int closed_conn_num = closeRemainingConnect(listen_fd_, &idle_fd_);
+        Metrics::add(Metrics::EMFILE_DROPS, static_cast<uint64_t>(closed_conn_num));
+        WARN("No reliable pipes in new connection, close %d conns", closed_conn_num);
+    }
+    else if(res != -EINTR && res != -ECONNABORTED && res != -EAGAIN)
+        ERROR("Accept Error! (%s)", strerror(-res));
+
+    // multishot accept 终止时, 需要重新提交
+    if(!(flags & IORING_CQE_F_MORE))
+        armAccept_();
+}
+
+void EventLoop::handleRecvCqe_(HttpHandler* handler, int res, unsigned flags)
+{
+    HttpHandler::UringState& state = handler->uring_;
+    if(!(flags & IORING_CQE_F_MORE))
+    {
+        state.recv_armed = false;
+        --state.inflight;
+    }
+    if(res > 0)
+    {
+        unsigned short bid = static_cast<unsigned short>(flags >> IORING_CQE_BUFFER_SHIFT);
+        // 关闭过程中读到的数据直接丢弃
+        if(!state.closing)
+        {
+            handler->appendRequest(ring_->getBuffer(bid), static_cast<size_t>(res));
+            Metrics::add(Metrics::RECEIVED_BYTES, static_cast<uint64_t>(res));
+            printConnectionStatus(handler->getClientFd(), "-------->>>>> New Message");
+        }
+        ring_->recycleBuffer(bid);
+        if(state.closing)
+            return;
+        // 如果出现无法恢复的错误, 则在发送完已有的响应后释放该实例
+        bool keep = handler->RunEventLoop();
+        submitSends(handler);
+        if(!keep)
+            shutdownConnection_(handler, false);
+        // multishot recv 可能因为 CQ 溢出等原因终止
+        else if(!state.recv_armed)
+            armRecv_(handler);
+    }
+    // 远程关闭了当前连接
+    else if(res == 0)
+    {
+        INFO("Socket(%d) was closed by peer.", handler->getClientFd());
+        shutdownConnection_(handler, false);
+    }
+    else if(state.closing)
+        return;
+    // provided buffer 暂时用尽, 或者 fixed file 更新失败导致 recv 被取消, 则重新提交
+    else if(res == -ENOBUFS || res == -ECANCELED)
+    {
+        if(!state.recv_armed)
+            armRecv_(handler);
+    }
+    else
+    {
+        ERROR("Socket(%d) error. (%s)", handler->getClientFd(), strerror(-res));
+        shutdownConnection_(handler, true);
+    }
+}
+
+void EventLoop::handleSendCqe_(HttpHandler* handler, int res)
+{
+    HttpHandler::UringState& state = handler->uring_;
+    --state.sending;
+    --state.inflight;
+    if(res >= 0)
+    {
+        handler->consumeOutput(static_cast<size_t>(res));
+        // 只要对端仍在接收数据, 就不应该因为超时而断开连接
+        if(res > 0 && !state.aborted)
+            handler->getTimer()->setTime(handler->timeoutPerRequest, 0);
+    }
+    // 由于前一个 send 只发送了部分数据而被取消, 则等待整组完成后重新提交
+    else if(res != -ECANCELED && !state.aborted)
+    {
+        ERROR("Send to socket(%d) fail. (%s)", handler->getClientFd(), strerror(-res));
+        shutdownConnection_(handler, true);
+        return;
+    }
+    // 整组 send 完成后, 提交剩余的数据以及新产生的响应
+    if(!state.sending && !state.aborted)
+    {
+        // 流水线中因为发送队列超过高水位线而被推迟的请求, 在此时继续处理
+        bool keep = true;
+        if(!state.closing && handler->hasPendingRequest())
+            keep = handler->RunEventLoop();
+        submitSends(handler);
+        if(!keep)
+            shutdownConnection_(handler, false);
+    }
+}
+
+void EventLoop::handleEpollCqe_(int res, unsigned flags)
+{
+    if(res >= 0)
+    {
+        // epoll 实例中只有 CGI 程序的管道与 pidfd, 并且都是边缘触发的
+        int event_num = epoll_.wait(0);
+        if(event_num > 0)
+            handleEvents_(event_num);
+        else if(event_num < 0 && errno != EINTR)
+            ERROR("epoll_wait fail! (%s)", strerror(errno));
+    }
+    else if(res != -ECANCELED)
+        ERROR("Poll epoll fail! (%s)", strerror(-res));
+
+    // multishot poll 终止时, 需要重新提交
+    if(!(flags & IORING_CQE_F_MORE))
+        armEpoll_();
+}
+
+void EventLoop::handleNewConnections()
+{
+    // 注意:可能会有很多个 connect 动作,但只会有一个 event
+    sockaddr_in client_addr;
+    socklen_t client_addr_len = 0;
+
+    /**
+     *  如果
+     *      1. accept 没有发生错误
+     *      2. accppt 发生了 EINTR 错误
+     *      3. accept 发生了 ECONNABORTED 错误(该错误是远程连接被中断)
+     *  则重新循环. 其中第三点, 若发生了 aborted 错误,则继续循环接受下一个socket 的请求
+     *  每轮最多 accept accept_budget 个连接, listen 套接字是水平触发的, 剩余的连接在下一轮 epoll_wait 中处理
+     */
+    for(size_t accepted = 0; accepted < accept_budget; ) {
+        int client_fd = accept4(listen_fd_, (sockaddr*)&client_addr, &client_addr_len,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        // accept 的错误处理
+        if(client_fd == -1) {
+            // 如果是因为一些无关的错误所阻断，则继续 accept
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // 正常情况下,如果处理了所有的 accept后, errno == EAGAIN，则直接退出
+            else if (errno == EAGAIN)
+                break;
+            // 如果由于文件描述符不够用了,则会返回 EMFILE，此时清空全部的尚未 accept 连接
+            else if(errno == EMFILE) {
+                int closed_conn_num = closeRemainingConnect(listen_fd_, &idle_fd_);
+                Metrics::add(Metrics::EMFILE_DROPS, static_cast<uint64_t>(closed_conn_num));
+                WARN("No reliable pipes in new connection, close %d conns", closed_conn_num);
+                break;
+            }
+            // 如果是其他的错误，则输出信息. 错误可能会持续存在 (例如 ENFILE), 因此留到下一轮再重试
+            else {
+                ERROR("Accept Error! (%s)", strerror(errno));
+                break;
+            }
+        }
+        // 如果 accept 正常
+        else {
+            /** 构建一个新的 HttpHandler,并放入 epoll 实例中
+             *  注意分发模式下使用了 ONESHOT, 每个套接字只会在 边缘触发,可读时处于就绪状态
+             *  且每个套接字只会被一个线程处理
+             *  NOTE: 每个 client_fd 只会在 HttpHandler 中被 close
+             *        每个 client_handler 只会在 RunEventLoop 返回 false、连接出错或者超时时被放回对象池
+             *        每个连接的定时器都是 HttpHandler 的成员, 挂在当前事件循环的时间轮上, 不占用文件描述符
+             */
+            HttpHandler* client_handler = ConnectionPool::acquire(this, client_fd);
+            Metrics::add(Metrics::ACCEPTED_CONNECTIONS);
+            ++accepted;
+            /**
+             * @brief EPOLLRDHUP EPOLLHUP 不同点,前者是半关闭连接时出发,后者是完全关闭后触发
+             * @ref tcp 源码 https://elixir.bootlin.com/linux/v4.19/source/net/ipv4/tcp.c#L524
+             * @ref TCP: When is EPOLLHUP generated? https://stackoverflow.com/questions/52976152/tcp-when-is-epollhup-generated
+             */
+            bool ret = epoll_.add(client_fd, client_handler->getClientEpollEvent(), client_handler->getClientTriggerCond());
+            assert(ret);
+            (void)ret;
+            // 输出相关信息
+            printConnectionStatus(client_fd, "-------->>>>> New Connection");
+        }
+    }
+}
+
+void EventLoop::handleOldConnection(epoll_event* event)
+{
+    EpollEvent* curr_epoll_event = static_cast<EpollEvent*>(event->data.ptr);
+    HttpHandler* handler = static_cast<HttpHandler*>(curr_epoll_event->ptr);
+    // CGI 程序的管道或者 pidfd 上的事件, 管道关闭时产生的 EPOLLHUP 也交给 CGI 处理
+    if(curr_epoll_event != handler->getClientEpollEvent())
+    {
+        handleCgiEvent_(handler, curr_epoll_event);
+        return;
+    }
+    // 处理一些错误事件
+    int events_ = event->events;
+    // 如果远程关闭了当前连接
+    if ((events_ & EPOLLHUP) || (events_ & EPOLLRDHUP)) {
+        INFO("Socket(%d) was closed by peer.", handler->getClientFd());
+        // 当某个 handler 无法使用时,一定要将其放回对象池
+        ConnectionPool::release(handler);
+        // 之后重新开始遍历新的事件.
+        return;
+    }
+    // 如果当前 socket / events_ 存在错误
+    else if ((events_ & EPOLLERR) || !(events_ & (EPOLLIN | EPOLLOUT))) {
+        ERROR("Socket(%d) error.", handler->getClientFd());
+        // 当某个 handler 无法使用时,一定要将其放回对象池
+        ConnectionPool::release(handler);
+        // 之后重新开始遍历新的事件.
+        return;
+    }
+    // 如果没有错误发生
+    // 1. 如果是多 reactor 模式, 则直接在当前线程中处理
+    //    由于该连接上的所有事件(包括超时)都只会在当前线程中被处理, 因此无需暂停 timer 来防止条件竞争
+    if(!isDispatchMode())
+    {
+        printConnectionStatus(handler->getClientFd(), "-------->>>>> New Message");
+
+        // 如果出现无法恢复的错误,则直接释放该实例以及对应的 client_fd
+        if(!(handler->RunEventLoop()))
+            ConnectionPool::release(handler);
+    }
+    // 2. 如果是分发模式
+    else
+    {
+        // 则暂停 timer, 防止超时回调在工作线程处理该连接时释放它
+        handler->getTimer()->pause();
+        // 并在本轮事件遍历完毕后, 与其他就绪的连接一起放入线程池中并行执行
+        // 工作窃取模式下优先交给上一次处理该连接的线程
+        ThreadPool::ThreadpoolTask task = { handleTask_, handler, handler->getLastWorker() };
+        pending_tasks_.push_back(task);
+    }
+}
+
+void EventLoop::handleCgiEvent_(HttpHandler* handler, EpollEvent* event)
+{
+    // 分发模式下, 工作线程可能仍在 watchCgi 中
+    MutexLockGuard guard(handler->cgi_lock_);
+    // 同一轮的事件中, 连接可能已经被关闭, 或者 CGI 程序已经在处理之前的事件时被回收了
+    if(event->fd < 0 || !handler->cgi_.isRunning())
+        return;
+    pumpCgi(handler);
+}
+
+void EventLoop::watchCgi(HttpHandler* handler)
+{
+    // 放入 epoll 之后, 事件循环线程可能立即开始处理该 CGI 程序, 因此需要持有锁直到定时器启动
+    {
+        MutexLockGuard guard(handler->cgi_lock_);
+        handler->cgi_.watch(&epoll_, handler);
+        handler->armCgiTimer();
+    }
+    // 工作线程中设置的定时器不会缩短事件循环正在等待的时间, 因此需要唤醒事件循环
+    if(wakeup_fd_ >= 0)
+    {
+        uint64_t one = 1;
+        if(write(wakeup_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            ERROR("Write wakeup eventfd fail! (%s)", strerror(errno));
+    }
+}
+
+bool EventLoop::pumpCgi(HttpHandler* handler)
+{
+    if(!handler->cgi_.pump())
+        return true;
+    handler->cgi_timer_.cancel();
+    pending_cgis_.push_back(handler);
+    return false;
+}
+
+void EventLoop::finishCgis_()
+{
+    for(size_t i = 0; i < pending_cgis_.size(); i++)
+    {
+        HttpHandler* handler = pending_cgis_[i];
+        // 连接可能在此之前因为超时等原因被关闭了, 此时 CGI 程序已经在 cleanup 中被结束
+        if(!handler->cgi_.isExited() || (ring_ && handler->uring_.closing))
+            continue;
+        // 分发模式下与新的事件一样放入线程池中, 由工作线程发送 CGI 程序的输出
+        if(isDispatchMode())
+        {
+            handler->getTimer()->pause();
+            ThreadPool::ThreadpoolTask task = { handleTask_, handler, handler->getLastWorker() };
+            pending_tasks_.push_back(task);
+            continue;
+        }
+        // 多 reactor 模式下直接在当前线程中处理
+        bool keep = handler->RunEventLoop();
+        if(ring_)
+            submitSends(handler);
+        if(!keep)
+            closeConnection(handler);
+    }
+    pending_cgis_.clear();
+}
+
+void EventLoop::handleTask_(void* arg)
+{
+    HttpHandler* handler = static_cast<HttpHandler*>(arg);
+    handler->setLastWorker(ThreadPool::getCurrentWorker());
+
+    printConnectionStatus(handler->getClientFd(), "-------->>>>> New Message");
+
+    // 如果出现无法恢复的错误,则直接释放该实例以及对应的 client_fd
+    if(!(handler->RunEventLoop()))
+        ConnectionPool::release(handler);
+}
+
+void EventLoop::dispatchTasks_()
+{
+    if(pending_tasks_.empty())
+        return;
+    size_t appended = thread_pool_->appendTasks(pending_tasks_.data(), pending_tasks_.size());
+    // 线程池的队列已满时, 剩余的连接直接在当前线程中处理, 以免其定时器一直处于暂停状态
+    for(size_t i = appended; i < pending_tasks_.size(); i++)
+    {
+        WARN("Thread pool queue is full, handle socket(%d) in event loop.",
+             static_cast<HttpHandler*>(pending_tasks_[i].arguments)->getClientFd());
+        handleTask_(pending_tasks_[i].arguments);
+    }
+    pending_tasks_.clear();
+}
+
+void EventLoop::loop()
+{
+    if(ring_)
+        loopUring_();
+    else
+        loopEpoll_();
+}
+
+void EventLoop::loopUring_()
+{
+    armAccept_();
+    armEpoll_();
+    for(;;)
+    {
+        // 批量提交所有的 SQE, 并等待新的 CQE, 最多等到时间轮中下一个定时器到期
+        if(ring_->submitAndWait(timer_wheel_.getNextTimeout()) < 0)
+            FATAL("io_uring_enter fail! (%s)", strerror(errno));
+
+        // 遍历获取到的 CQE
+        io_uring_cqe* cqe;
+        while((cqe = ring_->peekCqe()) != nullptr)
+        {
+            // 先复制 CQE 并归还给内核, 处理过程中可能会释放 handler
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring_->seenCqe();
+            handleCqe_(user_data, res, flags);
+        }
+        // 处理超时的连接
+        timer_wheel_.tick();
+        // 继续处理 CGI 程序退出的连接, 产生的 SQE 在下一轮提交
+        finishCgis_();
+    }
+}
+
+void EventLoop::loopEpoll_()
+{
+    // 开始事件循环
+    for(;;)
+    {
+        // 阻塞等待新的事件, 最多等到时间轮中下一个定时器到期
+        int event_num = epoll_.wait(timer_wheel_.getNextTimeout());
+        // 如果报错
+        if(event_num < 0)
+        {
+            // 表示该错误一定不是因为无效的 epoll 导致的
+            assert(event_num != -2);
+            // 如果只是中断,则直接重新循环
+            if(errno == EINTR)
+                continue;
+            // 如果是其他异常,则输出信息并终止.
+            else
+                FATAL("epoll_wait fail! (%s)", strerror(errno));
+        }
+
+
+        // 遍历获取到的事件
+        handleEvents_(event_num);
+        // 处理超时的连接. 如果什么也没读到,则说明 epoll_wait 超时, 或者是因为 signal 导致的
+        /// NOTE: 超时的 CGI 程序被回收时, 同样需要在本轮继续处理其所属的连接, 因此先于 finishCgis_
+        timer_wheel_.tick();
+        finishCgis_();
+        // 分发模式下, 将所有就绪的连接批量放入线程池, 只需唤醒一次工作线程
+        if(isDispatchMode())
+            dispatchTasks_();
+    }
+}
+
+void EventLoop::handleEvents_(int event_num)
+{
+    for(int i = 0; i < event_num; i++)
+    {
+        // 获取事件相关的信息
+        epoll_event&& event = epoll_.getEvent(static_cast<size_t>(i));
+        EpollEvent* curr_epoll_event = static_cast<EpollEvent*>(event.data.ptr);
+
+        // 如果当前文件描述符是 listen_fd, 则建立连接
+        if(curr_epoll_event->fd == listen_fd_)
+            handleNewConnections();
+        // 如果是唤醒事件, 则只需清空计数. 之后会重新计算 epoll_wait 的超时时间
+        else if(curr_epoll_event == &wakeup_event_)
+        {
+            uint64_t count;
+            if(read(wakeup_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                ERROR("Read wakeup eventfd fail! (%s)", strerror(errno));
+        }
+        else
+            handleOldConnection(&event);
+    }
+}
@@ -0,0 +1,209 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <vector>
+
+#include "Epoll.h"
+#include "IoUring.h"
+#include "ThreadPool.h"
+#include "TimerWheel.h"
+
+class HttpHandler;
+
+/**
+ * @brief EventLoop 封装了一个完整的事件循环, 负责 accept 新连接并处理旧连接上的事件
+ *        根据是否传入线程池, 其有两种工作模式:
+ *          1. 分发模式 (thread_pool != nullptr):
+ *             事件循环只负责分发, 每个就绪的连接都会被放入线程池中执行
+ *          2. 多 reactor 模式 (thread_pool == nullptr):
+ *             每个线程独占一个 EventLoop, 以及一个 SO_REUSEPORT 的 listen 套接字,
+ *             连接上的请求直接在接收该事件的线程中处理, 不存在跨线程的交接.
+ *             所有线程也可以共享同一个 listen 套接字, 其以 EPOLLEXCLUSIVE 放入每个 epoll 中,
+ *             新连接只会唤醒其中一个正在等待的线程, 而不是所有线程(惊群)
+ *        listen 套接字使用水平触发, 每轮事件循环最多 accept 一定数量的连接 (accept_budget),
+ *        剩余的连接留到下一轮, 以免大量新连接涌入时饿死已经建立的连接
+ *        多 reactor 模式下还可以选择 io_uring 作为事件后端:
+ *             multishot accept 接收新连接, multishot recv + provided buffer 读取请求,
+ *             链接(IOSQE_IO_LINK)的 send 发送响应, listen 与 client fd 都放入 fixed file 表中.
+ *             所有的 SQE 都在下一次 io_uring_enter 时批量提交, 请求的读写不再需要单独的系统调用
+ *        CGI 程序的管道与 pidfd 同样放入事件循环的 epoll 中, 其超时由时间轮控制, 处理请求的线程不会等待子进程.
+ *        io_uring 后端下, epoll 实例本身通过 multishot poll 监听
+ */
+class EventLoop
+{
+public:
+    // 事件后端
+    enum BACKEND_TYPE {
+        BACKEND_EPOLL,      // epoll + recv/send
+        BACKEND_URING       // io_uring, 只能用于多 reactor 模式
+    };
+
+    /**
+     * @brief 创建一个事件循环
+     * @param listen_fd     当前事件循环所监听的 listen 描述符
+     * @param thread_pool   用于处理请求的线程池, 传入 nullptr 则表示在当前线程中直接处理
+     * @param backend       事件后端. 若 io_uring 初始化失败, 则自动退化为 epoll
+     */
+    EventLoop(int listen_fd, ThreadPool* thread_pool = nullptr, BACKEND_TYPE backend = BACKEND_EPOLL);
+
+    /**
+     * @brief 释放事件循环所使用的资源
+     * @note  注意,不会主动关闭 listen_fd
+     */
+    ~EventLoop();
+
+    /**
+     * @brief 开始事件循环, 该函数不会返回
+     */
+    void loop();
+
+    // 设置每轮事件循环最多 accept 的连接个数, 只用于 epoll 后端
+    static void setAcceptBudget(size_t budget)  { accept_budget = budget; }
+
+    Epoll* getEpoll()               { return &epoll_; }
+    TimerWheel* getTimerWheel()     { return &timer_wheel_; }
+    // 获取 io_uring 实例, epoll 后端下返回 nullptr
+    IoUring* getRing()              { return ring_; }
+    // 是否处于分发模式. 分发模式下连接需要以 EPOLLONESHOT 的方式放入 epoll, 以防止多个线程同时处理一个连接
+    bool isDispatchMode()           { return thread_pool_ != nullptr; }
+
+    /**
+     * @brief 关闭并释放一个连接
+     * @param handler 待关闭的连接
+     * @param force   是否立即关闭. 否则 io_uring 后端下将等待已提交的响应发送完毕后再释放
+     * @note  epoll 后端下会立即释放 handler; io_uring 后端下, 只有当该连接的所有 SQE 都完成后才会释放
+     */
+    void closeConnection(HttpHandler* handler, bool force = false);
+
+    /**
+     * @brief 将连接的 fd 从事件后端中移除, 在关闭 client fd 之前由 HttpHandler 调用
+     */
+    void detachConnection(int client_fd);
+
+    /**
+     * @brief 将连接中待发送的响应报文以链接的 send SQE 提交给 io_uring
+     * @note  只在 io_uring 后端下使用, 同一时刻每个连接最多只有一组 send 正在进行
+     */
+    void submitSends(HttpHandler* handler);
+
+    /**
+     * @brief 开始监听连接上正在运行的 CGI 程序, 并启动其定时器
+     * @note  可以在任意线程中调用. 分发模式下, 调用之后工作线程不能再访问该连接,
+     *        CGI 程序退出后, 连接会重新作为一个任务放入线程池中
+     */
+    void watchCgi(HttpHandler* handler);
+
+    /**
+     * @brief 推进连接上的 CGI 程序, 其退出后在本轮事件循环的最后继续处理该连接
+     * @return CGI 程序仍在运行时返回 true
+     * @note  只能在事件循环线程中调用, 调用者必须持有该连接的 cgi_lock_
+     */
+    bool pumpCgi(HttpHandler* handler);
+
+private:
+    // 每轮事件循环最多 accept 的连接个数
+    static size_t accept_budget;
+
+    // io_uring 的 user_data 中, 低 3 位表示操作类型, 其余位为 HttpHandler 指针
+    enum URING_OP_TYPE {
+        URING_OP_IGNORE = 0,    // 不需要处理的 CQE, 例如 cancel
+        URING_OP_ACCEPT,        // multishot accept
+        URING_OP_FILES_UPDATE,  // 将 client fd 放入 fixed file 表
+        URING_OP_RECV,          // multishot recv
+        URING_OP_SEND,          // send
+        URING_OP_EPOLL          // multishot poll, 监听 epoll 实例中 CGI 程序的管道与 pidfd
+    };
+    static const uint64_t URING_OP_MASK = 7;
+
+    static const unsigned URING_ENTRIES = 4096;         // SQ 队列长度
+    static const unsigned URING_BUF_ENTRIES = 512;      // provided buffer 个数
+    static const unsigned URING_BUF_SIZE = 4096;        // 每个 provided buffer 的大小
+    static const unsigned URING_MAX_FILES = 65536;      // fixed file 表的最大长度
+    static const size_t URING_MAX_SEND = 64 * 1024;     // 单个 send 的最大长度, 慢速连接上每发送这么多数据就会刷新一次定时器
+
+    /**
+     * @brief 处理新的连接
+     */
+    void handleNewConnections();
+
+    /**
+     * @brief 处理旧的连接
+     * @param event         待处理的事件
+     */
+    void handleOldConnection(epoll_event* event);
+
+    /**
+     * @brief 处理 epoll_wait 所获取到的事件
+     * @param event_num 事件个数
+     */
+    void handleEvents_(int event_num);
+
+    /**
+     * @brief 处理 CGI 程序的管道或者 pidfd 上的事件
+     * @param handler   CGI 程序所属的连接
+     * @param event     就绪的 epoll event, 其 fd 为 -1 表示该事件已经过期
+     */
+    void handleCgiEvent_(HttpHandler* handler, EpollEvent* event);
+
+    /**
+     * @brief 继续处理本轮中 CGI 程序退出的连接
+     */
+    void finishCgis_();
+
+    /**
+     * @brief 分发模式下工作线程所执行的任务, 处理一个就绪的连接
+     * @param arg 待处理的 HttpHandler
+     */
+    static void handleTask_(void* arg);
+
+    /**
+     * @brief 将 pending_tasks_ 批量放入线程池
+     */
+    void dispatchTasks_();
+
+    /**
+     * @brief 将连接标记为关闭, 并取消其上尚未完成的操作, 但不会释放 handler
+     * @note  处理 CQE 的过程中使用该函数, 由 handleCqe_ 在最后统一释放
+     */
+    void shutdownConnection_(HttpHandler* handler, bool force);
+
+    /**
+     * @brief 初始化 io_uring 后端, 失败时返回 false
+     */
+    bool setupUring_();
+
+    // epoll / io_uring 后端的事件循环
+    void loopEpoll_();
+    void loopUring_();
+
+    // 提交 multishot accept / multishot recv / 监听 epoll 实例的 multishot poll
+    void armAccept_();
+    void armRecv_(HttpHandler* handler);
+    void armEpoll_();
+
+    /**
+     * @brief 处理一个 CQE
+     */
+    void handleCqe_(uint64_t user_data, int res, unsigned flags);
+    void handleAcceptCqe_(int res, unsigned flags);
+    void handleRecvCqe_(HttpHandler* handler, int res, unsigned flags);
+    void handleSendCqe_(HttpHandler* handler, int res);
+    void handleEpollCqe_(int res, unsigned flags);
+
+    Epoll epoll_;                   // 当前事件循环独占的 epoll 实例
+    IoUring* ring_;                 // io_uring 后端下当前事件循环独占的 io_uring 实例
+    TimerWheel timer_wheel_;        // 当前事件循环所有连接的定时器, 由 epoll_wait 的超时时间驱动
+    int listen_fd_;                 // 监听套接字
+    EpollEvent listen_event_;       // 监听套接字的 epoll event
+    int idle_fd_;                   // 空闲 fd，用于关闭溢出的文件描述符
+    // 分发模式下用于唤醒事件循环的 eventfd, 使得工作线程启动的 CGI 定时器能够重新计算 epoll_wait 的超时时间
+    int wakeup_fd_;
+    EpollEvent wakeup_event_;
+    ThreadPool* thread_pool_;       // 分发模式下所使用的线程池
+    // 分发模式下, 本轮 epoll_wait 中所有就绪的连接, 在遍历完所有事件后一次性放入线程池
+    vector<ThreadPool::ThreadpoolTask> pending_tasks_;
+    // 本轮中 CGI 程序退出的连接, 在时间轮推进之后统一处理
+    vector<HttpHandler*> pending_cgis_;
+};
+
+#endif
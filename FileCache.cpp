@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <functional>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "FileCache.h"
+#include "Log.h"
+#include "Utils.h"
+
+// 会导致已缓存的条目失效的 inotify 事件
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE
+                                 | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                                 | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+FileCache::Entry::~Entry()
+{
+    if(map_addr)
+        munmap(map_addr, st.st_size);
+    if(fd >= 0)
+        close(fd);
+}
+
+FileCache::FileCache(const string& www_path, size_t fd_budget)
+    : shard_budget_(max(fd_budget / SHARD_NUM, static_cast<size_t>(1))),
+      inotify_fd_(-1), thread_started_(false), enabled_(false), generation_(0)
+{
+    char* real_path = canonicalize_file_name(www_path.c_str());
+    if(!real_path)
+    {
+        ERROR("FileCache: cannot get www path [%s] (%s)", www_path.c_str(), strerror(errno));
+        return;
+    }
+    www_real_path_ = real_path;
+    free(real_path);
+
+    // 没有 inotify 时无法感知文件的变化, 因此不能启用缓存
+    if((inotify_fd_ = inotify_init1(IN_CLOEXEC)) == -1)
+    {
+        ERROR("FileCache: inotify_init1 fail! (%s)", strerror(errno));
+        return;
+    }
+    addWatches_(www_real_path_);
+    if(pthread_create(&inotify_thread_, nullptr, inotifyThread_, this))
+    {
+        ERROR("FileCache: create inotify thread fail!");
+        return;
+    }
+    thread_started_ = true;
+    enabled_ = true;
+    INFO("FileCache: watching %lu directories under [%s], %lu entries per shard",
+         watches_.size(), www_real_path_.c_str(), shard_budget_);
+}
+
+FileCache::~FileCache()
+{
+    if(thread_started_)
+    {
+        // read 是取消点, 因此 inotify 线程会在阻塞时退出
+        pthread_cancel(inotify_thread_);
+        pthread_join(inotify_thread_, nullptr);
+    }
+    if(inotify_fd_ >= 0)
+        close(inotify_fd_);
+}
+
+FileCache::Shard& FileCache::getShard_(const string& key)
+{
+    return shards_[hash<string>()(key) % SHARD_NUM];
+}
+
+FileCache::EntryPtr FileCache::get(const string& key)
+{
+    if(!isEnabled())
+        return nullptr;
+    Shard& shard = getShard_(key);
+    MutexLockGuard guard(shard.lock);
+    auto iter = shard.index.find(key);
+    if(iter == shard.index.end())
+        return nullptr;
+    // 移动至 LRU 链表的头部
+    shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+    return iter->second->second;
+}
+
+FileCache::EntryPtr FileCache::createEntry(int fd, const struct stat& st, const string& mime_type,
+                                           const string& real_path, bool map_file)
+{
+    shared_ptr<Entry> entry = make_shared<Entry>();
+    entry->fd = fd;
+    entry->st = st;
+    entry->mime_type = mime_type;
+    entry->content_length = to_string(st.st_size);
+    // 与 nginx 类似, ETag 由 inode、大小与纳秒级的修改时间组成
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx.%lx\"", static_cast<unsigned long>(st.st_ino),
+             static_cast<unsigned long>(st.st_size), static_cast<unsigned long>(st.st_mtim.tv_sec),
+             static_cast<unsigned long>(st.st_mtim.tv_nsec));
+    entry->etag = etag;
+    entry->last_modified = formatHttpDate(st.st_mtim.tv_sec);
+    entry->real_path = real_path;
+    if(map_file && st.st_size > 0)
+    {
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(addr == MAP_FAILED)
+        {
+            WARN("Can not map file [%s] -> mem! (%s)", real_path.c_str(), strerror(errno));
+            return nullptr;
+        }
+        entry->map_addr = static_cast<char*>(addr);
+    }
+    return entry;
+}
+
+void FileCache::put(const string& key, const EntryPtr& entry, uint64_t generation)
+{
+    if(!isEnabled())
+    {
+        entry->stale_flag->set();
+        return;
+    }
+
+    Shard& shard = getShard_(key);
+    MutexLockGuard guard(shard.lock);
+    // 打开文件之后发生过失效, 则该文件可能已经过期. 在锁内检查, 以保证不会与 invalidate 交错
+    if(getGeneration() != generation)
+    {
+        entry->stale_flag->set();
+        return;
+    }
+    auto iter = shard.index.find(key);
+    if(iter != shard.index.end())
+    {
+        // 其他线程已经放入了同一个文件, 以新的条目为准
+        iter->second->second->stale_flag->set();
+        iter->second->second = entry;
+        shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+        return;
+    }
+    shard.lru.emplace_front(key, entry);
+    shard.index[key] = shard.lru.begin();
+    // 超出预算时淘汰最久未使用的条目, 正在发送中的文件会在发送完成后才关闭
+    while(shard.lru.size() > shard_budget_)
+    {
+        shard.lru.back().second->stale_flag->set();
+        shard.index.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+}
+
+void FileCache::invalidate(const string& path)
+{
+    __atomic_add_fetch(&generation_, 1, __ATOMIC_ACQ_REL);
+    for(size_t i = 0; i < SHARD_NUM; i++)
+    {
+        Shard& shard = shards_[i];
+        MutexLockGuard guard(shard.lock);
+        for(auto iter = shard.lru.begin(); iter != shard.lru.end(); )
+        {
+            const string& real_path = iter->second->real_path;
+            // 目录下的所有文件都需要失效, 注意 /a/b 不是 /a/bc 的父目录
+            if(path.empty() || (real_path.compare(0, path.size(), path) == 0
+                && (real_path.size() == path.size() || real_path[path.size()] == '/')))
+            {
+                INFO("FileCache: invalidate [%s]", iter->first.c_str());
+                iter->second->stale_flag->set();
+                shard.index.erase(iter->first);
+                iter = shard.lru.erase(iter);
+            }
+            else
+                ++iter;
+        }
+    }
+}
+
+void FileCache::addWatches_(const string& dir)
+{
+    int wd = inotify_add_watch(inotify_fd_, dir.c_str(), WATCH_MASK);
+    if(wd == -1)
+    {
+        WARN("FileCache: cannot watch [%s] (%s)", dir.c_str(), strerror(errno));
+        return;
+    }
+    watches_[wd] = dir;
+
+    DIR* dirp = opendir(dir.c_str());
+    if(!dirp)
+        return;
+    // 不跟随符号链接, 因此所有被监视的路径都是真实路径
+    dirent* ent;
+    while((ent = readdir(dirp)) != nullptr)
+    {
+        if(ent->d_type != DT_DIR || !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        addWatches_(dir + "/" + ent->d_name);
+    }
+    closedir(dirp);
+}
+
+void* FileCache::inotifyThread_(void* arg)
+{
+    static_cast<FileCache*>(arg)->handleEvents_();
+    return nullptr;
+}
+
+void FileCache::handleEvents_()
+{
+    // inotify_event 需要按照其自身的对齐方式存放
+    char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+    for(;;)
+    {
+        ssize_t len = read(inotify_fd_, buf, sizeof(buf));
+        if(len <= 0)
+        {
+            if(len < 0 && errno == EINTR)
+                continue;
+            ERROR("FileCache: read inotify fail, cache is cleared and disabled! (%s)", strerror(errno));
+            __atomic_store_n(&enabled_, false, __ATOMIC_RELEASE);
+            invalidate("");
+            return;
+        }
+        for(char* ptr = buf; ptr < buf + len; )
+        {
+            inotify_event* event = reinterpret_cast<inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+
+            // 事件队列溢出, 已经无法知道哪些文件被修改了
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                WARN("FileCache: inotify queue overflow, clear the cache.");
+                invalidate("");
+                continue;
+            }
+            auto iter = watches_.find(event->wd);
+            if(iter == watches_.end())
+                continue;
+            // 目录本身被删除后, watch 会被自动移除
+            if(event->mask & IN_IGNORED)
+            {
+                watches_.erase(iter);
+                continue;
+            }
+            string path = iter->second;
+            if(event->len > 0 && event->name[0])
+                path += string("/") + event->name;
+            invalidate(path);
+            // 新建的子目录也需要监视
+            if((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                addWatches_(path);
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief 静态文件的元数据缓存, 以请求路径为键, 缓存已经打开的 fd、stat 信息以及响应头所需的字段
+ *        命中缓存时, 发送文件之前不需要任何文件系统相关的系统调用 (canonicalize / stat / open)
+ * @note  缓存被分为多个分片, 每个分片有独立的锁以及 LRU 链表, 以减少多线程下的锁竞争
+ * @note  后台线程通过 inotify 监视 www 目录下的所有子目录, 文件被修改/删除/移动时使对应的条目失效
+ *        条目以其真实路径(canonical path)进行匹配, 因此通过符号链接间接修改的文件不会被感知
+ */
+class FileCache
+{
+public:
+    // 条目的失效标志. 条目离开缓存(失效/淘汰/未能放入)时被置位, 此后该文件的变化将不再被感知
+    // 其他依赖于该文件内容的缓存(例如 ResponseCache)可以单独持有该标志, 而不必持有文件本身
+    struct StaleFlag {
+        bool stale;
+        StaleFlag() : stale(false) {}
+        bool isStale() const    { return __atomic_load_n(&stale, __ATOMIC_ACQUIRE); }
+        void set()              { __atomic_store_n(&stale, true, __ATOMIC_RELEASE); }
+    };
+
+    // 缓存中的一个文件. 创建后不再修改, 因此可以在多个线程之间共享
+    struct Entry {
+        int fd;                 // 已经打开的文件, 条目释放时关闭
+        struct stat st;         // 文件的 stat 信息
+        string mime_type;       // Content-type
+        string content_length;  // 预先格式化的 Content-length
+        string etag;            // 由 stat 信息生成的 ETag, 文件被修改后随之改变
+        string last_modified;   // 预先格式化的 Last-Modified
+        string real_path;       // 文件的真实路径, 用于 inotify 失效
+        char* map_addr;         // io_uring 后端下映射至内存的文件内容, 否则为 nullptr
+        shared_ptr<StaleFlag> stale_flag;
+
+        Entry() : fd(-1), map_addr(nullptr), stale_flag(make_shared<StaleFlag>()) {}
+        ~Entry();
+    };
+    typedef shared_ptr<const Entry> EntryPtr;
+
+    /**
+     * @brief 创建文件缓存, 并启动 inotify 线程
+     * @param www_path   被监视的 www 目录
+     * @param fd_budget  缓存最多持有的 fd 个数. 正在发送中的文件会在发送完成后才关闭,
+     *                   因此实际打开的 fd 个数可能短暂地超过该值
+     */
+    FileCache(const string& www_path, size_t fd_budget);
+    ~FileCache();
+
+    /**
+     * @brief 查询缓存
+     * @param key 请求路径
+     * @return 命中则返回对应的条目, 否则返回 nullptr
+     */
+    EntryPtr get(const string& key);
+
+    /**
+     * @brief 缓存是否可用. inotify 不可用时无法感知文件的变化, 此时不使用缓存
+     */
+    bool isEnabled()    { return __atomic_load_n(&enabled_, __ATOMIC_ACQUIRE); }
+
+    /**
+     * @brief 获取当前的失效计数. 每次 invalidate 都会使其加一
+     * @note  调用者需要在 stat / open 文件之前获取该值并传递给 put,
+     *        以防止在此期间被修改的文件在失效之后才放入缓存
+     */
+    uint64_t getGeneration()    { return __atomic_load_n(&generation_, __ATOMIC_ACQUIRE); }
+
+    /**
+     * @brief 将一个条目放入缓存中
+     * @param key        请求路径
+     * @param entry      通过 createEntry 创建的条目
+     * @param generation 打开文件之前通过 getGeneration 获取的失效计数. 若期间发生过失效, 则不放入缓存
+     * @note  未能放入缓存的条目会被立即标记为失效
+     */
+    void put(const string& key, const EntryPtr& entry, uint64_t generation);
+
+    /**
+     * @brief 由一个已经打开的普通文件创建条目, 未启用缓存时也使用该条目来管理文件的生命周期
+     * @param fd        已经打开的文件, 之后由条目负责关闭. -1 表示只使用条目中的元数据, 此时不能放入缓存
+     * @param st        文件的 stat 信息
+     * @param mime_type Content-type
+     * @param real_path 文件的真实路径
+     * @param map_file  是否将文件映射至内存 (供没有 sendfile 的 io_uring 后端使用)
+     * @return 新建的条目; 若映射文件失败, 则关闭 fd 并返回 nullptr
+     */
+    static EntryPtr createEntry(int fd, const struct stat& st, const string& mime_type,
+                                const string& real_path, bool map_file);
+
+    /**
+     * @brief 使真实路径为 path 或者位于目录 path 之下的所有条目失效
+     * @param path 真实路径, 为空时清空整个缓存
+     */
+    void invalidate(const string& path);
+
+private:
+    static const size_t SHARD_NUM = 16;
+
+    // 一个分片: LRU 链表, 以及由 key 到链表节点的索引
+    struct Shard {
+        MutexLock lock;
+        list<pair<string, EntryPtr>> lru;
+        unordered_map<string, list<pair<string, EntryPtr>>::iterator> index;
+    };
+
+    Shard shards_[SHARD_NUM];
+    size_t shard_budget_;           // 每个分片最多持有的条目个数
+
+    string www_real_path_;          // www 目录的真实路径
+    int inotify_fd_;
+    unordered_map<int, string> watches_;    // watch descriptor -> 目录的真实路径, 只由 inotify 线程访问
+    pthread_t inotify_thread_;
+    bool thread_started_;
+    bool enabled_;                  // inotify 是否正常工作, 出错后缓存将被停用. 使用原子操作访问
+    uint64_t generation_;           // 失效计数, 使用原子操作访问
+
+    Shard& getShard_(const string& key);
+
+    /**
+     * @brief 递归地监视目录 dir 及其所有子目录
+     */
+    void addWatches_(const string& dir);
+
+    /**
+     * @brief inotify 线程所执行的函数, 读取并处理 inotify 事件
+     */
+    static void* inotifyThread_(void* arg);
+    void handleEvents_();
+};
+
+#endif
@@ -2,95 +2,513 @@
 #include <cassert>
 #include <cstring>
 #include <cctype>
+#include <cstddef>
+#include <cstdio>
 #include <fcntl.h>
+#include <linux/tcp.h>
 #include <netinet/in.h>
-#include <sstream>
+#include <poll.h>
+#include <random>
 #include <sys/mman.h>
-#include <sys/prctl.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/uio.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "HttpHandler.h"
+#include "HttpScan.h"
 #include "Log.h"
 #include "Utils.h"
 
 // 声明一下该静态成员变量
  // 如果先前没有设置 www 路径,则设置路径为当前的工作路径
 string HttpHandler::www_path = ".";
+FileCache* HttpHandler::file_cache = nullptr;
+ResponseCache* HttpHandler::response_cache = nullptr;
+CompressCache* HttpHandler::compress_cache = nullptr;
+size_t HttpHandler::max_header_size = 8192;
+string HttpHandler::metrics_path;
 
-HttpHandler::HttpHandler(Epoll* epoll, int client_fd, Timer* timer) 
-      // 初始化 client 的 fd 和 epoll event
-    : client_fd_(client_fd), client_event_{client_fd_, this}, 
-      // 初始化 timer 的 fd 和 epoll event
-      timer_(timer), epoll_(epoll), curr_parse_pos_(0)
+// 统计数据中每个 ERROR_TYPE 的名称, ERR_SUCCESS 与 ERR_AGAIN 不是错误, 不会被统计
+static const char* const error_type_names[] = {
+    nullptr,                        // ERR_SUCCESS
+    "read_request_fail",
+    nullptr,                        // ERR_AGAIN
+    "connection_closed",
+    "send_response_fail",
+    "bad_request",
+    "header_too_large",
+    "not_found",
+    "length_required",
+    "not_implemented",
+    "internal_server_error",
+    "http_version_not_supported",
+};
+
+// 被抽样的请求输出其响应报文
+#define DUMP_RESPONSE(x...) do { \
+    if(dump_packet_) { \
+        DUMP("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<- Response Packet ->>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> "); \
+        DUMP(x); \
+    } \
+  } while (0)
+
+// multipart/byteranges 所使用的分隔符, 在启动时随机生成
+static string makeBoundary()
+{
+    random_device rd;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%08x%08x", rd(), rd());
+    return buf;
+}
+static const string byteranges_boundary = makeBoundary();
+// multipart/byteranges 响应的 Content-type, 以及 body 末尾的结束分隔符
+static const string byteranges_content_type = "multipart/byteranges; boundary=" + byteranges_boundary;
+static const string byteranges_end = "\r\n--" + byteranges_boundary + "--\r\n";
+
+// 是否根据 Accept-Encoding 为该文件选择压缩的表示形式. 过小的文件压缩后节省的字节数不足以抵消其开销
+static bool isNegotiable(const FileCache::EntryPtr& file)
+{
+    return S_ISREG(file->st.st_mode) && CompressCache::isCompressible(file->mime_type)
+        && static_cast<size_t>(file->st.st_size) >= CompressCache::MIN_SOURCE_SIZE;
+}
+
+// 在栈上格式化一个十进制数, 用于 Content-length 等响应头
+class DecimalStr
+{
+public:
+    explicit DecimalStr(size_t num)     { buf_[ResponseBuilder::formatDecimal(buf_, num)] = '\0'; }
+    const char* c_str() const           { return buf_; }
+
+private:
+    char buf_[ResponseBuilder::MAX_DECIMAL_LEN + 1];
+};
+
+// 静态文件响应中的验证器. 可以协商压缩的文件, 其响应内容随 Accept-Encoding 变化
+static void appendValidatorHeaders(ResponseBuilder& out, const FileCache::EntryPtr& file, const string& etag)
+{
+    out.append("ETag: ").append(etag);
+    out.append("\r\nLast-Modified: ").append(file->last_modified);
+    out.append("\r\n");
+    if(isNegotiable(file))
+        out.append("Vary: Accept-Encoding\r\n");
+}
+
+// 静态文件响应中的 Accept-Ranges 以及验证器
+static void appendFileHeaders(ResponseBuilder& out, const FileCache::EntryPtr& file)
+{
+    out.append("Accept-Ranges: bytes\r\n");
+    appendValidatorHeaders(out, file, file->etag);
+}
+
+// 启动时预先生成的响应片段, 拼接响应头时直接复制, 错误响应则整个报文都不需要拼接
+struct HttpHandler::ResponseTemplates
+{
+    int codes[STATUS_NUM];                      // 状态码的数值
+    string status_lines[STATUS_NUM];            // "HTTP/1.1 200 OK\r\n"
+    string connection_headers[2];               // Connection, Keep-Alive 与 Server, 下标表示是否为持续连接
+    string error_responses[STATUS_NUM][2];      // 错误状态码的完整响应报文, 下标同上. 其余状态码为空
+    size_t error_header_len[STATUS_NUM][2];     // 错误响应报文中头部的长度, HEAD 请求只发送这一部分
+
+    ResponseTemplates();
+};
+
+HttpHandler::ResponseTemplates::ResponseTemplates()
+{
+    static const struct {
+        int code;
+        const char* reason;
+    } statuses[STATUS_NUM] = {
+        { 200, "OK" },
+        { 206, "Partial Content" },
+        { 304, "Not Modified" },
+        { 400, "Bad Request" },
+        { 404, "Not Found" },
+        { 411, "Length Required" },
+        { 416, "Range Not Satisfiable" },
+        { 431, "Request Header Fields Too Large" },
+        { 500, "Internal Server Error" },
+        { 501, "Not Implemented" },
+        { 505, "HTTP Version Not Supported" },
+    };
+
+    // Keep-Alive 头中, timeout 表示超时时间(单位s), max表示最多接收请求次数,超过则断开.
+    connection_headers[0] = "Connection: Close\r\nServer: WebServer/1.1\r\n";
+    connection_headers[1] = "Connection: Keep-Alive\r\nKeep-Alive: timeout=" + to_string(timeoutPerRequest)
+                          + ", max=" + to_string(keepAliveMaxRequests) + "\r\nServer: WebServer/1.1\r\n";
+
+    for(int i = 0; i < STATUS_NUM; i++)
+    {
+        string status = to_string(statuses[i].code) + " " + statuses[i].reason;
+        codes[i] = statuses[i].code;
+        status_lines[i] = "HTTP/1.1 " + status + "\r\n";
+        for(int keepAlive = 0; keepAlive < 2; keepAlive++)
+        {
+            error_header_len[i][keepAlive] = 0;
+            // 416 的响应中需要包含文件的大小, 由 sendRangeResponse 单独生成
+            if(statuses[i].code < 400 || i == STATUS_RANGE_NOT_SATISFIABLE)
+                continue;
+            string body = "<html>"
+                          "<title>" + status + "</title>"
+                          "<body>" + status +
+                              "<hr><em> Kiprey's Web Server</em>"
+                          "</body>"
+                          "</html>";
+            string& response = error_responses[i][keepAlive];
+            response = status_lines[i] + connection_headers[keepAlive]
+                     + "Content-length: " + to_string(body.size()) + "\r\n"
+                     + "Content-type: text/html\r\n\r\n";
+            error_header_len[i][keepAlive] = response.size();
+            response += body;
+        }
+    }
+}
+
+const HttpHandler::ResponseTemplates HttpHandler::templates;
+
+// Accept-Encoding 中可以接受的压缩方式
+static const int ENCODING_GZIP = 1;
+static const int ENCODING_BR = 2;
+
+// 解析 Accept-Encoding, 返回 q 值不为 0 的压缩方式. 未列出的压缩方式使用 * 的 q 值
+static int parseAcceptEncoding(const char* str, size_t len)
 {
+    int accepted = 0, listed = 0;
+    bool any = false;
+    const char* p = str;
+    const char* end = str + len;
+    while(p < end)
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        const char* coding = p;
+        while(p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            ++p;
+        size_t coding_len = static_cast<size_t>(p - coding);
+        // 只需要区分 q 值是否为 0, 即 "0", "0.", "0.0" ...
+        bool rejected = false;
+        while(p < end && *p != ',')
+        {
+            if(*p == ';')
+            {
+                ++p;
+                while(p < end && (*p == ' ' || *p == '\t'))
+                    ++p;
+                if(end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=')
+                {
+                    const char* q = p + 2;
+                    rejected = q < end && *q == '0';
+                    for(++q; rejected && q < end && *q != ',' && *q != ';' && *q != ' ' && *q != '\t'; ++q)
+                        rejected = *q == '.' || *q == '0';
+                }
+                continue;
+            }
+            ++p;
+        }
+
+        int bit = 0;
+        if((coding_len == 4 && !strncasecmp(coding, "gzip", 4)) || (coding_len == 6 && !strncasecmp(coding, "x-gzip", 6)))
+            bit = ENCODING_GZIP;
+        else if(coding_len == 2 && !strncasecmp(coding, "br", 2))
+            bit = ENCODING_BR;
+        else if(coding_len == 1 && *coding == '*')
+        {
+            any = !rejected;
+            continue;
+        }
+        listed |= bit;
+        if(!rejected)
+            accepted |= bit;
+    }
+    if(any)
+        accepted |= (ENCODING_GZIP | ENCODING_BR) & ~listed;
+    return accepted;
+}
+
+// If-None-Match 中的 ETag 列表是否包含 etag. 使用弱比较, 即忽略 W/ 前缀
+static bool matchEntityTag(const char* str, size_t len, const string& etag)
+{
+    const char* p = str;
+    const char* end = str + len;
+    while(p < end)
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        const char* tag = p;
+        while(p < end && *p != ',')
+            ++p;
+        const char* tag_end = p;
+        while(tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+            --tag_end;
+        if(tag_end - tag == 1 && *tag == '*')
+            return true;
+        if(tag_end - tag >= 2 && tag[0] == 'W' && tag[1] == '/')
+            tag += 2;
+        if(static_cast<size_t>(tag_end - tag) == etag.size() && !memcmp(tag, etag.data(), etag.size()))
+            return true;
+    }
+    return false;
+}
+
+// 单个 Range 请求头中最多的区间个数, 超出时忽略该请求头, 以免少量请求产生大量的响应数据
+static const size_t MAX_RANGE_NUM = 16;
+
+// 解析 Range 中的一个十进制数, 溢出时取 SIZE_MAX. 没有数字时返回 false
+static bool parseRangeNumber(const char*& p, const char* end, size_t* num)
+{
+    const char* begin = p;
+    *num = 0;
+    for(; p < end && isdigit(*p); p++)
+        *num = (*num > (SIZE_MAX - 9) / 10) ? SIZE_MAX : *num * 10 + static_cast<size_t>(*p - '0');
+    return p != begin;
+}
+
+/**
+ * @brief 解析 Range 请求头, 格式为 bytes=<first>-<last>, <first>-, -<suffix_length>, 多个区间以逗号分隔
+ * @param ranges 可以满足的区间, 每个区间表示为 [begin, end)
+ * @return false 表示格式错误、单位不是 bytes 或者区间过多, 此时应当忽略该请求头
+ */
+static bool parseByteRanges(const char* str, size_t len, size_t file_size, ArenaVector<pair<size_t, size_t>>& ranges)
+{
+    const char* p = str;
+    const char* end = str + len;
+    if(len < 6 || strncasecmp(p, "bytes=", 6))
+        return false;
+    p += 6;
+    size_t count = 0;
+    while(true)
+    {
+        while(p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        size_t first, last;
+        bool has_first = parseRangeNumber(p, end, &first);
+        if(p == end || *p != '-')
+            return false;
+        ++p;
+        bool has_last = parseRangeNumber(p, end, &last);
+        if((!has_first && !has_last) || (has_first && has_last && last < first))
+            return false;
+        if(++count > MAX_RANGE_NUM)
+            return false;
+
+        if(has_first)
+        {
+            // 起始位置超出文件大小的区间无法满足
+            if(first < file_size)
+                ranges.push_back(make_pair(first, has_last ? min(last, file_size - 1) + 1 : file_size));
+        }
+        // 后缀区间表示文件末尾的 last 个字节
+        else if(last > 0 && file_size > 0)
+            ranges.push_back(make_pair(file_size - min(last, file_size), file_size));
+
+        while(p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        if(p == end)
+            return true;
+        if(*p != ',')
+            return false;
+        ++p;
+    }
+}
+
+/**
+ * @brief 将作用域内当前线程的堆分配次数计入统计数据, 只有调试版本才会统计
+ */
+class AllocScope
+{
+public:
+    AllocScope() : start_(AllocCounter::threadCount()) {}
+    ~AllocScope()
+    {
+        if(AllocCounter::ENABLED)
+            Metrics::add(Metrics::HEAP_ALLOCATIONS, AllocCounter::threadCount() - start_);
+    }
+
+private:
+    uint64_t start_;
+};
+
+/**
+ * @brief 清空缓冲区, 容量超过 limit 时将其释放
+ */
+static void trimBuffer(string& buf, size_t limit)
+{
+    if(buf.capacity() > limit)
+        string().swap(buf);
+    else
+        buf.clear();
+}
+
+HttpHandler::HttpHandler()
+      // 初始化 timer, 超时时释放当前实例. 绑定连接时才会挂到事件循环的时间轮上
+    : client_fd_(-1), client_event_{-1, this}, timer_(nullptr, handleTimeout, this),
+      cgi_timer_(nullptr, handleCgiTimeout, this), loop_(nullptr), epoll_(nullptr),
+      pool_owner_(nullptr), pool_next_(nullptr)
+{
+}
+
+void HttpHandler::init(EventLoop* loop, int client_fd)
+{
+    // 初始化 client 的 fd 和 epoll event
+    client_fd_ = client_fd;
+    client_event_.fd = client_fd;
+    timer_.attach(loop->getTimerWheel());
+    cgi_timer_.attach(loop->getTimerWheel());
+    loop_ = loop;
+    epoll_ = loop->getEpoll();
+    last_worker_ = -1;
+    // 上一个连接遗留的数据已经在 cleanup 中清除
+    request_.clear();
+    curr_parse_pos_ = 0;
+    scanned_size_ = 0;
+    cache_generation_ = 0;
+    out_offset_ = 0;
+    out_bytes_ = 0;
+    close_after_flush_ = false;
+    acked_bytes_ = 0;
+    stalled_timeouts_ = 0;
+
+    uring_.fd = client_fd_;
+    uring_.fixed_file = uring_.recv_armed = uring_.closing = uring_.aborted = false;
+    uring_.inflight = 0;
+    uring_.sending = 0;
+    client_trigger_cond_ = getClientTriggerCond();
     // HTTP1.1下,默认是持续连接
     // 除非 client http headers 中带有 Connection: close
     isKeepAlive_ = true;
     // 初始化一些变量
     reset();
-    // 设置 timer epoll event
-    if(timer)
-        timer_event_ = {timer->getFd(), this};
 }
 
-HttpHandler::~HttpHandler()
+void HttpHandler::cleanup()
 {
-    // 从 epoll 中删除该套接字相关的事件
+    // 从 epoll / io_uring 中删除该套接字相关的事件
     /// NOTE: 注意先删除 epoll 中的条目,再来关闭 fd
-    bool ret1 = epoll_->del(client_fd_);
-    bool ret2 = true;
-    // 如果不是空定时器,则释放
-    if(timer_)
-    {
-        ret2 = epoll_->del(timer_->getFd());
-        // 删除定时器
-        delete timer_;
-    }
-    assert(ret1 && ret2);
+    loop_->detachConnection(client_fd_);
+    // 从时间轮中删除定时器
+    timer_.destroy();
+    // 结束仍在运行的 CGI 程序, 其管道同样需要在关闭之前从 epoll 中删除
+    cgi_.abort();
+    cgi_timer_.destroy();
+    // 释放发送队列中尚未发送的文件, 同时回收 output_arena_
+    while(!out_queue_.empty())
+        popOutputChunk();
+    out_queue_.trim(maxIdleOutputChunks);
     // 关闭客户套接字
     INFO("------------------------ "
          "Connection Closed (socket: %d)"
          "------------------------",
          client_fd_);
     close(client_fd_);
+    client_fd_ = -1;
+    // 释放对缓存条目的引用, 并限制空闲对象所占用的内存
+    file_entry_.reset();
+    trimBuffer(request_, maxIdleBufferSize);
+    trimBuffer(http_body_, maxIdleBufferSize);
+    trimBuffer(path_, maxIdleBufferSize);
+    trimBuffer(real_path_, maxIdleBufferSize);
+}
+
+HttpHandler::~HttpHandler()
+{
+    if(client_fd_ >= 0)
+        cleanup();
 }
 
 void HttpHandler::reset()
 {
-    // 清除已经处理过的数据
+    // 清除已经处理过的数据, 流水线中后续请求的数据保留在 request_ 中
     assert(request_.length() >= curr_parse_pos_);
 
-    request_.clear();
+    request_.erase(0, curr_parse_pos_);
     curr_parse_pos_ = 0;
+    scanned_size_ = 0;
+    // 决定下一个请求是否输出报文
+    dump_packet_ = samplePacketDump();
+    request_start_us_ = 0;
+    response_status_ = 0;
+    // 重置解析进度, 下一个请求从 request_ 的起始位置开始
+    parse_state_ = PARSE_METHOD;
+    scan_pos_ = 0;
+    field_begin_ = 0;
     // 重设状态
     state_ = STATE_PARSE_URI;
-    // 重置重试次数
-    againTimes_ = maxAgainTimes;
-    // 重置 headers_
-    headers_.clear();
+    // 重置请求头
+    http_request_.reset();
     // 重置 body
     http_body_.clear();
-    // 重置超时时间
-    if(timer_)
-        timer_->setTime(timeoutPerRequest, 0);
+    // 回收上一个请求的临时数据, 发送队列中的数据位于 output_arena_ 中, 不受影响
+    request_arena_.reset();
+    // 释放对缓存条目的引用
+    file_entry_.reset();
+    // 重置超时时间, 这只是一次时间轮上的内存操作
+    timer_.setTime(timeoutPerRequest, 0);
+}
+
+void HttpHandler::handleTimeout(void* arg)
+{
+    HttpHandler* handler = static_cast<HttpHandler*>(arg);
+    // 对端仍在接收数据, 只是没有收到可写通知
+    if(handler->rearmStalledOutput() || handler->checkSendProgress())
+        return;
+    INFO("-------->>>>> "
+         "New Message: socket(%d) timeout."
+         " <<<<<--------",
+         handler->getClientFd());
+    Metrics::add(Metrics::TIMEOUTS);
+    // 删除 handler 实例
+    handler->getLoop()->closeConnection(handler, true);
+}
+
+void HttpHandler::handleCgiTimeout(void* arg)
+{
+    HttpHandler* handler = static_cast<HttpHandler*>(arg);
+    MutexLockGuard guard(handler->cgi_lock_);
+    CgiProcess& cgi = handler->cgi_;
+    if(!cgi.isRunning())
+        return;
+    // 超时后杀死子进程, 之后与正常退出一样等待其被回收
+    if(!cgi.isKilled() && cgi.getRuntimeMs() >= static_cast<uint64_t>(handler->maxCGIRuntime))
+    {
+        WARN("Sub process timeout.");
+        Metrics::add(Metrics::CGI_TIMEOUTS);
+        cgi.kill();
+    }
+    if(handler->getLoop()->pumpCgi(handler))
+        handler->armCgiTimer();
+}
+
+void HttpHandler::armCgiTimer()
+{
+    // 存在 pidfd 时只需要在超时的时候唤醒, 否则每隔 cgiStepTime 检查一次子进程是否已经退出
+    // 被杀死之后同样轮询, 以防 pidfd 没能放入 epoll 中
+    uint64_t runtime = cgi_.getRuntimeMs();
+    long timeout_ms = cgiStepTime;
+    if(cgi_.hasPidFd() && !cgi_.isKilled() && runtime < static_cast<uint64_t>(maxCGIRuntime))
+        timeout_ms = maxCGIRuntime - static_cast<long>(runtime);
+    cgi_timer_.setTime(timeout_ms / 1000, timeout_ms % 1000 * 1000000);
 }
 
 HttpHandler::ERROR_TYPE HttpHandler::readRequest()
 {
-    INFO("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<"
-         "- Request Packet -"
-         ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ");
+    if(dump_packet_)
+        DUMP("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<"
+             "- Request Packet -"
+             ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ");
+
+    // io_uring 后端下, 数据已经由事件循环通过 multishot recv 读入 request_ 中了
+    if(loop_->getRing())
+        return ERR_SUCCESS;
 
-    char buffer[MAXBUF];
+    char buffer[recvBufSize];
     
     while(true)
     {
         // 非阻塞,使用 recv 读取
-        ssize_t len = recv(client_fd_, buffer, MAXBUF, MSG_DONTWAIT);
+        ssize_t len = recv(client_fd_, buffer, recvBufSize, MSG_DONTWAIT);
         if(len < 0) {
             // 读取时没有出错
             if(errno == EAGAIN)
@@ -106,66 +524,107 @@ HttpHandler::ERROR_TYPE HttpHandler::readRequest()
         }
 
         // 将读取到的数据组装起来
-        string request(buffer, buffer + len);
-        INFO("{%s}", escapeStr(request, MAXBUF).c_str());
-
-        request_ += request;
+        if(dump_packet_)
+            DUMP("{%s}", EscapedStr(buffer, static_cast<size_t>(len)).c_str());
+        request_.append(buffer, static_cast<size_t>(len));
+        Metrics::add(Metrics::RECEIVED_BYTES, static_cast<uint64_t>(len));
     }
     return ERR_SUCCESS;
 }
 
+HttpHandler::ERROR_TYPE HttpHandler::waitForHeader(size_t pos)
+{
+    scan_pos_ = pos;
+    // 当前请求位于 request_ 的起始位置, 因此 pos 就是已经读入的请求行与请求头的长度
+    if(pos >= max_header_size)
+        return ERR_HEADER_TOO_LARGE;
+    return ERR_AGAIN;
+}
+
 HttpHandler::ERROR_TYPE HttpHandler::parseURI()
 {
-    size_t pos1, pos2;
-    
-    pos1 = request_.find("\r\n");
-    if(pos1 == string::npos)    return ERR_AGAIN;
-    string&& first_line = request_.substr(0, pos1);
-    // a. 查找get
-    pos1 = first_line.find(' ');
-    if(pos1 == string::npos)    return ERR_BAD_REQUEST;
-    string methodStr = first_line.substr(0, pos1);
-
-    string output_method = "Method: ";
-    if(methodStr == "GET")
-        method_ = METHOD_GET;
-    else if(methodStr == "POST")
-        method_ = METHOD_POST;
-    else if(methodStr == "HEAD")
-        method_ = METHOD_HEAD;
-    else
-        return ERR_NOT_IMPLEMENTED;
-    INFO("Method: %s", methodStr.c_str());
+    // 每个字节只会被扫描一次: 数据不足时在 parse_state_ 与 scan_pos_ 中记录进度, 下次从该位置继续
+    // 扫描的同时检查字符的合法性, 各个字段都直接在 request_ 中比较
+    const char* buf = request_.data();
+    size_t limit = min(request_.size(), max_header_size);
+    while(true)
+    {
+        size_t pos = scan_pos_;
+        switch(parse_state_)
+        {
+        case PARSE_METHOD:
+        {
+            // a. 查找get, 请求方式只能由 token 字符组成, 终止于空格
+            pos += scanToken(buf + pos, limit - pos);
+            if(pos == limit)    return waitForHeader(pos);
+            if(buf[pos] != ' ' || pos == field_begin_)  return ERR_BAD_REQUEST;
+            size_t method_len = pos - field_begin_;
 
-    // b. 查找目标路径
-    pos1++;
-    pos2 = first_line.find(' ', pos1);
-    if(pos2 == string::npos)    return ERR_BAD_REQUEST;
+            if(!request_.compare(field_begin_, method_len, "GET"))
+                method_ = METHOD_GET;
+            else if(!request_.compare(field_begin_, method_len, "POST"))
+                method_ = METHOD_POST;
+            else if(!request_.compare(field_begin_, method_len, "HEAD"))
+                method_ = METHOD_HEAD;
+            else
+                return ERR_NOT_IMPLEMENTED;
+            INFO("Method: %.*s", static_cast<int>(method_len), buf + field_begin_);
 
-    // 获取path时,注意加上 www path
-    path_ = www_path + "/" + first_line.substr(pos1, pos2 - pos1);
-    // 检测目录穿越
-    if(!is_path_parent(www_path, path_))
-        return ERR_NOT_FOUND;
-    
-    INFO("Path: %s", path_.c_str());
-
-    // c. 查看HTTP版本
-    pos2++;
-    string http_version_str = first_line.substr(pos2, first_line.length() - pos2);
-    INFO("HTTP Version: %s", http_version_str.c_str());
-
-    // 检测是否支持客户端 http 版本
-    if(http_version_str == "HTTP/1.0")
-        http_version_ = HTTP_1_0;
-    else if (http_version_str == "HTTP/1.1")
-        http_version_ = HTTP_1_1;
-    else
-        return ERR_HTTP_VERSION_NOT_SUPPORTED;
+            field_begin_ = scan_pos_ = pos + 1;
+            parse_state_ = PARSE_URI;
+            break;
+        }
+        case PARSE_URI:
+            // b. 查找目标路径, 路径只能由可见字符组成, 终止于空格
+            pos += scanVisible(buf + pos, limit - pos);
+            if(pos == limit)    return waitForHeader(pos);
+            if(buf[pos] != ' ' || pos == field_begin_)  return ERR_BAD_REQUEST;
+            http_request_.uri = StrSlice(field_begin_, pos - field_begin_);
 
-    // 更新curr_parse_pos_
-    curr_parse_pos_ += first_line.length() + 2;
-    return ERR_SUCCESS;
+            field_begin_ = scan_pos_ = pos + 1;
+            parse_state_ = PARSE_VERSION;
+            break;
+        case PARSE_VERSION:
+        {
+            // c. 查看HTTP版本, 其后紧跟着行尾的 \r\n
+            pos += scanVisible(buf + pos, limit - pos);
+            if(pos == limit)    return waitForHeader(pos);
+            if(buf[pos] != '\r')    return ERR_BAD_REQUEST;
+            size_t version_len = pos - field_begin_;
+            INFO("HTTP Version: %.*s", static_cast<int>(version_len), buf + field_begin_);
+
+            // 检测是否支持客户端 http 版本
+            if(!request_.compare(field_begin_, version_len, "HTTP/1.0"))
+                http_version_ = HTTP_1_0;
+            else if(!request_.compare(field_begin_, version_len, "HTTP/1.1"))
+                http_version_ = HTTP_1_1;
+            else
+                return ERR_HTTP_VERSION_NOT_SUPPORTED;
+
+            scan_pos_ = pos + 1;
+            parse_state_ = PARSE_REQUEST_LINE_LF;
+            break;
+        }
+        case PARSE_REQUEST_LINE_LF:
+            if(pos == limit)    return waitForHeader(pos);
+            if(buf[pos] != '\n')    return ERR_BAD_REQUEST;
+
+            // 获取path时,注意加上 www path. path_ 会复用之前请求所分配的内存
+            // 目录穿越检测推迟至 handleRequest 中进行, 以便在返回 404 之前完整地解析当前请求
+            path_.assign(www_path);
+            path_ += '/';
+            path_.append(request_, http_request_.uri.offset, http_request_.uri.length);
+            INFO("Path: %s", path_.c_str());
+
+            // 更新curr_parse_pos_
+            curr_parse_pos_ = field_begin_ = scan_pos_ = pos + 1;
+            parse_state_ = PARSE_HEADER_NAME;
+            return ERR_SUCCESS;
+        default:
+            assert(false);
+            return ERR_INTERNAL_SERVER_ERR;
+        }
+    }
 }
 
 HttpHandler::ERROR_TYPE HttpHandler::parseHttpHeader()
@@ -174,63 +633,104 @@ HttpHandler::ERROR_TYPE HttpHandler::parseHttpHeader()
          "- Request Info -"
          ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>");
 
-    size_t pos1, pos2;
-    for(pos1 = curr_parse_pos_;
-        (pos2 = request_.find("\r\n", pos1)) != string::npos;
-        pos1 = pos2 + 2)
+    const char* buf = request_.data();
+    size_t limit = min(request_.size(), max_header_size);
+    while(true)
     {
-        string&& header = request_.substr(pos1, pos2 - pos1);
-        // 如果遍历到了空头,则表示http header部分结束
-        if(header.size() == 0)
+        size_t pos = scan_pos_;
+        switch(parse_state_)
         {
-            curr_parse_pos_ = pos1 + 2;
-            return ERR_SUCCESS;
-        }
-        pos1 = header.find(' ');
+        case PARSE_HEADER_NAME:
+            // 格式： `key: value`. key 只能由 token 字符组成, 扫描终止于 ':'
+            pos += scanToken(buf + pos, limit - pos);
+            if(pos == limit)    return waitForHeader(pos);
+            // 如果遍历到了空头,则表示http header部分结束
+            if(buf[pos] == '\r' && pos == field_begin_)
+            {
+                scan_pos_ = pos + 1;
+                parse_state_ = PARSE_HEADERS_END_LF;
+                break;
+            }
+            if(buf[pos] != ':' || pos == field_begin_)  return ERR_BAD_REQUEST;
+            header_name_ = StrSlice(field_begin_, pos - field_begin_);
 
-        if(pos1 == string::npos)    return ERR_BAD_REQUEST;
+            field_begin_ = scan_pos_ = pos + 1;
+            parse_state_ = PARSE_HEADER_VALUE;
+            break;
+        case PARSE_HEADER_VALUE:
+        {
+            // value 中不能含有控制字符, 扫描终止于行尾的 '\r'
+            pos += scanFieldValue(buf + pos, limit - pos);
+            if(pos == limit)    return waitForHeader(pos);
+            if(buf[pos] != '\r')    return ERR_BAD_REQUEST;
 
-        // key 的格式： `XXX:`
-        string&& key = header.substr(0, pos1);
+            // value 前后的空白字符不属于 value
+            size_t value_begin = field_begin_;
+            size_t value_end = pos;
+            while(value_begin < value_end && (buf[value_begin] == ' ' || buf[value_begin] == '\t'))
+                ++value_begin;
+            while(value_end > value_begin && (buf[value_end - 1] == ' ' || buf[value_end - 1] == '\t'))
+                --value_end;
 
-        // 消除key里的最后一个冒号字符
-        if(key.size() < 2 || key.back() != ':') return ERR_BAD_REQUEST;
-        key.pop_back();
+            INFO("HTTP Header: [%.*s : %.*s]", static_cast<int>(header_name_.length), header_name_.data(request_),
+                 static_cast<int>(value_end - value_begin), buf + value_begin);
 
-        // key 转小写
-        transform(key.begin(), key.end(), key.begin(), ::tolower);
-        // 获取 value
-        string&& value = header.substr(pos1 + 1);
+            http_request_.addHeader(request_, header_name_, StrSlice(value_begin, value_end - value_begin));
 
-        INFO("HTTP Header: [%s : %s]", key.c_str(), value.c_str());
+            scan_pos_ = pos + 1;
+            parse_state_ = PARSE_HEADER_LF;
+            break;
+        }
+        case PARSE_HEADER_LF:
+            if(pos == limit)    return waitForHeader(pos);
+            if(buf[pos] != '\n')    return ERR_BAD_REQUEST;
 
-        headers_[key] = value;
-    }
+            // 已经解析过的请求头无需在下次读取到数据后重新解析
+            curr_parse_pos_ = field_begin_ = scan_pos_ = pos + 1;
+            parse_state_ = PARSE_HEADER_NAME;
+            break;
+        case PARSE_HEADERS_END_LF:
+            if(pos == limit)    return waitForHeader(pos);
+            if(buf[pos] != '\n')    return ERR_BAD_REQUEST;
 
-    // 执行到这里说明: 没有遍历到空头,即还有数据没有读完
-    return ERR_AGAIN;
+            curr_parse_pos_ = scan_pos_ = pos + 1;
+            return ERR_SUCCESS;
+        default:
+            assert(false);
+            return ERR_INTERNAL_SERVER_ERR;
+        }
+    }
 }
 
 HttpHandler::ERROR_TYPE HttpHandler::parseBody()
 {
-    assert(method_ == METHOD_POST);
-    
-    auto content_len_iter = headers_.find("content-length");
-    if(content_len_iter == headers_.end())
-        return ERR_LENGTH_REQUIRED;
+    // 只有 POST 请求必须带有 body. 其他请求的 body 会被跳过, 以免被当作流水线中的下一个请求
+    StrSlice len_slice;
+    if(!http_request_.getHeader(HttpRequest::HEADER_CONTENT_LENGTH, &len_slice))
+        return method_ == METHOD_POST ? ERR_LENGTH_REQUIRED : ERR_SUCCESS;
 
-    string len_str = content_len_iter->second;
-    if(!isNumericStr(len_str))
+    // Content-Length 只能由数字组成, 且不能溢出
+    if(len_slice.empty())
         return ERR_BAD_REQUEST;
+    size_t len = 0;
+    for(size_t i = 0; i < len_slice.length; i++)
+    {
+        char ch = request_[len_slice.offset + i];
+        if(!isdigit(ch) || len > (SIZE_MAX - 9) / 10)
+            return ERR_BAD_REQUEST;
+        len = len * 10 + static_cast<size_t>(ch - '0');
+    }
 
-    int len = atoi(len_str.c_str());
-
-    if(request_.length() < curr_parse_pos_ + len)
+    if(request_.length() - curr_parse_pos_ < len)
         return ERR_AGAIN;
-    http_body_ = request_.substr(curr_parse_pos_, len);
-
-    // 输出剩余的 HTTP body
-    INFO("HTTP Body: {%s}", escapeStr(http_body_, MAXBUF).c_str());
+    if(method_ == METHOD_POST)
+    {
+        http_body_.assign(request_, curr_parse_pos_, len);
+        // 输出剩余的 HTTP body
+        if(dump_packet_)
+            DUMP("HTTP Body: {%s}", EscapedStr(http_body_).c_str());
+    }
+    curr_parse_pos_ += len;
 
     return ERR_SUCCESS;    
 }
@@ -238,21 +738,149 @@ HttpHandler::ERROR_TYPE HttpHandler::parseBody()
 HttpHandler::ERROR_TYPE HttpHandler::handleRequest()
 {
     // 设置只在 HTTP/1.1时 默认允许 持续连接
-    if(http_version_ == HTTP_1_0)
-        isKeepAlive_ = false;
+    isKeepAlive_ = (http_version_ == HTTP_1_1);
 
     // 获取header完成后,处理一下 Connection 头
-    auto conHeaderIter = headers_.find("connection");
-    if(conHeaderIter != headers_.end())
+    StrSlice connection;
+    if(http_request_.getHeader(HttpRequest::HEADER_CONNECTION, &connection))
     {
-        string value = conHeaderIter->second;
-        transform(value.begin(), value.end(), value.begin(), ::tolower);
-        if(value == "keep-alive")
+        if(connection.equalsIgnoreCase(request_, "keep-alive"))
             isKeepAlive_ = true;
+        else if(connection.equalsIgnoreCase(request_, "close"))
+            isKeepAlive_ = false;
     }
 
+    // 统计数据不对应任何文件
+    if(isMetricsRequest())
+    {
+        // 发送队列持有格式化后的数据, 直到其发送完毕
+        shared_ptr<string> metrics = make_shared<string>(
+            Metrics::format(error_type_names, sizeof(error_type_names) / sizeof(error_type_names[0])));
+        return sendResponse(STATUS_OK, Metrics::CONTENT_TYPE, OutputChunk(metrics, metrics->data(), metrics->size()));
+    }
+
+    // 静态文件命中缓存时, 该路径在放入缓存之前已经通过了目录穿越检测, 无需再访问文件系统
+    // io_uring 后端只能使用已经映射至内存的文件
+    file_entry_.reset();
+    if(file_cache && method_ != METHOD_POST)
+    {
+        file_entry_ = file_cache->get(path_);
+        if(file_entry_ && loop_->getRing() && !file_entry_->map_addr && file_entry_->st.st_size > 0)
+            file_entry_.reset();
+        // 必须在访问文件系统之前获取失效计数
+        cache_generation_ = file_cache->getGeneration();
+    }
+    // 检测目录穿越
+    if(!file_entry_ && !is_path_parent(www_path, path_, &real_path_))
+        return ERR_NOT_FOUND;
+
+    // 开始处理请求
+    // 对于普通的 GET / HEAD 请求,读取文件并发送
+    if(method_ == METHOD_GET || method_ == METHOD_HEAD)
+        return handleStaticRequest();
+
     // 获取目标文件的信息
     struct stat st;
+    ERROR_TYPE err = statRequestFile(st);
+    if(err != ERR_SUCCESS)
+        return err;
+    // 而对于POST来说,将 http body 传入目标可执行文件并将结果返回给客户端
+    /**
+     * @brief 多进程调试
+     *  gdb: set follow-fork-mode parent
+     *       set detach-on-fork off
+     *  shell: 
+     *       查看某个进程的pid:          ps ax | grep "WebServer" 
+     *       查看某个pid的文件描述符列表:  lsof -p <PID>
+     *       查看WebServer的所有子进程:  pstree -p -g <WebServerPID>
+     */
+    if(method_ == METHOD_POST)
+    {
+        // 启动 CGI 程序后立即返回, 其输入输出由事件循环完成, 退出后由 finishCgiRequest 发送响应
+        if(!cgi_.start(path_, &http_body_))
+            return ERR_INTERNAL_SERVER_ERR;
+        Metrics::add(Metrics::CGI_RUNS);
+        return ERR_SUCCESS;
+    }
+    else
+        return ERR_INTERNAL_SERVER_ERR;
+    UNREACHABLE();
+    return ERR_SUCCESS;
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::handleStaticRequest()
+{
+    // 压缩后的内容不支持 Range, 因此带有 Range 的 GET 请求总是使用原始文件
+    StrSlice value, range;
+    bool has_range = method_ == METHOD_GET && http_request_.getHeader(HttpRequest::HEADER_RANGE, &range);
+    int encodings = 0;
+    if(!has_range && http_request_.getHeader(HttpRequest::HEADER_ACCEPT_ENCODING, &value))
+        encodings = parseAcceptEncoding(value.data(request_), value.length);
+
+    // 内容协商、条件请求与 HEAD 请求只需要文件的元数据: 命中文件缓存时不需要任何系统调用, 否则也只需要 stat
+    if(encodings || method_ == METHOD_HEAD
+        || http_request_.getHeader(HttpRequest::HEADER_IF_NONE_MATCH, &value)
+        || http_request_.getHeader(HttpRequest::HEADER_IF_MODIFIED_SINCE, &value))
+    {
+        FileCache::EntryPtr meta = file_entry_;
+        ERROR_TYPE err = meta ? ERR_SUCCESS : statRequestMetadata(meta);
+        if(err != ERR_SUCCESS)
+            return err;
+        Variant variant;
+        bool encoded = encodings && selectVariant(meta, encodings, variant);
+        if(isNotModified(meta, encoded ? variant.etag() : meta->etag))
+            return sendNotModifiedResponse(meta, encoded ? &variant : nullptr);
+        if(encoded)
+            return sendEncodedResponse(meta, variant);
+        // HEAD 请求只发送响应头
+        if(method_ == METHOD_HEAD)
+            return sendFileResponse(meta);
+    }
+
+    // 带有 Range 的 GET 请求不使用响应缓存, 只从文件中发送被请求的部分
+    if(has_range)
+    {
+        FileCache::EntryPtr entry = file_entry_;
+        ERROR_TYPE err = entry ? ERR_SUCCESS : openRequestFile(entry);
+        if(err != ERR_SUCCESS)
+            return err;
+        return sendRangeResponse(entry, range);
+    }
+
+    // 命中文件缓存且无法放入响应缓存时, 直接发送已经打开的文件
+    if(file_entry_ && (!response_cache
+        || !response_cache->isCacheable(static_cast<size_t>(file_entry_->st.st_size))))
+        return sendFileResponse(file_entry_);
+
+    // 查询响应缓存. 若其他线程正在加载同一个文件, 则等待其加载完成后直接使用其结果
+    bool should_load = false;
+    if(response_cache)
+    {
+        ResponseCache::EntryPtr cached = response_cache->get(path_, &should_load);
+        if(cached)
+            return sendCachedResponse(cached);
+    }
+
+    FileCache::EntryPtr entry = file_entry_;
+    ERROR_TYPE err = entry ? ERR_SUCCESS : openRequestFile(entry);
+    // 由当前线程负责加载时, 无论成功与否都必须结束加载, 否则等待的线程将永远阻塞
+    if(should_load)
+    {
+        ResponseCache::EntryPtr cached;
+        if(err == ERR_SUCCESS)
+            cached = makeCachedResponse(entry);
+        response_cache->complete(path_, cached);
+        if(cached)
+            return sendCachedResponse(cached);
+    }
+    if(err != ERR_SUCCESS)
+        return err;
+    // 发送数据, 文件内容不会拷贝至用户态. 在该函数内部, METHOD_HEAD 不发送 http body
+    return sendFileResponse(entry);
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::statRequestFile(struct stat& st)
+{
     if(stat(path_.c_str(), &st) == -1)
     {
         WARN("Can not get file [%s] state ! (%s)", path_.c_str(), strerror(errno));
@@ -264,6 +892,7 @@ HttpHandler::ERROR_TYPE HttpHandler::handleRequest()
     // 如果试图打开一个文件夹,则添加 index.html
     if (S_ISDIR(st.st_mode)) {
         path_ += "/index.html";
+        real_path_ += "/index.html";
         if(stat(path_.c_str(), &st) == -1)
         {
             WARN("Can not get file [%s] state ! (%s)", path_.c_str(), strerror(errno));
@@ -273,245 +902,192 @@ HttpHandler::ERROR_TYPE HttpHandler::handleRequest()
                 return ERR_INTERNAL_SERVER_ERR;
         }
     }
+    return ERR_SUCCESS;
+}
 
-    // 开始处理请求
-    // 对于普通的 GET / HEAD 请求,读取文件并发送
-    if(method_ == METHOD_GET || method_ == METHOD_HEAD)
+HttpHandler::ERROR_TYPE HttpHandler::openRequestFile(FileCache::EntryPtr& entry)
+{
+    // 请求目录时 statRequestFile 会在路径后添加 index.html, 之后截断即可恢复, 不需要复制路径
+    size_t path_len = path_.size();
+    size_t real_path_len = real_path_.size();
+    // 获取目标文件的信息
+    struct stat st;
+    ERROR_TYPE err = statRequestFile(st);
+
+    // 试图打开一个文件
+    int file_fd = -1;
+    if(err == ERR_SUCCESS && (file_fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC, 0)) == -1)
     {
-        // 试图打开一个文件
-        int file_fd;
-        if((file_fd = open(path_.c_str(), O_RDONLY, 0)) == -1)
-        {
-            WARN("File [%s] open failed ! (%s)", path_.c_str(), strerror(errno));
-            if(errno == ENOENT)
-                // 如果打开失败,则返回404
-                return ERR_NOT_FOUND;
-            else
-                // 如果是因为其他问题出错，则返回500
-                return ERR_INTERNAL_SERVER_ERR;
-        }  
-        // 读取文件, 使用 mmap 来高速读取文件
-        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
-        // 记得关闭文件描述符
-        close(file_fd); 
-        // 异常处理
-        if(addr == MAP_FAILED)
-        {
-            WARN("Can not map file [%s] -> mem! (%s)", path_.c_str(), strerror(errno));
-            return ERR_INTERNAL_SERVER_ERR;
-        }
-        // 将数据从内存页存入至 responseBody
-        char* file_data_ptr = static_cast<char*>(addr);
-        string responseBody(file_data_ptr, file_data_ptr + st.st_size);
-        // 记得删除内存
-        int res = munmap(addr, st.st_size);
-        if(res == -1)
-            WARN("Can not unmap file [%s] -> mem! (%s)", path_.c_str(), strerror(errno));
-        // 获取 Content-type
-        string suffix = path_;
-        // 通过循环找到最后一个 dot
-        size_t dot_pos;
-        while((dot_pos = suffix.find('.')) != string::npos)
-            suffix = suffix.substr(dot_pos + 1);
-
-        // 发送数据, 在该函数内部, METHOD_HEAD 不发送 http body
-        return sendResponse("200", "OK", MimeType::getMineType(suffix), responseBody);
+        WARN("File [%s] open failed ! (%s)", path_.c_str(), strerror(errno));
+        if(errno == ENOENT)
+            // 如果打开失败,则返回404
+            err = ERR_NOT_FOUND;
+        else
+            // 如果是因为其他问题出错，则返回500
+            err = ERR_INTERNAL_SERVER_ERR;
     }
-    // 而对于POST来说,将 http body 传入目标可执行文件并将结果返回给客户端
-    /**
-     * @brief 多进程调试
-     *  gdb: set follow-fork-mode parent
-     *       set detach-on-fork off
-     *  shell: 
-     *       查看某个进程的pid:          ps ax | grep "WebServer" 
-     *       查看某个pid的文件描述符列表:  lsof -p <PID>
-     *       查看WebServer的所有子进程:  pstree -p -g <WebServerPID>
-     */
-    else if(method_ == METHOD_POST)
-    {
-        // 创建两个管道
-        int cgi_output[2];
-        int cgi_input[2];
-        /**
-         * NOTE: 创建管道时，一定要指定 O_CLOEXEC
-         * 因为当当前线程 thread1 执行 fork 产生子进程 subproc1 后，
-         * subproc1 会同步继承这些其他线程 thread2 用于其他进程 subproc2 通信的管道
-         * 这样当 thread2 关闭了向 subproc2 写入数据的管道 pipe2w 后，
-         * 由于 subproc1 保存了 pipe2w，因此实际上该管道不会被销毁
-         * 所以 subproc2 将无法从 pipe2w 中读取数据，因为管道没有关闭，不存在EOF
-         * 
-         * NOTE: 即便创建管道时指定了 O_CLOEXEC
-         * 但实际上，在子进程中执行 dup2 操作时，新复制出的文件描述符将不会继承 O_CLOEXEC，
-         * 这样我们就可以达到：关闭所有的进程间通信管道，只保留当前子进程的输入输出管道，这样的一个目的
-         */ 
-        if (pipe2(cgi_output, O_CLOEXEC) == -1) {
-            WARN("cgi_output create error. (%s)", strerror(errno));
-            return ERR_INTERNAL_SERVER_ERR;
-        }
-        if (pipe2(cgi_input, O_CLOEXEC) == -1) {
-            WARN("cgi_input create error. (%s)", strerror(errno));
-            // 记得关闭之前的管道
-            close(cgi_output[0]);
-            close(cgi_output[1]);
-            return ERR_INTERNAL_SERVER_ERR;
-        }
-        // 尝试执行该CGI程序
-        pid_t pid;
-        /**
-         * @note 需要注意的是 fork 在多进程中要慎重使用
-         * @ref 谨慎使用多线程中的fork https://www.cnblogs.com/liyuan989/p/4279210.html
-         * @ref 程序员的自我修养（三）：fork() 安全 https://liam.page/2017/01/17/fork-safe/
-         */ 
-        if((pid = fork()) < 0)
-        {
-            WARN("Fork error. (%s)", strerror(errno));
-            close(cgi_input[0]);
-            close(cgi_input[1]);
-            close(cgi_output[0]);
-            close(cgi_output[1]);
-            return ERR_INTERNAL_SERVER_ERR;
-        }
-        // 对于子进程来说
-        if(pid == 0)
-        {
-            /**
-             * 将当前进程的进程号设置为所在组的进程组的组号
-             * 这有助于WebServer 杀死子进程
-             * 
-             * kill -pid 时会杀死 PGID为 `-pid` 的所有子进程
-             * 因此可以利用 setpgid 来达到区分进程的目的
-             * 
-             * 正常来说,如果没有设置 setpgid,则WebServer所有的子进程,以及子进程的子进程
-             * 其PGID都为WebServer的PID,这为杀死 pid为某个特定值的子进程以及该子进程的子进程巨大障碍
-             * 因此在子进程处需要重新设置 pgid
-             */
-            // 正常来说, setpgid 不可能会失败.如果失败了就直接abort
-            // 因为设置失败将会导致该子进程无法受到父进程的超时限制
-            if(setpgid(0, 0) == -1)
-                FATAL("setpgid fail in child process! (%s)", strerror(errno));
-            // 设置当父进程死亡时，子进程同步死亡
-            if(prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
-                FATAL("prctl fail in child process! (%s)", strerror(errno));
-            // 首先重新设置标准输入输出流
-            // 注意 dup2 会自动关闭当前打开的 fd0、fd1 和 fd2
-            if(dup2(cgi_input[0], 0) == -1 
-                || dup2(cgi_output[1], 1) == -1 
-                || dup2(1, 2) == -1)
-                FATAL("dup2 fail! (%s)", strerror(errno));
-            close(cgi_input[0]);
-            close(cgi_input[1]);
-            close(cgi_output[0]);
-            close(cgi_output[1]);
-
-            // 准备参数
-            char path[path_.size() + 1];
-            strcpy(path, path_.c_str());
-            char* const args[] = { path, NULL };
-
-            // 此时已经完成了所有的准备，现在准备执行目标程序
-
-            // 执行
-            execve(path, args, environ);
-            // 如果执行到这里，则说明出现了问题
-            FATAL("execve fail in child process! (%s)", strerror(errno));
-        }
-        // 对于父进程WebServer来说
+    // 由条目负责管理文件的生命周期
+    if(err == ERR_SUCCESS)
+    {
+        entry = FileCache::createEntry(file_fd, st, getRequestMimeType(),
+                                       real_path_, loop_->getRing() != nullptr);
+        if(!entry)
+            err = ERR_INTERNAL_SERVER_ERR;
+    }
+    path_.resize(path_len);
+    real_path_.resize(real_path_len);
+    // 只有普通文件才会放入缓存中, 缓存的键为请求路径
+    if(err == ERR_SUCCESS && file_cache && S_ISREG(st.st_mode))
+        file_cache->put(path_, entry, cache_generation_);
+    return err;
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::statRequestMetadata(FileCache::EntryPtr& entry)
+{
+    // 请求目录时 statRequestFile 会在路径后添加 index.html, 之后需要恢复
+    size_t path_len = path_.size();
+    size_t real_path_len = real_path_.size();
+    struct stat st;
+    ERROR_TYPE err = statRequestFile(st);
+    if(err == ERR_SUCCESS)
+    {
+        entry = FileCache::createEntry(-1, st, getRequestMimeType(), real_path_, false);
+        if(!entry)
+            err = ERR_INTERNAL_SERVER_ERR;
+    }
+    path_.resize(path_len);
+    real_path_.resize(real_path_len);
+    return err;
+}
+
+const string& HttpHandler::getRequestMimeType()
+{
+    // 后缀为最后一个 dot 之后的部分, 没有 dot 时使用默认类型
+    size_t dot_pos = path_.rfind('.');
+    return MimeType::getMineType(dot_pos == string::npos ? "" : path_.c_str() + dot_pos + 1);
+}
+
+bool HttpHandler::isNotModified(const FileCache::EntryPtr& file, const string& etag)
+{
+    StrSlice value;
+    // If-None-Match 存在时忽略 If-Modified-Since
+    if(http_request_.getHeader(HttpRequest::HEADER_IF_NONE_MATCH, &value))
+        return matchEntityTag(value.data(request_), value.length, etag);
+    time_t since;
+    if(http_request_.getHeader(HttpRequest::HEADER_IF_MODIFIED_SINCE, &value)
+        && parseHttpDate(value.data(request_), value.length, &since))
+        return file->st.st_mtim.tv_sec <= since;
+    return false;
+}
+
+bool HttpHandler::selectVariant(const FileCache::EntryPtr& file, int encodings, Variant& variant)
+{
+    if(!isNegotiable(file))
+        return false;
+    // 预压缩文件通常使用了更高的压缩级别, 因此优先于压缩缓存
+    if((encodings & ENCODING_BR) && findSidecar(file, ".br", variant.sidecar))
+        variant.encoding = "br";
+    else if((encodings & ENCODING_GZIP) && findSidecar(file, ".gz", variant.sidecar))
+        variant.encoding = "gzip";
+    else if((encodings & ENCODING_GZIP) && compress_cache)
+    {
+        variant.sidecar.reset();
+        variant.compressed = compress_cache->get(file->real_path);
+        // 只有已经打开的文件才能提交压缩, 即只压缩已经进入文件缓存的文件
+        if(!variant.compressed)
+            compress_cache->submit(file->real_path, file);
+        // 压缩效果不佳的文件发送原始内容
+        else if(variant.compressed->compressed)
+            variant.encoding = "gzip";
+    }
+    return variant.encoding != nullptr;
+}
+
+bool HttpHandler::findSidecar(const FileCache::EntryPtr& file, const char* suffix, FileCache::EntryPtr& sidecar)
+{
+    // 以预压缩文件的真实路径作为文件缓存的键. 请求路径中总是包含 "//", 因此不会与其冲突
+    string sidecar_path = file->real_path + suffix;
+    sidecar.reset();
+    if(file_cache)
+        sidecar = file_cache->get(sidecar_path);
+    if(sidecar && loop_->getRing() && !sidecar->map_addr && sidecar->st.st_size > 0)
+        sidecar.reset();
+    if(!sidecar)
+    {
+        // 不跟随符号链接, 以免其指向 www 目录之外的文件
+        struct stat st;
+        int fd = open(sidecar_path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW, 0);
+        if(fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+            sidecar = FileCache::createEntry(fd, st, MimeType::getMineType(suffix + 1),
+                                             sidecar_path, loop_->getRing() != nullptr);
         else
         {
-            close(cgi_input[0]);
-            close(cgi_output[1]);
-
-            // 将 HTTP body 写入 CGI 程序的标准输入中
-            ssize_t len = writen(cgi_input[1], http_body_.c_str(), http_body_.length(), true);
-            // 如果写入失败
-            if(len <= 0)
-                WARN("Write %ld bytes to CGI input fail! (%s)", http_body_.length(), strerror(errno));
-
-            close(cgi_input[1]);
-
-            // 设置超时时间 maxCGIRuntime(ms)
-            int timeouts = maxCGIRuntime;
-            /**
-             * @brief 进入一个死循环,只有当子进程退出后才会break
-             * @note 该循环将会有2条执行流程
-             *          1. 执行子进程 -> waitpid -> 子进程退出 -> 结束循环;
-             *          2. 执行子进程 -> waitpid -> 子进程没有退出
-             *              -> 超时 -> kill -> waitpid -> 子进程退出 -> 结束循环;
-             */
-            while(true)
-            {
-                // 单次休息 cgiStepTime(ms)
-                if(!usleep(cgiStepTime * 1000))
-                    timeouts -= cgiStepTime;
-                int wstats = -1;
-                int waitpid_ret = waitpid(pid, &wstats, WNOHANG);
-                // 如果waitpid 出错
-                if(waitpid_ret < 0)
-                {
-                    WARN("waitpid error. (%s)", strerror(errno));
-                    // ret 前,一定一定一定要关闭这个读取端口
-                    close(cgi_output[0]);
-                    return ERR_INTERNAL_SERVER_ERR;
-                }
-                // 如果子进程状态被修改, 当子进程状态改变后,waitpid 才会设置 status, 否则 status 不变
-                else if(waitpid_ret > 0)
-                {
-                    // 只有在子进程自然退出,或者子进程被 kill 时,才会处理,退出该循环
-                    // 至于其他情况,例如子进程遇到了 SIGINT,则忽视
-                    bool ifExited = WIFEXITED(wstats);
-                    // 注意 SIGKILL 会 terminate 子进程,因此使用 WTERMSIG 来获取TERSIG
-                    // 这里不指定是 SIGKILL信号,因为可能有其他信号会kill子进程
-                    bool ifKilled = WIFSIGNALED(wstats) && (WTERMSIG(wstats) != 0);
-                    if(ifExited || ifKilled)
-                        break;
-                }
-                // 如果什么也没有发生, 即子进程仍然在跑.如果顺便超时了,则kill
-                else if(timeouts <= 0)
-                {
-                    /** 
-                     * @brief 把 kill 放到循环内部是为了 waitpid 回收子进程
-                     * NOTE: -pid 指的是杀死当前子进程以及该子进程自身的子进程,例如shell脚本
-                     * NOTE: 再kill一次 pid 是为了防止子进程太久没有轮到执行,仍然处于fork与execl之间的状态
-                     *       此时,之前的 kill -pid 将会不起作用.因此为了确保子进程一定被kill,需要再kill一次pid
-                     */        
-                    int res_kill_sub = kill(pid, SIGKILL);
-                    int res_kill_pgid = 0;
-                    // 只有在子进程的pgid变化后才kill -pid,防止误伤其他线程中的子进程
-                    if(getpgid(pid) == pid)
-                        res_kill_pgid = kill(-pid, SIGKILL);
-                    assert(!res_kill_sub && !res_kill_pgid);
-                    WARN("Sub process timeout.");
-                }
-            }
+            if(fd != -1)
+                close(fd);
+            // 不存在的预压缩文件同样放入缓存, 以免每次请求都访问文件系统. 其被创建时会通过 inotify 失效
+            memset(&st, 0, sizeof(st));
+            sidecar = FileCache::createEntry(-1, st, "", sidecar_path, false);
+        }
+        if(!sidecar)
+            return false;
+        if(file_cache)
+            file_cache->put(sidecar_path, sidecar, cache_generation_);
+    }
 
-            // 走到这里则说明程序已经执行结束了
-            string responseBody;
-            char buf[MAXBUF];
-            // 非阻塞读取
-            if(!setFdNoBlock(cgi_output[0]))
-            {
-                WARN("set fd(%d) no block fail! (%s)", cgi_output[0], strerror(errno));
-                close(cgi_output[0]);
-                return ERR_INTERNAL_SERVER_ERR;
-            }
-            while((len = readn(cgi_output[0], buf, MAXBUF)) > 0)
-                responseBody += string(buf, buf + len);
-            close(cgi_output[0]);
+    // 比原始文件更旧的预压缩文件可能已经过期
+    const struct timespec& sidecar_mtime = sidecar->st.st_mtim;
+    const struct timespec& file_mtime = file->st.st_mtim;
+    return S_ISREG(sidecar->st.st_mode) && (sidecar_mtime.tv_sec > file_mtime.tv_sec
+        || (sidecar_mtime.tv_sec == file_mtime.tv_sec && sidecar_mtime.tv_nsec >= file_mtime.tv_nsec));
+}
 
-            if(responseBody.empty())
-                return ERR_INTERNAL_SERVER_ERR;
-            // 发送数据
-            return sendResponse("200", "OK", MimeType::getMineType("txt"), responseBody);
+ResponseCache::EntryPtr HttpHandler::makeCachedResponse(const FileCache::EntryPtr& file)
+{
+    size_t size = static_cast<size_t>(file->st.st_size);
+    if(!S_ISREG(file->st.st_mode) || !response_cache->isCacheable(size))
+        return nullptr;
+
+    // 使用 pread 读取, 不会影响其他线程对同一个 fd 的使用
+    string body(size, '\0');
+    for(size_t done = 0; done < size; )
+    {
+        ssize_t len = pread(file->fd, &body[done], size - done, static_cast<off_t>(done));
+        if(len < 0 && errno == EINTR)
+            continue;
+        // 文件在此期间被截断, 不缓存不完整的内容
+        if(len <= 0)
+        {
+            WARN("Read file [%s] for response cache fail!", file->real_path.c_str());
+            return nullptr;
         }
+        done += static_cast<size_t>(len);
     }
-    else
-        return ERR_INTERNAL_SERVER_ERR;
-    UNREACHABLE();
-    return ERR_SUCCESS;
+
+    shared_ptr<ResponseCache::Entry> cached = make_shared<ResponseCache::Entry>();
+    ResponseBuilder header;
+    for(int keepAlive = 0; keepAlive < 2; keepAlive++)
+    {
+        // 缓存的报文被所有请求共享, 因此 Keep-Alive 中的 max 使用其初始值
+        header.clear();
+        makeResponseHeader(header, STATUS_OK, file->mime_type.c_str(), file->content_length.c_str(), keepAlive);
+        appendFileHeaders(header, file);
+        header.append("\r\n");
+        if(header.overflow())
+            return nullptr;
+        cached->header_len[keepAlive] = header.size();
+        string& response = cached->response[keepAlive];
+        response.reserve(header.size() + body.size());
+        response.assign(header.data(), header.size());
+        response += body;
+    }
+    cached->stale_flag = file->stale_flag;
+    return cached;
 }
 
 bool HttpHandler::handleErrorType(HttpHandler::ERROR_TYPE err)
 {
+    if(err != ERR_SUCCESS && err != ERR_AGAIN)
+        Metrics::addError(err);
     // 除了 ERR_SUCESS 和 ERR_AGAIN 没有设置 state 以外, 其他 case 都设置了 state_
     bool isSuccess = false;
     switch(err)
@@ -525,14 +1101,8 @@ bool HttpHandler::handleErrorType(HttpHandler::ERROR_TYPE err)
         state_ = STATE_FATAL_ERROR;
         break;
     case ERR_AGAIN:
-        --againTimes_;
         INFO("HTTP waiting for more messages...");
         /* 注意这里没有设置 STATE , 与 ERR_SUCESS一样 */
-        if(againTimes_ <= 0)
-        {
-            state_ = STATE_FATAL_ERROR;
-            WARN("Reach max read times");
-        }
         break;
     case ERR_CONNECTION_CLOSED:
         INFO("HTTP Socket(%d) was closed.", client_fd_);
@@ -542,34 +1112,46 @@ bool HttpHandler::handleErrorType(HttpHandler::ERROR_TYPE err)
         ERROR("Send Response failed !");
         state_ = STATE_FATAL_ERROR;
         break;
+    // 400 / 411 / 431 / 501 / 505 发生在请求解析完成之前, 此时已经无法确定流水线中下一个请求的起始位置,
+    // 因此发送响应后关闭连接. 404 / 500 则在整个请求解析完成之后才会产生
     case ERR_BAD_REQUEST:
         WARN("HTTP Bad Request.");
-        sendErrorResponse("400", "Bad Request");
+        isKeepAlive_ = false;
+        sendErrorResponse(STATUS_BAD_REQUEST);
+        state_ = STATE_ERROR;
+        break;
+    case ERR_HEADER_TOO_LARGE:
+        WARN("HTTP Request Header Fields Too Large.");
+        isKeepAlive_ = false;
+        sendErrorResponse(STATUS_HEADER_TOO_LARGE);
         state_ = STATE_ERROR;
         break;
     case ERR_NOT_FOUND:
         WARN("HTTP Not Found.");
-        sendErrorResponse("404", "Not Found");
+        sendErrorResponse(STATUS_NOT_FOUND);
         state_ = STATE_ERROR;
         break;
     case ERR_LENGTH_REQUIRED:
         WARN("HTTP Length Required.");
-        sendErrorResponse("411", "Length Required");
+        isKeepAlive_ = false;
+        sendErrorResponse(STATUS_LENGTH_REQUIRED);
         state_ = STATE_ERROR;
         break;
     case ERR_NOT_IMPLEMENTED:
         WARN("HTTP Request method is not implemented.");
-        sendErrorResponse("501", "Not Implemented");
+        isKeepAlive_ = false;
+        sendErrorResponse(STATUS_NOT_IMPLEMENTED);
         state_ = STATE_ERROR;
         break;
     case ERR_INTERNAL_SERVER_ERR:
         WARN("HTTP Internal Server Error.");
-        sendErrorResponse("500", "Internal Server Error");
+        sendErrorResponse(STATUS_INTERNAL_SERVER_ERR);
         state_ = STATE_ERROR;
         break;
     case ERR_HTTP_VERSION_NOT_SUPPORTED:
         WARN("HTTP Request HTTP Version Not Supported.");
-        sendErrorResponse("505", "HTTP Version Not Supported");
+        isKeepAlive_ = false;
+        sendErrorResponse(STATUS_HTTP_VERSION_NOT_SUPPORTED);
         state_ = STATE_ERROR;
         break;
     default:
@@ -578,94 +1160,535 @@ bool HttpHandler::handleErrorType(HttpHandler::ERROR_TYPE err)
     return isSuccess;
 }
 
-HttpHandler::ERROR_TYPE HttpHandler::sendResponse(const string& responseCode, const string& responseMsg, 
-                            const string& responseBodyType, const string& responseBody)
+void HttpHandler::makeResponseHeader(ResponseBuilder& out, HTTP_STATUS status,
+                            const char* responseBodyType, const char* contentLength, bool keepAlive)
 {
-    stringstream sstream;
-    sstream << "HTTP/1.1" << " " << responseCode << " " << responseMsg << "\r\n";
-    sstream << "Connection: " << (isKeepAlive_ ? "Keep-Alive" : "Close") << "\r\n";
-    if(isKeepAlive_)
-        // Keep-Alive 头中, timeout 表示超时时间(单位s), max表示最多接收请求次数,超过则断开.
-        sstream << "Keep-Alive: timeout=" << timeoutPerRequest << ", max=" << againTimes_ << "\r\n";
-    sstream << "Server: WebServer/1.1" << "\r\n";
-    sstream << "Content-length: " << responseBody.size() << "\r\n";
-    sstream << "Content-type: " << responseBodyType << "\r\n";
-    sstream << "\r\n";
-    // 如果是 HEAD 请求,则不发送 http body
-    if(method_ != METHOD_HEAD)
-        sstream << responseBody;
+    response_status_ = templates.codes[status];
+    out.append(templates.status_lines[status]);
+    out.append(templates.connection_headers[keepAlive ? 1 : 0]);
+    // 304 没有 body, 因此也不发送 body 的长度与类型
+    if(contentLength)
+    {
+        out.append("Content-length: ").append(contentLength).append("\r\n");
+        out.append("Content-type: ").append(responseBodyType).append("\r\n");
+    }
+}
 
-    string&& response = sstream.str();
+bool HttpHandler::pushResponseHeader(const ResponseBuilder& header)
+{
+    if(header.overflow())
+    {
+        ERROR("Response header exceeds %lu bytes!", ResponseBuilder::CAPACITY);
+        return false;
+    }
+    pushOutputData(header.data(), header.size());
+    return true;
+}
 
-    ssize_t len = writen(client_fd_, (void*)response.c_str(), response.size());
+HttpHandler::ERROR_TYPE HttpHandler::sendResponse(HTTP_STATUS status, const char* responseBodyType,
+                            OutputChunk&& responseBody)
+{
+    ResponseBuilder header;
+    makeResponseHeader(header, status, responseBodyType, DecimalStr(responseBody.size).c_str(), isKeepAlive_);
+    header.append("\r\n");
+    if(!pushResponseHeader(header))
+        return ERR_INTERNAL_SERVER_ERR;
+    // 如果是 HEAD 请求,则不发送 http body
+    size_t bodyLen = (method_ == METHOD_HEAD) ? 0 : responseBody.size;
 
     // 输出返回的数据
-    INFO("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<- Response Packet ->>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ");
-    INFO("{%s}", escapeStr(response, MAXBUF).c_str());
+    DUMP_RESPONSE("{%s%s}", EscapedStr(header.data(), header.size()).c_str(),
+                  EscapedStr(responseBody.ptr(), bodyLen).c_str());
 
-    if(len < 0 || static_cast<size_t>(len) != response.size())
-        return ERR_SEND_RESPONSE_FAIL;
+    // 响应头与 body 在发送队列中相邻, 将在 RunEventLoop 处理完所有已经读入的请求之后由同一次 sendmsg 发送
+    if(bodyLen > 0)
+        pushOutputChunk(std::move(responseBody));
     return ERR_SUCCESS;
 }
 
-HttpHandler::ERROR_TYPE HttpHandler::sendErrorResponse(const string& errCode, const string& errMsg)
+HttpHandler::ERROR_TYPE HttpHandler::sendFileResponse(const FileCache::EntryPtr& file)
 {
-    string errStr = errCode + " " + errMsg;
-    string responseBody = 
-                "<html>"
-                "<title>" + errStr + "</title>"
-                "<body>" + errStr + 
-                    "<hr><em> Kiprey's Web Server</em>"
-                "</body>"
-                "</html>";
-    return sendResponse(errCode, errMsg, "text/html", responseBody);
+    ResponseBuilder header;
+    makeResponseHeader(header, STATUS_OK, file->mime_type.c_str(), file->content_length.c_str(), isKeepAlive_);
+    appendFileHeaders(header, file);
+    header.append("\r\n");
+
+    // 输出返回的数据, 文件内容不会被读入内存, 因此只输出头部
+    DUMP_RESPONSE("{%s} + file (%s bytes)", EscapedStr(header.data(), header.size()).c_str(),
+                  file->content_length.c_str());
+
+    if(!pushResponseHeader(header))
+        return ERR_INTERNAL_SERVER_ERR;
+    // 如果是 HEAD 请求,则不发送 http body
+    // 发送队列持有该文件的引用, 即便其在发送过程中被移出缓存, 也会等到发送完成后才关闭
+    if(method_ != METHOD_HEAD && file->st.st_size > 0)
+        pushOutputChunk(OutputChunk(file, 0, static_cast<size_t>(file->st.st_size)));
+    return ERR_SUCCESS;
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::sendEncodedResponse(const FileCache::EntryPtr& file, const Variant& variant)
+{
+    ResponseBuilder header;
+    makeResponseHeader(header, STATUS_OK, file->mime_type.c_str(), variant.contentLength().c_str(), isKeepAlive_);
+    header.append("Content-Encoding: ").append(variant.encoding).append("\r\n");
+    appendValidatorHeaders(header, file, variant.etag());
+    header.append("\r\n");
+    DUMP_RESPONSE("{%s} + %s body (%s bytes)", EscapedStr(header.data(), header.size()).c_str(),
+                  variant.sidecar ? "sidecar" : "compressed", variant.contentLength().c_str());
+
+    if(!pushResponseHeader(header))
+        return ERR_INTERNAL_SERVER_ERR;
+    // 如果是 HEAD 请求,则不发送 http body
+    if(method_ == METHOD_HEAD)
+        return ERR_SUCCESS;
+    if(variant.sidecar && variant.sidecar->st.st_size > 0)
+        pushOutputChunk(OutputChunk(variant.sidecar, 0, static_cast<size_t>(variant.sidecar->st.st_size)));
+    else if(variant.compressed)
+        pushOutputChunk(OutputChunk(variant.compressed, variant.compressed->body.data(),
+                                    variant.compressed->body.size()));
+    return ERR_SUCCESS;
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::sendNotModifiedResponse(const FileCache::EntryPtr& file, const Variant* variant)
+{
+    ResponseBuilder header;
+    makeResponseHeader(header, STATUS_NOT_MODIFIED, file->mime_type.c_str(), nullptr, isKeepAlive_);
+    if(variant)
+        appendValidatorHeaders(header, file, variant->etag());
+    else
+        appendFileHeaders(header, file);
+    header.append("\r\n");
+    DUMP_RESPONSE("{%s}", EscapedStr(header.data(), header.size()).c_str());
+    if(!pushResponseHeader(header))
+        return ERR_INTERNAL_SERVER_ERR;
+    return ERR_SUCCESS;
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::sendRangeResponse(const FileCache::EntryPtr& file, StrSlice range)
+{
+    // If-Range 只有在与当前文件的 ETag (强比较) 或者 Last-Modified 完全相同时, 才会使 Range 生效
+    StrSlice if_range;
+    if(http_request_.getHeader(HttpRequest::HEADER_IF_RANGE, &if_range)
+        && request_.compare(if_range.offset, if_range.length, file->etag)
+        && request_.compare(if_range.offset, if_range.length, file->last_modified))
+        return sendFileResponse(file);
+
+    size_t file_size = static_cast<size_t>(file->st.st_size);
+    ArenaVector<pair<size_t, size_t>> ranges(&request_arena_);
+    if(!S_ISREG(file->st.st_mode)
+        || !parseByteRanges(range.data(request_), range.length, file_size, ranges))
+        return sendFileResponse(file);
+
+    const char* mime_type = file->mime_type.c_str();
+    const char* size_str = file->content_length.c_str();
+    ResponseBuilder header;
+    // 所有区间都无法满足, 返回 416 以及文件的实际大小
+    if(ranges.empty())
+    {
+        WARN("HTTP Range Not Satisfiable.");
+        makeResponseHeader(header, STATUS_RANGE_NOT_SATISFIABLE, mime_type, "0", isKeepAlive_);
+        header.append("Content-Range: bytes */").append(size_str).append("\r\n\r\n");
+        DUMP_RESPONSE("{%s}", EscapedStr(header.data(), header.size()).c_str());
+        if(!pushResponseHeader(header))
+            return ERR_INTERNAL_SERVER_ERR;
+        return ERR_SUCCESS;
+    }
+
+    // 单个区间直接作为 body 发送
+    if(ranges.size() == 1)
+    {
+        size_t begin = ranges[0].first, len = ranges[0].second - ranges[0].first;
+        makeResponseHeader(header, STATUS_PARTIAL_CONTENT, mime_type, DecimalStr(len).c_str(), isKeepAlive_);
+        appendFileHeaders(header, file);
+        header.append("Content-Range: bytes ").appendDecimal(begin).append("-").appendDecimal(ranges[0].second - 1);
+        header.append("/").append(size_str).append("\r\n\r\n");
+        DUMP_RESPONSE("{%s} + file range (%lu bytes)", EscapedStr(header.data(), header.size()).c_str(), len);
+        if(!pushResponseHeader(header))
+            return ERR_INTERNAL_SERVER_ERR;
+        pushOutputChunk(OutputChunk(file, begin, len));
+        return ERR_SUCCESS;
+    }
+
+    // 多个区间: 每个区间之前都有一个 part 头部, 其后是该区间在文件中的数据
+    // part 头部在计算出总长度之前就已经复制到了 output_arena_ 中
+    ArenaVector<pair<const char*, size_t>> parts(&request_arena_);
+    parts.reserve(ranges.size());
+    ResponseBuilder part;
+    size_t content_length = 0;
+    for(size_t i = 0; i < ranges.size(); i++)
+    {
+        part.clear();
+        part.append("\r\n--").append(byteranges_boundary).append("\r\nContent-Type: ").append(mime_type);
+        part.append("\r\nContent-Range: bytes ").appendDecimal(ranges[i].first).append("-");
+        part.appendDecimal(ranges[i].second - 1).append("/").append(size_str).append("\r\n\r\n");
+        if(part.overflow())
+            return ERR_INTERNAL_SERVER_ERR;
+        parts.push_back(make_pair(output_arena_.copy(part.data(), part.size()), part.size()));
+        content_length += part.size() + ranges[i].second - ranges[i].first;
+    }
+    content_length += byteranges_end.size();
+
+    makeResponseHeader(header, STATUS_PARTIAL_CONTENT, byteranges_content_type.c_str(),
+                       DecimalStr(content_length).c_str(), isKeepAlive_);
+    appendFileHeaders(header, file);
+    header.append("\r\n");
+    DUMP_RESPONSE("{%s} + %lu file ranges", EscapedStr(header.data(), header.size()).c_str(), ranges.size());
+    if(!pushResponseHeader(header))
+        return ERR_INTERNAL_SERVER_ERR;
+    for(size_t i = 0; i < ranges.size(); i++)
+    {
+        pushOutputChunk(OutputChunk(parts[i].first, parts[i].second));
+        pushOutputChunk(OutputChunk(file, ranges[i].first, ranges[i].second - ranges[i].first));
+    }
+    // 结束分隔符在启动时生成, 不需要复制
+    pushOutputChunk(OutputChunk(byteranges_end.data(), byteranges_end.size()));
+    return ERR_SUCCESS;
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::sendCachedResponse(const ResponseCache::EntryPtr& cached)
+{
+    // 响应缓存中只有 200 响应
+    response_status_ = 200;
+    int variant = isKeepAlive_ ? 1 : 0;
+    const string& response = cached->response[variant];
+    size_t header_len = cached->header_len[variant];
+
+    DUMP_RESPONSE("{%s} + cached body (%lu bytes)", EscapedStr(response.data(), header_len).c_str(),
+                  response.size() - header_len);
+
+    // 如果是 HEAD 请求,则只发送报文中的响应头部分
+    pushOutputChunk(OutputChunk(cached, response.data(),
+                                method_ == METHOD_HEAD ? header_len : response.size()));
+    return ERR_SUCCESS;
+}
+
+void HttpHandler::pushOutputChunk(OutputChunk&& chunk)
+{
+    out_bytes_ += chunk.size;
+    out_queue_.push_back(std::move(chunk));
+}
+
+void HttpHandler::popOutputChunk()
+{
+    // 文件由其缓存条目负责关闭
+    out_queue_.pop_front();
+    out_offset_ = 0;
+    // 发送队列清空时, 其中所有的内存数据都已经发送完毕 (io_uring 后端下所有的 send 也都已经完成)
+    if(out_queue_.empty())
+        output_arena_.reset();
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::finishCgiRequest()
+{
+    const string& output = cgi_.getOutput();
+    ERROR_TYPE err = ERR_INTERNAL_SERVER_ERR;
+    // 输出复制到 output_arena_ 中, 在发送完成之前一直有效. 相比于 fork 与 exec, 这次复制的开销可以忽略
+    if(!output.empty())
+        err = sendResponse(STATUS_OK, MimeType::getMineType("txt").c_str(),
+                           OutputChunk(output_arena_.copy(output.data(), output.size()), output.size()));
+    cgi_.finish();
+    return err;
+}
+
+void HttpHandler::recordRequest()
+{
+    // 请求方式尚未解析完成时就发生了错误
+    Metrics::Method method = Metrics::METHOD_OTHER;
+    if(parse_state_ != PARSE_METHOD)
+        method = method_ == METHOD_GET ? Metrics::METHOD_GET
+               : method_ == METHOD_POST ? Metrics::METHOD_POST : Metrics::METHOD_HEAD;
+    Metrics::addRequest(method, response_status_, Metrics::nowMicros() - request_start_us_);
+}
+
+bool HttpHandler::isMetricsRequest()
+{
+    return !metrics_path.empty() && (method_ == METHOD_GET || method_ == METHOD_HEAD)
+        && !request_.compare(http_request_.uri.offset, http_request_.uri.length, metrics_path);
+}
+
+void HttpHandler::consumeOutput(size_t len)
+{
+    Metrics::add(Metrics::SENT_BYTES, len);
+    out_bytes_ -= len;
+    while(len > 0)
+    {
+        size_t remain = out_queue_.front().size - out_offset_;
+        if(len < remain)
+        {
+            out_offset_ += len;
+            return;
+        }
+        len -= remain;
+        popOutputChunk();
+    }
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::flushResponse()
+{
+    size_t sent_bytes = 0;
+    while(!out_queue_.empty())
+    {
+        const OutputChunk& chunk = out_queue_.front();
+        ssize_t len;
+        if(chunk.isFile())
+        {
+            // 文件内容直接由内核从页缓存发送至套接字
+            off_t offset = static_cast<off_t>(chunk.file_offset + out_offset_);
+            len = sendfile(client_fd_, chunk.file->fd, &offset, chunk.size - out_offset_);
+            // 文件被截断时 sendfile 返回 0, 此时已经无法发送完整的 body 了
+            if(len == 0)
+                return ERR_SEND_RESPONSE_FAIL;
+        }
+        else
+        {
+            // 将队首开始的所有相邻内存数据合并为一次 sendmsg
+            iovec iov[maxSendIov];
+            size_t iov_num = 0;
+            for(; iov_num < out_queue_.size() && iov_num < maxSendIov && !out_queue_[iov_num].isFile(); iov_num++)
+            {
+                size_t offset = (iov_num == 0) ? out_offset_ : 0;
+                iov[iov_num].iov_base = const_cast<char*>(out_queue_[iov_num].ptr() + offset);
+                iov[iov_num].iov_len = out_queue_[iov_num].size - offset;
+            }
+            // 后面紧跟着文件时使用 MSG_MORE, 使得头部与文件内容可以合并在同一个报文中发送
+            int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+            if(iov_num < out_queue_.size() && out_queue_[iov_num].isFile())
+                flags |= MSG_MORE;
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_num;
+            len = sendmsg(client_fd_, &msg, flags);
+        }
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            else if(errno != EAGAIN)
+                return ERR_SEND_RESPONSE_FAIL;
+            // 发送缓冲区已满, 保留剩余的数据
+            if(sent_bytes)
+                // 只要对端仍在接收数据, 就不应该因为超时而断开连接
+                timer_.setTime(timeoutPerRequest, 0);
+            INFO("Socket(%d) send buffer is full, %lu bytes pending.", client_fd_, out_bytes_);
+            return ERR_AGAIN;
+        }
+        sent_bytes += static_cast<size_t>(len);
+        consumeOutput(static_cast<size_t>(len));
+    }
+    return ERR_SUCCESS;
+}
+
+void HttpHandler::updateEpollEvent()
+{
+    // io_uring 后端下不使用 epoll
+    if(loop_->getRing())
+        return;
+    int cond = getClientTriggerCond();
+    // 多 reactor 模式下没有使用 ONESHOT, 只有触发条件变化时才需要修改
+    if(!loop_->isDispatchMode() && cond == client_trigger_cond_)
+        return;
+    // 分发模式下, CGI 程序运行期间连接由事件循环持有, 重新放入 epoll 会使其他工作线程同时处理该连接
+    if(loop_->isDispatchMode() && cgi_.isRunning())
+        return;
+    client_trigger_cond_ = cond;
+    // 分发模式下需要重新放入 epoll 中
+    // 恢复分发时被暂停的定时器, 若定时器已经在 reset 中重新启动, 则什么也不做
+    /// NOTE: 必须在放入 epoll 之前恢复, 否则可能与其他线程中的 pause 交错
+    if(loop_->isDispatchMode())
+        timer_.resume();
+    bool ret = epoll_->modify(client_fd_, getClientEpollEvent(), cond);
+    assert(ret);
+    (void)ret;
+}
+
+bool HttpHandler::rearmStalledOutput()
+{
+    // io_uring 后端下由事件循环负责发送
+    if(out_queue_.empty() || loop_->getRing())
+        return false;
+    // poll 与 epoll 使用相同的判断条件 (包括 TCP_NOTSENT_LOWAT), 可写则说明通知已经丢失
+    pollfd pfd;
+    pfd.fd = client_fd_;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT))
+        return false;
+    INFO("Socket(%d) is writable but EPOLLOUT was missed, %lu bytes pending.", client_fd_, out_bytes_);
+    timer_.setTime(timeoutPerRequest, 0);
+    // 边缘触发模式下, EPOLL_CTL_MOD 会重新检查就绪状态, 因此可写事件将会立即产生
+    client_trigger_cond_ = getClientTriggerCond();
+    bool ret = epoll_->modify(client_fd_, getClientEpollEvent(), client_trigger_cond_);
+    assert(ret);
+    (void)ret;
+    return true;
+}
+
+bool HttpHandler::checkSendProgress()
+{
+    if(out_queue_.empty())
+        return false;
+    tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if(getsockopt(client_fd_, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+        return false;
+    // 上一个超时周期内对端确认了新的数据
+    if(info.tcpi_bytes_acked != acked_bytes_)
+    {
+        acked_bytes_ = info.tcpi_bytes_acked;
+        stalled_timeouts_ = 0;
+        timer_.setTime(timeoutPerRequest, 0);
+        return true;
+    }
+    // 对端的接收窗口已满, 只是读取得慢. 较旧的内核不提供 tcpi_snd_wnd, 此时该字段保持为 0
+    if(len >= offsetof(tcp_info, tcpi_snd_wnd) + sizeof(info.tcpi_snd_wnd)
+        && info.tcpi_snd_wnd < info.tcpi_snd_mss && ++stalled_timeouts_ < maxStalledTimeouts)
+    {
+        INFO("Socket(%d) peer receive window is full, %lu bytes pending (%d).",
+             client_fd_, out_bytes_, stalled_timeouts_);
+        timer_.setTime(timeoutPerRequest, 0);
+        return true;
+    }
+    return false;
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::sendErrorResponse(HTTP_STATUS status)
+{
+    int keepAlive = isKeepAlive_ ? 1 : 0;
+    const string& response = templates.error_responses[status][keepAlive];
+    assert(!response.empty());
+    response_status_ = templates.codes[status];
+    // 如果是 HEAD 请求,则只发送报文中的响应头部分
+    size_t len = (method_ == METHOD_HEAD) ? templates.error_header_len[status][keepAlive] : response.size();
+
+    DUMP_RESPONSE("{%s}", EscapedStr(response.data(), len).c_str());
+
+    // 预先生成的报文与进程的生命周期相同, 因此不需要复制
+    pushOutputChunk(OutputChunk(response.data(), len));
+    return ERR_SUCCESS;
 }
 
 bool HttpHandler::RunEventLoop()
 {
+    AllocScope alloc_scope;
+    // 先发送之前因为套接字缓冲区已满而暂存在发送队列中的数据
+    if(!out_queue_.empty() && !loop_->getRing())
+    {
+        ERROR_TYPE err = flushResponse();
+        if(err == ERR_SEND_RESPONSE_FAIL)
+        {
+            handleErrorType(err);
+            return false;
+        }
+        // 最后一个响应发送完毕后关闭连接
+        if(close_after_flush_ && err == ERR_SUCCESS)
+            return false;
+    }
+    // 发送队列超过高水位线, 或者即将关闭连接时, 不再处理新的请求
+    if(out_bytes_ >= outputHighWaterMark || close_after_flush_)
+    {
+        updateEpollEvent();
+        return true;
+    }
+
+    // CGI 程序仍在运行时, 不读取也不解析新的请求. 其退出后事件循环会再次调用该函数
+    if(cgi_.isRunning())
+    {
+        updateEpollEvent();
+        return true;
+    }
+
     // 从socket读取请求数据, 如果读取失败,或者断开连接
     if(!handleErrorType(readRequest()))
         // 直接断开连接
         return false;
-    
-    // 解析信息 ------------------------------------------
-    // 1. 先解析第一行
-    if(state_ == STATE_PARSE_URI && handleErrorType(parseURI()))
-        state_ = STATE_PARSE_HEADER;
-    // 2. 解析每一条http header
-    if(state_ == STATE_PARSE_HEADER && handleErrorType(parseHttpHeader()))
-        state_ = STATE_PARSE_BODY;
-    // 3. 对于 post 解析 http body
-    if(state_ == STATE_PARSE_BODY)
-    {
-        if(method_ != METHOD_POST || handleErrorType(parseBody()))
-            state_ = STATE_ANALYSI_REQUEST;
-    }
-    // 4. 开始处理数据
-    if(state_ == STATE_ANALYSI_REQUEST && handleErrorType(handleRequest()))
-        state_ = STATE_FINISHED;
-
-    // 开始处理当前状态
-    // 如果这个过程中有任何非致命错误, 或者当前过程圆满结束
-    if(state_ == STATE_ERROR || state_ == STATE_FINISHED)
-    {
-        // 如果 keep Alive, 则重置状态, 并跳出 if 到最后的return 处重新放入 epoll 中
-        if(isKeepAlive_)
-            reset();
-        else 
-            // 否则,既然已经发生了错误 / 完成了请求,则直接销毁当前实例
-            return false;
+    // 只是因为 EPOLLOUT 而被唤醒, 没有新的请求数据时无需解析, 以免消耗重试次数
+    if(!hasPendingRequest() && state_ != STATE_WAIT_CGI)
+    {
+        updateEpollEvent();
+        return true;
     }
-    // 如果是致命错误,则直接返回 false
-    else if(state_ == STATE_FATAL_ERROR)
-        return false;
 
-    // 执行到这里则表示需要更多数据,因此重新放入 epoll 中
-    bool ret1 = true;
-    if(timer_)
-        ret1 = epoll_->modify(timer_->getFd(), getTimerEpollEvent(), getTimerTriggerCond());
-    bool ret2 = epoll_->modify(client_fd_, getClientEpollEvent(), getClientTriggerCond());
-    assert(ret1 && ret2);
+    // 是否在发送完所有响应后关闭连接
+    bool finished = false;
+    do
+    {
+        // 依次处理 request_ 中所有完整的请求 (HTTP 流水线), 其响应暂存在发送队列中
+        while(true)
+        {
+            // 从收到请求的第一批数据开始计时
+            if(!request_start_us_)
+                request_start_us_ = Metrics::nowMicros();
+            // 解析信息 ------------------------------------------
+            // 1. 先解析第一行
+            if(state_ == STATE_PARSE_URI && handleErrorType(parseURI()))
+                state_ = STATE_PARSE_HEADER;
+            // 2. 解析每一条http header
+            if(state_ == STATE_PARSE_HEADER && handleErrorType(parseHttpHeader()))
+                state_ = STATE_PARSE_BODY;
+            // 3. 解析 http body, 只有 post 会使用它
+            if(state_ == STATE_PARSE_BODY && handleErrorType(parseBody()))
+                state_ = STATE_ANALYSI_REQUEST;
+            // 4. 开始处理数据, POST 请求需要等待 CGI 程序退出
+            if(state_ == STATE_ANALYSI_REQUEST && handleErrorType(handleRequest()))
+                state_ = cgi_.isRunning() ? STATE_WAIT_CGI : STATE_FINISHED;
+            // 5. CGI 程序退出后发送其输出
+            if(state_ == STATE_WAIT_CGI && cgi_.isExited() && handleErrorType(finishCgiRequest()))
+                state_ = STATE_FINISHED;
+
+            // 开始处理当前状态
+            // 如果这个过程中有任何非致命错误, 或者当前过程圆满结束
+            if(state_ == STATE_ERROR || state_ == STATE_FINISHED)
+            {
+                recordRequest();
+                // 否则,既然已经发生了错误 / 完成了请求,则在响应发送完毕后销毁当前实例
+                if(!isKeepAlive_)
+                {
+                    finished = true;
+                    break;
+                }
+                // 如果 keep Alive, 则重置状态, 并继续处理流水线中的下一个请求
+                reset();
+                // 发送队列超过高水位线时, 剩余的请求留到响应发送之后再处理
+                if(!hasPendingRequest() || out_bytes_ >= outputHighWaterMark)
+                    break;
+            }
+            // 如果是致命错误,则直接返回 false
+            else if(state_ == STATE_FATAL_ERROR)
+                return false;
+            // CGI 程序仍在运行, 流水线中的后续请求等待其退出后再处理
+            else if(state_ == STATE_WAIT_CGI)
+                break;
+            // 当前请求尚不完整, 需要等待更多数据
+            else
+            {
+                scanned_size_ = request_.size();
+                break;
+            }
+        }
+
+        // 将本轮产生的所有响应合并发送, io_uring 后端下由事件循环统一提交 send
+        if(!loop_->getRing() && flushResponse() == ERR_SEND_RESPONSE_FAIL)
+        {
+            handleErrorType(ERR_SEND_RESPONSE_FAIL);
+            return false;
+        }
+    // 响应被立即发送完毕时, 继续处理因为高水位线而被推迟的请求
+    } while(!finished && state_ != STATE_WAIT_CGI && hasPendingRequest() && out_bytes_ < outputHighWaterMark);
+
+    if(finished)
+    {
+        // io_uring 后端下由事件循环负责等待响应发送完毕
+        if(out_queue_.empty() || loop_->getRing())
+            return false;
+        close_after_flush_ = true;
+    }
 
+    // 执行到这里则表示需要更多数据, 或者需要等待发送队列中的数据发送完毕
+    updateEpollEvent();
+    // 由事件循环监听刚刚启动的 CGI 程序. 分发模式下这是工作线程最后一次访问当前实例
+    if(cgi_.isRunning())
+        loop_->watchCgi(this);
     return true;
-}
\ No newline at end of file
+}
@@ -1,10 +1,23 @@
 #ifndef HTTPHANDLER_H
 #define HTTPHANDLER_H
 
+#include <cstring>
 #include <iostream>
-#include <map>
+#include <utility>
+#include <vector>
 
+#include "Arena.h"
+#include "CgiProcess.h"
+#include "CompressCache.h"
+#include "ConnectionPool.h"
 #include "Epoll.h"
+#include "EventLoop.h"
+#include "FileCache.h"
+#include "HttpRequest.h"
+#include "Metrics.h"
+#include "MutexLock.h"
+#include "ResponseBuilder.h"
+#include "ResponseCache.h"
 #include "Timer.h"
 
 using namespace std;
@@ -15,19 +28,15 @@ using namespace std;
  */ 
 class HttpHandler
 {
+    // io_uring 后端下, 事件循环需要直接访问连接的发送队列与 io_uring 状态
+    friend class EventLoop;
+    // 连接对象只由对象池创建与复用
+    friend class ConnectionPool;
 public:
-    
-    /**
-     * @brief   显式指定 client fd
-     * @param   epoll_fd    epoll 实例相关的描述符
-     * @param   client_fd   连接的 client_fd
-     * @param   timer       给当前连接限制时间的timer
-     */
-    explicit HttpHandler(Epoll* epoll, int client_fd, Timer* timer);
 
     /**
-     * @brief   释放所有 HttpHandler 所使用的资源
-     * @note    注意,不会主动关闭 client_fd
+     * @brief   释放所有 HttpHandler 所使用的资源, 若仍绑定在连接上则关闭该连接
+     * @note    池中的对象会被复用, 不会被析构
      */
     ~HttpHandler();
 
@@ -39,20 +48,53 @@ public:
      */ 
     bool RunEventLoop();
 
+    /**
+     * @brief   将事件循环已经读取到的数据追加至请求数据中
+     * @note    只在 io_uring 后端下使用, 此时 readRequest 不会再从 client_fd_ 中读取数据
+     */
+    void appendRequest(const char* buf, size_t len) { request_.append(buf, len); }
+
+    /**
+     * @brief   是否存在已经读入但尚未解析的请求数据
+     * @note    流水线中的请求可能因为发送队列超过高水位线而被推迟处理
+     */
+    bool hasPendingRequest()    { return request_.size() > scanned_size_; }
+
     // 只有getFd,没有setFd,因为Fd必须在创造该实例时被设置
     int getClientFd()           { return client_fd_; }
-    Epoll* getEpoll()           { return epoll_; }
-    Timer* getTimer()           { return timer_; }
-    // 获取 client_fd 和 timer_fd 所需要设置的 epoll 触发条件
-    int getClientTriggerCond() { return EPOLLET | EPOLLIN | EPOLLONESHOT | EPOLLRDHUP | EPOLLHUP; }
-    int getTimerTriggerCond()  { return EPOLLET | EPOLLIN | EPOLLONESHOT; }
-    // 获取 client 和 timer 的 epoll event
+    EventLoop* getLoop()        { return loop_; }
+    Timer* getTimer()           { return &timer_; }
+    // 分发模式下上一次处理该连接的工作线程编号, 作为下一个事件的 affinity
+    int getLastWorker()         { return last_worker_; }
+    void setLastWorker(int worker)  { last_worker_ = worker; }
+    // 获取 client_fd 所需要设置的 epoll 触发条件
+    // 只有分发模式下才需要 ONESHOT, 多 reactor 模式下连接只会被其所属的线程处理
+    // 存在尚未发送的响应时监听 EPOLLOUT; 若其超过了高水位线, 则暂停读取新的请求
+    int getClientTriggerCond()
+    {
+        int cond = EPOLLET | EPOLLRDHUP | EPOLLHUP | getOneShotCond();
+        if(!out_queue_.empty())
+            cond |= EPOLLOUT;
+        if(out_bytes_ < outputHighWaterMark && !close_after_flush_)
+            cond |= EPOLLIN;
+        return cond;
+    }
+    // 获取 client 的 epoll event
     void* getClientEpollEvent() { return &client_event_; }
-    void* getTimerEpollEvent()  { return &timer_event_; }
 
     // 设置HTTP处理时, www文件夹的路径
     static void setWWWPath(string path) { www_path = path; };
     static string getWWWPath()          { return www_path; }
+    // 设置静态文件所使用的缓存, nullptr 表示不使用缓存
+    static void setFileCache(FileCache* cache)  { file_cache = cache; }
+    // 设置小文件所使用的响应报文缓存, nullptr 表示不使用缓存. 其依赖于文件缓存的失效机制
+    static void setResponseCache(ResponseCache* cache)  { response_cache = cache; }
+    // 设置文本文件的压缩缓存, nullptr 表示只发送预压缩的文件. 其依赖于文件缓存的失效机制
+    static void setCompressCache(CompressCache* cache)  { compress_cache = cache; }
+    // 设置请求行与请求头的总长度上限(字节), 超出时返回 431
+    static void setMaxHeaderSize(size_t size)   { max_header_size = size; }
+    // 设置输出统计数据的路径, 例如 /metrics, 空字符串表示不输出. 该路径会覆盖 www 目录下的同名文件
+    static void setMetricsPath(const string& path)  { metrics_path = path; }
 
     // HttpHandler 内部状态
     enum STATE_TYPE {
@@ -60,6 +102,7 @@ public:
         STATE_PARSE_HEADER,       // 解析 HTTP header
         STATE_PARSE_BODY,         // 解析 HTTP body (只针对 POST 请求解析. 注: GET 请求不会解析多余的body)
         STATE_ANALYSI_REQUEST,    // 解析获取到的整体报文,处理并发送对应的响应报文
+        STATE_WAIT_CGI,           // 等待 CGI 程序退出, 期间不再读取与解析新的请求
         STATE_FINISHED,           // 当前报文已经解析完毕
         STATE_ERROR,              // 遇到了可恢复的错误
         STATE_FATAL_ERROR         // 遇到了无法恢复的错误,即将断开连接并销毁当前实例
@@ -80,6 +123,7 @@ private:
         ERR_SEND_RESPONSE_FAIL,         // 响应包发送失败
 
         ERR_BAD_REQUEST,                // 用户的请求包中存在错误,无法解析                   400 Bad Request
+        ERR_HEADER_TOO_LARGE,           // 请求行与请求头的总长度超出上限                    431 Request Header Fields Too Large
         ERR_NOT_FOUND,                  // 目标文件不存在                                 404 Not Found
         ERR_LENGTH_REQUIRED,            // POST请求中没有 Content-Length 请求头            411 Length Required
 
@@ -88,6 +132,27 @@ private:
         ERR_HTTP_VERSION_NOT_SUPPORTED  // 不支持当前客户端的http版本                       505 HTTP Version Not Supported
     };
 
+    // 响应的状态码. 每个状态码的状态行, 以及错误状态码的完整响应报文都在启动时预先生成
+    enum HTTP_STATUS {
+        STATUS_OK = 0,                          // 200 OK
+        STATUS_PARTIAL_CONTENT,                 // 206 Partial Content
+        STATUS_NOT_MODIFIED,                    // 304 Not Modified
+        STATUS_BAD_REQUEST,                     // 400 Bad Request
+        STATUS_NOT_FOUND,                       // 404 Not Found
+        STATUS_LENGTH_REQUIRED,                 // 411 Length Required
+        STATUS_RANGE_NOT_SATISFIABLE,           // 416 Range Not Satisfiable
+        STATUS_HEADER_TOO_LARGE,                // 431 Request Header Fields Too Large
+        STATUS_INTERNAL_SERVER_ERR,             // 500 Internal Server Error
+        STATUS_NOT_IMPLEMENTED,                 // 501 Not Implemented
+        STATUS_HTTP_VERSION_NOT_SUPPORTED,      // 505 HTTP Version Not Supported
+
+        STATUS_NUM
+    };
+
+    // 启动时预先生成的响应片段
+    struct ResponseTemplates;
+    static const ResponseTemplates templates;
+
     // 请求的 HTTP 版本号
     enum HTTP_VERSION{
         HTTP_1_0,           // HTTP/1.0
@@ -101,45 +166,210 @@ private:
         METHOD_HEAD         // HEAD 请求,与 GET 处理方式相同,但不返回 body
     };
 
+    // 经过 Accept-Encoding 协商后选定的压缩表示形式, sidecar 与 compressed 二者之一非空
+    struct Variant {
+        const char* encoding;               // Content-Encoding
+        FileCache::EntryPtr sidecar;        // 预压缩文件, 例如 foo.js.gz
+        CompressCache::EntryPtr compressed; // 后台线程压缩的结果
+
+        Variant() : encoding(nullptr) {}
+        const string& etag() const          { return sidecar ? sidecar->etag : compressed->etag; }
+        const string& contentLength() const { return sidecar ? sidecar->content_length : compressed->content_length; }
+    };
+
+    // 请求行与请求头解析过程中, 下一个待扫描的字节所属的部分
+    enum PARSE_STATE {
+        PARSE_METHOD,           // 请求方式
+        PARSE_URI,              // 目标路径
+        PARSE_VERSION,          // HTTP 版本, 终止于 '\r'
+        PARSE_REQUEST_LINE_LF,  // 请求行末尾的 '\n'
+        PARSE_HEADER_NAME,      // 请求头的名称, 行首的 '\r' 表示空行
+        PARSE_HEADER_VALUE,     // 请求头的值, 终止于 '\r'
+        PARSE_HEADER_LF,        // 请求头末尾的 '\n'
+        PARSE_HEADERS_END_LF    // 空行末尾的 '\n'
+    };
+
     // 当前 HTTP handler 的 www 工作目录, 默认情况下为当前工作目录
     static string www_path;
+    // 所有连接共享的静态文件缓存
+    static FileCache* file_cache;
+    // 所有连接共享的小文件响应报文缓存
+    static ResponseCache* response_cache;
+    // 所有连接共享的压缩缓存
+    static CompressCache* compress_cache;
+    // 请求行与请求头的总长度上限
+    static size_t max_header_size;
+    // 输出统计数据的路径
+    static string metrics_path;
 
     // 一些常量
-    const size_t MAXBUF = 1024;         // 缓冲区大小
-    const int maxAgainTimes = 10;       // 最多重试次数
+    static const size_t recvBufSize = 16 * 1024;  // 单次 recv 读取的最大字节数
+    static const int keepAliveMaxRequests = 10;  // Keep-Alive 响应头中的 max 字段
     const int maxCGIRuntime = 1000;     // CGI程序最长等待时间(ms)
-    const int cgiStepTime = 1;          // 单次轮询CGI程序是否退出的等待时间(ms, <= 1000)
-    const int timeoutPerRequest = 10;   // 单个请求的超时时间(s)
+    const int cgiStepTime = 1;          // 内核不支持 pidfd 时, 轮询CGI程序是否退出的间隔(ms, <= 1000)
+    static const int timeoutPerRequest = 10;   // 单个请求的超时时间(s)
+    const int maxStalledTimeouts = 6;   // 对端接收窗口关闭时, 最多连续容忍的超时次数
+    const size_t outputHighWaterMark = 1 << 20;  // 发送队列的高水位线(字节), 超过后暂停读取新的请求
+    static const size_t maxIdleBufferSize = 64 * 1024;  // 放回对象池时, 每个缓冲区最多保留的容量(字节)
+    static const size_t maxIdleOutputChunks = 64;  // 放回对象池时, 发送队列最多保留的容量(个)
+    static const size_t maxSendIov = 64;  // 单次 sendmsg 最多合并的数据段个数
 
     // 相关描述符
     int client_fd_;
     EpollEvent client_event_;
-
-    Timer* timer_;
-    EpollEvent timer_event_;
-
+    // client_fd_ 当前在 epoll 中所设置的触发条件
+    int client_trigger_cond_;
+
+    // 给当前连接限制时间的timer, 挂在所属事件循环的时间轮上
+    Timer timer_;
+    // 当前请求所执行的 CGI 程序, 其管道与退出事件由所属的事件循环监听
+    CgiProcess cgi_;
+    // 限制 CGI 程序运行时间的 timer, 内核不支持 pidfd 时还用于轮询子进程是否退出
+    Timer cgi_timer_;
+    // 分发模式下, 工作线程将 CGI 程序交给事件循环的过程, 可能与事件循环线程对其的处理交错
+    MutexLock cgi_lock_;
+
+    EventLoop* loop_;
     Epoll* epoll_;
+    // 上一次处理该连接的工作线程编号, -1 表示未知
+    int last_worker_;
 
-    // http 请求包的所有数据
+    // 尚未处理完成的请求数据. 流水线中后续请求的数据会保留至当前请求处理完成之后
     string request_;
-    // http 头部
-    map<string, string> headers_; 
+    // request_ 中已经解析过, 但不足以构成一个完整请求的字节数
+    size_t scanned_size_;
+    // 当前请求是否被抽样, 需要输出其请求与响应报文
+    bool dump_packet_;
+    // 开始解析当前请求的时间(us), 0 表示尚未开始
+    uint64_t request_start_us_;
+    // 当前请求的响应状态码, 用于统计
+    int response_status_;
+    // 解析后的请求头, 其中的字段都是指向 request_ 的切片
+    HttpRequest http_request_;
     // 请求方式
     METHOD_TYPE method_;
     // 请求路径
     string path_;
+    // 请求路径所对应的真实路径, 用于文件缓存的失效
+    string real_path_;
+    // 命中文件缓存时的条目
+    FileCache::EntryPtr file_entry_;
+    // 开始访问文件系统之前的文件缓存失效计数
+    uint64_t cache_generation_;
     // http版本号
     HTTP_VERSION http_version_;
     // 当前handler 状态
     STATE_TYPE state_;
-    // 重试次数
-    int againTimes_;
+    // 请求行与请求头的解析进度. 数据不足时保留在这里, 读取到新数据后从 scan_pos_ 继续扫描
+    PARSE_STATE parse_state_;
+    // 下一个待扫描的字节
+    size_t scan_pos_;
+    // 当前字段的起始位置
+    size_t field_begin_;
+    // 正在解析的请求头的名称
+    StrSlice header_name_;
     // http body 数据
     string http_body_;
+    // 处理当前请求时的临时数据, 例如响应头的拼接, 在 reset 中整体回收
+    Arena request_arena_;
+    // 发送队列中内存数据所使用的内存, 例如响应头以及 CGI 的输出, 在发送队列清空时整体回收
+    /// NOTE: 流水线中的响应可能在之后的请求中才发送完毕, 因此不能与 request_arena_ 一同回收.
+    ///       io_uring 后端下内核会在 send 完成之前访问这些数据, arena 保证了它们在回收之前不会被移动
+    Arena output_arena_;
 
     // 是否是 `持续连接`
     bool isKeepAlive_;
 
+    // 发送队列中的一段数据, 其来源为以下四者之一:
+    //  1. output_arena_ 中的数据 addr, 例如响应头以及 CGI 的输出; 或者生命周期与进程相同的数据, 例如预先生成的错误响应
+    //  2. epoll 后端下通过 sendfile 发送的文件 file->fd 中从 file_offset 开始的部分, 文件内容不会拷贝至用户态
+    //  3. io_uring 后端下映射至内存的文件 file->map_addr + file_offset, 由 send 直接从页缓存中发送
+    //  4. 多个连接共享的只读数据 addr, 例如响应缓存中的报文, 由 ref 持有其所有者
+    struct OutputChunk {
+        FileCache::EntryPtr file;
+        shared_ptr<const void> ref;
+        const char* addr;
+        size_t file_offset; // 文件数据在文件中的起始位置
+        size_t size;        // 数据总长度
+
+        OutputChunk(const char* ptr, size_t len)
+            : addr(ptr), file_offset(0), size(len) {}
+        OutputChunk(const FileCache::EntryPtr& entry, size_t offset, size_t len)
+            : file(entry), addr(entry->map_addr ? entry->map_addr + offset : nullptr),
+              file_offset(offset), size(len) {}
+        OutputChunk(const shared_ptr<const void>& owner, const char* ptr, size_t len)
+            : ref(owner), addr(ptr), file_offset(0), size(len) {}
+        // 是否需要通过 sendfile 发送
+        bool isFile() const         { return file && !file->map_addr; }
+        // 获取内存中数据的起始地址, 只能用于不需要 sendfile 的数据
+        const char* ptr() const     { return addr; }
+    };
+
+    // 发送队列. 出队的数据只是移动队首位置, 队列清空时保留其容量, 因此稳定状态下入队与出队都不会分配内存
+    class OutputQueue {
+    public:
+        OutputQueue() : head_(0) {}
+        bool empty() const                  { return head_ == chunks_.size(); }
+        size_t size() const                 { return chunks_.size() - head_; }
+        const OutputChunk& front() const    { return chunks_[head_]; }
+        const OutputChunk& operator[](size_t i) const   { return chunks_[head_ + i]; }
+        void push_back(OutputChunk&& chunk) { chunks_.push_back(std::move(chunk)); }
+        void pop_front()
+        {
+            // 释放对文件与共享数据的引用
+            chunks_[head_].file.reset();
+            chunks_[head_].ref.reset();
+            if(++head_ == chunks_.size())
+            {
+                chunks_.clear();
+                head_ = 0;
+            }
+            // 队列长时间不为空时, 移除队首之前已经出队的数据
+            else if(head_ >= compactThreshold && head_ * 2 >= chunks_.size())
+            {
+                chunks_.erase(chunks_.begin(), chunks_.begin() + static_cast<ptrdiff_t>(head_));
+                head_ = 0;
+            }
+        }
+        // 队列为空时, 释放超出 limit 个元素的容量
+        void trim(size_t limit)
+        {
+            if(empty() && chunks_.capacity() > limit)
+                vector<OutputChunk>().swap(chunks_);
+        }
+
+    private:
+        static const size_t compactThreshold = 64;
+        vector<OutputChunk> chunks_;
+        size_t head_;
+    };
+
+    // 尚未发送完成的响应数据, 以及队首数据中已经发送的字节数
+    OutputQueue out_queue_;
+    size_t out_offset_;
+    // 发送队列中尚未发送的总字节数
+    size_t out_bytes_;
+    // 是否在发送队列清空后关闭连接
+    bool close_after_flush_;
+    // 上次超时检查时对端已经确认的字节数, 以及此后连续没有任何进展的超时次数
+    uint64_t acked_bytes_;
+    int stalled_timeouts_;
+
+    // io_uring 后端下该连接的状态, 只由事件循环访问
+    struct UringState {
+        int fd;             // client fd 的副本, 作为 IORING_OP_FILES_UPDATE 的参数, 其地址必须在 SQE 完成前有效
+        bool fixed_file;    // client fd 是否放入了 fixed file 表
+        bool recv_armed;    // multishot recv 是否仍然有效
+        bool closing;       // 是否正在关闭
+        bool aborted;       // 是否被强制关闭, 此时不再发送剩余的响应
+        int inflight;       // 尚未完成的 SQE 个数, 只有为 0 时才能释放当前实例
+        size_t sending;     // 正在发送的响应报文个数
+    } uring_;
+
+    // 对象池中该对象的所有者, 以及空闲链表中的下一个对象, 只由 ConnectionPool 访问
+    ConnectionPool::ThreadCache* pool_owner_;
+    HttpHandler* pool_next_;
+
     /** 
      * @brief 当前解析读入数据的位置
      * @note 该成员变量只在 
@@ -148,6 +378,43 @@ private:
      */
     size_t curr_parse_pos_;
 
+    int getOneShotCond()        { return loop_->isDispatchMode() ? EPOLLONESHOT : 0; }
+
+    /**
+     * @brief 创建一个没有绑定连接的对象, 只由对象池调用
+     */
+    HttpHandler();
+
+    /**
+     * @brief 将对象绑定到一个新的连接上, 所有与连接相关的状态都会被重新初始化
+     * @param loop      当前连接所属的事件循环
+     * @param client_fd 连接的 client_fd
+     */
+    void init(EventLoop* loop, int client_fd);
+
+    /**
+     * @brief 关闭当前连接并释放其所使用的资源, 之后对象可以放回对象池中
+     *        缓冲区的容量在 maxIdleBufferSize 以内保留, 以便下一个连接直接使用
+     */
+    void cleanup();
+
+    /**
+     * @brief 定时器超时回调函数, 在事件循环线程中释放超时的连接
+     * @param arg 超时的 HttpHandler
+     */
+    static void handleTimeout(void* arg);
+
+    /**
+     * @brief CGI 定时器超时回调函数, 在事件循环线程中杀死超时的 CGI 程序, 并检查其是否已经退出
+     * @param arg CGI 程序所属的 HttpHandler
+     */
+    static void handleCgiTimeout(void* arg);
+
+    /**
+     * @brief 设置 CGI 定时器的下一次超时时间
+     */
+    void armCgiTimer();
+
     /**
      * @brief 初始化,清空所有数据
      */
@@ -162,6 +429,13 @@ private:
      */
     ERROR_TYPE readRequest();
 
+    /**
+     * @brief 数据不足以完成请求行与请求头的解析时, 记录扫描位置
+     * @param pos 下一个待扫描的字节
+     * @return ERR_AGAIN 表示需要等待更多数据; ERR_HEADER_TOO_LARGE 表示已经达到长度上限
+     */
+    ERROR_TYPE waitForHeader(size_t pos);
+
     /**
      * @brief 从0位置处解析 请求方式\URI\HTTP版本等
      * @return ERR_SUCCESS 表示读取成功;
@@ -193,6 +467,74 @@ private:
      */
     ERROR_TYPE handleRequest();
 
+    /**
+     * @brief 处理 GET / HEAD 请求, 依次查询响应缓存、文件缓存, 最后才打开文件
+     * @return ERR_SUCCESS 表示成功发送, 其他则表示处理过程存在错误
+     */
+    ERROR_TYPE handleStaticRequest();
+
+    /**
+     * @brief 获取请求路径所对应文件的 stat 信息. 若其为目录, 则改为其中的 index.html
+     * @param st 获取到的 stat 信息
+     * @return ERR_SUCCESS 表示成功, 其他则表示文件不存在或者无法访问
+     */
+    ERROR_TYPE statRequestFile(struct stat& st);
+
+    /**
+     * @brief 打开请求路径所对应的文件, 并将其放入文件缓存中
+     * @param entry 打开的文件
+     * @return ERR_SUCCESS 表示成功, 其他则表示文件不存在或者无法打开
+     * @note  与 statRequestMetadata 相同, 不会修改 path_, 因此 path_ 仍然可以作为响应缓存的键
+     */
+    ERROR_TYPE openRequestFile(FileCache::EntryPtr& entry);
+
+    /**
+     * @brief 获取请求路径所对应文件的元数据, 不会打开文件. 用于 HEAD 请求以及条件请求
+     * @param entry 只包含元数据的条目, 其中没有打开的文件
+     * @return ERR_SUCCESS 表示成功, 其他则表示文件不存在或者无法访问
+     * @note  不会修改 path_, 之后仍然可以使用请求路径打开文件并放入缓存
+     */
+    ERROR_TYPE statRequestMetadata(FileCache::EntryPtr& entry);
+
+    /**
+     * @brief 获取请求路径所对应的 Content-type
+     */
+    const string& getRequestMimeType();
+
+    /**
+     * @brief 根据 If-None-Match / If-Modified-Since 判断客户端缓存的内容是否仍然有效
+     * @param file 目标文件, 只使用其中的元数据
+     * @param etag 所选表示形式的 ETag, 压缩后的内容与原始文件的 ETag 不同
+     * @return true 表示应当返回 304
+     */
+    bool isNotModified(const FileCache::EntryPtr& file, const string& etag);
+
+    /**
+     * @brief 根据 Accept-Encoding 选择压缩的表示形式, 依次尝试 .br 与 .gz 预压缩文件, 最后是压缩缓存
+     *        压缩缓存未命中时, 将已经打开的文件提交给后台线程压缩, 本次请求仍然发送原始文件
+     * @param file      目标文件
+     * @param encodings 客户端可以接受的压缩方式
+     * @param variant   选定的表示形式
+     * @return false 表示应当发送原始文件
+     */
+    bool selectVariant(const FileCache::EntryPtr& file, int encodings, Variant& variant);
+
+    /**
+     * @brief 查找文件的预压缩版本, 即同一目录下添加了 suffix 后缀的文件. 查找结果(包括不存在)会放入文件缓存
+     * @param file      原始文件
+     * @param suffix    预压缩文件的后缀, 例如 ".gz"
+     * @param sidecar   找到的预压缩文件
+     * @return true 表示预压缩文件存在, 并且不比原始文件更旧
+     */
+    bool findSidecar(const FileCache::EntryPtr& file, const char* suffix, FileCache::EntryPtr& sidecar);
+
+    /**
+     * @brief 读取文件的内容, 生成可以放入响应缓存的完整响应报文
+     * @param file 已经打开的文件
+     * @return 文件不是普通文件、过大或者读取失败时返回 nullptr
+     */
+    ResponseCache::EntryPtr makeCachedResponse(const FileCache::EntryPtr& file);
+
     /**
      * @brief 处理传入的错误类型
      * @param err 错误类型
@@ -201,64 +543,193 @@ private:
     bool handleErrorType(ERROR_TYPE err);
 
     /**
-     * @brief   发送响应报文给客户端
-     * @param   responseCode        http 状态码, http报文第二个字段
-     * @param   responseMsg         http 报文第三个字段
+     * @brief CGI 程序退出后, 将其输出作为响应发送
+     * @return 输出为空时返回 ERR_INTERNAL_SERVER_ERR
+     */
+    ERROR_TYPE finishCgiRequest();
+
+    /**
+     * @brief 将处理完成的当前请求计入统计数据
+     */
+    void recordRequest();
+
+    /**
+     * @brief 请求的是否为统计数据的路径
+     */
+    bool isMetricsRequest();
+
+    /**
+     * @brief   发送响应报文给客户端. 响应头与 body 是发送队列中相邻的两段数据, 由同一次 sendmsg 发送
+     * @param   status              http 状态码
      * @param   responseBodyType    返回的body类型,即 Content-type
-     * @param   responseBody        返回的body内容
+     * @param   responseBody        返回的body内容, 其中的数据不会被复制, 因此必须在发送完成之前保持有效,
+     *                              例如位于 output_arena_ 中, 或者由 OutputChunk 持有其所有者
+     * @return  ERR_SUCCESS 表示成功发送, 其他则表示发送过程存在错误
+     */
+    ERROR_TYPE sendResponse(HTTP_STATUS status, const char* responseBodyType, OutputChunk&& responseBody);
+
+    /**
+     * @brief   发送文件作为响应报文的 body, 文件内容不会被复制到用户态的缓冲区中
+     * @param   file    待发送的文件, 其中包含了 Content-type 与 Content-length
+     * @return  ERR_SUCCESS 表示成功发送, 其他则表示发送过程存在错误
+     */
+    ERROR_TYPE sendFileResponse(const FileCache::EntryPtr& file);
+
+    /**
+     * @brief   发送压缩后的表示形式, 预压缩文件与原始文件一样不会被复制, 压缩缓存中的内容由所有连接共享
+     * @param   file    原始文件, 提供 Content-type 与 Last-Modified
+     * @param   variant 选定的表示形式
+     * @return  ERR_SUCCESS 表示成功发送, 其他则表示发送过程存在错误
+     */
+    ERROR_TYPE sendEncodedResponse(const FileCache::EntryPtr& file, const Variant& variant);
+
+    /**
+     * @brief   发送 304 Not Modified, 只包含验证器而没有 body
+     * @param   file    目标文件, 只使用其中的元数据
+     * @param   variant 选定的压缩表示形式, nullptr 表示原始文件
+     * @return  ERR_SUCCESS 表示成功发送, 其他则表示发送过程存在错误
+     */
+    ERROR_TYPE sendNotModifiedResponse(const FileCache::EntryPtr& file, const Variant* variant = nullptr);
+
+    /**
+     * @brief   处理带有 Range 请求头的 GET 请求. 单个区间返回 206, 多个区间以 multipart/byteranges 返回,
+     *          所有区间都无法满足时返回 416. 文件内容与 sendFileResponse 一样不会被复制
+     * @param   file    待发送的文件
+     * @param   range   Range 请求头的值
+     * @return  ERR_SUCCESS 表示成功发送, 其他则表示发送过程存在错误
+     * @note    Range 格式错误、或者 If-Range 与当前文件不一致时, 忽略 Range 并发送完整的文件
+     */
+    ERROR_TYPE sendRangeResponse(const FileCache::EntryPtr& file, StrSlice range);
+
+    /**
+     * @brief   发送响应缓存中的报文, 报文由所有连接共享, 不会被复制
+     * @param   cached  响应缓存中的条目
      * @return  ERR_SUCCESS 表示成功发送, 其他则表示发送过程存在错误
      */
-    ERROR_TYPE sendResponse(const string& responseCode, const string& responseMsg, 
-                      const string& responseBodyType, const string& responseBody);
+    ERROR_TYPE sendCachedResponse(const ResponseCache::EntryPtr& cached);
+
+    /**
+     * @brief   生成响应报文的头部, 追加至 out 的末尾. 状态行与连接相关的响应头直接复制预先生成的内容
+     * @param   out                 输出的缓冲区
+     * @param   status              http 状态码
+     * @param   responseBodyType    返回的body类型,即 Content-type
+     * @param   contentLength       格式化后的 body 长度, 为 nullptr 时不发送 Content-length 与 Content-type
+     * @param   keepAlive           是否为持续连接
+     * @note    之后由调用者追加额外的响应头, 以及结束头部的空行
+     */
+    void makeResponseHeader(ResponseBuilder& out, HTTP_STATUS status,
+                      const char* responseBodyType, const char* contentLength, bool keepAlive);
+
+    /**
+     * @brief   将响应头复制到 output_arena_ 中, 并放入发送队列的末尾
+     * @return  false 表示响应头超出了 ResponseBuilder 的容量, 此时不会放入发送队列
+     */
+    bool pushResponseHeader(const ResponseBuilder& header);
+
+    /**
+     * @brief   将数据放入发送队列的末尾
+     */
+    void pushOutputChunk(OutputChunk&& chunk);
+
+    /**
+     * @brief   将数据复制到 output_arena_ 中, 并放入发送队列的末尾
+     */
+    void pushOutputData(const char* data, size_t len)
+    {
+        pushOutputChunk(OutputChunk(output_arena_.copy(data, len), len));
+    }
+
+    /**
+     * @brief   移除发送队列中的队首数据, 并释放其所使用的文件资源
+     */
+    void popOutputChunk();
+
+    /**
+     * @brief   从队首开始移除已经发送的 len 字节数据
+     */
+    void consumeOutput(size_t len);
+
+    /**
+     * @brief   以非阻塞的方式尽可能多地发送发送队列中的数据
+     *          相邻的内存数据通过一次 sendmsg 发送, 因此流水线中多个请求的响应可以合并为一次写入
+     * @return  ERR_SUCCESS 表示发送队列已清空;
+     *          ERR_AGAIN 表示套接字缓冲区已满, 剩余的数据仍保留在发送队列中, 等待 EPOLLOUT 后再发送
+     *          ERR_SEND_RESPONSE_FAIL 表示发送过程存在错误
+     */
+    ERROR_TYPE flushResponse();
+
+    /**
+     * @brief   根据发送队列的状态, 更新 client_fd_ 在 epoll 中的触发条件
+     * @note    分发模式下由于使用了 ONESHOT, 每次都需要重新放入 epoll 中
+     */
+    void updateEpollEvent();
+
+    /**
+     * @brief   发送队列非空但套接字已经可写时, 重新注册 EPOLLOUT 并刷新定时器
+     * @return  true 表示连接仍在正常发送, 不应因为超时而被关闭
+     * @note    设置了 TCP_NOTSENT_LOWAT 时, 接收窗口关闭期间边缘触发的可写通知可能会丢失
+     */
+    bool rearmStalledOutput();
+
+    /**
+     * @brief   发送队列非空时, 根据 TCP_INFO 判断对端是否仍在接收数据, 是则刷新定时器
+     * @return  true 表示对端在上一个超时周期内确认了新的数据, 或者只是接收窗口已满
+     * @note    对端读取得很慢时, 接收窗口可能连续关闭超过一个超时周期, 套接字也一直不可写.
+     *          窗口关闭的情况最多连续容忍 maxStalledTimeouts 次, 以免无限期地占用连接
+     */
+    bool checkSendProgress();
     
     /**
-     * @brief 发送错误信息至客户端
-     * @param errCode   错误http状态码
-     * @param errMsg    错误信息, http报文第三个字段
+     * @brief 发送错误信息至客户端. 响应报文是预先生成的, 不会被复制
+     * @param status    错误http状态码
      * @return ERR_SUCCESS 表示成功发送, 其他则表示发送过程存在错误
      */
-    ERROR_TYPE sendErrorResponse(const string& errCode, const string& errMsg);
+    ERROR_TYPE sendErrorResponse(HTTP_STATUS status);
 };
 
 class MimeType
 {
 private:
-    // (suffix -> type)
-    map<string, string> mime_map_;
+    // (suffix -> type). 后缀的个数很少, 顺序比较即可, 查找时也不需要构造 string
+    vector<pair<const char*, string>> mime_types_;
+    // 未知后缀所使用的类型
+    string default_type_;
 
-    string getMineType_(string suffix)
+    const string& getMineType_(const char* suffix)
     {
-        if(mime_map_.find(suffix) != mime_map_.end())
-            return mime_map_[suffix];
-        else
-            return mime_map_["default"];
+        for(size_t i = 0; i < mime_types_.size(); i++)
+            if(!strcmp(mime_types_[i].first, suffix))
+                return mime_types_[i].second;
+        return default_type_;
     }
 public:
-    MimeType()
+    MimeType() : default_type_("text/plain")
     {
-        mime_map_["doc"] = "application/msword";
-        mime_map_["gz"] = "application/x-gzip";
-        mime_map_["ico"] = "application/x-ico";
-
-        mime_map_["gif"] = "image/gif";
-        mime_map_["jpg"] = "image/jpeg";
-        mime_map_["png"] = "image/png";
-        mime_map_["bmp"] = "image/bmp";
-
-        mime_map_["mp3"] = "audio/mp3";
-        mime_map_["avi"] = "video/x-msvideo";
-
-        mime_map_["html"] = "text/html";
-        mime_map_["htm"] = "text/html";
-        mime_map_["css"] = "text/html";
-        mime_map_["js"] = "text/html";
-
-        mime_map_["c"] = "text/plain";
-        mime_map_["txt"] = "text/plain";
-        mime_map_["default"] = "text/plain";
+        mime_types_.push_back(make_pair("doc", "application/msword"));
+        mime_types_.push_back(make_pair("gz", "application/x-gzip"));
+        mime_types_.push_back(make_pair("ico", "application/x-ico"));
+
+        mime_types_.push_back(make_pair("gif", "image/gif"));
+        mime_types_.push_back(make_pair("jpg", "image/jpeg"));
+        mime_types_.push_back(make_pair("png", "image/png"));
+        mime_types_.push_back(make_pair("bmp", "image/bmp"));
+        mime_types_.push_back(make_pair("svg", "image/svg+xml"));
+
+        mime_types_.push_back(make_pair("mp3", "audio/mp3"));
+        mime_types_.push_back(make_pair("avi", "video/x-msvideo"));
+
+        mime_types_.push_back(make_pair("html", "text/html"));
+        mime_types_.push_back(make_pair("htm", "text/html"));
+        mime_types_.push_back(make_pair("css", "text/css"));
+        mime_types_.push_back(make_pair("js", "application/javascript"));
+        mime_types_.push_back(make_pair("json", "application/json"));
+        mime_types_.push_back(make_pair("xml", "application/xml"));
+
+        mime_types_.push_back(make_pair("c", "text/plain"));
+        mime_types_.push_back(make_pair("txt", "text/plain"));
     }
 
-    static string getMineType(string suffix)
+    static const string& getMineType(const char* suffix)
     {
         static MimeType _mimeTy;
         return _mimeTy.getMineType_(suffix);
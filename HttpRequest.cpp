@@ -0,0 +1,75 @@
+#include <cstring>
+#include <strings.h>
+
+#include "HttpRequest.h"
+
+// 常用请求头的名称, 与 HEADER_TYPE 一一对应
+static const char* const KNOWN_HEADER_NAMES[HttpRequest::HEADER_KNOWN_NUM] = {
+    "connection", "content-length", "host", "if-none-match", "if-modified-since",
+    "range", "if-range", "accept-encoding"
+};
+
+bool StrSlice::equalsIgnoreCase(const string& buf, const char* str) const
+{
+    return strlen(str) == length && !strncasecmp(data(buf), str, length);
+}
+
+void HttpRequest::reset()
+{
+    uri = StrSlice();
+    for(size_t i = 0; i < HEADER_KNOWN_NUM; i++)
+        known_present_[i] = false;
+    other_num_ = 0;
+}
+
+void HttpRequest::addHeader(const string& buf, StrSlice name, StrSlice value)
+{
+    for(size_t i = 0; i < HEADER_KNOWN_NUM; i++)
+    {
+        if(name.equalsIgnoreCase(buf, KNOWN_HEADER_NAMES[i]))
+        {
+            known_headers_[i] = value;
+            known_present_[i] = true;
+            return;
+        }
+    }
+    for(size_t i = 0; i < other_num_; i++)
+    {
+        if(other_names_[i].length == name.length
+            && !strncasecmp(other_names_[i].data(buf), name.data(buf), name.length))
+        {
+            other_values_[i] = value;
+            return;
+        }
+    }
+    if(other_num_ < MAX_OTHER_HEADERS)
+    {
+        other_names_[other_num_] = name;
+        other_values_[other_num_] = value;
+        ++other_num_;
+    }
+}
+
+bool HttpRequest::getHeader(HEADER_TYPE type, StrSlice* value) const
+{
+    if(!known_present_[type])
+        return false;
+    *value = known_headers_[type];
+    return true;
+}
+
+bool HttpRequest::findHeader(const string& buf, const char* name, StrSlice* value) const
+{
+    for(size_t i = 0; i < HEADER_KNOWN_NUM; i++)
+        if(!strcasecmp(name, KNOWN_HEADER_NAMES[i]))
+            return getHeader(static_cast<HEADER_TYPE>(i), value);
+    for(size_t i = 0; i < other_num_; i++)
+    {
+        if(other_names_[i].equalsIgnoreCase(buf, name))
+        {
+            *value = other_values_[i];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,90 @@
+#ifndef HTTPREQUEST_H
+#define HTTPREQUEST_H
+
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+/**
+ * @brief 接收缓冲区中的一段数据, 以 (偏移, 长度) 的形式表示
+ * @note  接收缓冲区扩容时其地址可能改变, 因此不保存指针
+ */
+struct StrSlice {
+    size_t offset;
+    size_t length;
+
+    StrSlice() : offset(0), length(0) {}
+    StrSlice(size_t off, size_t len) : offset(off), length(len) {}
+    bool empty() const  { return length == 0; }
+    // 获取该切片在缓冲区 buf 中的起始地址
+    const char* data(const string& buf) const   { return buf.data() + offset; }
+    // 与字符串 str 比较, 忽略大小写
+    bool equalsIgnoreCase(const string& buf, const char* str) const;
+    // 复制为一个新的字符串, 只在需要保存该数据时使用
+    string toString(const string& buf) const    { return buf.substr(offset, length); }
+};
+
+/**
+ * @brief 解析后的 HTTP 请求头. 所有字段都是指向接收缓冲区的切片, 解析过程中不会分配内存
+ *        常用的请求头保存在以 HEADER_TYPE 为下标的固定位置中, 其余的请求头保存在一个定长的数组中
+ * @note  切片只在当前请求处理完成之前有效, 之后接收缓冲区中的数据将被移除
+ */
+class HttpRequest
+{
+public:
+    // 常用的请求头
+    enum HEADER_TYPE {
+        HEADER_CONNECTION,          // Connection
+        HEADER_CONTENT_LENGTH,      // Content-Length
+        HEADER_HOST,                // Host
+        HEADER_IF_NONE_MATCH,       // If-None-Match
+        HEADER_IF_MODIFIED_SINCE,   // If-Modified-Since
+        HEADER_RANGE,               // Range
+        HEADER_IF_RANGE,            // If-Range
+        HEADER_ACCEPT_ENCODING,     // Accept-Encoding
+        HEADER_KNOWN_NUM
+    };
+
+    HttpRequest()   { reset(); }
+
+    /**
+     * @brief 清空所有请求头
+     */
+    void reset();
+
+    /**
+     * @brief 记录一个请求头, 同名的请求头以最后一个为准
+     * @param buf   接收缓冲区
+     * @param name  请求头的名称
+     * @param value 请求头的值
+     */
+    void addHeader(const string& buf, StrSlice name, StrSlice value);
+
+    /**
+     * @brief 获取常用的请求头
+     * @return 请求头不存在时返回 false
+     */
+    bool getHeader(HEADER_TYPE type, StrSlice* value) const;
+
+    /**
+     * @brief 按照名称查找请求头, 忽略大小写
+     * @return 请求头不存在时返回 false
+     */
+    bool findHeader(const string& buf, const char* name, StrSlice* value) const;
+
+    // 请求的 URI
+    StrSlice uri;
+
+private:
+    // 除常用请求头以外, 最多保存的请求头个数. 超出的部分将被忽略
+    static const size_t MAX_OTHER_HEADERS = 32;
+
+    StrSlice known_headers_[HEADER_KNOWN_NUM];
+    bool known_present_[HEADER_KNOWN_NUM];
+    StrSlice other_names_[MAX_OTHER_HEADERS];
+    StrSlice other_values_[MAX_OTHER_HEADERS];
+    size_t other_num_;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "HttpScan.h"
+
+// 字符类别, 作为查找表中的位
+enum CHAR_CLASS {
+    CLASS_TOKEN = 1,        // tchar
+    CLASS_VISIBLE = 2,      // 0x21 ~ 0x7e
+    CLASS_FIELD_VALUE = 4   // HTAB / 0x20 ~ 0x7e / 0x80 ~ 0xff
+};
+
+// 标量实现所使用的查找表, 以及不足一个向量长度的剩余字节
+static unsigned char char_classes[256];
+
+static void initCharClasses()
+{
+    const char* separators = "\"(),/:;<=>?@[\\]{}";
+    for(int ch = 0; ch < 256; ch++)
+    {
+        unsigned char cls = 0;
+        if(ch >= 0x21 && ch <= 0x7e)
+        {
+            cls |= CLASS_VISIBLE;
+            if(!strchr(separators, ch))
+                cls |= CLASS_TOKEN;
+        }
+        if(ch == '\t' || (ch >= 0x20 && ch != 0x7f))
+            cls |= CLASS_FIELD_VALUE;
+        char_classes[ch] = cls;
+    }
+}
+
+static inline size_t scanScalar(const char* buf, size_t pos, size_t len, unsigned char cls)
+{
+    while(pos < len && (char_classes[static_cast<unsigned char>(buf[pos])] & cls))
+        ++pos;
+    return pos;
+}
+
+static size_t scanTokenScalar(const char* buf, size_t len)      { return scanScalar(buf, 0, len, CLASS_TOKEN); }
+static size_t scanVisibleScalar(const char* buf, size_t len)    { return scanScalar(buf, 0, len, CLASS_VISIBLE); }
+static size_t scanFieldValueScalar(const char* buf, size_t len) { return scanScalar(buf, 0, len, CLASS_FIELD_VALUE); }
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * 向量实现: 每个字符类别都可以表示为若干个字节区间的组合, 而字节 x 是否位于区间 [lo, hi] 中,
+ * 等价于无符号比较 (x - lo) <= (hi - lo), 即 max(x - lo, hi - lo) == hi - lo.
+ * SSE2 与 AVX2 的实现只有向量宽度不同, 因此使用宏生成
+ */
+#define DEFINE_SCAN_KERNELS(TARGET, SUFFIX, VEC, WIDTH, LOAD, SET1, SUB, MAX, CMPEQ, OR, ANDNOT, MOVEMASK) \
+TARGET static inline VEC inRange##SUFFIX(VEC x, unsigned char lo, unsigned char hi)              \
+{                                                                                               \
+    VEC span = SET1(static_cast<char>(hi - lo));                                                \
+    return CMPEQ(MAX(SUB(x, SET1(static_cast<char>(lo))), span), span);                         \
+}                                                                                               \
+/* 非 token 字符: 不可见字符以及分隔符 "(),/:;<=>?@[\]{} */                                     \
+TARGET static inline VEC badToken##SUFFIX(VEC x)                                               \
+{                                                                                               \
+    VEC sep = OR(OR(inRange##SUFFIX(x, 0x22, 0x22), inRange##SUFFIX(x, 0x28, 0x29)),           \
+                 OR(inRange##SUFFIX(x, 0x2c, 0x2c), inRange##SUFFIX(x, 0x2f, 0x2f)));          \
+    sep = OR(sep, OR(OR(inRange##SUFFIX(x, 0x3a, 0x40), inRange##SUFFIX(x, 0x5b, 0x5d)),       \
+                     OR(inRange##SUFFIX(x, 0x7b, 0x7b), inRange##SUFFIX(x, 0x7d, 0x7d))));     \
+    return OR(ANDNOT(inRange##SUFFIX(x, 0x21, 0x7e), SET1(static_cast<char>(0xff))), sep);     \
+}                                                                                               \
+TARGET static inline VEC badVisible##SUFFIX(VEC x)                                             \
+{                                                                                               \
+    return ANDNOT(inRange##SUFFIX(x, 0x21, 0x7e), SET1(static_cast<char>(0xff)));              \
+}                                                                                               \
+/* 除 HTAB 以外的控制字符, 以及 DEL */                                                          \
+TARGET static inline VEC badFieldValue##SUFFIX(VEC x)                                          \
+{                                                                                               \
+    return OR(ANDNOT(inRange##SUFFIX(x, 0x09, 0x09), inRange##SUFFIX(x, 0x00, 0x1f)),          \
+              inRange##SUFFIX(x, 0x7f, 0x7f));                                                  \
+}                                                                                               \
+TARGET static size_t scanToken##SUFFIX(const char* buf, size_t len)                            \
+{                                                                                               \
+    size_t pos = 0;                                                                             \
+    for(; pos + WIDTH <= len; pos += WIDTH)                                                     \
+    {                                                                                           \
+        unsigned mask = static_cast<unsigned>(MOVEMASK(badToken##SUFFIX(LOAD(buf + pos))));    \
+        if(mask)                                                                                \
+            return pos + __builtin_ctz(mask);                                                   \
+    }                                                                                           \
+    return scanScalar(buf, pos, len, CLASS_TOKEN);                                              \
+}                                                                                               \
+TARGET static size_t scanVisible##SUFFIX(const char* buf, size_t len)                          \
+{                                                                                               \
+    size_t pos = 0;                                                                             \
+    for(; pos + WIDTH <= len; pos += WIDTH)                                                     \
+    {                                                                                           \
+        unsigned mask = static_cast<unsigned>(MOVEMASK(badVisible##SUFFIX(LOAD(buf + pos))));  \
+        if(mask)                                                                                \
+            return pos + __builtin_ctz(mask);                                                   \
+    }                                                                                           \
+    return scanScalar(buf, pos, len, CLASS_VISIBLE);                                            \
+}                                                                                               \
+TARGET static size_t scanFieldValue##SUFFIX(const char* buf, size_t len)                       \
+{                                                                                               \
+    size_t pos = 0;                                                                             \
+    for(; pos + WIDTH <= len; pos += WIDTH)                                                     \
+    {                                                                                           \
+        unsigned mask = static_cast<unsigned>(MOVEMASK(badFieldValue##SUFFIX(LOAD(buf + pos))));\
+        if(mask)                                                                                \
+            return pos + __builtin_ctz(mask);                                                   \
+    }                                                                                           \
+    return scanScalar(buf, pos, len, CLASS_FIELD_VALUE);                                        \
+}
+
+#define SSE2_LOAD(p)    _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))
+#define AVX2_LOAD(p)    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))
+
+DEFINE_SCAN_KERNELS(__attribute__((target("sse2"))), Sse2, __m128i, 16, SSE2_LOAD,
+                    _mm_set1_epi8, _mm_sub_epi8, _mm_max_epu8, _mm_cmpeq_epi8,
+                    _mm_or_si128, _mm_andnot_si128, _mm_movemask_epi8)
+DEFINE_SCAN_KERNELS(__attribute__((target("avx2"))), Avx2, __m256i, 32, AVX2_LOAD,
+                    _mm256_set1_epi8, _mm256_sub_epi8, _mm256_max_epu8, _mm256_cmpeq_epi8,
+                    _mm256_or_si256, _mm256_andnot_si256, _mm256_movemask_epi8)
+
+#endif
+
+// 当前所使用的实现
+struct ScanImpl {
+    const char* name;
+    size_t (*scan_token)(const char*, size_t);
+    size_t (*scan_visible)(const char*, size_t);
+    size_t (*scan_field_value)(const char*, size_t);
+};
+
+static ScanImpl selectScanImpl()
+{
+    initCharClasses();
+#if defined(__x86_64__) || defined(__i386__)
+    // __builtin_cpu_supports 通过 CPUID 检测, 对于 AVX2 还会确认操作系统保存了 YMM 寄存器
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return ScanImpl{"avx2", scanTokenAvx2, scanVisibleAvx2, scanFieldValueAvx2};
+    if(__builtin_cpu_supports("sse2"))
+        return ScanImpl{"sse2", scanTokenSse2, scanVisibleSse2, scanFieldValueSse2};
+#endif
+    return ScanImpl{"scalar", scanTokenScalar, scanVisibleScalar, scanFieldValueScalar};
+}
+// 在 main 之前完成选择, 此时还没有其他线程
+static const ScanImpl scan_impl = selectScanImpl();
+
+size_t scanToken(const char* buf, size_t len)
+{
+    return scan_impl.scan_token(buf, len);
+}
+
+size_t scanVisible(const char* buf, size_t len)
+{
+    return scan_impl.scan_visible(buf, len);
+}
+
+size_t scanFieldValue(const char* buf, size_t len)
+{
+    return scan_impl.scan_field_value(buf, len);
+}
+
+const char* getScanImplName()
+{
+    return scan_impl.name;
+}
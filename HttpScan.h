@@ -0,0 +1,34 @@
+#ifndef HTTPSCAN_H
+#define HTTPSCAN_H
+
+#include <cstddef>
+
+/**
+ * @brief HTTP 报文的字符扫描函数, 解析器通过它们查找分隔符, 并在同一次扫描中检查字符的合法性
+ *        启动时根据 CPUID 选择 AVX2 (每次 32 字节) / SSE2 (每次 16 字节) 实现, 其他平台使用查表的标量实现
+ * @note  所有函数都返回 [buf, buf + len) 中第一个不满足条件的字节的下标, 若所有字节都满足条件则返回 len
+ */
+
+/**
+ * @brief 扫描 token (RFC 7230 tchar), 用于请求方式与请求头名称
+ *        对于合法的请求头, 扫描终止于 ':'; 终止于其他字符则说明名称中含有非法字符
+ */
+size_t scanToken(const char* buf, size_t len);
+
+/**
+ * @brief 扫描可见字符 (0x21 ~ 0x7e), 用于 URI 与 HTTP 版本, 扫描终止于空格或者 '\r'
+ */
+size_t scanVisible(const char* buf, size_t len);
+
+/**
+ * @brief 扫描请求头的值, 允许 HTAB、可见字符、空格以及 obs-text (0x80 ~ 0xff)
+ *        对于合法的请求头, 扫描终止于行尾的 '\r'; 终止于其他控制字符则说明值中含有非法字符
+ */
+size_t scanFieldValue(const char* buf, size_t len);
+
+/**
+ * @brief 获取当前所使用的实现的名称, 用于输出日志
+ */
+const char* getScanImplName();
+
+#endif
@@ -0,0 +1,269 @@
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "IoUring.h"
+#include "Log.h"
+
+// 内核与用户态共享的 ring 指针需要使用 acquire / release 语义访问
+#define LOAD_ACQUIRE(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+IoUring::IoUring(unsigned entries)
+    : ring_fd_(-1), features_(0),
+      sq_ring_ptr_(MAP_FAILED), sq_ring_size_(0), sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)), sqes_size_(0),
+      sqe_tail_(0), to_submit_(0),
+      cq_ring_ptr_(MAP_FAILED),
+      file_table_size_(0),
+      buf_ring_(MAP_FAILED), buf_ring_size_(0), bufs_(nullptr), buf_entries_(0), buf_size_(0), buf_group_(0)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.cq_entries = entries * 2;
+    // 每个 ring 只会被其所属的事件循环线程使用, 因此可以让内核将任务推迟到 io_uring_enter 时统一执行
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+                 | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    // 老版本内核不支持上述标志, 则退化为默认设置
+    if(ring_fd_ < 0 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        params.cq_entries = entries * 2;
+        params.flags = IORING_SETUP_CQSIZE;
+        ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if(ring_fd_ < 0)
+    {
+        ERROR("Create io_uring fail! (%s)", strerror(errno));
+        return;
+    }
+    features_ = params.features;
+    // 事件循环需要 io_uring_enter 支持超时参数
+    if(!(features_ & IORING_FEAT_EXT_ARG) || !(features_ & IORING_FEAT_SINGLE_MMAP))
+    {
+        ERROR("io_uring is too old! (features: %x)", features_);
+        destroy();
+        return;
+    }
+
+    // 映射 SQ 与 CQ ring, 在 IORING_FEAT_SINGLE_MMAP 下二者共用同一块内存
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if(cq_ring_size > sq_ring_size_)
+        sq_ring_size_ = cq_ring_size;
+    sq_ring_ptr_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if(sq_ring_ptr_ == MAP_FAILED)
+    {
+        ERROR("mmap io_uring sq ring fail! (%s)", strerror(errno));
+        destroy();
+        return;
+    }
+    cq_ring_ptr_ = sq_ring_ptr_;
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+    if(sqes_ == MAP_FAILED)
+    {
+        ERROR("mmap io_uring sqes fail! (%s)", strerror(errno));
+        destroy();
+        return;
+    }
+
+    char* sq_ptr = static_cast<char*>(sq_ring_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq_ptr + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq_ptr + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq_ptr + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sqe_tail_ = *sq_tail_;
+    // SQ array 中的下标与 SQE 一一对应, 之后无需再修改
+    unsigned* sq_array = reinterpret_cast<unsigned*>(sq_ptr + params.sq_off.array);
+    for(unsigned i = 0; i < sq_entries_; i++)
+        sq_array[i] = i;
+
+    char* cq_ptr = static_cast<char*>(cq_ring_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq_ptr + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq_ptr + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq_ptr + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ptr + params.cq_off.cqes);
+}
+
+IoUring::~IoUring()
+{
+    destroy();
+}
+
+bool IoUring::isValid()
+{
+    return ring_fd_ >= 0;
+}
+
+void IoUring::flushSq_()
+{
+    if(!to_submit_)
+        return;
+    // 确保 SQE 的内容在 tail 更新之前对内核可见
+    STORE_RELEASE(sq_tail_, sqe_tail_);
+}
+
+io_uring_sqe* IoUring::getSqe()
+{
+    if(!isValid())
+        return nullptr;
+    // SQ 已满, 先将已有的 SQE 提交给内核
+    if(sqe_tail_ - LOAD_ACQUIRE(sq_head_) >= sq_entries_)
+    {
+        flushSq_();
+        int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, 0, 0, nullptr, 0);
+        if(ret < 0)
+            return nullptr;
+        to_submit_ -= ret;
+        if(sqe_tail_ - LOAD_ACQUIRE(sq_head_) >= sq_entries_)
+            return nullptr;
+    }
+    io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqe_tail_;
+    ++to_submit_;
+    return sqe;
+}
+
+int IoUring::submitAndWait(int timeout_ms)
+{
+    if(!isValid())
+        return -1;
+    flushSq_();
+
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    __kernel_timespec ts;
+    if(timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = reinterpret_cast<__u64>(&ts);
+    }
+    // 已经有 CQE 时不需要等待
+    unsigned wait_nr = (LOAD_ACQUIRE(cq_tail_) != *cq_head_) ? 0 : 1;
+    int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, wait_nr,
+                      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if(ret < 0)
+    {
+        // 超时或者被信号中断都不算错误
+        if(errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN)
+            return 0;
+        return -1;
+    }
+    to_submit_ -= ret;
+    return ret;
+}
+
+io_uring_cqe* IoUring::peekCqe()
+{
+    unsigned head = *cq_head_;
+    if(head == LOAD_ACQUIRE(cq_tail_))
+        return nullptr;
+    return &cqes_[head & cq_mask_];
+}
+
+void IoUring::seenCqe()
+{
+    STORE_RELEASE(cq_head_, *cq_head_ + 1);
+}
+
+bool IoUring::registerFiles(unsigned nr)
+{
+    if(!isValid())
+        return false;
+    io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = nr;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if(syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0)
+        return false;
+    file_table_size_ = nr;
+    return true;
+}
+
+bool IoUring::updateFile(unsigned slot, int fd)
+{
+    if(!isValid() || slot >= file_table_size_)
+        return false;
+    io_uring_rsrc_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.data = reinterpret_cast<__u64>(&fd);
+    return syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+bool IoUring::setupBufRing(unsigned entries, unsigned buf_size, unsigned short bgid)
+{
+    if(!isValid() || (entries & (entries - 1)) || entries > 32768)
+        return false;
+    buf_ring_size_ = entries * sizeof(io_uring_buf);
+    buf_ring_ = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(buf_ring_ == MAP_FAILED)
+        return false;
+    bufs_ = new char[static_cast<size_t>(entries) * buf_size];
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<__u64>(buf_ring_);
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if(syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        munmap(buf_ring_, buf_ring_size_);
+        buf_ring_ = MAP_FAILED;
+        delete[] bufs_;
+        bufs_ = nullptr;
+        return false;
+    }
+    buf_entries_ = entries;
+    buf_size_ = buf_size;
+    buf_group_ = bgid;
+    // 将所有 buffer 交给内核
+    for(unsigned i = 0; i < entries; i++)
+        recycleBuffer(static_cast<unsigned short>(i));
+    return true;
+}
+
+char* IoUring::getBuffer(unsigned short bid)
+{
+    return bufs_ + static_cast<size_t>(bid) * buf_size_;
+}
+
+void IoUring::recycleBuffer(unsigned short bid)
+{
+    // buffer ring 的 tail 与第 0 个 io_uring_buf 的 resv 字段重叠
+    io_uring_buf_ring* br = static_cast<io_uring_buf_ring*>(buf_ring_);
+    io_uring_buf* bufs = static_cast<io_uring_buf*>(buf_ring_);
+    unsigned short tail = br->tail;
+    io_uring_buf* buf = &bufs[tail & (buf_entries_ - 1)];
+    buf->addr = reinterpret_cast<__u64>(getBuffer(bid));
+    buf->len = buf_size_;
+    buf->bid = bid;
+    STORE_RELEASE(&br->tail, static_cast<unsigned short>(tail + 1));
+}
+
+void IoUring::destroy()
+{
+    if(sqes_ != MAP_FAILED)
+        munmap(sqes_, sqes_size_);
+    if(sq_ring_ptr_ != MAP_FAILED)
+        munmap(sq_ring_ptr_, sq_ring_size_);
+    sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+    sq_ring_ptr_ = cq_ring_ptr_ = MAP_FAILED;
+    // 关闭 ring fd 后, 内核会自动注销 fixed file 表与 buffer ring
+    if(isValid())
+        close(ring_fd_);
+    ring_fd_ = -1;
+    if(buf_ring_ != MAP_FAILED)
+        munmap(buf_ring_, buf_ring_size_);
+    buf_ring_ = MAP_FAILED;
+    delete[] bufs_;
+    bufs_ = nullptr;
+}
@@ -0,0 +1,129 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <linux/io_uring.h>
+
+#include "Utils.h"
+
+/**
+ * @brief io_uring 的简单封装, 直接使用 io_uring_setup / io_uring_enter / io_uring_register 系统调用
+ *        与 Epoll 类一样, 该类只负责 ring 本身的管理, 不关心具体的事件含义
+ * @note  每个 IoUring 实例只能由一个线程使用 (IORING_SETUP_SINGLE_ISSUER)
+ */
+class IoUring
+{
+public:
+    /**
+     * @brief 创建一个 io_uring 实例
+     * @param entries SQ 队列的长度, CQ 队列的长度为其两倍
+     */
+    IoUring(unsigned entries = 4096);
+    ~IoUring();
+
+    /**
+     * @brief 确定当前 io_uring 实例是否有效
+     * @return 有效则返回 true, 无效则返回 false
+     */
+    bool isValid();
+
+    /**
+     * @brief 获取一个空闲的 SQE, 若 SQ 已满则先提交已有的 SQE
+     * @return 清零后的 SQE, 失败时返回 nullptr
+     */
+    io_uring_sqe* getSqe();
+
+    /**
+     * @brief 提交所有 SQE, 并等待至少一个 CQE 或者超时
+     * @param timeout_ms 最大超时时间,单位毫秒. -1 则设置永久等待
+     * @return 成功则返回提交的 SQE 个数, 超时或被信号中断也视为成功; 出错时返回 -1
+     * @note 该函数调用的内部函数在错误时会设置 errno
+     */
+    int submitAndWait(int timeout_ms);
+
+    /**
+     * @brief 获取下一个尚未处理的 CQE
+     * @return 没有 CQE 时返回 nullptr
+     * @note 处理完成后必须调用 seenCqe
+     */
+    io_uring_cqe* peekCqe();
+    void seenCqe();
+
+    /**
+     * @brief 注册一个稀疏的 fixed file 表, 之后可以通过 updateFile 将 fd 放入其中
+     * @param nr 表的大小
+     * @return 成功则返回true, 失败则返回 false
+     */
+    bool registerFiles(unsigned nr);
+    // 获取 fixed file 表的大小
+    unsigned getFileTableSize()     { return file_table_size_; }
+
+    /**
+     * @brief 同步更新 fixed file 表中的某一项
+     * @param slot 表中的位置
+     * @param fd   放入的文件描述符, -1 表示清空该位置
+     * @return 成功则返回true, 失败则返回 false
+     */
+    bool updateFile(unsigned slot, int fd);
+
+    /**
+     * @brief 注册一组 provided buffer (buffer ring), 供 IOSQE_BUFFER_SELECT 的 recv 使用
+     * @param entries  buffer 个数, 必须为 2 的幂
+     * @param buf_size 每个 buffer 的大小
+     * @param bgid     buffer group id
+     * @return 成功则返回true, 失败则返回 false
+     */
+    bool setupBufRing(unsigned entries, unsigned buf_size, unsigned short bgid);
+
+    /**
+     * @brief 获取 buffer ring 中的某个 buffer / 将用完的 buffer 归还给内核
+     * @param bid buffer id, 即 cqe->flags >> IORING_CQE_BUFFER_SHIFT
+     */
+    char* getBuffer(unsigned short bid);
+    void recycleBuffer(unsigned short bid);
+    unsigned short getBufGroup()    { return buf_group_; }
+
+    /**
+     * @brief 释放当前 io_uring 实例
+     */
+    void destroy();
+
+private:
+    int ring_fd_;
+    unsigned features_;
+
+    // SQ ring
+    void* sq_ring_ptr_;
+    size_t sq_ring_size_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned sqe_tail_;         // 本地的 SQ tail, 提交时才会同步至 *sq_tail_
+    unsigned to_submit_;        // 尚未提交的 SQE 个数
+
+    // CQ ring
+    void* cq_ring_ptr_;         // 与 sq_ring_ptr_ 共用同一块映射
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+
+    unsigned file_table_size_;
+
+    // buffer ring
+    void* buf_ring_;
+    size_t buf_ring_size_;
+    char* bufs_;
+    unsigned buf_entries_;
+    unsigned buf_size_;
+    unsigned short buf_group_;
+
+    /**
+     * @brief 将本地的 SQ tail 同步至内核可见的 SQ ring 中
+     */
+    void flushSq_();
+};
+
+#endif
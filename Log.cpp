@@ -1,4 +1,371 @@
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "Condition.h"
 #include "Log.h"
+#include "MutexLock.h"
+
+// 单条日志的最大长度, 超出的部分被截断
+static const size_t LOG_LINE_MAX = 4096;
+// 每个线程的环形缓冲区大小, 必须为 2 的幂
+static const size_t LOG_RING_SIZE = 128 * 1024;
+// 单次 writev 最多写入的日志条数
+static const int LOG_IOV_MAX = 256;
+// 后台线程没有日志可写时的最长休眠时间(ms)
+static const long LOG_IDLE_MS = 100;
+// 每条日志末尾的重置颜色代码与换行
+static const char LOG_SUFFIX[] = cRST "\n";
+
+// 环形缓冲区中每条日志之前的头部. fd 为 -1 表示填充至缓冲区末尾的空白记录
+struct LogRecord {
+    uint32_t len;
+    int32_t fd;
+};
+
+/**
+ * @brief 单生产者单消费者的无锁环形缓冲区, 生产者是其所属的线程, 消费者是后台日志线程
+ *        head 与 tail 只增不减, 对缓冲区大小取模后才是实际的位置. 每条日志在缓冲区中总是连续存放
+ * @note  线程退出后缓冲区不会被释放, 而是由之后新建的线程复用, 因此缓冲区的个数不超过同时存在的线程数
+ */
+struct LogRing {
+    char buf[LOG_RING_SIZE];
+    size_t head;                // 只由生产者修改
+    char head_pad[64];          // 避免 head 与 tail 位于同一缓存行
+    size_t tail;                // 只由消费者修改
+    char tail_pad[64];
+    size_t dropped;             // 由于缓冲区已满而被丢弃的日志条数
+    bool in_use;                // 是否有线程正在使用该缓冲区
+    LogRing* next;              // 所有缓冲区组成的链表, 只会在头部插入
+
+    LogRing() : head(0), tail(0), dropped(0), in_use(true), next(nullptr) {}
+};
+
+// 线程退出时归还其缓冲区
+struct LogRingHolder {
+    LogRing* ring;
+    ~LogRingHolder()    { if(ring) __atomic_store_n(&ring->in_use, false, __ATOMIC_RELEASE); }
+};
+
+static LogRing* log_rings = nullptr;
+static bool log_async = false;          // 是否以异步的方式输出
+static bool log_forked_child = false;   // 是否为 fork 得到的子进程
+static LogFullPolicy info_full_policy = LOG_FULL_DROP;
+
+int log_level = LOG_LEVEL_DUMP;
+// 报文的抽样比例, 以及每个线程已经处理的请求个数
+static unsigned packet_dump_sampling = 1;
+static thread_local unsigned packet_dump_counter = 0;
+
+// 后台线程的休眠与唤醒
+static MutexLock log_lock;
+static Condition log_cond(log_lock);
+static bool log_thread_sleeping = false;
+static bool log_thread_stopping = false;
+static pthread_t log_thread;
+
+// 缓存的线程号, 以免每条日志都需要 gettid 系统调用
+static thread_local long log_tid = 0;
+static thread_local LogRingHolder log_ring_holder = {nullptr};
+
+static size_t alignRecord(size_t len)
+{
+    return (sizeof(LogRecord) + len + 7) & ~static_cast<size_t>(7);
+}
+
+// 完整地写入数据, 写入失败时直接丢弃, 日志模块无处报告自身的错误
+static void writeAll(int fd, const char* data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t ret = write(fd, data, len);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return;
+        data += ret;
+        len -= static_cast<size_t>(ret);
+    }
+}
+
+static void writevAll(int fd, iovec* iov, int cnt)
+{
+    while(cnt > 0)
+    {
+        ssize_t ret = writev(fd, iov, cnt);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return;
+        // 跳过已经写入的部分
+        size_t written = static_cast<size_t>(ret);
+        while(cnt > 0 && written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            ++iov;
+            --cnt;
+        }
+        if(cnt > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+static LogRing* acquireRing()
+{
+    // 优先复用已经退出的线程所留下的缓冲区
+    LogRing* ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    for(; ring; ring = ring->next)
+    {
+        bool expected = false;
+        if(!__atomic_load_n(&ring->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&ring->in_use, &expected, true, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return ring;
+    }
+    ring = new LogRing();
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return ring;
+}
+
+static void wakeLogThread(bool force)
+{
+    // 与后台线程进入休眠之前的检查配对, 保证不会在其休眠之后才发布日志而没有唤醒
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(force || __atomic_load_n(&log_thread_sleeping, __ATOMIC_RELAXED))
+    {
+        MutexLockGuard guard(log_lock);
+        log_cond.notify();
+    }
+}
+
+static bool ringsEmpty()
+{
+    for(LogRing* ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+        if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+            return false;
+    return true;
+}
+
+/**
+ * @brief 将日志放入当前线程的缓冲区
+ * @return false 表示异步输出已经停止, 调用者需要自行输出
+ */
+static bool pushRecord(int fd, const char* line, size_t len, bool block)
+{
+    if(!log_ring_holder.ring)
+        log_ring_holder.ring = acquireRing();
+    LogRing* ring = log_ring_holder.ring;
+
+    size_t need = alignRecord(len);
+    size_t head = ring->head;
+    size_t offset, contiguous;
+    for(;;)
+    {
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        offset = head & (LOG_RING_SIZE - 1);
+        contiguous = LOG_RING_SIZE - offset;
+        // 缓冲区末尾的空间不足时, 该部分空间被跳过, 日志从缓冲区头部开始存放
+        size_t total = need <= contiguous ? need : need + contiguous;
+        if(LOG_RING_SIZE - (head - tail) >= total)
+            break;
+        if(!block)
+        {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            wakeLogThread(false);
+            return true;
+        }
+        if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+            return false;
+        wakeLogThread(true);
+        usleep(100);
+    }
+
+    if(need > contiguous)
+    {
+        LogRecord* pad = reinterpret_cast<LogRecord*>(ring->buf + offset);
+        pad->len = static_cast<uint32_t>(contiguous - sizeof(LogRecord));
+        pad->fd = -1;
+        head += contiguous;
+        offset = 0;
+    }
+    LogRecord* record = reinterpret_cast<LogRecord*>(ring->buf + offset);
+    record->len = static_cast<uint32_t>(len);
+    record->fd = fd;
+    memcpy(record + 1, line, len);
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+    wakeLogThread(false);
+    return true;
+}
+
+/**
+ * @brief 取出所有缓冲区中的日志并写入, 同一缓冲区中连续的、写入同一 fd 的日志通过一次 writev 写入
+ * @return 写入的日志条数
+ * @note  同一时刻只能有一个线程调用
+ */
+static size_t drainRings()
+{
+    size_t drained = 0;
+    iovec iov[LOG_IOV_MAX];
+    for(LogRing* ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+    {
+        size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if(dropped)
+        {
+            char msg[128];
+            int len = snprintf(msg, sizeof(msg), cYEL "[!] " cBRI "WARNING: " cRST
+                               "%lu log messages dropped, the log buffer is full" cRST "\n", dropped);
+            writeAll(STDERR_FILENO, msg, static_cast<size_t>(len));
+        }
+
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        int cnt = 0, fd = -1;
+        while(tail != head)
+        {
+            LogRecord* record = reinterpret_cast<LogRecord*>(ring->buf + (tail & (LOG_RING_SIZE - 1)));
+            if(record->fd >= 0)
+            {
+                if(cnt == LOG_IOV_MAX || (cnt > 0 && record->fd != fd))
+                {
+                    writevAll(fd, iov, cnt);
+                    // 写入完成之后才能归还空间
+                    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+                    cnt = 0;
+                }
+                fd = record->fd;
+                iov[cnt].iov_base = record + 1;
+                iov[cnt].iov_len = record->len;
+                cnt++;
+                drained++;
+            }
+            tail += alignRecord(record->len);
+        }
+        if(cnt > 0)
+            writevAll(fd, iov, cnt);
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    return drained;
+}
+
+static void* logThreadFunc(void*)
+{
+    for(;;)
+    {
+        bool stopping = __atomic_load_n(&log_thread_stopping, __ATOMIC_ACQUIRE);
+        if(drainRings() > 0)
+            continue;
+        if(stopping)
+            return nullptr;
+
+        MutexLockGuard guard(log_lock);
+        __atomic_store_n(&log_thread_sleeping, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(ringsEmpty() && !__atomic_load_n(&log_thread_stopping, __ATOMIC_ACQUIRE))
+            log_cond.waitForMillis(LOG_IDLE_MS);
+        __atomic_store_n(&log_thread_sleeping, false, __ATOMIC_RELAXED);
+    }
+}
+
+static void stopLogThread()
+{
+    if(!__atomic_exchange_n(&log_async, false, __ATOMIC_ACQ_REL))
+        return;
+    {
+        MutexLockGuard guard(log_lock);
+        __atomic_store_n(&log_thread_stopping, true, __ATOMIC_RELEASE);
+        log_cond.notify();
+    }
+    pthread_join(log_thread, nullptr);
+    // 后台线程已经退出, 当前线程是唯一的消费者. 输出其退出前最后一刻放入的日志
+    drainRings();
+}
+
+static void onForkChild()
+{
+    // 子进程中只有调用 fork 的线程, 后台线程并不存在
+    log_forked_child = true;
+    log_tid = 0;
+}
+
+void startLogThread()
+{
+    if(__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+        return;
+    if(pthread_create(&log_thread, nullptr, logThreadFunc, nullptr))
+    {
+        ERROR("Create log thread fail, log synchronously.");
+        return;
+    }
+    pthread_atfork(nullptr, nullptr, onForkChild);
+    atexit(stopLogThread);
+    __atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+}
+
+void setLogFullPolicy(LogFullPolicy policy)
+{
+    __atomic_store_n(&info_full_policy, policy, __ATOMIC_RELAXED);
+}
+
+void setLogLevel(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+void setPacketDumpSampling(unsigned n)
+{
+    __atomic_store_n(&packet_dump_sampling, n, __ATOMIC_RELAXED);
+}
+
+bool samplePacketDump()
+{
+    // 报文输出在编译期被移除时, 该条件恒为 false
+    unsigned n = __atomic_load_n(&packet_dump_sampling, __ATOMIC_RELAXED);
+    if(LOG_MIN_LEVEL > LOG_LEVEL_DUMP || n == 0 || !isLogEnabled(LOG_LEVEL_DUMP))
+        return false;
+    return packet_dump_counter++ % n == 0;
+}
+
+void flushLog()
+{
+    if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE) || log_forked_child)
+        return;
+    // 最多等待 1 秒, 以免在日志无法写出时永远阻塞
+    for(int i = 0; i < 1000 && !ringsEmpty(); i++)
+    {
+        wakeLogThread(true);
+        usleep(1000);
+    }
+}
+
+void logWrite(int fd, bool block, const char* fmt, ...)
+{
+    if(!log_tid)
+        log_tid = syscall(SYS_gettid);
+
+    char line[LOG_LINE_MAX];
+    size_t len = static_cast<size_t>(snprintf(line, sizeof(line), "(Thread %lx): ", log_tid));
+    // 为末尾的 LOG_SUFFIX 预留空间
+    size_t avail = sizeof(line) - len - sizeof(LOG_SUFFIX) + 1;
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = vsnprintf(line + len, avail, fmt, ap);
+    va_end(ap);
+    if(ret > 0)
+        len += static_cast<size_t>(ret) < avail ? static_cast<size_t>(ret) : avail - 1;
+    memcpy(line + len, LOG_SUFFIX, sizeof(LOG_SUFFIX) - 1);
+    len += sizeof(LOG_SUFFIX) - 1;
 
-// 全局日志输出锁，确保单个线程可以完整的输出一条语句
-MutexLock global_log_lock;
\ No newline at end of file
+    if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE) || log_forked_child
+        || !pushRecord(fd, line, len, block || __atomic_load_n(&info_full_policy, __ATOMIC_RELAXED) == LOG_FULL_BLOCK))
+        writeAll(fd, line, len);
+}
@@ -2,10 +2,8 @@
 #define LOG_H
 
 #include <cstdio>
+#include <cstdlib>
 #include <unistd.h>
-#include <sys/syscall.h>
-
-#include "MutexLock.h"
 
 #define cRST "\x1b[0m"      // 终端红色字体代码
 #define cLRD "\x1b[1;91m"   // 终端重置字体颜色代码
@@ -13,59 +11,127 @@
 #define cBRI "\x1b[1;97m"   // 终端加粗白色字体代码
 #define cLBL "\x1b[1;94m"   // 终端蓝色字体代码
 
-// 全局日志输出锁
-extern MutexLock global_log_lock;
+/**
+ * 日志默认以同步的方式直接写入 stdout / stderr. 调用 startLogThread 之后改为异步输出:
+ * 每个线程将格式化后的日志写入自己的无锁环形缓冲区, 由一个后台线程统一取出, 以 writev 批量写入
+ * 因此记录日志时既不需要全局锁, 也不需要系统调用. 同一线程的日志保持原有的顺序
+ */
+
+// 缓冲区已满时的处理方式
+enum LogFullPolicy {
+    LOG_FULL_DROP,      // 丢弃该条日志, 由后台线程稍后输出被丢弃的条数
+    LOG_FULL_BLOCK      // 等待后台线程腾出空间
+};
+
+/**
+ * @brief 启动后台日志线程, 此后的日志以异步的方式输出. 进程退出时会输出剩余的所有日志
+ * @note  fork 得到的子进程中没有后台线程, 因此子进程中的日志总是同步输出
+ */
+void startLogThread();
+
+/**
+ * @brief 设置 INFO 日志在缓冲区已满时的处理方式, 默认为丢弃. WARN / ERROR / FATAL 总是等待
+ */
+void setLogFullPolicy(LogFullPolicy policy);
+
+/**
+ * @brief 等待所有已经记录的日志输出完毕
+ */
+void flushLog();
 
-#if 1
-// 开启所有输出
+/**
+ * @brief 格式化并记录一条日志, 自动添加线程号前缀以及换行
+ * @param fd    输出的目标, STDOUT_FILENO 或者 STDERR_FILENO
+ * @param block 缓冲区已满时是否总是等待
+ */
+void logWrite(int fd, bool block, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+// 日志级别, 低于当前级别的日志不会被格式化, 其参数也不会被求值
+#define LOG_LEVEL_DUMP  0   // 请求与响应报文, 按照 setPacketDumpSampling 抽样输出
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+
+// 编译期的最低日志级别, 低于该级别的日志语句会被完全移除. 编译时可以通过 -DLOG_MIN_LEVEL=<level> 指定
+// FATAL 不受日志级别的影响
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DUMP
+#endif
+
+// 运行时的日志级别, 只能通过 setLogLevel 修改
+extern int log_level;
+
+/**
+ * @brief 设置运行时的日志级别, 默认为 LOG_LEVEL_DUMP, 即输出所有日志
+ */
+void setLogLevel(int level);
+
+/**
+ * @brief 该级别的日志当前是否会被输出
+ */
+inline bool isLogEnabled(int level)     { return level >= __atomic_load_n(&log_level, __ATOMIC_RELAXED); }
+
+/**
+ * @brief 设置报文的抽样比例, 每 n 个请求中只输出 1 个请求的报文, 0 表示不输出报文
+ */
+void setPacketDumpSampling(unsigned n);
+
+/**
+ * @brief 判断下一个请求是否需要输出报文. 每个线程独立计数, 不需要同步
+ */
+bool samplePacketDump();
+
+// 被移除的日志语句. 参数仍然会经过类型检查, 但不会被求值
+#define LOG_ELIDED(x...) do { if(0) logWrite(STDOUT_FILENO, false, x); } while (0)
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DUMP
+#define DUMP(x...) do { \
+    if(isLogEnabled(LOG_LEVEL_DUMP)) \
+        logWrite(STDOUT_FILENO, false, cLBL "[>] " cRST x); \
+  } while (0)
+#else
+#define DUMP(x...) LOG_ELIDED(x)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
 #define INFO(x...) do { \
-    MutexLockGuard log_guard(global_log_lock);    \
-    fprintf(stdout, "(Thread %lx): ", syscall(SYS_gettid));  \
-    fprintf(stdout, cLBL "[*] " cRST x); \
-    fprintf(stdout, cRST "\n"); \
-    fflush(stdout);    \
+    if(isLogEnabled(LOG_LEVEL_INFO)) \
+        logWrite(STDOUT_FILENO, false, cLBL "[*] " cRST x); \
   } while (0)
+#else
+#define INFO(x...) LOG_ELIDED(x)
+#endif
 
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARN
 #define WARN(x...) do { \
-    MutexLockGuard log_guard(global_log_lock);    \
-    fprintf(stderr, "(Thread %lx): ", syscall(SYS_gettid));  \
-    fprintf(stderr, cYEL "[!] " cBRI "WARNING: " cRST x); \
-    fprintf(stderr, cRST "\n");    \
-    fflush(stderr);    \
+    if(isLogEnabled(LOG_LEVEL_WARN)) \
+        logWrite(STDERR_FILENO, true, cYEL "[!] " cBRI "WARNING: " cRST x); \
   } while (0)
+#else
+#define WARN(x...) LOG_ELIDED(x)
+#endif
 
+#if LOG_MIN_LEVEL <= LOG_LEVEL_ERROR
 #define ERROR(x...) do { \
-    MutexLockGuard log_guard(global_log_lock);    \
-    fprintf(stderr, "(Thread %lx): ", syscall(SYS_gettid));  \
-    fprintf(stderr, cLRD "[-] " cRST x); \
-    fprintf(stderr, cRST "\n"); \
-    fflush(stderr);    \
+    if(isLogEnabled(LOG_LEVEL_ERROR)) \
+        logWrite(STDERR_FILENO, true, cLRD "[-] " cRST x); \
   } while (0)
+#else
+#define ERROR(x...) LOG_ELIDED(x)
+#endif
 
 #define FATAL(x...) do { \
-    MutexLockGuard log_guard(global_log_lock);    \
-    fprintf(stderr, "(Thread %lx): ", syscall(SYS_gettid));  \
-    fprintf(stderr, cRST cLRD "[-] PROGRAM ABORT : " cBRI x); \
-    fprintf(stderr, cLRD "\n         Location : " cRST "%s(), %s:%u\n\n", \
+    logWrite(STDERR_FILENO, true, cRST cLRD "[-] PROGRAM ABORT : " cBRI x); \
+    logWrite(STDERR_FILENO, true, cLRD "         Location : " cRST "%s(), %s:%u\n", \
          __FUNCTION__, __FILE__, __LINE__); \
-    fflush(stderr);    \
+    flushLog(); \
     abort(); \
   } while (0)
 
-#else
-
-// 关闭所有输出
-#define INFO(x...) 
-#define WARN(x...)
-#define ERROR(x...) 
-#define FATAL(x...) 
-
-#endif
-
 /**
  * @brief 调试用,表示某个代码区域不应该到达
  * @param x 可输出的信息
  */
 #define UNREACHABLE(x) FATAL("UNREACHABLE CODE");
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,246 @@
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+
+#include "Metrics.h"
+
+const char* const Metrics::CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8";
+
+// 会被单独统计的响应状态码, 其他的状态码统一记为 other
+static const int STATUS_CODES[] = { 200, 206, 304, 400, 404, 411, 416, 431, 500, 501, 505 };
+static const size_t STATUS_NUM = sizeof(STATUS_CODES) / sizeof(STATUS_CODES[0]) + 1;
+
+static const char* const METHOD_NAMES[Metrics::METHOD_NUM] = { "GET", "POST", "HEAD", "OTHER" };
+
+/**
+ * 延迟直方图与 HdrHistogram 类似, 采用对数-线性的分桶方式: 每个 2 的幂区间再均分为 2^LATENCY_SUB_BITS 个桶,
+ * 因此每个桶的相对误差不超过 1/2^LATENCY_SUB_BITS. 计算桶的编号只需要几条位运算指令
+ * 最后一个桶收集所有超出范围的值, 只会体现在 +Inf 中
+ */
+static const unsigned LATENCY_SUB_BITS = 2;
+static const size_t LATENCY_SUB_NUM = 1 << LATENCY_SUB_BITS;
+static const unsigned LATENCY_MAX_EXP = 26;     // 2^26 us 约为 67s
+static const size_t LATENCY_BUCKET_NUM = (LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) * LATENCY_SUB_NUM;
+
+// 一个线程的所有计数器. 前后的填充使其不会与其他线程的数据位于同一缓存行
+struct MetricsShard {
+    char head_pad[64];
+    uint64_t counters[Metrics::COUNTER_NUM];
+    uint64_t errors[Metrics::MAX_ERROR_TYPES];
+    uint64_t requests[Metrics::METHOD_NUM][STATUS_NUM];
+    uint64_t latency_buckets[Metrics::METHOD_NUM][LATENCY_BUCKET_NUM];
+    uint64_t latency_sum_us[Metrics::METHOD_NUM];
+    char tail_pad[64];
+    bool in_use;                // 是否有线程正在使用该分片
+    MetricsShard* next;         // 所有分片组成的链表, 只会在头部插入
+
+    MetricsShard() : counters(), errors(), requests(), latency_buckets(), latency_sum_us(),
+                     in_use(true), next(nullptr) {}
+};
+
+// 线程退出时归还其分片
+struct MetricsShardHolder {
+    MetricsShard* shard;
+    ~MetricsShardHolder()   { if(shard) __atomic_store_n(&shard->in_use, false, __ATOMIC_RELEASE); }
+};
+
+static MetricsShard* metrics_shards = nullptr;
+static thread_local MetricsShardHolder metrics_shard_holder = {nullptr};
+
+static MetricsShard* acquireShard()
+{
+    // 优先复用已经退出的线程所留下的分片, 其中的计数会被继续累加
+    MetricsShard* shard = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE);
+    for(; shard; shard = shard->next)
+    {
+        bool expected = false;
+        if(!__atomic_load_n(&shard->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&shard->in_use, &expected, true, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return shard;
+    }
+    shard = new MetricsShard();
+    shard->next = __atomic_load_n(&metrics_shards, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&metrics_shards, &shard->next, shard, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return shard;
+}
+
+static inline MetricsShard* getShard()
+{
+    if(!metrics_shard_holder.shard)
+        metrics_shard_holder.shard = acquireShard();
+    return metrics_shard_holder.shard;
+}
+
+/**
+ * @brief 每个计数器只由一个线程修改, 因此普通的读取加上原子的写入就足够了, 输出时也不会读到写了一半的值
+ */
+static inline void bump(uint64_t* counter, uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static size_t statusIndex(int status)
+{
+    for(size_t i = 0; i < STATUS_NUM - 1; i++)
+        if(STATUS_CODES[i] == status)
+            return i;
+    return STATUS_NUM - 1;
+}
+
+static size_t latencyBucket(uint64_t us)
+{
+    if(us < LATENCY_SUB_NUM)
+        return static_cast<size_t>(us);
+    unsigned exp = 63 - static_cast<unsigned>(__builtin_clzll(us));
+    size_t sub = static_cast<size_t>(us >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_NUM - 1);
+    size_t index = (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB_NUM + sub;
+    return index < LATENCY_BUCKET_NUM ? index : LATENCY_BUCKET_NUM - 1;
+}
+
+/**
+ * @brief 桶的上界(微秒, 不含), 即其中所有值都小于该值
+ */
+static uint64_t latencyBucketBound(size_t index)
+{
+    if(index < LATENCY_SUB_NUM)
+        return index + 1;
+    unsigned exp = static_cast<unsigned>(index / LATENCY_SUB_NUM) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = index % LATENCY_SUB_NUM;
+    return (LATENCY_SUB_NUM + sub + 1) << (exp - LATENCY_SUB_BITS);
+}
+
+uint64_t Metrics::nowMicros()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+}
+
+void Metrics::add(Counter counter, uint64_t value)
+{
+    bump(&getShard()->counters[counter], value);
+}
+
+void Metrics::addError(size_t type)
+{
+    if(type < MAX_ERROR_TYPES)
+        bump(&getShard()->errors[type], 1);
+}
+
+void Metrics::addRequest(Method method, int status, uint64_t latency_us)
+{
+    MetricsShard* shard = getShard();
+    bump(&shard->requests[method][statusIndex(status)], 1);
+    bump(&shard->latency_buckets[method][latencyBucket(latency_us)], 1);
+    bump(&shard->latency_sum_us[method], latency_us);
+}
+
+// 输出一行 Prometheus 文本
+static void appendLine(string& out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void appendLine(string& out, const char* fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if(len > 0)
+        out.append(line, static_cast<size_t>(len) < sizeof(line) ? static_cast<size_t>(len) : sizeof(line) - 1);
+}
+
+string Metrics::format(const char* const* error_names, size_t error_num)
+{
+    // 汇总所有线程的计数器. 各个计数器不是在同一时刻读取的, 但每个计数器自身总是单调递增的
+    MetricsShard total;
+    for(MetricsShard* shard = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); shard; shard = shard->next)
+    {
+        for(size_t i = 0; i < COUNTER_NUM; i++)
+            total.counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        for(size_t i = 0; i < MAX_ERROR_TYPES; i++)
+            total.errors[i] += __atomic_load_n(&shard->errors[i], __ATOMIC_RELAXED);
+        for(size_t m = 0; m < METHOD_NUM; m++)
+        {
+            for(size_t i = 0; i < STATUS_NUM; i++)
+                total.requests[m][i] += __atomic_load_n(&shard->requests[m][i], __ATOMIC_RELAXED);
+            for(size_t i = 0; i < LATENCY_BUCKET_NUM; i++)
+                total.latency_buckets[m][i] += __atomic_load_n(&shard->latency_buckets[m][i], __ATOMIC_RELAXED);
+            total.latency_sum_us[m] += __atomic_load_n(&shard->latency_sum_us[m], __ATOMIC_RELAXED);
+        }
+    }
+
+    string out;
+    static const struct {
+        Counter counter;
+        const char* name;
+        const char* help;
+    } counters[COUNTER_NUM] = {
+        { ACCEPTED_CONNECTIONS, "webserver_accepted_connections_total", "Connections accepted." },
+        { EMFILE_DROPS, "webserver_emfile_dropped_connections_total", "Connections dropped because no fd was available." },
+        { TIMEOUTS, "webserver_timeouts_total", "Connections closed by timeout." },
+        { CGI_RUNS, "webserver_cgi_runs_total", "CGI programs started." },
+        { CGI_TIMEOUTS, "webserver_cgi_timeouts_total", "CGI programs killed by timeout." },
+        { RECEIVED_BYTES, "webserver_received_bytes_total", "Bytes received from clients." },
+        { SENT_BYTES, "webserver_sent_bytes_total", "Bytes sent to clients." },
+        { HEAP_ALLOCATIONS, "webserver_heap_allocations_total", "Heap allocations made while handling connection events." },
+    };
+    for(size_t i = 0; i < COUNTER_NUM; i++)
+    {
+#ifdef NDEBUG
+        // 发布版本中不统计堆分配
+        if(counters[i].counter == HEAP_ALLOCATIONS)
+            continue;
+#endif
+        appendLine(out, "# HELP %s %s\n# TYPE %s counter\n", counters[i].name, counters[i].help, counters[i].name);
+        appendLine(out, "%s %lu\n", counters[i].name, total.counters[counters[i].counter]);
+    }
+
+    out += "# HELP webserver_errors_total Request handling errors by type.\n"
+           "# TYPE webserver_errors_total counter\n";
+    for(size_t i = 0; i < error_num && i < MAX_ERROR_TYPES; i++)
+        if(error_names[i])
+            appendLine(out, "webserver_errors_total{type=\"%s\"} %lu\n", error_names[i], total.errors[i]);
+
+    out += "# HELP webserver_requests_total Requests by method and response status.\n"
+           "# TYPE webserver_requests_total counter\n";
+    for(size_t m = 0; m < METHOD_NUM; m++)
+        for(size_t i = 0; i < STATUS_NUM; i++)
+        {
+            // 没有出现过的组合不输出, 以免产生大量的 0
+            if(!total.requests[m][i])
+                continue;
+            if(i < STATUS_NUM - 1)
+                appendLine(out, "webserver_requests_total{method=\"%s\",status=\"%d\"} %lu\n",
+                           METHOD_NAMES[m], STATUS_CODES[i], total.requests[m][i]);
+            else
+                appendLine(out, "webserver_requests_total{method=\"%s\",status=\"other\"} %lu\n",
+                           METHOD_NAMES[m], total.requests[m][i]);
+        }
+
+    out += "# HELP webserver_request_duration_seconds Time from parsing a request to queueing its response.\n"
+           "# TYPE webserver_request_duration_seconds histogram\n";
+    for(size_t m = 0; m < METHOD_NUM; m++)
+    {
+        uint64_t count = 0;
+        for(size_t i = 0; i < LATENCY_BUCKET_NUM; i++)
+            count += total.latency_buckets[m][i];
+        if(!count)
+            continue;
+        // Prometheus 的桶是累积的
+        uint64_t cumulative = 0;
+        for(size_t i = 0; i + 1 < LATENCY_BUCKET_NUM; i++)
+        {
+            cumulative += total.latency_buckets[m][i];
+            appendLine(out, "webserver_request_duration_seconds_bucket{method=\"%s\",le=\"%.6f\"} %lu\n",
+                       METHOD_NAMES[m], static_cast<double>(latencyBucketBound(i)) / 1e6, cumulative);
+        }
+        appendLine(out, "webserver_request_duration_seconds_bucket{method=\"%s\",le=\"+Inf\"} %lu\n",
+                   METHOD_NAMES[m], count);
+        appendLine(out, "webserver_request_duration_seconds_sum{method=\"%s\"} %.6f\n",
+                   METHOD_NAMES[m], static_cast<double>(total.latency_sum_us[m]) / 1e6);
+        appendLine(out, "webserver_request_duration_seconds_count{method=\"%s\"} %lu\n", METHOD_NAMES[m], count);
+    }
+    return out;
+}
@@ -0,0 +1,79 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+/**
+ * @brief 运行时的统计数据, 以 Prometheus 的文本格式输出
+ *        每个线程拥有自己的一份计数器, 只由该线程修改, 因此更新时既不需要加锁, 也不需要原子的读-改-写指令.
+ *        各个线程的计数器位于不同的缓存行中, 不存在伪共享. 只有在输出时才会将所有线程的计数器相加
+ * @note  线程退出后其计数器保留, 并由之后新建的线程继续使用, 因此统计结果不会减少
+ */
+class Metrics
+{
+public:
+    // 简单的计数器
+    enum Counter {
+        ACCEPTED_CONNECTIONS,   // 成功 accept 的连接个数
+        EMFILE_DROPS,           // 由于 fd 耗尽而直接关闭的连接个数
+        TIMEOUTS,               // 因为超时而被关闭的连接个数
+        CGI_RUNS,               // 执行 CGI 程序的次数
+        CGI_TIMEOUTS,           // CGI 程序因为超时而被杀死的次数
+        RECEIVED_BYTES,         // 接收的字节数
+        SENT_BYTES,             // 发送的字节数
+        HEAP_ALLOCATIONS,       // 处理连接事件时 operator new 的调用次数, 只有调试版本才会统计与输出
+        COUNTER_NUM
+    };
+
+    // 请求方式
+    enum Method {
+        METHOD_GET,
+        METHOD_POST,
+        METHOD_HEAD,
+        METHOD_OTHER,           // 不支持或者无法解析的请求方式
+        METHOD_NUM
+    };
+
+    // 可以统计的错误种类上限, 错误种类由调用者编号
+    static const size_t MAX_ERROR_TYPES = 16;
+
+    /**
+     * @brief 增加一个计数器的值
+     */
+    static void add(Counter counter, uint64_t value = 1);
+
+    /**
+     * @brief 记录一次错误
+     * @param type 错误的编号, 小于 MAX_ERROR_TYPES
+     */
+    static void addError(size_t type);
+
+    /**
+     * @brief 记录一个处理完成的请求
+     * @param method        请求方式
+     * @param status        响应的状态码
+     * @param latency_us    从开始解析请求到响应放入发送队列所经过的时间(微秒)
+     */
+    static void addRequest(Method method, int status, uint64_t latency_us);
+
+    /**
+     * @brief 获取单调递增的当前时间(us), 通过 vDSO 读取, 不会陷入内核
+     */
+    static uint64_t nowMicros();
+
+    /**
+     * @brief 汇总所有线程的计数器, 并以 Prometheus 的文本格式输出
+     * @param error_names   每个错误编号的名称, 为 nullptr 的错误不会被输出
+     * @param error_num     error_names 的元素个数
+     */
+    static string format(const char* const* error_names, size_t error_num);
+
+    // 输出时的 Content-type
+    static const char* const CONTENT_TYPE;
+};
+
+#endif
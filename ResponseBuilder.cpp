@@ -0,0 +1,40 @@
+#include "ResponseBuilder.h"
+
+// 00 ~ 99 的两位十进制表示
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+size_t ResponseBuilder::formatDecimal(char* buf, uint64_t num)
+{
+    // 从低位开始写入临时缓冲区的末尾, 最后整体复制到 buf 的起始位置
+    char tmp[MAX_DECIMAL_LEN];
+    char* pos = tmp + MAX_DECIMAL_LEN;
+    while(num >= 100)
+    {
+        size_t idx = static_cast<size_t>(num % 100) * 2;
+        num /= 100;
+        *--pos = digit_pairs[idx + 1];
+        *--pos = digit_pairs[idx];
+    }
+    if(num >= 10)
+    {
+        size_t idx = static_cast<size_t>(num) * 2;
+        *--pos = digit_pairs[idx + 1];
+        *--pos = digit_pairs[idx];
+    }
+    else
+        *--pos = static_cast<char>('0' + num);
+
+    size_t len = static_cast<size_t>(tmp + MAX_DECIMAL_LEN - pos);
+    memcpy(buf, pos, len);
+    return len;
+}
@@ -0,0 +1,72 @@
+#ifndef RESPONSEBUILDER_H
+#define RESPONSEBUILDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+/**
+ * @brief 在固定大小的栈上缓冲区中拼接响应头, 整个过程不会分配内存
+ *        超出容量的部分会被丢弃并标记为溢出, 由调用者决定如何处理
+ * @note  响应头中的字段都由服务器生成, 长度有限, 正常情况下不会溢出
+ */
+class ResponseBuilder
+{
+public:
+    static const size_t CAPACITY = 1024;
+    // 64 位无符号整数的最大十进制长度
+    static const size_t MAX_DECIMAL_LEN = 20;
+
+    ResponseBuilder() : len_(0), overflow_(false) {}
+
+    ResponseBuilder(const ResponseBuilder&) = delete;
+    ResponseBuilder& operator=(const ResponseBuilder&) = delete;
+
+    ResponseBuilder& append(const char* data, size_t len)
+    {
+        if(len > CAPACITY - len_)
+        {
+            overflow_ = true;
+            len = CAPACITY - len_;
+        }
+        memcpy(buf_ + len_, data, len);
+        len_ += len;
+        return *this;
+    }
+    ResponseBuilder& append(const char* str)    { return append(str, strlen(str)); }
+    ResponseBuilder& append(const string& str)  { return append(str.data(), str.size()); }
+
+    /**
+     * @brief 以十进制追加一个整数
+     */
+    ResponseBuilder& appendDecimal(uint64_t num)
+    {
+        char buf[MAX_DECIMAL_LEN];
+        return append(buf, formatDecimal(buf, num));
+    }
+
+    // 清空已经拼接的内容, 以便复用同一个缓冲区
+    void clear()                { len_ = 0; overflow_ = false; }
+
+    const char* data() const    { return buf_; }
+    size_t size() const         { return len_; }
+    // 是否有数据因为超出容量而被丢弃
+    bool overflow() const       { return overflow_; }
+
+    /**
+     * @brief 将整数格式化为十进制字符串, 每次处理两位数字, 不使用 printf 系列函数
+     * @param buf 输出缓冲区, 至少需要 MAX_DECIMAL_LEN 字节, 结果末尾不包含 '\0'
+     * @return 输出的字符个数
+     */
+    static size_t formatDecimal(char* buf, uint64_t num);
+
+private:
+    char buf_[CAPACITY];
+    size_t len_;
+    bool overflow_;
+};
+
+#endif
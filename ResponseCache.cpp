@@ -0,0 +1,170 @@
+#include <cstring>
+#include <functional>
+
+#include "Log.h"
+#include "ResponseCache.h"
+
+// count-min sketch 每一行所使用的哈希乘数
+static const uint64_t SKETCH_SEEDS[] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+ResponseCache::Shard::Shard()
+    : cond(lock), window_bytes(0), main_bytes(0), samples(0)
+{
+    memset(sketch, 0, sizeof(sketch));
+}
+
+ResponseCache::ResponseCache(size_t byte_budget)
+{
+    size_t shard_budget = byte_budget / SHARD_NUM;
+    // 与 W-TinyLFU 一样, 窗口只占总容量的 1%
+    window_budget_ = shard_budget / 100;
+    main_budget_ = shard_budget - window_budget_;
+    INFO("ResponseCache: %lu bytes per shard, %lu bytes window", shard_budget, window_budget_);
+}
+
+uint64_t ResponseCache::hashKey_(const string& key)
+{
+    return static_cast<uint64_t>(hash<string>()(key));
+}
+
+void ResponseCache::recordAccess_(Shard& shard, uint64_t hash)
+{
+    for(size_t i = 0; i < SKETCH_DEPTH; i++)
+    {
+        uint8_t& counter = shard.sketch[i][(hash * SKETCH_SEEDS[i]) >> (64 - SKETCH_WIDTH_BITS)];
+        if(counter < 15)
+            ++counter;
+    }
+    // 周期性地将所有计数器减半
+    if(++shard.samples >= SKETCH_SAMPLE_SIZE)
+    {
+        for(size_t i = 0; i < SKETCH_DEPTH; i++)
+            for(size_t j = 0; j < SKETCH_WIDTH; j++)
+                shard.sketch[i][j] >>= 1;
+        shard.samples /= 2;
+    }
+}
+
+unsigned ResponseCache::frequency_(Shard& shard, uint64_t hash)
+{
+    unsigned freq = 15;
+    for(size_t i = 0; i < SKETCH_DEPTH; i++)
+    {
+        unsigned counter = shard.sketch[i][(hash * SKETCH_SEEDS[i]) >> (64 - SKETCH_WIDTH_BITS)];
+        if(counter < freq)
+            freq = counter;
+    }
+    return freq;
+}
+
+ResponseCache::EntryPtr ResponseCache::get(const string& key, bool* should_load)
+{
+    *should_load = false;
+    uint64_t hash = hashKey_(key);
+    Shard& shard = getShard_(hash);
+    MutexLockGuard guard(shard.lock);
+    // 未命中也需要记录, 以便多次访问的文件能够通过准入
+    recordAccess_(shard, hash);
+
+    auto iter = shard.index.find(key);
+    if(iter != shard.index.end())
+    {
+        list<Node>::iterator node = iter->second;
+        // 文件已经被修改或者离开了 FileCache, 当作未命中处理
+        if(!node->entry->stale_flag->isStale())
+        {
+            list<Node>& lru = node->in_main ? shard.main : shard.window;
+            lru.splice(lru.begin(), lru, node);
+            return node->entry;
+        }
+        INFO("ResponseCache: drop stale [%s]", key.c_str());
+        remove_(shard, node);
+    }
+
+    auto flight_iter = shard.flights.find(key);
+    if(flight_iter == shard.flights.end())
+    {
+        // 由当前线程负责加载
+        shard.flights[key] = make_shared<Flight>();
+        *should_load = true;
+        return nullptr;
+    }
+    // 其他线程正在加载同一个文件, 等待其完成. 加载只涉及一个小文件的读取, 因此等待时间很短
+    shared_ptr<Flight> flight = flight_iter->second;
+    while(!flight->done)
+        shard.cond.wait();
+    return flight->result;
+}
+
+void ResponseCache::complete(const string& key, const EntryPtr& entry)
+{
+    uint64_t hash = hashKey_(key);
+    Shard& shard = getShard_(hash);
+    MutexLockGuard guard(shard.lock);
+
+    auto flight_iter = shard.flights.find(key);
+    if(flight_iter != shard.flights.end())
+    {
+        flight_iter->second->done = true;
+        flight_iter->second->result = entry;
+        shard.flights.erase(flight_iter);
+        shard.cond.notifyAll();
+    }
+
+    // 加载期间文件已经失效, 或者该文件过大, 则不放入缓存
+    if(!entry || entry->stale_flag->isStale())
+        return;
+    size_t charge = key.size() + entry->response[0].size() + entry->response[1].size();
+    if(charge > main_budget_)
+        return;
+    auto iter = shard.index.find(key);
+    if(iter != shard.index.end())
+        remove_(shard, iter->second);
+    insert_(shard, Node{key, hash, entry, charge, false});
+}
+
+void ResponseCache::insert_(Shard& shard, Node&& node)
+{
+    shard.window_bytes += node.charge;
+    shard.window.push_front(std::move(node));
+    shard.index[shard.window.front().key] = shard.window.begin();
+    while(shard.window_bytes > window_budget_ && !shard.window.empty())
+        admit_(shard, prev(shard.window.end()));
+}
+
+void ResponseCache::admit_(Shard& shard, list<Node>::iterator candidate)
+{
+    while(shard.main_bytes + candidate->charge > main_budget_ && !shard.main.empty())
+    {
+        list<Node>::iterator victim = prev(shard.main.end());
+        // 已经失效的条目总是优先被淘汰
+        if(!victim->entry->stale_flag->isStale()
+            && frequency_(shard, candidate->hash) <= frequency_(shard, victim->hash))
+        {
+            remove_(shard, candidate);
+            return;
+        }
+        remove_(shard, victim);
+    }
+    shard.window_bytes -= candidate->charge;
+    shard.main_bytes += candidate->charge;
+    candidate->in_main = true;
+    shard.main.splice(shard.main.begin(), shard.window, candidate);
+}
+
+void ResponseCache::remove_(Shard& shard, list<Node>::iterator iter)
+{
+    shard.index.erase(iter->key);
+    if(iter->in_main)
+    {
+        shard.main_bytes -= iter->charge;
+        shard.main.erase(iter);
+    }
+    else
+    {
+        shard.window_bytes -= iter->charge;
+        shard.window.erase(iter);
+    }
+}
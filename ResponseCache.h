@@ -0,0 +1,135 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "Condition.h"
+#include "FileCache.h"
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief 小文件的完整响应报文缓存, 以请求路径为键, 缓存序列化后的响应头与文件内容
+ *        命中缓存时, 处理请求只需要一次哈希查找以及一次发送, 不需要访问文件系统
+ * @note  缓存按照字节数限制大小, 并使用 W-TinyLFU 的准入策略:
+ *        新条目先放入一个小的窗口 LRU 中, 被挤出窗口时, 只有当其访问频率(由 count-min sketch 估计)
+ *        高于主 LRU 中即将被淘汰的条目时才能进入主 LRU. 因此一次性的大量扫描(例如爬虫)无法冲刷掉热点文件
+ * @note  同一个文件同时未命中时, 只有一个线程负责加载 (single-flight), 其他线程等待其加载完成
+ * @note  条目与 FileCache 中对应的条目共享失效标志, 文件被修改或者离开 FileCache 时, 该条目随之失效
+ */
+class ResponseCache
+{
+public:
+    // 一个文件的完整响应报文. 创建后不再修改, 因此可以在多个线程之间共享, 并直接作为发送队列中的数据
+    struct Entry {
+        string response[2];         // GET 请求的完整响应报文, 下标表示是否为持续连接
+        size_t header_len[2];       // 响应头的长度, HEAD 请求只发送响应头
+        shared_ptr<FileCache::StaleFlag> stale_flag;    // 与 FileCache 条目共享的失效标志
+    };
+    typedef shared_ptr<const Entry> EntryPtr;
+
+    // 能够放入缓存的最大文件大小
+    static const size_t MAX_OBJECT_SIZE = 64 * 1024;
+
+    /**
+     * @brief 创建响应缓存
+     * @param byte_budget 所有响应报文的总字节数上限
+     */
+    explicit ResponseCache(size_t byte_budget);
+
+    /**
+     * @brief 查询缓存, 并记录一次访问
+     * @param key         请求路径
+     * @param should_load 未命中且没有其他线程正在加载时被设置为 true, 此时调用者必须在之后调用 complete;
+     *                    若其他线程正在加载, 则阻塞等待其完成, 并返回其加载结果
+     * @return 命中则返回对应的条目, 否则返回 nullptr
+     */
+    EntryPtr get(const string& key, bool* should_load);
+
+    /**
+     * @brief 结束一次加载, 唤醒等待的线程, 并尝试将条目放入缓存
+     * @param key   请求路径
+     * @param entry 加载的结果, nullptr 表示该文件无法缓存
+     */
+    void complete(const string& key, const EntryPtr& entry);
+
+    /**
+     * @brief 大小为 size 的文件是否可以放入缓存
+     */
+    bool isCacheable(size_t size)   { return size <= MAX_OBJECT_SIZE && 2 * size < main_budget_; }
+
+private:
+    static const size_t SHARD_NUM = 16;
+    // count-min sketch 的行数与每行的计数器个数, 每个计数器最大为 15
+    static const size_t SKETCH_DEPTH = 4;
+    static const size_t SKETCH_WIDTH_BITS = 12;
+    static const size_t SKETCH_WIDTH = 1 << SKETCH_WIDTH_BITS;
+    // 记录的访问次数达到该值时, 所有计数器减半, 使得过去的热点逐渐冷却
+    static const size_t SKETCH_SAMPLE_SIZE = 10 * SKETCH_WIDTH;
+
+    // 缓存中的一个条目
+    struct Node {
+        string key;
+        uint64_t hash;      // key 的哈希值, 用于查询访问频率
+        EntryPtr entry;
+        size_t charge;      // 该条目所占用的字节数
+        bool in_main;       // 位于主 LRU 还是窗口 LRU 中
+    };
+
+    // 一次正在进行的加载
+    struct Flight {
+        bool done;
+        EntryPtr result;
+        Flight() : done(false) {}
+    };
+
+    // 一个分片: 窗口 LRU、主 LRU、访问频率以及正在进行的加载
+    struct Shard {
+        MutexLock lock;
+        Condition cond;     // 等待加载完成
+        list<Node> window;
+        list<Node> main;
+        size_t window_bytes;
+        size_t main_bytes;
+        unordered_map<string, list<Node>::iterator> index;
+        unordered_map<string, shared_ptr<Flight>> flights;
+        uint8_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+        size_t samples;
+
+        Shard();
+    };
+
+    Shard shards_[SHARD_NUM];
+    size_t window_budget_;      // 每个分片窗口 LRU 的字节数上限
+    size_t main_budget_;        // 每个分片主 LRU 的字节数上限
+
+    static uint64_t hashKey_(const string& key);
+    Shard& getShard_(uint64_t hash)     { return shards_[hash % SHARD_NUM]; }
+
+    // 在 count-min sketch 中记录一次访问 / 估计访问频率. 调用者需持有分片的锁
+    void recordAccess_(Shard& shard, uint64_t hash);
+    unsigned frequency_(Shard& shard, uint64_t hash);
+
+    /**
+     * @brief 将新条目放入窗口 LRU, 并将被挤出窗口的条目交给 admit_
+     */
+    void insert_(Shard& shard, Node&& node);
+
+    /**
+     * @brief 决定被挤出窗口的条目 candidate 能否进入主 LRU
+     * @note  主 LRU 已满时, 与其最久未使用的条目比较访问频率, 频率较低者被淘汰
+     */
+    void admit_(Shard& shard, list<Node>::iterator candidate);
+
+    /**
+     * @brief 从缓存中移除一个条目
+     */
+    void remove_(Shard& shard, list<Node>::iterator iter);
+};
+
+#endif
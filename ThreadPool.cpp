@@ -1,22 +1,128 @@
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include "Log.h"
 #include "ThreadPool.h"
 #include "Utils.h"
 
-ThreadPool::ThreadPool(size_t threadNum, ShutdownMode shutdown_mode, size_t maxQueueSize)
+// 当前线程在线程池中的编号
+static thread_local int current_worker = -1;
+
+/**
+ * @brief 自旋等待时降低 CPU 占用
+ */
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static void futexWait(uint32_t* addr, uint32_t expected)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+static void futexWake(uint32_t* addr, int num)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, num, nullptr, nullptr, 0);
+}
+
+ThreadPool::TaskRing::TaskRing(size_t capacity)
+        : enqueue_pos_(0), dequeue_pos_(0)
+{
+    // 队列大小取为 2 的幂, 这样序号只需要与 mask_ 相与即可得到位置
+    size_t size = 2;
+    while(size < capacity)
+        size <<= 1;
+    slots_.resize(size);
+    mask_ = size - 1;
+    // 位置 i 在第一轮中可以被序号为 i 的入队操作写入
+    for(size_t i = 0; i < size; i++)
+        slots_[i].seq = i;
+}
+
+bool ThreadPool::TaskRing::push(const ThreadpoolTask& task)
+{
+    size_t pos = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        Slot& slot = slots_[pos & mask_];
+        size_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        // 该位置空闲, 尝试占用序号 pos. 失败时 pos 会被更新为最新的值
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&enqueue_pos_, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                slot.task = task;
+                // 通知消费者该位置已经写入完成
+                __atomic_store_n(&slot.seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+        // 该位置上一轮的数据还没有被取走, 即队列已满
+        else if(diff < 0)
+            return false;
+        // 其他生产者已经占用了该序号
+        else
+            pos = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+    }
+}
+
+bool ThreadPool::TaskRing::pop(ThreadpoolTask& task)
+{
+    size_t pos = __atomic_load_n(&dequeue_pos_, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        Slot& slot = slots_[pos & mask_];
+        size_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+        // 该位置已经写入完成, 尝试取走序号 pos
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&dequeue_pos_, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                task = slot.task;
+                // 该位置可以被下一轮的生产者写入
+                __atomic_store_n(&slot.seq, pos + mask_ + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+        // 该位置还没有被写入, 即队列为空
+        else if(diff < 0)
+            return false;
+        // 其他消费者已经取走了该序号
+        else
+            pos = __atomic_load_n(&dequeue_pos_, __ATOMIC_RELAXED);
+    }
+}
+
+ThreadPool::ThreadPool(size_t threadNum, ShutdownMode shutdown_mode, size_t maxQueueSize,
+                       SchedulePolicy policy)
         : threadNum_(threadNum),
-          maxQueueSize_(maxQueueSize), 
-          // 使用 类成员变量 threadpool_mutex_ 来初始化 threadpool_cond_
-          threadpool_cond_(threadpool_mutex_), 
+          task_queue_(maxQueueSize),
+          policy_(policy),
+          spin_count_(sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_COUNT : 0),
+          next_wake_(0),
           shutdown_mode_(shutdown_mode)
 {
-    // 开始循环创建线程 
-    while(threads_.size() < threadNum_)
+    // 线程启动后会访问其他线程的队列, 因此先创建所有的 Worker
+    for(size_t i = 0; i < threadNum_; i++)
+        workers_.push_back(unique_ptr<Worker>(new Worker(this, static_cast<int>(i))));
+    // 开始循环创建线程
+    for(size_t i = 0; i < threadNum_; )
     {
-        pthread_t thread;
-        // 如果线程创建成功,则将其压入栈内存中
-        if(!pthread_create(&thread, nullptr, TaskForWorkerThreads_, this))
+        // 如果线程创建成功,则继续创建下一个
+        if(!pthread_create(&workers_[i]->thread, nullptr, TaskForWorkerThreads_, workers_[i].get()))
         {
-            threads_.push_back(thread);
+            i++;
             // // 注意这里只修改已启动的线程数量
             // startedThreadNum_++;
         }
@@ -25,84 +131,153 @@ ThreadPool::ThreadPool(size_t threadNum, ShutdownMode shutdown_mode, size_t maxQ
 
 ThreadPool::~ThreadPool()
 {
-    // 向任务队列中添加退出线程事件,注意上锁
-    // 注意在 cond 使用之前一定要上 mutex
+    // 如果需要立即关闭当前的线程池,则先将当前队列清空
+    if(shutdown_mode_ == IMMEDIATE_SHUTDOWN)
     {
-        // 操作 task_queue_ 时一定要上锁
-        MutexLockGuard guard(threadpool_mutex_);
-        // 如果需要立即关闭当前的线程池,则
-        if(shutdown_mode_ == IMMEDIATE_SHUTDOWN)
-            // 先将当前队列清空
-            while(!task_queue_.empty())
-                task_queue_.pop();
-
-        // 往任务队列中添加退出线程任务
+        ThreadpoolTask task;
+        while(task_queue_.pop(task))
+            ;
         for(size_t i = 0; i < threadNum_; i++)
-        {
-            auto pthreadExit = [](void*) { pthread_exit(0); };
-            ThreadpoolTask task = { pthreadExit, nullptr };
-            task_queue_.push(task);
-        }
-        // 唤醒所有线程以执行退出操作
-        threadpool_cond_.notifyAll();
+            while(workers_[i]->local_queue.pop(task))
+                ;
+    }
+
+    // 往共享队列中添加退出线程任务, 队列已满时等待工作线程取走事件
+    // 每个线程执行一个退出任务后就会退出, 因此每个线程恰好执行一个
+    auto pthreadExit = [](void*) { pthread_exit(0); };
+    ThreadpoolTask task = { pthreadExit, nullptr, -1 };
+    for(size_t i = 0; i < threadNum_; i++)
+    {
+        while(!task_queue_.push(task))
+            sched_yield();
+        wakeWorkers_(1);
     }
     for(size_t i = 0; i < threadNum_; i++)
     {
         // 回收线程资源
-        pthread_join(threads_[i], nullptr);
+        pthread_join(workers_[i]->thread, nullptr);
     }
 }
 
-bool ThreadPool::appendTask(void (*function)(void*), void* arguments)
+int ThreadPool::getCurrentWorker()
 {
-    // 由于会操作事件队列,因此需要上锁
-    MutexLockGuard guard(threadpool_mutex_);
-    // 如果队列长度过长,则将当前task丢弃
-    if(task_queue_.size() > maxQueueSize_)
+    return current_worker;
+}
+
+bool ThreadPool::wakeWorker_(Worker& worker)
+{
+    // 只有将 sleeping 由 true 改为 false 的一方才需要唤醒, 以免重复执行系统调用
+    if(!__atomic_load_n(&worker.sleeping, __ATOMIC_RELAXED)
+        || !__atomic_exchange_n(&worker.sleeping, false, __ATOMIC_ACQ_REL))
         return false;
-    else
+    __atomic_add_fetch(&worker.wake_seq, 1, __ATOMIC_RELEASE);
+    futexWake(&worker.wake_seq, 1);
+    return true;
+}
+
+void ThreadPool::wakeWorkers_(size_t num)
+{
+    // 与 waitTask_ 中的屏障配对: 要么工作线程在休眠前看到新的事件, 要么这里看到休眠中的线程
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    size_t start = __atomic_fetch_add(&next_wake_, 1, __ATOMIC_RELAXED);
+    for(size_t i = 0; i < threadNum_ && num > 0; i++)
+        if(wakeWorker_(*workers_[(start + i) % threadNum_]))
+            num--;
+}
+
+bool ThreadPool::appendTask(void (*function)(void*), void* arguments, int affinity)
+{
+    ThreadpoolTask task = { function, arguments, affinity };
+    return appendTasks(&task, 1) == 1;
+}
+
+size_t ThreadPool::appendTasks(const ThreadpoolTask* tasks, size_t num)
+{
+    size_t appended = 0;
+    // 需要唤醒任意一个线程来处理的 task 个数
+    size_t wake_num = 0;
+    for(; appended < num; appended++)
     {
-        // 添加task至列表中
-        ThreadpoolTask task = { function, arguments };
-        task_queue_.push(task);
-        // 每当有新事件进入之时,只唤醒一个等待线程
-        threadpool_cond_.notify();
-        return true;
+        const ThreadpoolTask& task = tasks[appended];
+        int affinity = task.affinity;
+        if(policy_ == WORK_STEALING && affinity >= 0 && static_cast<size_t>(affinity) < threadNum_
+            && workers_[affinity]->local_queue.push(task))
+        {
+            Worker& worker = *workers_[affinity];
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            // 目标线程正在休眠则唤醒它; 正在执行其他事件时, 再唤醒一个空闲线程来窃取, 以免该 task 等待过久
+            // 目标线程正在自旋时, 它很快就会取走该 task
+            if(!wakeWorker_(worker) && __atomic_load_n(&worker.busy, __ATOMIC_RELAXED))
+                wake_num++;
+        }
+        // 如果队列已满,则将剩余的task丢弃, 由调用者处理
+        else if(task_queue_.push(task))
+            wake_num++;
+        else
+            break;
     }
+    if(wake_num > 0)
+        wakeWorkers_(wake_num);
+    return appended;
 }
 
-void* ThreadPool::TaskForWorkerThreads_(void* arg)
+bool ThreadPool::tryGetTask_(Worker& worker, ThreadpoolTask& task)
+{
+    if(policy_ == SHARED_QUEUE)
+        return task_queue_.pop(task);
+    if(worker.local_queue.pop(task) || task_queue_.pop(task))
+        return true;
+    // 从其他线程的队列中窃取, 取走的是其中等待最久的 task
+    for(size_t i = 1; i < threadNum_; i++)
+        if(workers_[(worker.index + i) % threadNum_]->local_queue.pop(task))
+            return true;
+    return false;
+}
+
+ThreadPool::ThreadpoolTask ThreadPool::waitTask_(Worker& worker)
 {
-    ThreadPool* pool = (ThreadPool*)arg;
-    // 启动当前线程
     ThreadpoolTask task;
-    // 对于子线程来说,事件循环开始
     for(;;)
     {
-        // 首先获取事件
+        // 先自旋一段时间, 突发的请求通常很快就会到来
+        for(int i = 0; i < spin_count_; i++)
         {
-            // 获取事件时需要上个锁
-            MutexLockGuard guard(pool->threadpool_mutex_);
-
-            /** 
-             * 如果好不容易获得到锁了,但是没有事件可以执行
-             * 则陷入沉睡,释放锁,并等待唤醒
-             * NOTE: 注意, pthread_cond_signal 会唤醒至少一个线程
-             *       也就是说,可能存在被唤醒的线程仍然没有事件处理的情况
-             *       这时只需循环wait即可.
-             */ 
-            while(pool->task_queue_.size() == 0)
-                pool->threadpool_cond_.wait();
-            // 唤醒后一定有事件
-            assert(pool->task_queue_.size() != 0);
-            task = pool->task_queue_.front();
-            pool->task_queue_.pop();
+            if(tryGetTask_(worker, task))
+                return task;
+            cpuRelax();
         }
+
+        // 记录休眠前的唤醒序号, 此后发生的唤醒会使 futexWait 立即返回
+        uint32_t seq = __atomic_load_n(&worker.wake_seq, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&worker.sleeping, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        // 声明休眠之后再检查一次, 以免错过在此之前添加的事件
+        bool got = tryGetTask_(worker, task);
+        if(!got)
+            futexWait(&worker.wake_seq, seq);
+        __atomic_store_n(&worker.sleeping, false, __ATOMIC_RELAXED);
+        if(got)
+            return task;
+    }
+}
+
+void* ThreadPool::TaskForWorkerThreads_(void* arg)
+{
+    Worker* worker = static_cast<Worker*>(arg);
+    ThreadPool* pool = worker->pool;
+    current_worker = worker->index;
+    // 对于子线程来说,事件循环开始
+    for(;;)
+    {
+        // 首先获取事件, 没有事件时自旋或者休眠
+        ThreadpoolTask task = pool->waitTask_(*worker);
         // 执行事件
+        __atomic_store_n(&worker->busy, true, __ATOMIC_RELAXED);
         (task.function)(task.arguments);
+        __atomic_store_n(&worker->busy, false, __ATOMIC_RELAXED);
     }
     // 注意: UNREACHABLE, 控制流不可能会到达此处
     // 因为线程的退出不会走这条控制流,而是执行退出事件
     UNREACHABLE();
     return nullptr;
-}
\ No newline at end of file
+}
@@ -2,29 +2,56 @@
 #define THREADPOOL_H
 
 #include <cassert>
-#include <queue>
-
-#include "Condition.h"
-#include "MutexLock.h"
+#include <cstdint>
+#include <memory>
+#include <pthread.h>
+#include <vector>
 
 using namespace std;
 
+/**
+ * @brief 线程池. 事件队列是有界的无锁多生产者多消费者环形队列, 添加与获取事件时都不需要加锁
+ *        空闲的工作线程先自旋一段时间, 仍然没有事件时才通过 futex 休眠.
+ *        只有存在休眠的线程时, 添加事件的一方才需要执行系统调用唤醒它们
+ *        根据调度方式的不同, 其有两种工作模式:
+ *          1. 共享队列 (SHARED_QUEUE):
+ *             所有事件放入同一个队列, 由任意一个空闲的线程取出
+ *          2. 工作窃取 (WORK_STEALING):
+ *             每个线程额外拥有一个自己的队列, 指定了 affinity 的事件优先放入对应线程的队列,
+ *             使同一个连接的请求尽量由同一个线程处理, 以复用其缓存中的连接状态.
+ *             线程优先处理自己队列中的事件, 其次是共享队列, 最后从其他线程的队列中窃取
+ */
 class ThreadPool
 {
 public:
     // 线程池摧毁时,当前正在工作的线程是等待工作完成后退出(graceful) 还是直接退出(immediate)
     enum ShutdownMode { GRACEFUL_QUIT, IMMEDIATE_SHUTDOWN } ;
+    // 事件的调度方式
+    enum SchedulePolicy { SHARED_QUEUE, WORK_STEALING };
+
+    /***
+     * 每个线程的基本事件单元
+     */
+    struct ThreadpoolTask
+    {
+        void (*function)(void*);
+        void* arguments;
+        int affinity;       // 优先处理该事件的线程编号, -1 表示不指定. 只在工作窃取模式下有效
+    };
+
     /***
      * @brief   创建线程池
      * @param   threadNum       线程池线程个数
      * @param   shutdown_mode   当前线程池的摧毁方案
-     * @param   maxQueueSize    线程池事件队列最大大小, 默认不设限制(-1)
+     * @param   maxQueueSize    线程池共享事件队列最大大小, 向上取整为 2 的幂
+     * @param   policy          事件的调度方式
      */
-    ThreadPool( size_t threadNum, 
+    ThreadPool( size_t threadNum,
                 ShutdownMode shutdown_mode = GRACEFUL_QUIT,
-                size_t maxQueueSize = -1
+                size_t maxQueueSize = 65536,
+                SchedulePolicy policy = SHARED_QUEUE
     );
-    
+
     /***
      * @brief   销毁线程池
      */
@@ -36,49 +63,132 @@ public:
      * @return  返回添加结果, true 表示添加成功, false 表示队列已满, 添加失败
      * @note    这里的 arguments 指针指向的对象,将 **不会** 在子线程内部事件执行完成后自动释放
      *          也就是说,外部调用者需要自己考虑到内存释放
-     */ 
-    bool appendTask(void (*function)(void*), void* arguments);
+     */
+    bool appendTask(void (*function)(void*), void* arguments, int affinity = -1);
+
+    /***
+     * @brief   批量添加 task, 所有 task 添加完成后才唤醒休眠的线程
+     * @param   tasks   待处理的 task 数组
+     * @param   num     task 的个数
+     * @return  成功添加的 task 个数. 队列已满时, 从 tasks[返回值] 开始的 task 均未被添加
+     * @note    指定线程的队列已满时, task 会被放入共享队列
+     */
+    size_t appendTasks(const ThreadpoolTask* tasks, size_t num);
+
+    /***
+     * @brief   获取当前线程在线程池中的编号, 不是线程池中的线程则返回 -1
+     * @note    可以作为之后相关事件的 affinity
+     */
+    static int getCurrentWorker();
 
     // /**
     //  * @brief 声明一些获取线程池属性的方法.不管有没有用到,实现一下接口总是没错的.
-    //  */ 
+    //  */
     // size_t getThreadNum()           { return threadNum_; }
     // size_t getWorkingThreadNum()    { return workingThreadNum_; }
     // size_t getIdleThreadNum()       { return idleThreadNum_; }
     // size_t getStartedThreadNum()    { return startedThreadNum_; }
 
 private:
+    // 空闲线程休眠之前尝试获取事件的次数. 只有一个 CPU 时自旋没有意义, 不会自旋
+    static const int SPIN_COUNT = 256;
+    // 每个线程自己的队列大小
+    static const size_t LOCAL_QUEUE_SIZE = 256;
+
     /**
-     * @brief 每个子线程所要执行的函数, 在该函数中轮询事件队列
-     * @param pool 当前线程所属的线程池
-     */ 
-    static void* TaskForWorkerThreads_(void* arg);
+     * @brief 有界的无锁多生产者多消费者环形队列
+     *        每个位置的 seq 与入队/出队的序号比较, 以判断该位置当前能否写入或者读取
+     */
+    class TaskRing
+    {
+    public:
+        /**
+         * @param capacity 队列大小, 向上取整为 2 的幂
+         */
+        explicit TaskRing(size_t capacity);
+
+        /**
+         * @brief 无锁地将 task 放入队列 / 从队列中取出 task
+         * @return 队列已满 / 为空时返回 false
+         */
+        bool push(const ThreadpoolTask& task);
+        bool pop(ThreadpoolTask& task);
+
+    private:
+        struct Slot
+        {
+            size_t seq;
+            ThreadpoolTask task;
+        };
+
+        vector<Slot> slots_;                    // 大小为 2 的幂
+        size_t mask_;                           // slots_.size() - 1
+        char queue_pad_[64];
+        size_t enqueue_pos_;                    // 下一个入队的序号, 只增不减
+        char enqueue_pad_[64];                  // 避免入队与出队的序号位于同一缓存行
+        size_t dequeue_pos_;                    // 下一个出队的序号, 只增不减
+        char dequeue_pad_[64];
+    };
 
-    /***
-     * 每个线程的基本事件单元
+    /**
+     * @brief 一个工作线程的状态
      */
-    struct ThreadpoolTask
+    struct Worker
     {
-        void (*function)(void*);
-        void* arguments;
+        ThreadPool* pool;
+        int index;                              // 线程编号
+        pthread_t thread;
+        TaskRing local_queue;                   // 只在工作窃取模式下使用
+        uint32_t wake_seq;                      // futex 字, 每次唤醒时递增, 避免错过休眠前的唤醒
+        bool sleeping;                          // 是否正在休眠或准备休眠, 唤醒者将其置为 false 以避免重复唤醒
+        bool busy;                              // 是否正在执行事件
+        char pad[64];
+
+        Worker(ThreadPool* p, int i) : pool(p), index(i), local_queue(LOCAL_QUEUE_SIZE),
+                                       wake_seq(0), sleeping(false), busy(false) {}
     };
 
+    /**
+     * @brief 每个子线程所要执行的函数, 在该函数中轮询事件队列
+     * @param arg 当前线程所对应的 Worker
+     */
+    static void* TaskForWorkerThreads_(void* arg);
+
+    /**
+     * @brief 依次尝试自己的队列, 共享队列以及其他线程的队列
+     */
+    bool tryGetTask_(Worker& worker, ThreadpoolTask& task);
+
+    /**
+     * @brief 获取一个 task, 队列为空时先自旋, 之后休眠等待
+     */
+    ThreadpoolTask waitTask_(Worker& worker);
+
+    /**
+     * @brief 若线程正在休眠, 则唤醒它
+     * @return 是否执行了唤醒
+     */
+    bool wakeWorker_(Worker& worker);
+
+    /**
+     * @brief 唤醒至多 num 个休眠中的线程
+     */
+    void wakeWorkers_(size_t num);
+
     size_t threadNum_;                          // 线程个数
 
     // size_t workingThreadNum_;                   // 正在工作的线程个数
     // size_t idleThreadNum_;                      // 空闲线程个数
     // size_t startedThreadNum_;                   // 已经启动的线程个数,注意已经启动的线程分为 正在工作 和 空闲 两类
 
-    size_t maxQueueSize_;                       // 事件队列最大长度,超出则停止添加新事件
-    queue<ThreadpoolTask> task_queue_;          // 事件队列
-
-    vector<pthread_t> threads_;                 // 线程的标识符
-
-    MutexLock threadpool_mutex_;                // 线程池的锁,保证每次最多只能有一个线程正在操作该线程池
-    Condition threadpool_cond_;                 // 线程池的条件变量,对于来新task时,唤醒空闲线程
+    TaskRing task_queue_;                       // 共享事件队列
+    vector<unique_ptr<Worker>> workers_;        // 所有的工作线程
+    SchedulePolicy policy_;                     // 事件的调度方式
+    int spin_count_;                            // 实际的自旋次数
+    size_t next_wake_;                          // 下一次唤醒时开始查找的线程编号, 使唤醒分散到各个线程
 
     ShutdownMode  shutdown_mode_;               // 线程池析构时,剩余工作线程的处理方式
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,79 +1,79 @@
-#include <unistd.h>
-
 #include "Log.h"
 #include "Timer.h"
-#include "Utils.h"
+#include "TimerWheel.h"
 
-Timer::Timer(int flag, time_t sec, long nsec) : timer_fd_(-1)
+Timer::Timer(TimerWheel* wheel, void (*callback)(void*), void* arg)
+    : wheel_(wheel), callback_(callback), arg_(arg),
+      prev_(nullptr), next_(nullptr), expire_ms_(0), slot_tick_(0), linked_(false)
 {
-    if(create(flag))
-        setTime(sec, nsec);
 }
 
 Timer::~Timer()
 {
-    cancel();
     destroy();
 }
 
-int Timer::getFd()
+bool Timer::isValid()
 {
-    return timer_fd_;
+    return wheel_ != nullptr;
 }
 
-void Timer::setFd(int fd)
+bool Timer::setTime(time_t sec, long nsec)
 {
-    timer_fd_ = fd;
+    if(!isValid())
+        return false;
+    // sec & nsec 同时为 0 表示关闭定时器
+    if(sec == 0 && nsec == 0)
+        wheel_->remove(this);
+    else
+        wheel_->add(this, sec * 1000 + nsec / 1000000);
+    return true;
 }
 
-bool Timer::isValid()
+bool Timer::cancel()
 {
-    return timer_fd_ >= 0;
+    return setTime(0, 0);
 }
 
-bool Timer::create(int flag)
+bool Timer::pause()
 {
-    // 这里使用 CLOCK_BOOTTIME **相对时间**, 排除了系统时间与系统休眠时间的干扰
-    if(!isValid() && ((timer_fd_ = timerfd_create(CLOCK_BOOTTIME, flag)) == -1))
+    if(!isValid())
         return false;
+    wheel_->remove(this);
     return true;
 }
 
-bool Timer::setTime(time_t sec, long nsec)
+bool Timer::resume()
 {
-    struct itimerspec timerspec;
-    // 初始化为0
-    memset(&timerspec, 0, sizeof(timerspec));
-    // 设置超时事件,注意该定时器只是一次性的, 因为itimerspec.interval两个字段全为0
-    timerspec.it_value.tv_nsec = nsec;
-    timerspec.it_value.tv_sec = sec;
-    if(!isValid() || (timerfd_settime(timer_fd_, 0, &timerspec, nullptr) == -1))
+    if(!isValid())
         return false;
+    wheel_->resume(this);
     return true;
 }
 
-bool Timer::cancel()
+void Timer::destroy()
 {
-    // 设置itimerspec的value两个字段全为0时则表示取消
-    return setTime(0, 0);
+    if(isValid())
+        wheel_->remove(this);
+    wheel_ = nullptr;
 }
 
-void Timer::destroy()
+void Timer::attach(TimerWheel* wheel)
 {
-    if(isValid())
-        close(timer_fd_);
-    timer_fd_ = -1;
+    destroy();
+    wheel_ = wheel;
 }
 
 timespec Timer::getNextTimeout()
 {
-    itimerspec nextTime;
-    if(!isValid() || (timerfd_gettime(timer_fd_, &nextTime) == -1))
+    timespec ret;
+    long remaining = isValid() ? wheel_->getRemaining(this) : -1;
+    if(remaining < 0)
     {
-        ERROR("Timer getNextTimeout fail! (%s)", strerror(errno));
-        timespec ret;
         ret.tv_nsec = ret.tv_sec = -1;
         return ret;
     }
-    return nextTime.it_interval;
-}
\ No newline at end of file
+    ret.tv_sec = remaining / 1000;
+    ret.tv_nsec = (remaining % 1000) * 1000000;
+    return ret;
+}
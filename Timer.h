@@ -1,71 +1,90 @@
 #ifndef TIMER_H
 #define TIMER_H
 
-#include <sys/timerfd.h> 
+#include <cstdint>
+#include <ctime>
 
+class TimerWheel;
+
+/**
+ * @brief 一次性定时器. 定时器本身只是时间轮中的一个节点, 不持有任何文件描述符
+ *        超时后, 时间轮将在事件循环线程中调用创建时传入的回调函数
+ */
 class Timer
 {
+    friend class TimerWheel;
 private:
-    int timer_fd_;
-public:
-    /**
-     * @brief 初始时自动创建 timer fd,释放时自动释放timer fd
-     * @param flag 用以设置 timer fd 的属性, TFD_NONBLOCK / TFD_NONBLOCK
-     * @param sec 超时时间,单位秒
-     * @param nsec 超时时间,单位纳秒
-     */ 
-    Timer(int flag = 0, time_t sec = 0, long nsec = 0);
-    ~Timer();
+    TimerWheel* wheel_;             // 所属的时间轮
+    void (*callback_)(void*);       // 超时回调函数
+    void* arg_;                     // 回调函数的参数
 
+    // 以下成员只由时间轮在持有锁时访问
+    Timer* prev_;                   // 槽位链表中的前后节点
+    Timer* next_;
+    uint64_t expire_ms_;            // 超时的绝对时间, 单位毫秒
+    uint64_t slot_tick_;            // 当前所在槽位对应的 tick
+    bool linked_;                   // 是否在时间轮中
+public:
     /**
-     * @brief 获取与设置当前Timer的文件描述符
+     * @brief 创建一个定时器, 初始时不会启动. 析构时自动取消
+     * @param wheel     所属的时间轮
+     * @param callback  超时回调函数
+     * @param arg       传递给回调函数的参数
      */
-    int getFd();
-    void setFd(int fd);
+    Timer(TimerWheel* wheel, void (*callback)(void*), void* arg);
+    ~Timer();
 
     /**
-     * @brief 判断当前timer fd是否可用
+     * @brief 判断当前定时器是否可用
      * @return true表示可用,false表示不可用
-     */ 
-    bool isValid();
-
-    /**
-     * @brief 主动创建一个 timer fd,如果原先fd有效则不会重复创建
-     * @param flag 用以设置 timer fd 的属性, TFD_NONBLOCK / TFD_NONBLOCK
-     * @note 该函数调用的内部函数在错误时会设置 errno
-     * @note 必须在使用该类成员中的其他函数之前, 确保该函数成功调用 
      */
-    bool create(int flag = 0);
+    bool isValid();
 
     /**
-     * @brief 设置一次性定时器
+     * @brief 设置一次性定时器, 若定时器已启动则重置其超时时间
      * @param sec 表示定时器的秒级时间
      * @param nsec 表示定时器的纳秒级时间
      * @return true 表示设置正常,false表示设置失败
      * @note 若sec和nsec同时为0 ,则表示关闭定时器. sec & nsec 共同表示定时器的超时时间
-     * @note 该函数调用的内部函数在错误时会设置 errno
+     * @note 该操作只修改内存中的时间轮, 不会产生系统调用
      */
     bool setTime(time_t sec, long nsec);
 
     /**
      * @brief 取消定时器, 即setTime(0 ,0)
      * @return true 表示设置正常,false表示设置失败
-     * @note 该函数调用的内部函数在错误时会设置 errno
      */
     bool cancel();
 
     /**
-     * @brief 销毁timer fd
-     */ 
+     * @brief 暂停定时器, 即将其从时间轮中移除, 但保留其原先的超时时间
+     * @return true 表示设置正常,false表示设置失败
+     */
+    bool pause();
+
+    /**
+     * @brief 恢复被暂停的定时器. 若期间已经超过了原先的超时时间, 则将在下一个 tick 超时
+     * @return true 表示设置正常,false表示设置失败
+     */
+    bool resume();
+
+    /**
+     * @brief 取消定时器并将其与时间轮分离, 之后该定时器不再可用
+     */
     void destroy();
 
+    /**
+     * @brief 将定时器挂到时间轮 wheel 上, 使 destroy 之后的定时器可以再次使用. 定时器不会启动
+     * @note  用于对象池中复用定时器的所有者
+     */
+    void attach(TimerWheel* wheel);
+
     /**
      * @brief 获取当前定时器距离下一次超时的时间
      * @return 返回timespec结构的时间
-     * @note 若该函数执行失败,则返回的timespec结构体中,两个字段均为负数
-     * @note 该函数调用的内部函数在错误时会设置 errno
-     */ 
-    timespec getNextTimeout(); 
+     * @note 若定时器不可用或尚未启动,则返回的timespec结构体中,两个字段均为负数
+     */
+    timespec getNextTimeout();
 };
 
-#endif
\ No newline at end of file
+#endif
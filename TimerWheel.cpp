@@ -0,0 +1,185 @@
+#include <cassert>
+#include <cstring>
+
+#include "Timer.h"
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel(long tick_ms)
+    : tick_ms_(tick_ms > 0 ? tick_ms : 1), count_(0)
+{
+    memset(slots_, 0, sizeof(slots_));
+    memset(bitmap_, 0, sizeof(bitmap_));
+    curr_tick_ = nowMs() / tick_ms_;
+}
+
+uint64_t TimerWheel::nowMs()
+{
+    // CLOCK_MONOTONIC_COARSE 通过 vDSO 读取, 不会陷入内核, 其精度(通常为 1~4ms)对于连接超时来说足够了
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+void TimerWheel::link_(Timer* timer, uint64_t tick)
+{
+    assert(!timer->linked_);
+    // 已经过期的定时器挂到下一个待处理的槽位上
+    if(tick < curr_tick_)
+        tick = curr_tick_;
+    size_t slot = tick % SLOT_NUM;
+
+    timer->slot_tick_ = tick;
+    timer->prev_ = nullptr;
+    timer->next_ = slots_[slot];
+    if(slots_[slot])
+        slots_[slot]->prev_ = timer;
+    slots_[slot] = timer;
+    bitmap_[slot / 64] |= (1ULL << (slot % 64));
+
+    timer->linked_ = true;
+    ++count_;
+}
+
+void TimerWheel::unlink_(Timer* timer)
+{
+    assert(timer->linked_);
+    size_t slot = timer->slot_tick_ % SLOT_NUM;
+
+    if(timer->prev_)
+        timer->prev_->next_ = timer->next_;
+    else
+        slots_[slot] = timer->next_;
+    if(timer->next_)
+        timer->next_->prev_ = timer->prev_;
+    if(!slots_[slot])
+        bitmap_[slot / 64] &= ~(1ULL << (slot % 64));
+
+    timer->prev_ = timer->next_ = nullptr;
+    timer->linked_ = false;
+    --count_;
+}
+
+void TimerWheel::schedule_(Timer* timer, uint64_t expire_ms)
+{
+    // 向上取整, 保证定时器不会提前超时
+    uint64_t expire_tick = (expire_ms + tick_ms_ - 1) / tick_ms_;
+
+    timer->expire_ms_ = expire_ms;
+    // 如果定时器只是被推迟了, 则只需要修改超时时间, 等扫描到当前槽位时再移动
+    if(timer->linked_ && expire_tick >= timer->slot_tick_)
+        return;
+    if(timer->linked_)
+        unlink_(timer);
+    link_(timer, expire_tick);
+}
+
+void TimerWheel::add(Timer* timer, long timeout_ms)
+{
+    uint64_t expire_ms = nowMs() + (timeout_ms > 0 ? timeout_ms : 0);
+
+    MutexLockGuard guard(lock_);
+    schedule_(timer, expire_ms);
+}
+
+void TimerWheel::remove(Timer* timer)
+{
+    MutexLockGuard guard(lock_);
+    if(timer->linked_)
+        unlink_(timer);
+}
+
+void TimerWheel::resume(Timer* timer)
+{
+    MutexLockGuard guard(lock_);
+    if(!timer->linked_ && timer->expire_ms_ != 0)
+        schedule_(timer, timer->expire_ms_);
+}
+
+long TimerWheel::getRemaining(Timer* timer)
+{
+    uint64_t now = nowMs();
+    MutexLockGuard guard(lock_);
+    if(!timer->linked_)
+        return -1;
+    return timer->expire_ms_ > now ? static_cast<long>(timer->expire_ms_ - now) : 0;
+}
+
+int TimerWheel::getNextTimeout()
+{
+    MutexLockGuard guard(lock_);
+    if(count_ == 0)
+        return -1;
+
+    // 利用位图, 从 curr_tick_ 所在的槽位开始查找第一个非空槽位
+    size_t start = curr_tick_ % SLOT_NUM;
+    size_t dist = 0;
+    for(size_t i = 0; i <= BITMAP_WORDS; i++)
+    {
+        size_t word = (start / 64 + i) % BITMAP_WORDS;
+        uint64_t bits = bitmap_[word];
+        // 第一个字只查找 start 之后的位, 绕回一圈后只查找 start 之前的位
+        if(i == 0)
+            bits &= ~0ULL << (start % 64);
+        else if(i == BITMAP_WORDS)
+            bits &= (1ULL << (start % 64)) - 1;
+        if(bits)
+        {
+            size_t slot = word * 64 + __builtin_ctzll(bits);
+            dist = (slot + SLOT_NUM - start) % SLOT_NUM;
+            break;
+        }
+    }
+
+    uint64_t wake_ms = (curr_tick_ + dist) * tick_ms_;
+    uint64_t now = nowMs();
+    return wake_ms > now ? static_cast<int>(wake_ms - now) : 0;
+}
+
+void TimerWheel::tick()
+{
+    uint64_t now = nowMs();
+    uint64_t now_tick = now / tick_ms_;
+    // 已超时的定时器链表, 通过 next_ 串联
+    Timer* expired = nullptr;
+    {
+        MutexLockGuard guard(lock_);
+        // 最多只需要扫描一圈
+        size_t steps = 0;
+        for(; curr_tick_ <= now_tick && steps < SLOT_NUM; ++curr_tick_, ++steps)
+        {
+            size_t slot = curr_tick_ % SLOT_NUM;
+            if(!slots_[slot])
+                continue;
+            // 先将整个槽位摘下, 防止重新挂回同一个槽位时死循环
+            Timer* list = slots_[slot];
+            slots_[slot] = nullptr;
+            bitmap_[slot / 64] &= ~(1ULL << (slot % 64));
+
+            while(list)
+            {
+                Timer* timer = list;
+                list = list->next_;
+                timer->linked_ = false;
+                --count_;
+                if(timer->expire_ms_ <= now)
+                {
+                    timer->prev_ = nullptr;
+                    timer->next_ = expired;
+                    expired = timer;
+                }
+                // 被推迟的定时器, 挂到新的槽位上
+                else
+                    link_(timer, (timer->expire_ms_ + tick_ms_ - 1) / tick_ms_);
+            }
+        }
+        curr_tick_ = now_tick + 1;
+    }
+    // 在锁外执行回调函数, 因为回调函数通常会释放定时器本身
+    while(expired)
+    {
+        Timer* timer = expired;
+        expired = expired->next_;
+        timer->next_ = nullptr;
+        timer->callback_(timer->arg_);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "MutexLock.h"
+
+class Timer;
+
+/**
+ * @brief 哈希时间轮, 由事件循环持有, 并通过 epoll_wait 的超时时间来驱动
+ *        与每个连接一个 timerfd 相比, 时间轮不占用任何文件描述符,
+ *        且设置/重置/取消定时器都只是 O(1) 的内存操作, 不需要任何系统调用
+ * @note  时间轮中的每个槽位都是一个 Timer 构成的侵入式双向链表
+ *        定时器被推迟时(例如 keep-alive 连接收到了新的请求), 只修改其超时时间而不移动其位置,
+ *        等到时间轮扫描到其所在的槽位时, 再将其挂到新的槽位上 (lazy re-arm)
+ * @note  分发模式下工作线程会重置定时器, 因此所有操作都会上锁; 而超时回调函数在锁外执行
+ */
+class TimerWheel
+{
+public:
+    /**
+     * @brief 创建一个时间轮
+     * @param tick_ms 时间轮的精度, 单位毫秒
+     */
+    TimerWheel(long tick_ms = 10);
+
+    /**
+     * @brief 设置或重置定时器, 若定时器已经在时间轮中, 则更新其超时时间
+     * @param timer      目标定时器
+     * @param timeout_ms 距离超时的时间, 单位毫秒
+     */
+    void add(Timer* timer, long timeout_ms);
+
+    /**
+     * @brief 将定时器从时间轮中移除, 若定时器不在时间轮中则什么也不做
+     * @note  定时器原先的超时时间会被保留, 可以通过 resume 恢复
+     */
+    void remove(Timer* timer);
+
+    /**
+     * @brief 以定时器原先的超时时间, 将其重新放入时间轮中
+     * @note  若定时器已经在时间轮中, 或者从未被设置过, 则什么也不做
+     */
+    void resume(Timer* timer);
+
+    /**
+     * @brief 获取定时器距离超时的剩余时间
+     * @return 剩余时间, 单位毫秒. 若定时器不在时间轮中, 则返回 -1
+     */
+    long getRemaining(Timer* timer);
+
+    /**
+     * @brief 获取距离下一个非空槽位到期的时间, 用于 epoll_wait 的超时参数
+     * @return 单位毫秒, 若时间轮为空则返回 -1 (永久等待)
+     */
+    int getNextTimeout();
+
+    /**
+     * @brief 推进时间轮, 并执行所有已超时定时器的回调函数
+     * @note  该函数只能在持有该时间轮的事件循环线程中调用
+     */
+    void tick();
+
+private:
+    static const size_t SLOT_NUM = 1024;
+    static const size_t BITMAP_WORDS = SLOT_NUM / 64;
+
+    // 获取当前时间, 单位毫秒
+    static uint64_t nowMs();
+
+    // 将定时器的超时时间设置为 expire_ms, 调用时必须持有锁
+    void schedule_(Timer* timer, uint64_t expire_ms);
+
+    // 将定时器挂至第 tick 个槽位上 / 将定时器从其所在的槽位上摘下, 调用时必须持有锁
+    void link_(Timer* timer, uint64_t tick);
+    void unlink_(Timer* timer);
+
+    long tick_ms_;                      // 时间轮的精度
+    uint64_t curr_tick_;                // 下一个待处理的 tick
+    size_t count_;                      // 时间轮中的定时器个数
+    Timer* slots_[SLOT_NUM];            // 槽位, 每个槽位都是一个双向链表
+    uint64_t bitmap_[BITMAP_WORDS];     // 非空槽位的位图, 用于快速查找下一个到期的槽位
+    MutexLock lock_;
+};
+
+#endif
@@ -1,6 +1,10 @@
 #include <arpa/inet.h>
+#include <climits>
 #include <cctype>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -13,7 +17,7 @@
 #include "MutexLock.h"
 #include "Utils.h"
 
-int socket_bind_and_listen(int port)
+int socket_bind_and_listen(int port, bool reuse_port, int backlog)
 {
     int listen_fd = 0;
     // 开始创建 socket, 注意这是阻塞模式的socket
@@ -34,11 +38,14 @@ int socket_bind_and_listen(int port)
     int opt = 1;
     if(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
         return -1;
+    // 多 reactor 模式下, 每个线程都有一个绑定至同一端口的 listen 套接字, 由内核负责负载均衡
+    if(reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+        return -1;
     // 试着bind
     if(bind(listen_fd, (sockaddr*)&server_addr, sizeof(server_addr)) == -1)
         return -1;
-    // 试着listen, 设置最大队列长度为 1024
-    if(listen(listen_fd, 1024) == -1)
+    // 试着listen, 设置最大队列长度
+    if(listen(listen_fd, backlog) == -1)
         return -1;
 
     return listen_fd;
@@ -64,6 +71,20 @@ bool setSocketNoDelay(int fd)
     return true;
 }
 
+bool setSocketNotSentLowat(int fd, int bytes)
+{
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void *)&bytes, sizeof(bytes)) == -1)
+        return false;
+    return true;
+}
+
+bool setSocketDeferAccept(int fd, int seconds)
+{
+    if(setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (void *)&seconds, sizeof(seconds)) == -1)
+        return false;
+    return true;
+}
+
 ssize_t readn(int fd, void* buf, size_t len)
 {
     // 这里将 void* 转换成 char* 是为了在下面进行自增操作
@@ -158,37 +179,47 @@ void printConnectionStatus(int client_fd_, string prefix)
         ERROR("printConnectionStatus failed ! (%s)", strerror(errno));
 }
 
-string escapeStr(const string& str, size_t MAXBUF)
+size_t escapeStr(const char* data, size_t len, char* buf, size_t size)
 {
-    string msg = str;
-    // 遍历所有字符
-    for(size_t i = 0; i < msg.length(); i++)
+    static const char ELLIPSIS[] = " ... ... ";
+    static const char HEX[] = "0123456789abcdef";
+    // 为截断时末尾的省略号以及 '\0' 预留空间
+    size_t limit = size - sizeof(ELLIPSIS);
+    size_t pos = 0, i = 0;
+    for(; i < len; i++)
     {
-        char ch = msg[i];
-        // 如果当前字符无法打印,则转义
-        if(!isprint(ch))
+        unsigned char ch = static_cast<unsigned char>(data[i]);
+        // 可打印字符直接输出, 这里只对\r\n做特殊处理, 其余的以 \xhh 输出
+        if(ch >= 0x20 && ch < 0x7f)
         {
-            // 这里只对\r\n做特殊处理
-            string substr;
-            if(ch == '\r')
-                substr = "\\r";
-            else if(ch == '\n')
-                substr = "\\n";
-            else
-            {
-                char hex[10];
-                // 注意这里要设置成 unsigned,即零扩展
-                snprintf(hex, 10, "\\x%02x", static_cast<unsigned char>(ch));
-                substr = hex;
-            }
-            msg.replace(i, 1, substr);
+            if(pos + 1 > limit)
+                break;
+            buf[pos++] = static_cast<char>(ch);
+        }
+        else if(ch == '\r' || ch == '\n')
+        {
+            if(pos + 2 > limit)
+                break;
+            buf[pos++] = '\\';
+            buf[pos++] = ch == '\r' ? 'r' : 'n';
+        }
+        else
+        {
+            if(pos + 4 > limit)
+                break;
+            buf[pos++] = '\\';
+            buf[pos++] = 'x';
+            buf[pos++] = HEX[ch >> 4];
+            buf[pos++] = HEX[ch & 0xf];
         }
     }
-    // 将读取到的数据输出
-    if(msg.length() > MAXBUF)
-        return msg.substr(0, MAXBUF) + " ... ... ";
-    else
-        return msg;
+    if(i < len)
+    {
+        memcpy(buf + pos, ELLIPSIS, sizeof(ELLIPSIS) - 1);
+        pos += sizeof(ELLIPSIS) - 1;
+    }
+    buf[pos] = '\0';
+    return pos;
 }
 
 bool isNumericStr(string str)
@@ -216,25 +247,23 @@ size_t closeRemainingConnect(int listen_fd, int* idle_fd) {
     return count;
 }
 
-bool is_path_parent(const string& parent_path, const string& child_path) {
-    bool result = false;
-    char* parent_p = nullptr, *child_p = nullptr;
+bool is_path_parent(const string& parent_path, const string& child_path, string* real_child_path) {
+    // 使用栈上的缓冲区, 避免 canonicalize_file_name 每次都分配内存
+    char parent_p[PATH_MAX], child_p[PATH_MAX];
     char separator;
 
-    parent_p = canonicalize_file_name(parent_path.c_str());
-    if(!parent_p) {
+    if(!realpath(parent_path.c_str(), parent_p)) {
         ERROR("is_path_parent failed, cannot get parent path [%s] (%s)", 
               parent_path.c_str(), 
               strerror(errno));
-        goto clean_parent;
+        return false;
     }
 
-    child_p = canonicalize_file_name(child_path.c_str());
-    if(!child_p) {
+    if(!realpath(child_path.c_str(), child_p)) {
         ERROR("is_path_parent failed, cannot get child path [%s] (%s)", 
             child_path.c_str(), 
             strerror(errno));
-        goto clean_child;
+        return false;
     }
 
     // INFO("resolved parent path: %s", parent_p);
@@ -253,13 +282,66 @@ bool is_path_parent(const string& parent_path, const string& child_path) {
     if(child_p == strstr(child_p, parent_p)) {
         // parent 在 child 中，因此 child[parent.len] 不会越界
         separator = child_p[strlen(parent_p)];
-        if (separator == '\0' || separator == '/')
+        if (separator == '\0' || separator == '/') {
+            if(real_child_path)
+                real_child_path->assign(child_p);
             return true;
+        }
     }
+    return false;
+}
+
+// HTTP-date 总是使用 GMT, 且星期与月份的名称不受 locale 影响
+static const char* const DAYS[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char* const MONTHS[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+string formatHttpDate(time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT", DAYS[tm.tm_wday], tm.tm_mday,
+             MONTHS[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    return buf;
+}
 
-    free(child_p);
-clean_child:
-    free(parent_p);
-clean_parent:
-    return result;
+bool parseHttpDate(const char* str, size_t len, time_t* t)
+{
+    char buf[64];
+    if(len >= sizeof(buf))
+        return false;
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char month[4];
+    int consumed = 0;
+    // IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+    if(sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n", &tm.tm_mday, month, &tm.tm_year,
+              &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) == 6 && consumed == static_cast<int>(len))
+        ;
+    // RFC 850: Sunday, 06-Nov-94 08:49:37 GMT
+    else if(sscanf(buf, "%*[A-Za-z], %2d-%3s-%2d %2d:%2d:%2d GMT%n", &tm.tm_mday, month, &tm.tm_year,
+                   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) == 6 && consumed == static_cast<int>(len))
+        // 两位数的年份, 70 之前的视为 20xx
+        tm.tm_year += (tm.tm_year < 70) ? 2000 : 1900;
+    // asctime: Sun Nov  6 08:49:37 1994
+    else if(sscanf(buf, "%*3s %3s %2d %2d:%2d:%2d %4d%n", month, &tm.tm_mday, &tm.tm_hour,
+                   &tm.tm_min, &tm.tm_sec, &tm.tm_year, &consumed) == 6 && consumed == static_cast<int>(len))
+        ;
+    else
+        return false;
+
+    tm.tm_mon = -1;
+    for(int i = 0; i < 12; i++)
+        if(!strcmp(month, MONTHS[i]))
+            tm.tm_mon = i;
+    if(tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23
+        || tm.tm_min > 59 || tm.tm_sec > 60 || tm.tm_year < 1970)
+        return false;
+    tm.tm_year -= 1900;
+    *t = timegm(&tm);
+    return true;
 }
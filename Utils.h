@@ -14,10 +14,12 @@ using std::ostream;
 /**
  * @brief  绑定一个端口号并返回一个 fd
  * @param  port 目标端口号
+ * @param  reuse_port 是否设置 SO_REUSEPORT, 使得多个 listen 套接字可以绑定同一个端口
+ * @param  backlog 已完成握手但尚未 accept 的连接队列长度, 实际值不超过 net.core.somaxconn
  * @return 运行正常则返回 fd, 否则返回 -1
  * @note   该函数在错误时会生成 errno
  */
-int socket_bind_and_listen(int port);
+int socket_bind_and_listen(int port, bool reuse_port = false, int backlog = 1024);
 
 /**
  * @brief 设置传入的文件描述符为非阻塞模式
@@ -35,6 +37,26 @@ bool setFdNoBlock(int fd);
  */
 bool setSocketNoDelay(int fd);
 
+/**
+ * @brief 设置 socket 的 TCP_NOTSENT_LOWAT, 限制内核中尚未发送的数据量
+ *        未发送的数据低于该值时套接字才会变为可写, 以免每个连接在内核中缓存过多的数据
+ * @param fd    目标套接字. 对 listen 套接字设置时, accept 得到的套接字会继承该值
+ * @param bytes 未发送数据的上限(字节)
+ * @return true 表示设置成功, false 表示设置失败
+ * @note   setsockopt函数在错误时会生成 errno
+ */
+bool setSocketNotSentLowat(int fd, int bytes);
+
+/**
+ * @brief 设置 listen 套接字的 TCP_DEFER_ACCEPT, 连接只有在收到客户端的数据之后才能被 accept
+ *        只建立连接而不发送请求的客户端不会占用连接对象、定时器与 epoll 中的条目
+ * @param fd        目标 listen 套接字
+ * @param seconds   最多等待数据的时间(s), 超时后内核仍会完成该连接
+ * @return true 表示设置成功, false 表示设置失败
+ * @note   setsockopt函数在错误时会生成 errno
+ */
+bool setSocketDeferAccept(int fd, int seconds);
+
 /**
  * @brief   非阻塞模式 read 的wrapper
  * @param   fd  源文件描述符
@@ -76,13 +98,33 @@ void handleSigpipe();
 void printConnectionStatus(int client_fd_, string prefix);
 
 /**
- * @brief 将传入的字符串转义成终端可以直接显示的输出
- * @param str       待输出的字符串
- * @param MAXBUF    最长能输出的字符串长度
- * @return 转义后的字符串
+ * @brief 将传入的数据转义成终端可以直接显示的输出, 写入固定大小的缓冲区中
+ * @param data      待输出的数据
+ * @param len       数据的长度
+ * @param buf       输出缓冲区, 结果以 '\0' 结尾
+ * @param size      输出缓冲区的大小, 放不下的部分被截断, 并以 " ... ... " 结尾
+ * @return 写入 buf 的长度, 不包括末尾的 '\0'
  * @note  是将 '\r' 等无法在终端上显示的字符,转义成 "\r"字符串 输出
+ *        每个字节只处理一次, 且处理到缓冲区写满为止, 因此其耗时与输入的长度无关
  */
-string escapeStr(const string& str, size_t MAXBUF);
+size_t escapeStr(const char* data, size_t len, char* buf, size_t size);
+
+/**
+ * @brief 在栈上保存转义结果, 用于日志输出, 例如 INFO("{%s}", EscapedStr(header).c_str())
+ */
+class EscapedStr
+{
+public:
+    // 最长能输出的字符串长度
+    static const size_t MAXBUF = 1024;
+
+    EscapedStr(const char* data, size_t len)    { escapeStr(data, len, buf_, sizeof(buf_)); }
+    explicit EscapedStr(const string& str)      { escapeStr(str.data(), str.size(), buf_, sizeof(buf_)); }
+    const char* c_str() const                   { return buf_; }
+
+private:
+    char buf_[MAXBUF + 16];
+};
 
 /**
  * @brief 判断字符串是否全为数字
@@ -102,8 +144,25 @@ size_t closeRemainingConnect(int listen_fd, int* idle_fd);
  * @brief 检测两个 path 是否包含从属关系，以防止目录穿越漏洞
  * @param root_dir 最外层的路径
  * @param child_dir 内层路径
+ * @param real_child_path 若不为 nullptr, 则在存在从属关系时输出内层路径的真实路径
  * @return 返回从属关系
  */ 
-bool is_path_parent(const string& parent_path, const string& child_path);
+bool is_path_parent(const string& parent_path, const string& child_path, string* real_child_path = nullptr);
+
+/**
+ * @brief 将时间格式化为 HTTP-date, 例如 "Sun, 06 Nov 1994 08:49:37 GMT"
+ * @param t 待格式化的时间
+ * @return 格式化后的字符串
+ */
+string formatHttpDate(time_t t);
+
+/**
+ * @brief 解析 HTTP-date, 支持 IMF-fixdate、RFC 850 以及 asctime 三种格式
+ * @param str 待解析的字符串, 不要求以 '\0' 结尾
+ * @param len 字符串长度
+ * @param t   解析得到的时间
+ * @return 格式错误时返回 false
+ */
+bool parseHttpDate(const char* str, size_t len, time_t* t);
 
 #endif
\ No newline at end of file
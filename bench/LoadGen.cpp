@@ -0,0 +1,1003 @@
+/**
+ * @brief WebServer 的开环(open-loop)压力测试工具
+ *        每个连接按照固定的速率安排请求的计划发送时刻, 服务器变慢时之后的请求不会被推迟安排.
+ *        延迟从请求 **计划** 发送的时刻开始计算, 而不是实际发送的时刻. 这样服务器的一次停顿会体现在
+ *        所有受其影响的请求中, 不会因为压测端同步地等待响应而少算(即修正了协调遗漏, coordinated omission)
+ *        结果以 JSON 格式输出到标准输出, 便于脚本比较
+ */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <dirent.h>
+#include <functional>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <queue>
+#include <string>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// 请求方式
+enum Method { METHOD_GET, METHOD_HEAD, METHOD_POST, METHOD_NUM };
+static const char* const METHOD_NAMES[METHOD_NUM] = { "get", "head", "post" };
+
+// 测试的配置
+struct Options {
+    string host;
+    int port;
+    int threads;
+    int connections;
+    double rate;                // 所有连接每秒的请求数之和, 0 表示闭环, 即收到响应后立即发送下一个请求
+    double duration;            // 包括预热在内的测试时长(s)
+    double warmup;              // 预热时长(s), 该时间段内计划发送的请求不计入结果
+    double drain;               // 测试结束后等待剩余响应的最长时间(s), 超过则记为超时
+    bool keep_alive;
+    int pipeline;               // 每个连接最多同时等待的响应个数
+    int weights[METHOD_NUM];    // 各个请求方式的权重
+    string files_dir;           // GET / HEAD 请求的文件取自该目录, 请求路径为 "/" + 文件路径
+    string size_mix;            // 文件的选取方式: uniform / small / large
+    string uri;                 // 指定时 GET / HEAD 只请求该路径
+    string post_uri;            // POST 请求的 CGI 程序路径
+    size_t post_bytes;          // POST 请求的 body 大小
+    string name;                // 场景名称, 原样输出到结果中
+
+    Options() : host("127.0.0.1"), port(0), threads(2), connections(16), rate(1000), duration(10),
+                warmup(1), drain(5), keep_alive(true), pipeline(1), files_dir("html"),
+                size_mix("uniform"), post_uri("/html/CGI/base64"), post_bytes(64), name("default")
+    {
+        weights[METHOD_GET] = 1;
+        weights[METHOD_HEAD] = 0;
+        weights[METHOD_POST] = 0;
+    }
+};
+
+// 预先生成的请求报文
+struct Request {
+    Method method;
+    string data;
+};
+
+/**
+ * 与 HdrHistogram 类似的对数-线性直方图(单位 us): 每个 2 的幂区间再均分为 2^SUB_BITS 个桶,
+ * 相对误差不超过 1/2^SUB_BITS. 最后一个桶收集所有超出范围的值
+ */
+class Histogram
+{
+public:
+    Histogram() : buckets_(BUCKET_NUM, 0), count_(0), sum_(0), min_(UINT64_MAX), max_(0) {}
+
+    void record(uint64_t us)
+    {
+        buckets_[bucketOf(us)]++;
+        count_++;
+        sum_ += us;
+        min_ = min(min_, us);
+        max_ = max(max_, us);
+    }
+
+    void merge(const Histogram& other)
+    {
+        for(size_t i = 0; i < BUCKET_NUM; i++)
+            buckets_[i] += other.buckets_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = min(min_, other.min_);
+        max_ = max(max_, other.max_);
+    }
+
+    /**
+     * @brief 获取分位数, 返回值为对应桶中的最大值, 且不超过记录到的最大值
+     * @param quantile 0 ~ 1
+     */
+    uint64_t percentile(double quantile) const
+    {
+        if(!count_)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(quantile * static_cast<double>(count_) + 0.5);
+        rank = max<uint64_t>(rank, 1);
+        uint64_t cumulative = 0;
+        for(size_t i = 0; i < BUCKET_NUM; i++)
+        {
+            cumulative += buckets_[i];
+            if(cumulative >= rank)
+                return min(bucketBound(i) - 1, max_);
+        }
+        return max_;
+    }
+
+    uint64_t count() const      { return count_; }
+    uint64_t minimum() const    { return count_ ? min_ : 0; }
+    uint64_t maximum() const    { return max_; }
+    double mean() const         { return count_ ? static_cast<double>(sum_) / static_cast<double>(count_) : 0; }
+
+private:
+    static const unsigned SUB_BITS = 7;
+    static const size_t SUB_NUM = 1 << SUB_BITS;
+    static const unsigned MAX_EXP = 36;         // 2^36 us 约为 19 小时
+    static const size_t BUCKET_NUM = (MAX_EXP - SUB_BITS + 2) * SUB_NUM;
+
+    static size_t bucketOf(uint64_t us)
+    {
+        if(us < SUB_NUM)
+            return static_cast<size_t>(us);
+        unsigned exp = 63 - static_cast<unsigned>(__builtin_clzll(us));
+        size_t sub = static_cast<size_t>(us >> (exp - SUB_BITS)) & (SUB_NUM - 1);
+        size_t index = (exp - SUB_BITS + 1) * SUB_NUM + sub;
+        return index < BUCKET_NUM ? index : BUCKET_NUM - 1;
+    }
+
+    // 桶的上界(不含)
+    static uint64_t bucketBound(size_t index)
+    {
+        if(index < SUB_NUM)
+            return index + 1;
+        unsigned exp = static_cast<unsigned>(index / SUB_NUM) + SUB_BITS - 1;
+        uint64_t sub = index % SUB_NUM;
+        return (SUB_NUM + sub + 1) << (exp - SUB_BITS);
+    }
+
+    vector<uint64_t> buckets_;
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+};
+
+// 测试结果, 每个线程各自统计, 结束后汇总
+struct Stats {
+    Histogram latency;
+    uint64_t scheduled;         // 计划发送的请求个数
+    uint64_t completed;         // 收到完整响应的请求个数
+    uint64_t errors;            // 连接出错或者响应无法解析而失败的请求个数
+    uint64_t timeouts;          // 测试结束后仍未收到响应的请求个数
+    uint64_t retries;           // 服务器关闭持续连接后重新发送的请求个数
+    uint64_t connect_errors;    // 建立连接失败的次数
+    uint64_t status[6];         // 1xx ~ 5xx 以及其他状态码的响应个数
+    uint64_t bytes_read;
+
+    Stats() : scheduled(0), completed(0), errors(0), timeouts(0), retries(0), connect_errors(0),
+              status(), bytes_read(0) {}
+
+    void merge(const Stats& other)
+    {
+        latency.merge(other.latency);
+        scheduled += other.scheduled;
+        completed += other.completed;
+        errors += other.errors;
+        timeouts += other.timeouts;
+        retries += other.retries;
+        connect_errors += other.connect_errors;
+        for(size_t i = 0; i < 6; i++)
+            status[i] += other.status[i];
+        bytes_read += other.bytes_read;
+    }
+};
+
+static Options options;
+static sockaddr_in server_addr;
+static vector<Request> requests;        // 所有可能发送的请求
+static vector<double> request_weights;  // requests 的累积权重
+static uint64_t start_us;               // 开始发送请求的时刻
+static uint64_t measure_us;             // 开始统计的时刻, 即预热结束的时刻
+static uint64_t end_us;                 // 停止安排新请求的时刻
+
+static uint64_t nowMicros()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+}
+
+/**
+ * @brief 一个压测线程, 独占一个 epoll 实例以及一部分连接
+ */
+class Worker
+{
+public:
+    Worker(int index, int conn_num);
+    ~Worker();
+
+    /**
+     * @brief 创建线程执行测试 / 等待测试结束
+     */
+    bool start();
+    void join();
+    const Stats& stats() const { return stats_; }
+
+private:
+    // 一个已经计划的请求
+    struct Pending {
+        uint64_t intended_us;   // 计划发送的时刻, 延迟从该时刻开始计算
+        const Request* request;
+    };
+
+    struct Connection {
+        int fd;
+        bool connecting;            // 正在等待非阻塞 connect 完成
+        deque<Pending> queue;       // 已经到达计划时刻的请求, 前 sent 个已经发出
+        size_t sent;
+        string out;                 // 尚未写入套接字的请求数据
+        size_t out_off;
+        string header;              // 尚未接收完整的响应头
+        bool in_body;               // 响应头已经解析, 正在接收 body
+        bool until_eof;             // body 没有长度, 持续到连接关闭
+        size_t body_left;
+        int status;
+        bool close_after;           // 响应带有 Connection: close
+        uint64_t responses;         // 当前连接上已经收到的响应个数
+        double next_us;             // 开环模式下该连接下一个请求的计划发送时刻
+        bool timer_armed;           // 是否已经在 timers_ 中
+    };
+
+    typedef pair<uint64_t, Connection*> Timer;
+
+    static void* threadMain(void* arg);
+    void run();
+
+    const Request* pickRequest();
+    void schedule(Connection& conn, uint64_t intended_us);
+    void onTimer(Connection& conn, uint64_t now);
+    void armTimer(Connection& conn, uint64_t at);
+    bool openConnection(Connection& conn);
+    void closeConnection(Connection& conn);
+    void pump(Connection& conn);
+    bool flush(Connection& conn);
+    void handleEvent(Connection& conn, uint32_t events);
+    void readResponses(Connection& conn);
+    bool feed(Connection& conn, const char* data, size_t len);
+    bool parseHeader(Connection& conn);
+    void completeResponse(Connection& conn);
+    void connectionLost(Connection& conn);
+    void failRequests(Connection& conn, size_t num);
+    bool inWindow(uint64_t intended_us) const   { return intended_us >= measure_us && intended_us < end_us; }
+
+    int index_;
+    int epoll_fd_;
+    int timer_fd_;
+    uint64_t rng_;
+    vector<Connection> conns_;
+    priority_queue<Timer, vector<Timer>, greater<Timer>> timers_;
+    uint64_t outstanding_;              // 所有连接中尚未完成的请求个数
+    Stats stats_;
+    pthread_t thread_;
+};
+
+Worker::Worker(int index, int conn_num)
+        : index_(index), rng_(0x9E3779B97F4A7C15ULL * static_cast<uint64_t>(index + 1) ^ nowMicros()),
+          conns_(static_cast<size_t>(conn_num)), outstanding_(0)
+{
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(epoll_fd_ == -1 || timer_fd_ == -1)
+    {
+        perror("epoll_create1 / timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev);
+
+    for(Connection& conn : conns_)
+    {
+        conn.fd = -1;
+        conn.connecting = false;
+        conn.sent = 0;
+        conn.out_off = 0;
+        conn.in_body = false;
+        conn.until_eof = false;
+        conn.body_left = 0;
+        conn.status = 0;
+        conn.close_after = false;
+        conn.responses = 0;
+        conn.next_us = 0;
+        conn.timer_armed = false;
+    }
+}
+
+Worker::~Worker()
+{
+    for(Connection& conn : conns_)
+        if(conn.fd >= 0)
+            close(conn.fd);
+    close(timer_fd_);
+    close(epoll_fd_);
+}
+
+const Request* Worker::pickRequest()
+{
+    // xorshift64*
+    rng_ ^= rng_ >> 12;
+    rng_ ^= rng_ << 25;
+    rng_ ^= rng_ >> 27;
+    uint64_t r = rng_ * 0x2545F4914F6CDD1DULL;
+    double x = static_cast<double>(r >> 11) / static_cast<double>(1ULL << 53) * request_weights.back();
+    size_t i = static_cast<size_t>(upper_bound(request_weights.begin(), request_weights.end(), x)
+                                   - request_weights.begin());
+    return &requests[min(i, requests.size() - 1)];
+}
+
+void Worker::schedule(Connection& conn, uint64_t intended_us)
+{
+    Pending pending = { intended_us, pickRequest() };
+    conn.queue.push_back(pending);
+    outstanding_++;
+    if(inWindow(intended_us))
+        stats_.scheduled++;
+}
+
+void Worker::armTimer(Connection& conn, uint64_t at)
+{
+    if(conn.timer_armed)
+        return;
+    conn.timer_armed = true;
+    timers_.push(Timer(at, &conn));
+}
+
+void Worker::onTimer(Connection& conn, uint64_t now)
+{
+    conn.timer_armed = false;
+    if(options.rate > 0)
+    {
+        // 开环: 按照固定的间隔安排请求, 与之前的请求是否完成无关
+        // 计划时刻与定时器都使用取整后的值, 以免定时器在同一时刻反复到期
+        double interval = 1e6 * options.connections / options.rate;
+        for(; static_cast<uint64_t>(conn.next_us) <= now && conn.next_us < end_us; conn.next_us += interval)
+            schedule(conn, static_cast<uint64_t>(conn.next_us));
+        if(conn.next_us < end_us)
+            armTimer(conn, static_cast<uint64_t>(conn.next_us));
+    }
+    else
+    {
+        // 闭环: 保持 pipeline 个请求在途, 请求的计划时刻即为实际发送的时刻
+        while(conn.queue.size() < static_cast<size_t>(options.pipeline) && now < end_us)
+            schedule(conn, now);
+    }
+    pump(conn);
+}
+
+bool Worker::openConnection(Connection& conn)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        return false;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(fd, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr)) == -1
+        && errno != EINPROGRESS)
+    {
+        close(fd);
+        return false;
+    }
+    // 边缘触发, 同时关注读写, 此后不再需要修改
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &conn;
+    if(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        close(fd);
+        return false;
+    }
+    conn.fd = fd;
+    conn.connecting = true;
+    conn.responses = 0;
+    return true;
+}
+
+void Worker::closeConnection(Connection& conn)
+{
+    if(conn.fd >= 0)
+        close(conn.fd);
+    conn.fd = -1;
+    conn.connecting = false;
+    // 未收到响应的请求仍然留在队列中, 重新连接后再次发送
+    conn.sent = 0;
+    conn.out.clear();
+    conn.out_off = 0;
+    conn.header.clear();
+    conn.in_body = false;
+    conn.until_eof = false;
+    conn.body_left = 0;
+    conn.close_after = false;
+}
+
+void Worker::failRequests(Connection& conn, size_t num)
+{
+    for(size_t i = 0; i < num && !conn.queue.empty(); i++)
+    {
+        if(inWindow(conn.queue.front().intended_us))
+            stats_.errors++;
+        conn.queue.pop_front();
+        outstanding_--;
+    }
+}
+
+void Worker::pump(Connection& conn)
+{
+    if(conn.queue.empty())
+        return;
+    if(conn.fd < 0 && !openConnection(conn))
+    {
+        // 无法建立连接, 放弃所有等待中的请求. 闭环模式下稍后再安排新的请求, 以免忙等
+        stats_.connect_errors++;
+        failRequests(conn, conn.queue.size());
+        if(options.rate <= 0)
+            armTimer(conn, nowMicros() + 10000);
+        return;
+    }
+    if(conn.connecting)
+        return;
+    // 非持续连接上每次只发送一个请求
+    size_t depth = options.keep_alive ? static_cast<size_t>(options.pipeline) : 1;
+    for(; conn.sent < conn.queue.size() && conn.sent < depth; conn.sent++)
+        conn.out += conn.queue[conn.sent].request->data;
+    flush(conn);
+}
+
+bool Worker::flush(Connection& conn)
+{
+    while(conn.out_off < conn.out.size())
+    {
+        ssize_t len = send(conn.fd, conn.out.data() + conn.out_off, conn.out.size() - conn.out_off, MSG_NOSIGNAL);
+        if(len > 0)
+            conn.out_off += static_cast<size_t>(len);
+        else if(len == -1 && errno == EINTR)
+            continue;
+        // 剩余数据等待 EPOLLOUT 后再发送
+        else if(len == -1 && errno == EAGAIN)
+            return true;
+        else
+        {
+            connectionLost(conn);
+            return false;
+        }
+    }
+    conn.out.clear();
+    conn.out_off = 0;
+    return true;
+}
+
+void Worker::connectionLost(Connection& conn)
+{
+    // 服务器关闭了已经成功处理过请求的持续连接, 例如空闲超时, 此时重新发送未完成的请求
+    // 否则认为这些请求失败, 以免服务器出错时反复重试
+    if(options.keep_alive && conn.responses > 0)
+    {
+        for(size_t i = 0; i < conn.sent; i++)
+            if(inWindow(conn.queue[i].intended_us))
+                stats_.retries++;
+    }
+    else
+        failRequests(conn, max<size_t>(conn.sent, 1));
+    closeConnection(conn);
+    if(options.rate <= 0 && conn.queue.empty())
+        armTimer(conn, nowMicros() + 10000);
+}
+
+void Worker::handleEvent(Connection& conn, uint32_t events)
+{
+    if(conn.connecting)
+    {
+        if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)
+        {
+            stats_.connect_errors++;
+            failRequests(conn, conn.queue.size());
+            closeConnection(conn);
+            if(options.rate <= 0)
+                armTimer(conn, nowMicros() + 10000);
+            return;
+        }
+        conn.connecting = false;
+        pump(conn);
+    }
+    if(conn.fd >= 0 && (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+        readResponses(conn);
+    if(conn.fd >= 0 && (events & EPOLLOUT) && !flush(conn))
+        return;
+    // 连接可能在收到响应后被关闭, 此时若还有请求则重新连接
+    pump(conn);
+}
+
+void Worker::readResponses(Connection& conn)
+{
+    char buf[65536];
+    int fd = conn.fd;
+    while(conn.fd == fd)
+    {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if(len > 0)
+        {
+            stats_.bytes_read += static_cast<uint64_t>(len);
+            if(!feed(conn, buf, static_cast<size_t>(len)))
+                return;
+        }
+        else if(len == 0)
+        {
+            // 没有长度的 body 以连接关闭为结束
+            if(conn.in_body && conn.until_eof)
+                completeResponse(conn);
+            else if(conn.sent > 0)
+                connectionLost(conn);
+            else
+                closeConnection(conn);
+            return;
+        }
+        else if(errno == EINTR)
+            continue;
+        else if(errno == EAGAIN)
+            return;
+        else
+        {
+            connectionLost(conn);
+            return;
+        }
+    }
+}
+
+bool Worker::feed(Connection& conn, const char* data, size_t len)
+{
+    int fd = conn.fd;
+    while(len > 0 && conn.fd == fd)
+    {
+        if(conn.in_body)
+        {
+            // body 的内容直接丢弃, 不需要复制
+            if(conn.until_eof)
+                return true;
+            size_t used = min(len, conn.body_left);
+            data += used;
+            len -= used;
+            conn.body_left -= used;
+            if(!conn.body_left)
+                completeResponse(conn);
+            continue;
+        }
+        if(conn.sent == 0)
+        {
+            // 没有发出请求时收到的数据
+            connectionLost(conn);
+            return false;
+        }
+        // 只保存响应头, 从上一次的末尾开始查找空行
+        size_t old = conn.header.size();
+        conn.header.append(data, len);
+        size_t pos = conn.header.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+        if(pos == string::npos)
+        {
+            if(conn.header.size() > 65536)
+            {
+                connectionLost(conn);
+                return false;
+            }
+            return true;
+        }
+        size_t used = pos + 4 - old;
+        data += used;
+        len -= used;
+        conn.header.resize(pos + 4);
+        if(!parseHeader(conn))
+        {
+            connectionLost(conn);
+            return false;
+        }
+        conn.header.clear();
+        conn.in_body = true;
+        if(!conn.until_eof && !conn.body_left)
+            completeResponse(conn);
+    }
+    return conn.fd == fd;
+}
+
+bool Worker::parseHeader(Connection& conn)
+{
+    const string& header = conn.header;
+    if(header.size() < 12 || header.compare(0, 7, "HTTP/1."))
+        return false;
+    conn.status = atoi(header.c_str() + 9);
+    conn.close_after = !options.keep_alive;
+    long content_length = -1;
+    size_t line = header.find("\r\n") + 2;
+    while(line < header.size() - 2)
+    {
+        size_t end = header.find("\r\n", line);
+        const char* p = header.c_str() + line;
+        if(!strncasecmp(p, "Content-Length:", 15))
+            content_length = atol(p + 15);
+        else if(!strncasecmp(p, "Connection:", 11))
+        {
+            const char* v = p + 11;
+            while(*v == ' ')
+                v++;
+            if(!strncasecmp(v, "close", 5))
+                conn.close_after = true;
+        }
+        line = end + 2;
+    }
+    // HEAD 以及 1xx / 204 / 304 的响应没有 body
+    Method method = conn.queue.front().request->method;
+    conn.until_eof = false;
+    if(method == METHOD_HEAD || conn.status / 100 == 1 || conn.status == 204 || conn.status == 304)
+        conn.body_left = 0;
+    else if(content_length >= 0)
+        conn.body_left = static_cast<size_t>(content_length);
+    else if(conn.close_after)
+        conn.until_eof = true;
+    else
+        return false;
+    return true;
+}
+
+void Worker::completeResponse(Connection& conn)
+{
+    Pending pending = conn.queue.front();
+    conn.queue.pop_front();
+    conn.sent--;
+    outstanding_--;
+    conn.responses++;
+    conn.in_body = false;
+    conn.until_eof = false;
+    if(inWindow(pending.intended_us))
+    {
+        uint64_t now = nowMicros();
+        stats_.latency.record(now > pending.intended_us ? now - pending.intended_us : 0);
+        stats_.completed++;
+        int cls = conn.status / 100;
+        stats_.status[cls >= 1 && cls <= 5 ? cls - 1 : 5]++;
+    }
+    if(conn.close_after)
+        closeConnection(conn);
+    // 闭环模式下, 每完成一个请求就安排下一个
+    if(options.rate <= 0)
+    {
+        uint64_t now = nowMicros();
+        if(now < end_us)
+            schedule(conn, now);
+    }
+}
+
+void Worker::run()
+{
+    // 开环模式下, 各个连接的首个请求均匀地错开, 避免所有连接同时发送
+    int conn_offset = index_;
+    for(Connection& conn : conns_)
+    {
+        if(options.rate > 0)
+            conn.next_us = static_cast<double>(start_us)
+                           + 1e6 / options.rate * conn_offset;
+        else
+            conn.next_us = static_cast<double>(start_us);
+        conn_offset += options.threads;
+        armTimer(conn, static_cast<uint64_t>(conn.next_us));
+    }
+
+    uint64_t drain_deadline = end_us + static_cast<uint64_t>(options.drain * 1e6);
+    epoll_event events[256];
+    for(;;)
+    {
+        uint64_t now = nowMicros();
+        while(!timers_.empty() && timers_.top().first <= now)
+        {
+            Connection* conn = timers_.top().second;
+            timers_.pop();
+            onTimer(*conn, now);
+        }
+        if(now >= drain_deadline || (now >= end_us && !outstanding_))
+            break;
+        // 使用 timerfd 以获得微秒级的定时精度, epoll_wait 的超时只用于检查结束时刻
+        if(!timers_.empty())
+        {
+            itimerspec its;
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = static_cast<time_t>(timers_.top().first / 1000000);
+            its.it_value.tv_nsec = static_cast<long>(timers_.top().first % 1000000 * 1000);
+            timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &its, nullptr);
+        }
+        int num = epoll_wait(epoll_fd_, events, 256, 100);
+        for(int i = 0; i < num; i++)
+        {
+            if(!events[i].data.ptr)
+            {
+                uint64_t expirations;
+                while(read(timer_fd_, &expirations, sizeof(expirations)) > 0)
+                    ;
+                continue;
+            }
+            handleEvent(*static_cast<Connection*>(events[i].data.ptr), events[i].events);
+        }
+    }
+    // 仍未完成的请求记为超时
+    for(Connection& conn : conns_)
+        for(const Pending& pending : conn.queue)
+            if(inWindow(pending.intended_us))
+                stats_.timeouts++;
+}
+
+void* Worker::threadMain(void* arg)
+{
+    static_cast<Worker*>(arg)->run();
+    return nullptr;
+}
+
+bool Worker::start()
+{
+    return !pthread_create(&thread_, nullptr, threadMain, this);
+}
+
+void Worker::join()
+{
+    pthread_join(thread_, nullptr);
+}
+
+/**
+ * @brief 递归地收集目录中的普通文件, 跳过可执行文件(即 CGI 程序)
+ */
+static void collectFiles(const string& dir, vector<pair<string, off_t>>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if(!d)
+        return;
+    while(dirent* entry = readdir(d))
+    {
+        if(entry->d_name[0] == '.')
+            continue;
+        string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if(stat(path.c_str(), &st) == -1)
+            continue;
+        if(S_ISDIR(st.st_mode))
+            collectFiles(path, files);
+        else if(S_ISREG(st.st_mode) && !(st.st_mode & S_IXUSR))
+            files.push_back(make_pair(path, st.st_size));
+    }
+    closedir(d);
+}
+
+static string makeRequest(Method method, const string& uri, size_t body_bytes)
+{
+    static const char* const verbs[METHOD_NUM] = { "GET", "HEAD", "POST" };
+    char port[16];
+    snprintf(port, sizeof(port), "%d", options.port);
+    string data = string(verbs[method]) + " " + uri + " HTTP/1.1\r\nHost: " + options.host + ":" + port
+                  + "\r\nConnection: " + (options.keep_alive ? "keep-alive" : "close") + "\r\n";
+    if(method == METHOD_POST)
+    {
+        char length[64];
+        snprintf(length, sizeof(length), "Content-Type: text/plain\r\nContent-Length: %zu\r\n", body_bytes);
+        data += length;
+    }
+    data += "\r\n";
+    if(method == METHOD_POST)
+        for(size_t i = 0; i < body_bytes; i++)
+            data += static_cast<char>('a' + i % 26);
+    return data;
+}
+
+/**
+ * @brief 根据请求方式与文件的权重, 生成所有可能的请求以及它们的累积权重
+ * @return 是否有可以发送的请求
+ */
+static bool buildRequests()
+{
+    vector<pair<string, off_t>> files;
+    if(!options.uri.empty())
+        files.push_back(make_pair(options.uri, static_cast<off_t>(1)));
+    else
+    {
+        collectFiles(options.files_dir, files);
+        sort(files.begin(), files.end());
+        for(auto& file : files)
+        {
+            string& path = file.first;
+            if(!path.compare(0, 2, "./"))
+                path.erase(0, 2);
+            path.insert(0, "/");
+        }
+    }
+
+    double total = 0;
+    for(int m = 0; m < METHOD_NUM; m++)
+    {
+        if(options.weights[m] <= 0)
+            continue;
+        if(m == METHOD_POST)
+        {
+            Request request = { METHOD_POST, makeRequest(METHOD_POST, options.post_uri, options.post_bytes) };
+            requests.push_back(request);
+            request_weights.push_back(total += options.weights[m]);
+            continue;
+        }
+        if(files.empty())
+            return false;
+        // 同一请求方式下各个文件的权重之和为 1, 再乘以该请求方式的权重
+        vector<double> file_weights;
+        double sum = 0;
+        for(const auto& file : files)
+        {
+            double size = static_cast<double>(max<off_t>(file.second, 1));
+            double w = options.size_mix == "small" ? 1 / size : options.size_mix == "large" ? size : 1;
+            file_weights.push_back(w);
+            sum += w;
+        }
+        for(size_t i = 0; i < files.size(); i++)
+        {
+            Request request = { static_cast<Method>(m), makeRequest(static_cast<Method>(m), files[i].first, 0) };
+            requests.push_back(request);
+            request_weights.push_back(total += options.weights[m] * file_weights[i] / sum);
+        }
+    }
+    return !requests.empty();
+}
+
+static bool parseWeights(const char* arg)
+{
+    int get, head, post;
+    char tail;
+    if(sscanf(arg, "%d:%d:%d%c", &get, &head, &post, &tail) != 3 || get < 0 || head < 0 || post < 0)
+        return false;
+    options.weights[METHOD_GET] = get;
+    options.weights[METHOD_HEAD] = head;
+    options.weights[METHOD_POST] = post;
+    return get + head + post > 0;
+}
+
+static void printResult(const Stats& stats)
+{
+    double window = options.duration - options.warmup;
+    const Histogram& lat = stats.latency;
+    printf("{\"name\":\"%s\",\"config\":{\"host\":\"%s\",\"port\":%d,\"threads\":%d,\"connections\":%d,"
+           "\"rate\":%.0f,\"duration_s\":%g,\"warmup_s\":%g,\"keep_alive\":%s,\"pipeline\":%d,"
+           "\"mix\":{\"%s\":%d,\"%s\":%d,\"%s\":%d},\"size_mix\":\"%s\",\"requests\":%zu,\"post_bytes\":%zu},",
+           options.name.c_str(), options.host.c_str(), options.port, options.threads, options.connections,
+           options.rate, options.duration, options.warmup, options.keep_alive ? "true" : "false",
+           options.pipeline, METHOD_NAMES[METHOD_GET], options.weights[METHOD_GET],
+           METHOD_NAMES[METHOD_HEAD], options.weights[METHOD_HEAD], METHOD_NAMES[METHOD_POST],
+           options.weights[METHOD_POST], options.size_mix.c_str(), requests.size(), options.post_bytes);
+    printf("\"scheduled\":%lu,\"completed\":%lu,\"errors\":%lu,\"timeouts\":%lu,\"retries\":%lu,"
+           "\"connect_errors\":%lu,\"status\":{\"1xx\":%lu,\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu,\"other\":%lu},",
+           stats.scheduled, stats.completed, stats.errors, stats.timeouts, stats.retries, stats.connect_errors,
+           stats.status[0], stats.status[1], stats.status[2], stats.status[3], stats.status[4], stats.status[5]);
+    printf("\"throughput_rps\":%.1f,\"read_mbps\":%.2f,", stats.completed / window,
+           stats.bytes_read * 8 / window / 1e6);
+    printf("\"latency_us\":{\"min\":%lu,\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+           lat.minimum(), lat.mean(), lat.percentile(0.5), lat.percentile(0.9), lat.percentile(0.99),
+           lat.percentile(0.999), lat.maximum());
+}
+
+int main(int argc, char* argv[])
+{
+    bool bad_args = false;
+    int opt;
+    while(!bad_args && (opt = getopt(argc, argv, "a:t:c:r:d:W:D:k:p:m:f:s:u:q:b:n:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'a':
+            options.host = optarg;
+            break;
+        case 't':
+            bad_args = (options.threads = atoi(optarg)) <= 0;
+            break;
+        case 'c':
+            bad_args = (options.connections = atoi(optarg)) <= 0;
+            break;
+        case 'r':
+            bad_args = (options.rate = atof(optarg)) < 0;
+            break;
+        case 'd':
+            bad_args = (options.duration = atof(optarg)) <= 0;
+            break;
+        case 'W':
+            bad_args = (options.warmup = atof(optarg)) < 0;
+            break;
+        case 'D':
+            bad_args = (options.drain = atof(optarg)) < 0;
+            break;
+        case 'k':
+            options.keep_alive = atoi(optarg) != 0;
+            break;
+        case 'p':
+            bad_args = (options.pipeline = atoi(optarg)) <= 0;
+            break;
+        case 'm':
+            bad_args = !parseWeights(optarg);
+            break;
+        case 'f':
+            options.files_dir = optarg;
+            break;
+        case 's':
+            options.size_mix = optarg;
+            bad_args = options.size_mix != "uniform" && options.size_mix != "small" && options.size_mix != "large";
+            break;
+        case 'u':
+            options.uri = optarg;
+            bad_args = optarg[0] != '/';
+            break;
+        case 'q':
+            options.post_uri = optarg;
+            bad_args = optarg[0] != '/';
+            break;
+        case 'b':
+            options.post_bytes = static_cast<size_t>(atol(optarg));
+            break;
+        case 'n':
+            options.name = optarg;
+            break;
+        default:
+            bad_args = true;
+        }
+    }
+    if(bad_args || argc - optind != 1 || (options.port = atoi(argv[optind])) <= 0
+        || options.warmup >= options.duration)
+    {
+        fprintf(stderr, "usage: %s [-a <host>] [-t <threads>] [-c <connections>] [-r <rate>] [-d <duration_s>] "
+                "[-W <warmup_s>] [-D <drain_s>] [-k 0|1] [-p <pipeline>] [-m <get>:<head>:<post>] [-f <files_dir>] "
+                "[-s uniform|small|large] [-u <uri>] [-q <post_uri>] [-b <post_bytes>] [-n <name>] <port>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    // 非持续连接上不能使用管线化
+    if(!options.keep_alive)
+        options.pipeline = 1;
+    options.threads = min(options.threads, options.connections);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(static_cast<uint16_t>(options.port));
+    if(inet_pton(AF_INET, options.host.c_str(), &server_addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid IPv4 address: %s\n", options.host.c_str());
+        return EXIT_FAILURE;
+    }
+    if(!buildRequests())
+    {
+        fprintf(stderr, "No file found in %s\n", options.files_dir.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // 连接平均分配给各个线程. 所有线程创建完成后再开始计时
+    vector<Worker*> workers;
+    for(int i = 0; i < options.threads; i++)
+        workers.push_back(new Worker(i, options.connections / options.threads
+                                        + (i < options.connections % options.threads ? 1 : 0)));
+    start_us = nowMicros() + 100000;
+    measure_us = start_us + static_cast<uint64_t>(options.warmup * 1e6);
+    end_us = start_us + static_cast<uint64_t>(options.duration * 1e6);
+    for(Worker* worker : workers)
+        if(!worker->start())
+        {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+
+    Stats total;
+    for(Worker* worker : workers)
+    {
+        worker->join();
+        total.merge(worker->stats());
+        delete worker;
+    }
+    printResult(total);
+    fprintf(stderr, "%s: %lu/%lu completed, %.1f req/s, p50 %luus, p99 %luus, p99.9 %luus, errors %lu, timeouts %lu\n",
+            options.name.c_str(), total.completed, total.scheduled,
+            total.completed / (options.duration - options.warmup), total.latency.percentile(0.5),
+            total.latency.percentile(0.99), total.latency.percentile(0.999), total.errors, total.timeouts);
+    return total.completed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
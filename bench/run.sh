@@ -0,0 +1,105 @@
+#!/bin/bash
+# 启动 WebServer 并依次运行一组固定的压测场景, 每个场景的结果以 JSON 格式保存在输出目录中
+# 指定基准目录时, 与其中同名场景的结果比较: 吞吐量下降或 p99 延迟上升超过阈值,
+# 或者出现失败的请求与非 2xx 响应时, 返回非零值
+#
+# 用法: bench/run.sh [-o <out_dir>] [-c <baseline_dir>] [-x <tolerance_percent>] [-- <WebServer 参数>]
+# 以下环境变量可以调整测试强度:
+#   PORT        WebServer 监听的端口, 默认为 18080
+#   DURATION    每个场景的时长(s), 包括预热, 默认为 10
+#   WARMUP      预热时长(s), 默认为 2
+#   RATE        静态文件场景的目标速率(req/s), 默认为 2000
+#   CGI_RATE    CGI 场景的目标速率(req/s), 默认为 50
+#   THREADS     压测线程个数, 默认为 2
+
+cd "$(dirname "$0")/.." || exit 1
+
+OUT_DIR=bench/results
+BASELINE=
+TOLERANCE=20
+while getopts "o:c:x:" opt; do
+    case $opt in
+    o) OUT_DIR=$OPTARG ;;
+    c) BASELINE=$OPTARG ;;
+    x) TOLERANCE=$OPTARG ;;
+    *) echo "usage: $0 [-o <out_dir>] [-c <baseline_dir>] [-x <tolerance_percent>] [-- <WebServer args>]" >&2
+       exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+PORT=${PORT:-18080}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-2}
+RATE=${RATE:-2000}
+CGI_RATE=${CGI_RATE:-50}
+THREADS=${THREADS:-2}
+
+if [ ! -x ./WebServer ] || [ ! -x bench/LoadGen ]; then
+    echo "Build WebServer and bench/LoadGen with make first." >&2
+    exit 1
+fi
+
+# www 目录为仓库根目录, 因此 html/ 中的文件以 /html/... 的路径访问
+./WebServer -v error "$@" "$PORT" . > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2> /dev/null; wait $SERVER_PID 2> /dev/null' EXIT
+for _ in $(seq 50); do
+    (exec 3<> "/dev/tcp/127.0.0.1/$PORT") 2> /dev/null && break
+    sleep 0.1
+done
+
+# 场景名称 以及 LoadGen 参数
+SCENARIOS=(
+    "get_keepalive  -k 1 -c 32 -r $RATE -s small"
+    "get_close      -k 0 -c 32 -r $((RATE / 4)) -s small"
+    "get_pipeline   -k 1 -c 8  -r $RATE -p 8"
+    "get_large      -k 1 -c 16 -r $((RATE / 2)) -s large"
+    "head           -k 1 -c 16 -r $RATE -m 0:1:0"
+    "post_cgi       -k 1 -c 8  -r $CGI_RATE -m 0:0:1 -b 256"
+    "mixed          -k 1 -c 32 -r $((RATE / 2)) -m 8:1:1 -s small"
+)
+
+# 从单行 JSON 中取出数值字段
+field() {
+    sed -n "s/.*\"$2\":\([0-9.]*\).*/\1/p" "$1"
+}
+
+mkdir -p "$OUT_DIR"
+status=0
+for scenario in "${SCENARIOS[@]}"; do
+    read -r name args <<< "$scenario"
+    # shellcheck disable=SC2086
+    bench/LoadGen -n "$name" -t "$THREADS" -d "$DURATION" -W "$WARMUP" $args "$PORT" > "$OUT_DIR/$name.json" \
+        || status=1
+    result=$OUT_DIR/$name.json
+
+    # 任何失败的请求或者非 2xx 的响应都说明服务器出了问题
+    bad=$(awk -v e="$(field "$result" errors)" -v t="$(field "$result" timeouts)" \
+              -v s4="$(field "$result" 4xx)" -v s5="$(field "$result" 5xx)" 'BEGIN { print e + t + s4 + s5 }')
+    if [ "$bad" != 0 ]; then
+        echo "FAIL $name: $bad failed requests or error responses" >&2
+        status=1
+    fi
+
+    [ -n "$BASELINE" ] && [ -f "$BASELINE/$name.json" ] || continue
+    base=$BASELINE/$name.json
+    if ! awk -v name="$name" -v tol="$TOLERANCE" \
+             -v rps="$(field "$result" throughput_rps)" -v base_rps="$(field "$base" throughput_rps)" \
+             -v p99="$(field "$result" p99)" -v base_p99="$(field "$base" p99)" '
+        BEGIN {
+            bad = 0
+            if (rps < base_rps * (1 - tol / 100)) {
+                printf "REGRESSION %s: throughput %.1f -> %.1f req/s\n", name, base_rps, rps
+                bad = 1
+            }
+            if (p99 > base_p99 * (1 + tol / 100)) {
+                printf "REGRESSION %s: p99 %dus -> %dus\n", name, base_p99, p99
+                bad = 1
+            }
+            exit bad
+        }' >&2; then
+        status=1
+    fi
+done
+exit $status
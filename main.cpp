@@ -1,4 +1,6 @@
+#include <climits>
 #include <fcntl.h>
+#include <getopt.h>
 #include <iostream>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -6,227 +8,300 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "CompressCache.h"
 #include "Epoll.h"
+#include "EventLoop.h"
+#include "FileCache.h"
 #include "HttpHandler.h"
+#include "HttpScan.h"
 #include "Log.h"
+#include "ResponseCache.h"
 #include "ThreadPool.h"
 #include "Utils.h"
 
 using namespace std;
 
+// listen 套接字的参数
+struct ListenArgs {
+    int port;                           // 监听的端口号
+    int backlog;                        // 尚未 accept 的连接队列长度
+    int notsent_lowat;                  // TCP_NOTSENT_LOWAT, 0 表示不设置
+    int defer_accept;                   // TCP_DEFER_ACCEPT 的等待时间(s), 0 表示不设置
+};
+
+// 多 reactor 模式下每个线程的参数
+struct ReactorArgs {
+    ListenArgs listen;                  // 每个线程独立创建 listen 套接字时所使用的参数
+    int shared_listen_fd;               // 所有线程共享的 listen 套接字, -1 表示每个线程独立创建
+    EventLoop::BACKEND_TYPE backend;    // 事件后端
+};
+
 /**
- * @brief 处理新的连接
- * @param epoll     存放新连接的Epoll类实例 
- * @param listen_fd 新连接所对应的 listen 描述符
- */ 
-void handleNewConnections(Epoll* epoll, int listen_fd, int* idle_fd)
+ * @brief 创建 listen 套接字, 失败时终止进程. 可选的套接字选项设置失败时只输出警告
+ * @param args          listen 套接字的参数
+ * @param reuse_port    是否设置 SO_REUSEPORT
+ */
+static int createListenSocket(const ListenArgs& args, bool reuse_port)
 {
-    // 注意:可能会有很多个 connect 动作,但只会有一个 event
-    sockaddr_in client_addr;
-    socklen_t client_addr_len = 0;
-    
-    /**
-     *  如果 
-     *      1. accept 没有发生错误
-     *      2. accppt 发生了 EINTR 错误
-     *      3. accept 发生了 ECONNABORTED 错误(该错误是远程连接被中断)
-     *  则重新循环. 其中第三点, 若发生了 aborted 错误,则继续循环接受下一个socket 的请求
-     */
-    for(;;) {
-        int client_fd = accept4(listen_fd, (sockaddr*)&client_addr, &client_addr_len, 
-                SOCK_NONBLOCK | SOCK_CLOEXEC);
-        // accept 的错误处理
-        if(client_fd == -1) {
-            // 如果是因为一些无关的错误所阻断，则继续 accept
-            if(errno == EINTR || errno == ECONNABORTED)
-                continue;
-            // 正常情况下,如果处理了所有的 accept后, errno == EAGAIN，则直接退出
-            else if (errno == EAGAIN)
-                break;
-            // 如果由于文件描述符不够用了,则会返回 EMFILE，此时清空全部的尚未 accept 连接
-            else if(errno == EMFILE) {
-                int closed_conn_num = closeRemainingConnect(listen_fd, idle_fd);
-                WARN("No reliable pipes in new connection, close %d conns", closed_conn_num);
-                break;
-            }
-            // 如果是其他的错误，则输出信息
-            else 
-                ERROR("Accept Error! (%s)", strerror(errno));
-        }
-        // 如果 accept 正常
-        else {
-            /** 构建一个新的 HttpHandler,并放入 epoll 实例中
-             *  注意这里使用了 ONESHOT, 每个套接字只会在 边缘触发,可读时处于就绪状态
-             *  且每个套接字只会被一个线程处理
-             *  NOTE: 每个 client_fd 只会在 HttpHandler 中被 close + 下面的 timer 异常处理中被关闭
-             *        每个 client_handler 也只会在 setConnectionClosed 之后, 执行完 RunEventLoop 函数结束时被释放
-             *        每个 Timer 在此处创建, 在 HttpHandler 中被释放
-             *        可以看出,现在指针已经满天飞了 2333
-             */
-            Timer* timer = new Timer(TFD_NONBLOCK | TFD_CLOEXEC);
-            // 如果timer创建失败,则清空当前所有尚未 accept 的连接，因为文件描述符满
-            if(!timer->isValid())
-            {
-                delete timer;
-                // 直接关闭，告诉远程这里放不下了
-                close(client_fd);
-                
-                int closed_conn_num = closeRemainingConnect(listen_fd, idle_fd);
-                WARN("No reliable pipes in new connection, close %d conns", closed_conn_num);
-                break;
-            }
-            HttpHandler* client_handler = new HttpHandler(epoll, client_fd, timer);
-            /**
-             * @brief EPOLLRDHUP EPOLLHUP 不同点,前者是半关闭连接时出发,后者是完全关闭后触发
-             * @ref tcp 源码 https://elixir.bootlin.com/linux/v4.19/source/net/ipv4/tcp.c#L524
-             * @ref TCP: When is EPOLLHUP generated? https://stackoverflow.com/questions/52976152/tcp-when-is-epollhup-generated
-             */ 
-            bool ret1 = epoll->add(client_fd, client_handler->getClientEpollEvent(), client_handler->getClientTriggerCond());
-            // 设置定时器以边缘-单次触发方式
-            bool ret2 = epoll->add(timer->getFd(), client_handler->getTimerEpollEvent(), client_handler->getTimerTriggerCond());
-            assert(ret1 && ret2);
-            // 输出相关信息
-            printConnectionStatus(client_fd, "-------->>>>> New Connection");
-        }
-    }
+    int listen_fd = -1;
+    if((listen_fd = socket_bind_and_listen(args.port, reuse_port, args.backlog)) == -1)
+        FATAL("Bind %d port failed ! (%s)", args.port, strerror(errno));
+    if(args.notsent_lowat > 0 && !setSocketNotSentLowat(listen_fd, args.notsent_lowat))
+        WARN("Set TCP_NOTSENT_LOWAT failed ! (%s)", strerror(errno));
+    if(args.defer_accept > 0 && !setSocketDeferAccept(listen_fd, args.defer_accept))
+        WARN("Set TCP_DEFER_ACCEPT failed ! (%s)", strerror(errno));
+    return listen_fd;
 }
 
 /**
- * @brief 处理旧的连接
- * @param epoll         被唤醒的 epoll
- * @param fd            被唤醒的文件描述符
- * @param thread_pool   目标线程池
- * @param event         待处理的事件
+ * @brief 多 reactor 模式下, 每个线程所执行的函数
+ *        每个线程都拥有独立的 epoll / io_uring 实例与连接, 以及独立的 listen 套接字(SO_REUSEPORT),
+ *        或者与其他线程共享同一个 listen 套接字
+ * @param arg ReactorArgs 结构体指针
  */
-void handleOldConnection(Epoll* epoll, int fd, ThreadPool* thread_pool, epoll_event* event)
+void* reactorThread(void* arg)
 {
-    EpollEvent* curr_epoll_event = static_cast<EpollEvent*>(event->data.ptr);
-    HttpHandler* handler = static_cast<HttpHandler*>(curr_epoll_event->ptr);
-    // 处理一些错误事件
-    int events_ = event->events;
-    // 如果远程关闭了当前连接
-    if ((events_ & EPOLLHUP) || (events_ & EPOLLRDHUP)) {
-        INFO("Socket(%d) was closed by peer.", handler->getClientFd());
-        // 当某个 handler 无法使用时,一定要销毁内存
-        delete handler;
-        // 之后重新开始遍历新的事件.
-        return;
-    }
-    // 如果当前 socket / events_ 存在错误
-    else if ((events_ & EPOLLERR) || !(events_ & EPOLLIN)) {
-        ERROR("Socket(%d) error.", handler->getClientFd());
-        // 当某个 handler 无法使用时,一定要销毁内存
-        delete handler;
-        // 之后重新开始遍历新的事件.
-        return;
-    }
-    // 如果没有错误发生
-    // 1. 如果是因为超时
-    if(fd == handler->getTimer()->getFd())
-    {
-        INFO("-------->>>>> "
-             "New Message: socket(%d) - timerfd(%d) timeout."
-             " <<<<<--------",
-             handler->getClientFd(), handler->getTimer()->getFd());
-        /* 这里不像下面需要从epoll中关闭 timer fd
-           因为 timer将会在HttpHandler的析构函数中从epoll内部删除 */
-        // 删除 handler 实例
-        delete handler;
-    }
-    // 2. 如果不是因为超时
-    else 
-    {
-        // 则从epoll中关闭 timer, 防止条件竞争
-        epoll->modify(handler->getTimer()->getFd(), nullptr, 0);
-        // 并将其放入线程池中并行执行
-        thread_pool->appendTask(
-            // lambda 函数
-            [](void* arg)
-            {
-                HttpHandler* handler = static_cast<HttpHandler*>(arg);
-
-                printConnectionStatus(handler->getClientFd(), "-------->>>>> New Message");
-
-                // 如果出现无法恢复的错误,则直接释放该实例以及对应的 client_fd
-                if(!(handler->RunEventLoop()))
-                    delete handler;
-            }, 
-            handler);
-    }
+    ReactorArgs* args = static_cast<ReactorArgs*>(arg);
+    int listen_fd = args->shared_listen_fd;
+    if(listen_fd == -1)
+        listen_fd = createListenSocket(args->listen, true);
+
+    EventLoop loop(listen_fd, nullptr, args->backend);
+    loop.loop();
+
+    if(args->shared_listen_fd == -1)
+        close(listen_fd);
+    return nullptr;
 }
 
 int main(int argc, char* argv[])
 {
+    // 工作模式, 默认为单个 epoll 分发 + 线程池的模式
+    bool reactor_mode = false;
+    // 分发模式下线程池的调度方式
+    ThreadPool::SchedulePolicy schedule_policy = ThreadPool::SHARED_QUEUE;
+    // 工作线程个数. 分发模式下默认为 8, 多 reactor 模式下默认为 CPU 核数
+    long thread_num = -1;
+    // 事件后端, io_uring 只能用于多 reactor 模式
+    EventLoop::BACKEND_TYPE backend = EventLoop::BACKEND_EPOLL;
+    // 每个连接在内核中最多缓存的未发送数据量, 0 表示使用系统默认值
+    long notsent_lowat = 16384;
+    // listen 套接字的队列长度
+    long backlog = 1024;
+    // 等待客户端发送数据之后再 accept 的最长时间(s), 0 表示收到握手的 ACK 后就可以 accept
+    long defer_accept = 10;
+    // 每轮事件循环最多 accept 的连接个数
+    long accept_budget = 64;
+    // 多 reactor 模式下所有线程是否共享同一个 listen 套接字
+    bool shared_listen = false;
+    // 静态文件缓存最多持有的 fd 个数, 0 表示不使用缓存
+    long cache_fds = 1024;
+    // 小文件响应缓存的字节数上限, 0 表示不使用缓存
+    long resp_cache_bytes = 16 * 1024 * 1024;
+    // 文本文件压缩缓存的字节数上限, 0 表示只发送预压缩的文件
+    long compress_cache_bytes = 16 * 1024 * 1024;
+    // 请求行与请求头的总长度上限
+    long max_header_bytes = 8192;
+    // 运行时的日志级别, 以及报文的抽样比例
+    int runtime_log_level = LOG_LEVEL_DUMP;
+    long dump_sampling = 1;
+    // 输出统计数据的路径, 为空时不输出
+    const char* metrics_path = "";
     // 获取传入的参数
-    if (argc < 2 || !isNumericStr(argv[1])) 
+    bool bad_args = false;
+    int opt;
+    while(!bad_args && (opt = getopt(argc, argv, "m:t:b:w:q:D:a:L:c:r:z:l:v:d:s:")) != -1)
     {
-        ERROR("usage: %s <port> [<www_dir>]", argv[0]);
+        switch(opt)
+        {
+        case 'm':
+            if(!strcmp(optarg, "reactor"))
+                reactor_mode = true;
+            else if(!strcmp(optarg, "steal"))
+                schedule_policy = ThreadPool::WORK_STEALING;
+            else if(strcmp(optarg, "pool"))
+                bad_args = true;
+            break;
+        case 'b':
+            if(!strcmp(optarg, "uring"))
+                backend = EventLoop::BACKEND_URING;
+            else if(strcmp(optarg, "epoll"))
+                bad_args = true;
+            break;
+        case 'w':
+            if(!isNumericStr(optarg) || (notsent_lowat = atol(optarg)) > INT_MAX)
+                bad_args = true;
+            break;
+        case 'q':
+            if(!isNumericStr(optarg) || (backlog = atol(optarg)) <= 0 || backlog > INT_MAX)
+                bad_args = true;
+            break;
+        case 'D':
+            if(!isNumericStr(optarg) || (defer_accept = atol(optarg)) > INT_MAX)
+                bad_args = true;
+            break;
+        case 'a':
+            if(!isNumericStr(optarg) || (accept_budget = atol(optarg)) <= 0)
+                bad_args = true;
+            break;
+        case 'L':
+            if(!strcmp(optarg, "shared"))
+                shared_listen = true;
+            else if(strcmp(optarg, "reuseport"))
+                bad_args = true;
+            break;
+        case 'c':
+            if(!isNumericStr(optarg))
+                bad_args = true;
+            cache_fds = atol(optarg);
+            break;
+        case 'r':
+            if(!isNumericStr(optarg))
+                bad_args = true;
+            resp_cache_bytes = atol(optarg);
+            break;
+        case 'z':
+            if(!isNumericStr(optarg))
+                bad_args = true;
+            compress_cache_bytes = atol(optarg);
+            break;
+        case 'l':
+            if(!isNumericStr(optarg) || (max_header_bytes = atol(optarg)) <= 0)
+                bad_args = true;
+            break;
+        case 'v':
+            if(!strcmp(optarg, "dump"))
+                runtime_log_level = LOG_LEVEL_DUMP;
+            else if(!strcmp(optarg, "info"))
+                runtime_log_level = LOG_LEVEL_INFO;
+            else if(!strcmp(optarg, "warn"))
+                runtime_log_level = LOG_LEVEL_WARN;
+            else if(!strcmp(optarg, "error"))
+                runtime_log_level = LOG_LEVEL_ERROR;
+            else
+                bad_args = true;
+            break;
+        case 'd':
+            if(!isNumericStr(optarg) || (dump_sampling = atol(optarg)) > UINT_MAX)
+                bad_args = true;
+            break;
+        case 's':
+            // 只能是绝对路径, 与请求行中的路径直接比较
+            if(optarg[0] != '/')
+                bad_args = true;
+            metrics_path = optarg;
+            break;
+        case 't':
+            if(!isNumericStr(optarg) || (thread_num = atol(optarg)) <= 0)
+                bad_args = true;
+            break;
+        default:
+            bad_args = true;
+        }
+    }
+    if (bad_args || argc - optind < 1 || !isNumericStr(argv[optind])) 
+    {
+        ERROR("usage: %s [-m pool|steal|reactor] [-t <thread_num>] [-b epoll|uring] [-w <notsent_lowat>] [-q <backlog>] [-D <defer_accept_s>] [-a <accept_budget>] [-L reuseport|shared] [-c <cache_fds>] [-r <resp_cache_bytes>] [-z <compress_cache_bytes>] [-l <max_header_bytes>] [-v dump|info|warn|error] [-d <dump_sampling>] [-s <metrics_path>] <port> [<www_dir>]", argv[0]);
         exit(EXIT_FAILURE);
     }
-    int port = atoi(argv[1]);
-    if(argc > 2)
-        HttpHandler::setWWWPath(argv[2]);
+    int port = atoi(argv[optind]);
+    if(argc - optind > 1)
+        HttpHandler::setWWWPath(argv[optind + 1]);
+    HttpHandler::setMaxHeaderSize(static_cast<size_t>(max_header_bytes));
+    EventLoop::setAcceptBudget(static_cast<size_t>(accept_budget));
+    ListenArgs listen_args = {port, static_cast<int>(backlog), static_cast<int>(notsent_lowat),
+                              static_cast<int>(defer_accept)};
+    HttpHandler::setMetricsPath(metrics_path);
+    setLogLevel(runtime_log_level);
+    setPacketDumpSampling(static_cast<unsigned>(dump_sampling));
+    // 此后日志由后台线程异步输出, 记录日志不再需要全局锁
+    startLogThread();
     // 输出当前进程的 PID，便于调试
     INFO("PID: %d", getpid());
+    // 输出 HTTP 解析器所使用的字符扫描实现
+    INFO("HTTP scanner: %s", getScanImplName());
     // 忽略 SIGPIPE 信号
     handleSigpipe();
-    // 创建线程池
-    ThreadPool thread_pool(8);
-
-    // 空闲 fd，用于关闭溢出的文件描述符
-    int idle_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); 
-    int listen_fd = -1;
-    if((listen_fd = socket_bind_and_listen(port)) == -1)
+    // 创建静态文件缓存, 该实例在整个进程运行期间都有效
+    FileCache* file_cache = nullptr;
+    if(cache_fds > 0)
     {
-        ERROR("Bind %d port failed ! (%s)", port, strerror(errno));
-        exit(EXIT_FAILURE);
+        file_cache = new FileCache(HttpHandler::getWWWPath(), static_cast<size_t>(cache_fds));
+        HttpHandler::setFileCache(file_cache);
     }
-
-    // 声明一个 epoll 实例,该实例将在整个main函数结束时被释放
-    Epoll epoll(EPOLL_CLOEXEC);
-    assert(epoll.isEpollValid());
-    // 将 listen_fd 添加进 epoll 实例
-    EpollEvent* listen_epollevent = new EpollEvent{listen_fd, nullptr};
-    epoll.add(listen_fd, listen_epollevent, EPOLLET | EPOLLIN);
-
-    // 开始事件循环
-    for(;;)
+    // 响应缓存依赖于文件缓存来感知文件的变化
+    ResponseCache* response_cache = nullptr;
+    if(resp_cache_bytes > 0)
     {
-        // 阻塞等待新的事件
-        int event_num = epoll.wait(-1);
-        // 如果报错
-        if(event_num < 0)
+        if(file_cache)
         {
-            // 表示该错误一定不是因为无效的 epoll 导致的
-            assert(event_num != -2);
-            // 如果只是中断,则直接重新循环
-            if(errno == EINTR)
-                continue;
-            // 如果是其他异常,则输出信息并终止.
-            else
-                FATAL("epoll_wait fail! (%s)", strerror(errno));
+            response_cache = new ResponseCache(static_cast<size_t>(resp_cache_bytes));
+            HttpHandler::setResponseCache(response_cache);
         }
-        // 如果什么也没读到,则可能是因为 signal 导致的.例如 SIGINT XD
-        else if(event_num == 0)
-            continue;
-        
-        // 遍历获取到的事件
-        for(int i = 0; i < event_num; i++)
+        else
+            WARN("Response cache requires the file cache, disable it.");
+    }
+    // 压缩缓存同样依赖于文件缓存, 且只压缩已经进入文件缓存的文件
+    CompressCache* compress_cache = nullptr;
+    if(compress_cache_bytes > 0)
+    {
+        if(file_cache)
         {
-            // 获取事件相关的信息
-            epoll_event&& event = epoll.getEvent(static_cast<size_t>(i));
-            EpollEvent* curr_epoll_event = static_cast<EpollEvent*>(event.data.ptr);
-            
-            int fd = curr_epoll_event->fd;
-            
-            // 如果当前文件描述符是 listen_fd, 则建立连接
-            if(fd == listen_fd)
-                handleNewConnections(&epoll, listen_fd, &idle_fd);
-            else
-                handleOldConnection(&epoll, fd, &thread_pool, &event);
+            compress_cache = new CompressCache(static_cast<size_t>(compress_cache_bytes));
+            HttpHandler::setCompressCache(compress_cache);
+        }
+        else
+            WARN("Compress cache requires the file cache, disable it.");
+    }
+
+    // io_uring 后端下, 请求直接在事件循环线程中处理, 因此强制使用多 reactor 模式
+    if(backend == EventLoop::BACKEND_URING && !reactor_mode)
+    {
+        WARN("io_uring backend only works in reactor mode, switch to it.");
+        reactor_mode = true;
+    }
+    // 多 reactor 模式: 每个线程一个事件循环, 主线程自身也运行一个
+    if(reactor_mode)
+    {
+        if(thread_num < 0)
+            thread_num = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+        INFO("Multi-reactor mode: %ld event loops%s", thread_num, shared_listen ? " sharing one listen socket" : "");
+        ReactorArgs args = {listen_args, shared_listen ? createListenSocket(listen_args, false) : -1, backend};
+
+        vector<pthread_t> threads;
+        for(long i = 1; i < thread_num; i++)
+        {
+            pthread_t thread;
+            if(pthread_create(&thread, nullptr, reactorThread, &args))
+                FATAL("Create reactor thread failed !");
+            threads.push_back(thread);
         }
+        reactorThread(&args);
+
+        for(size_t i = 0; i < threads.size(); i++)
+            pthread_join(threads[i], nullptr);
+        if(args.shared_listen_fd != -1)
+            close(args.shared_listen_fd);
+        delete compress_cache;
+        delete response_cache;
+        delete file_cache;
+        return 0;
     }
-    delete listen_epollevent;
 
+    // 创建线程池
+    ThreadPool thread_pool(thread_num < 0 ? 8 : thread_num, ThreadPool::GRACEFUL_QUIT, 65536, schedule_policy);
+    if(schedule_policy == ThreadPool::WORK_STEALING)
+        INFO("Thread pool uses work stealing.");
+
+    int listen_fd = createListenSocket(listen_args, false);
+
+    // 声明一个事件循环,该实例将在整个main函数结束时被释放
+    EventLoop loop(listen_fd, &thread_pool);
+    // 开始事件循环
+    loop.loop();
+
+    delete compress_cache;
+    delete response_cache;
+    delete file_cache;
     return 0;
 }
\ No newline at end of file